@@ -0,0 +1,350 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nuria/memorytemplateloader.hpp"
+#include "nuria/templateengine.hpp"
+#include "private/templateengine_p.hpp"
+#include "private/tokenizer.hpp"
+#include "private/compiler.hpp"
+#include "private/parser.hpp"
+#include "private/bytecode.hpp"
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QJsonDocument>
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include <QTextStream>
+#include <QJsonArray>
+#include <QDir>
+#include <algorithm>
+#include <atomic>
+
+using namespace Nuria;
+
+// Count of heap allocations done by the process so far
+static std::atomic< quint64 > g_allocations (0);
+
+#ifdef __GLIBC__
+// Count allocations by interposing the allocation functions of the C library.
+// This also catches allocations done through operator new and QArrayData.
+extern "C" {
+void *__libc_malloc (size_t size);
+void *__libc_calloc (size_t count, size_t size);
+void *__libc_realloc (void *ptr, size_t size);
+
+void *malloc (size_t size) __THROW {
+	g_allocations.fetch_add (1, std::memory_order_relaxed);
+	return __libc_malloc (size);
+}
+
+void *calloc (size_t count, size_t size) __THROW {
+	g_allocations.fetch_add (1, std::memory_order_relaxed);
+	return __libc_calloc (count, size);
+}
+
+void *realloc (void *ptr, size_t size) __THROW {
+	g_allocations.fetch_add (1, std::memory_order_relaxed);
+	return __libc_realloc (ptr, size);
+}
+
+}
+
+static const bool g_countsAllocations = true;
+#else
+static const bool g_countsAllocations = false;
+#endif
+
+// Measurements of one phase of a test-case
+struct Phase {
+	QVector< qint64 > times;
+	quint64 allocations = 0;
+	bool warmedUp = false;
+	
+	// The first run only warms up caches and isn't measured
+	template< typename Func >
+	void measure (Func func) {
+		if (!this->warmedUp) {
+			this->warmedUp = true;
+			func ();
+			return;
+		}
+		
+		quint64 allocs = g_allocations.load (std::memory_order_relaxed);
+		QElapsedTimer timer;
+		timer.start ();
+		
+		func ();
+		
+		qint64 elapsed = timer.nsecsElapsed ();
+		this->allocations += g_allocations.load (std::memory_order_relaxed) - allocs;
+		this->times.append (elapsed);
+	}
+	
+	qint64 nsPerOp () const {
+		if (this->times.isEmpty ()) {
+			return 0;
+		}
+		
+		qint64 total = 0;
+		for (qint64 cur : this->times) {
+			total += cur;
+		}
+		
+		return total / this->times.length ();
+	}
+	
+	qint64 percentile (int percent) const {
+		if (this->times.isEmpty ()) {
+			return 0;
+		}
+		
+		QVector< qint64 > sorted = this->times;
+		std::sort (sorted.begin (), sorted.end ());
+		return sorted.at ((sorted.length () - 1) * percent / 100);
+	}
+	
+	// Returns -1 if allocations can't be counted on this platform
+	double allocationsPerOp () const {
+		if (!g_countsAllocations || this->times.isEmpty ()) {
+			return -1;
+		}
+		
+		return double (this->allocations) / this->times.length ();
+	}
+	
+	QJsonObject toJson () const {
+		return QJsonObject {
+			{ "nsPerOp", double (nsPerOp ()) },
+			{ "p50Ns", double (percentile (50)) },
+			{ "p99Ns", double (percentile (99)) },
+			{ "allocsPerOp", allocationsPerOp () }
+		};
+	}
+	
+};
+
+struct CaseResult {
+	QString name;
+	Phase tokenize;
+	Phase parse;
+	Phase compile;
+	Phase render;
+	Phase renderAst;
+	int bytes = 0;
+	bool sameOutputAsAst = true;
+};
+
+static QVariantMap loadTestCase (const QString &path) {
+	QFile file (path);
+	if (!file.open (QIODevice::ReadOnly)) {
+		qCritical() << "Failed to open test-case" << path;
+		return QVariantMap ();
+	}
+	
+	return QJsonDocument::fromJson (file.readAll ()).toVariant ().toMap ();
+}
+
+static MemoryTemplateLoader *createLoader (const QVariantMap &data) {
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	QVariant templateData = data.value (QStringLiteral("template"));
+	
+	if (templateData.userType () == QMetaType::QVariantMap) {
+		QVariantMap map = templateData.toMap ();
+		for (auto it = map.constBegin (); it != map.constEnd (); ++it) {
+			loader->addTemplate (it.key (), it.value ().toString ().toUtf8 ());
+		}
+		
+	} else {
+		loader->addTemplate ("main", templateData.toString ().toUtf8 ());
+	}
+	
+	return loader;
+}
+
+static CaseResult runCase (const QString &name, const QVariantMap &data, int iterations) {
+	CaseResult result;
+	result.name = name;
+	
+	TemplateEngine engine;
+	MemoryTemplateLoader *loader = createLoader (data);
+	engine.setValues (data.value (QStringLiteral("variables")).toMap ());
+	engine.setLoader (loader);
+	
+	// Private engine state to run the phases one by one
+	TemplateEnginePrivate state;
+	state.q_ptr = &engine;
+	state.loader = loader;
+	state.renderer = new Template::Compiler (&engine, &state);
+	
+	QByteArray code = loader->load ("main");
+	for (auto *phase : { &result.tokenize, &result.parse, &result.compile, &result.render,
+	                     &result.renderAst }) {
+		phase->times.reserve (iterations);
+	}
+	
+	// Tokenize
+	Template::Tokenizer tokenizer;
+	for (int i = 0; i <= iterations; i++) {
+		result.tokenize.measure ([&] { tokenizer.read (code); });
+	}
+	
+	// Parse
+	QVector< Token > tokens = tokenizer.allTokens ();
+	Template::Parser parser (&engine);
+	TemplateProgramPrivate scratch;
+	for (int i = 0; i <= iterations; i++) {
+		result.parse.measure ([&] { parser.parse (tokens, &scratch); });
+		parser.clear ();
+	}
+	
+	// Compile. This includes loading included templates.
+	for (int i = 0; i <= iterations; i++) {
+		QExplicitlySharedDataPointer< Template::Arena > arena (new Template::Arena);
+		Template::Arena::Scope arenaScope (arena.data ());
+		
+		TemplateProgramPrivate *program = new TemplateProgramPrivate;
+		program->info = new CompileInformation;
+		program->root = new Template::SharedNode (state.renderer->parseCode (code, program));
+		program->root->arena = arena;
+		
+		result.compile.measure ([&] { state.renderer->compile (program); });
+		
+		delete program->info;
+		program->info = nullptr;
+		delete program;
+	}
+	
+	// Render
+	TemplateProgram program = engine.program ("main");
+	QString output;
+	for (int i = 0; i <= iterations; i++) {
+		result.render.measure ([&] { output = program.render (); });
+	}
+	
+	result.bytes = output.toUtf8 ().length ();
+	
+	// Render the same program through the AST walker for comparison
+	QString astOutput;
+	Template::Bytecode::setEnabled (false);
+	for (int i = 0; i <= iterations; i++) {
+		result.renderAst.measure ([&] { astOutput = program.render (); });
+	}
+	
+	Template::Bytecode::setEnabled (true);
+	result.sameOutputAsAst = (astOutput == output);
+	if (!result.sameOutputAsAst) {
+		qCritical() << "Bytecode and AST output of" << name << "differ";
+	}
+	
+	return result;
+}
+
+static void printTable (const QVector< CaseResult > &results) {
+	QTextStream out (stdout);
+	out << qSetFieldWidth (40) << left << "case" << qSetFieldWidth (10) << "phase"
+	    << qSetFieldWidth (12) << right << "ns/op" << "p99 ns" << "allocs/op" << "bytes"
+	    << qSetFieldWidth (0) << endl;
+	
+	for (const CaseResult &cur : results) {
+		const QPair< const char *, const Phase * > phases[] = {
+		        { "tokenize", &cur.tokenize }, { "parse", &cur.parse },
+		        { "compile", &cur.compile }, { "render", &cur.render },
+		        { "render-ast", &cur.renderAst }
+		};
+		
+		for (const auto &phase : phases) {
+			out << qSetFieldWidth (40) << left << cur.name << qSetFieldWidth (10) << phase.first
+			    << qSetFieldWidth (12) << right << phase.second->nsPerOp ()
+			    << phase.second->percentile (99)
+			    << QString::number (phase.second->allocationsPerOp (), 'f', 1)
+			    << cur.bytes << qSetFieldWidth (0) << endl;
+		}
+		
+	}
+	
+}
+
+static void printJson (const QVector< CaseResult > &results, int iterations) {
+	QJsonArray cases;
+	
+	for (const CaseResult &cur : results) {
+		cases.append (QJsonObject {
+			{ "name", cur.name },
+			{ "bytes", cur.bytes },
+			{ "tokenize", cur.tokenize.toJson () },
+			{ "parse", cur.parse.toJson () },
+			{ "compile", cur.compile.toJson () },
+			{ "render", cur.render.toJson () },
+			{ "renderAst", cur.renderAst.toJson () },
+			{ "sameOutputAsAst", cur.sameOutputAsAst }
+		});
+	}
+	
+	QJsonObject root {
+		{ "iterations", iterations },
+		{ "countsAllocations", g_countsAllocations },
+		{ "cases", cases }
+	};
+	
+	QTextStream (stdout) << QJsonDocument (root).toJson ();
+}
+
+int main (int argc, char *argv[]) {
+	QCoreApplication app (argc, argv);
+	
+	QCommandLineParser parser;
+	parser.setApplicationDescription ("Runs the test-case corpus through the tokenize, parse, "
+	                                  "compile and render phases and measures each of them. "
+	                                  "Rendering is measured using the bytecode and the AST.");
+	parser.addHelpOption ();
+	parser.addOptions ({
+		{ "json", "Print results as JSON." },
+		{ { "i", "iterations" }, "Runs per phase and case.", "count", "1000" },
+		{ { "f", "filter" }, "Only run cases containing <text> in their name.", "text" }
+	});
+	
+	parser.addPositionalArgument ("directory", "Directory of the test-cases.", "[directory]");
+	parser.process (app);
+	
+	QString path = parser.positionalArguments ().value (0, QStringLiteral(":/test-cases"));
+	int iterations = qMax (1, parser.value ("iterations").toInt ());
+	QString filter = parser.value ("filter");
+	
+	// Run all cases which are expected to render successfully
+	QVector< CaseResult > results;
+	QDir dir (path);
+	for (const QString &file : dir.entryList ({ "*.json" }, QDir::Files, QDir::Name)) {
+		QString name = file.section (QLatin1Char ('.'), 0, 0);
+		QVariantMap data = loadTestCase (dir.absoluteFilePath (file));
+		
+		if (!name.contains (filter) || data.isEmpty () ||
+		    data.value (QStringLiteral("skip")).toBool () ||
+		    !data.value (QStringLiteral("error")).toString ().isEmpty ()) {
+			continue;
+		}
+		
+		results.append (runCase (name, data, iterations));
+	}
+	
+	// 
+	if (parser.isSet ("json")) {
+		printJson (results, iterations);
+	} else {
+		printTable (results);
+	}
+	
+	return 0;
+}
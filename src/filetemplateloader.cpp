@@ -16,8 +16,15 @@
 
 #include "nuria/filetemplateloader.hpp"
 
+#include <QFileSystemWatcher>
+#include <QReadWriteLock>
+#include <QWriteLocker>
+#include <QReadLocker>
 #include <QDateTime>
+#include <QThread>
+#include <QTimer>
 #include <QFile>
+#include <QSet>
 
 namespace Nuria {
 class FileTemplateLoaderPrivate {
@@ -26,24 +33,40 @@ public:
 	QVector< QDir > paths;
 	QString suffix;
 	
+	// Watching
+	QAtomicInt watching;
+	QFileSystemWatcher *watcher = nullptr;
+	QTimer debounce;
+	QSet< QString > pendingChanges;
+	
+	// Watched templates, mapping names to file paths. Accessed by the
+	// threads using the loader.
+	mutable QReadWriteLock lock;
+	QHash< QString, QString > watched;
+	
 };
 
 }
 
+static bool isResourcePath (const QString &path) {
+	return path.startsWith (QLatin1Char (':'));
+}
+
 Nuria::FileTemplateLoader::FileTemplateLoader (QObject *parent)
 	: TemplateLoader (parent), d_ptr (new FileTemplateLoaderPrivate)
 {
-	
+	this->d_ptr->debounce.setSingleShot (true);
+	connect (&this->d_ptr->debounce, &QTimer::timeout, this, &FileTemplateLoader::emitPendingChanges);
 }
 
 Nuria::FileTemplateLoader::FileTemplateLoader (const QDir &path, QObject *parent)
-	: TemplateLoader (parent), d_ptr (new FileTemplateLoaderPrivate)
+	: FileTemplateLoader (parent)
 {
 	this->d_ptr->paths.append (path);
 }
 
 Nuria::FileTemplateLoader::FileTemplateLoader (const QVector< QDir > &paths, QObject *parent)
-        : TemplateLoader (parent), d_ptr (new FileTemplateLoaderPrivate)
+        : FileTemplateLoader (parent)
 {
 	this->d_ptr->paths = paths;
 }
@@ -58,10 +81,12 @@ QVector< QDir > Nuria::FileTemplateLoader::searchPaths () const {
 
 void Nuria::FileTemplateLoader::addSearchPath (const QDir &path) {
 	this->d_ptr->paths.append (path);
+	watchSearchPaths ();
 }
 
 void Nuria::FileTemplateLoader::setSearchPaths (const QVector< QDir > &paths) const {
 	this->d_ptr->paths = paths;
+	watchSearchPaths ();
 }
 
 QString Nuria::FileTemplateLoader::suffix () const {
@@ -72,6 +97,45 @@ void Nuria::FileTemplateLoader::setSuffix (const QString &suffix) {
 	this->d_ptr->suffix = suffix;
 }
 
+bool Nuria::FileTemplateLoader::isWatching () const {
+	return this->d_ptr->watching.load ();
+}
+
+void Nuria::FileTemplateLoader::setWatching (bool watch) {
+	if (watch == isWatching ()) {
+		return;
+	}
+	
+	// Stop watching
+	if (!watch) {
+		this->d_ptr->watching.store (false);
+		delete this->d_ptr->watcher;
+		this->d_ptr->watcher = nullptr;
+		
+		QWriteLocker locker (&this->d_ptr->lock);
+		this->d_ptr->watched.clear ();
+		return;
+	}
+	
+	// Start watching
+	this->d_ptr->watcher = new QFileSystemWatcher (this);
+	connect (this->d_ptr->watcher, &QFileSystemWatcher::fileChanged,
+	         this, &FileTemplateLoader::templateFileChanged);
+	connect (this->d_ptr->watcher, &QFileSystemWatcher::directoryChanged,
+	         this, &FileTemplateLoader::searchPathChanged);
+	
+	watchSearchPaths ();
+	this->d_ptr->watching.store (true);
+}
+
+int Nuria::FileTemplateLoader::debounceInterval () const {
+	return this->d_ptr->debounce.interval ();
+}
+
+void Nuria::FileTemplateLoader::setDebounceInterval (int msec) {
+	this->d_ptr->debounce.setInterval (msec);
+}
+
 QByteArray Nuria::FileTemplateLoader::load (const QString &name) {
 	QString path = findTemplatePath (name);
 	if (path.isEmpty ()) {
@@ -84,7 +148,12 @@ QByteArray Nuria::FileTemplateLoader::load (const QString &name) {
 		return QByteArray ();
 	}
 	
-	// 
+	// The modification time is taken before reading, so that changes
+	// while reading are noticed when the file is watched.
+	if (isWatching ()) {
+		watchTemplate (name, path, QFileInfo (path).lastModified ());
+	}
+	
 	return file.readAll ();
 }
 
@@ -92,20 +161,35 @@ bool Nuria::FileTemplateLoader::hasTemplate (const QString &name) {
 	return !findTemplatePath (name).isEmpty ();
 }
 
-#include <nuria/logger.hpp>
 bool Nuria::FileTemplateLoader::hasTemplateChanged (const QString &name, const QDateTime &since) {
+	
+	// Changes of watched templates are signalled.
+	if (isWatching ()) {
+		QReadLocker locker (&this->d_ptr->lock);
+		if (this->d_ptr->watched.contains (name)) {
+			return false;
+		}
+		
+	}
+	
+	// 
 	QString path = findTemplatePath (name);
 	if (path.isEmpty ()) {
 		return true;
 	}
 	
 	// Resources can't have changed.
-	if (path.startsWith (QLatin1Char (':'))) {
+	if (isResourcePath (path)) {
 		return false;
 	}
 	
 	// 
-	return (since < QFileInfo (path).lastModified ());
+	QDateTime modified = QFileInfo (path).lastModified ();
+	if (isWatching ()) {
+		watchTemplate (name, path, modified);
+	}
+	
+	return (since < modified);
 	
 }
 
@@ -138,3 +222,127 @@ bool Nuria::FileTemplateLoader::pathContainsTemplate (const QDir &path, const QS
 	filePath = path.absoluteFilePath (name);
 	return QFile::exists (filePath);
 }
+
+void Nuria::FileTemplateLoader::watchSearchPaths () const {
+	QFileSystemWatcher *watcher = this->d_ptr->watcher;
+	if (!watcher) {
+		return;
+	}
+	
+	// Changes in directories may shadow or unshadow templates
+	QStringList directories = watcher->directories ();
+	for (const QDir &dir : this->d_ptr->paths) {
+		QString path = dir.absolutePath ();
+		if (!isResourcePath (path) && dir.exists () && !directories.contains (path)) {
+			watcher->addPath (path);
+		}
+		
+	}
+	
+}
+
+void Nuria::FileTemplateLoader::watchTemplate (const QString &name, const QString &path,
+                                               const QDateTime &modified) {
+	if (isResourcePath (path)) {
+		return;
+	}
+	
+	// The file system watcher lives in the thread of the loader.
+	QMetaObject::invokeMethod (this, "addWatchedFile", Q_ARG(QString, name), Q_ARG(QString, path),
+	                           Q_ARG(QDateTime, modified));
+}
+
+void Nuria::FileTemplateLoader::addWatchedFile (const QString &name, const QString &path,
+                                                const QDateTime &modified) {
+	if (!addWatchedPath (path)) {
+		return;
+	}
+	
+	// Until now, hasTemplateChanged() checked the file itself.
+	QWriteLocker locker (&this->d_ptr->lock);
+	this->d_ptr->watched.insert (name, path);
+	locker.unlock ();
+	
+	// Catch changes between reading the file and watching it.
+	if (QFileInfo (path).lastModified () != modified) {
+		scheduleChange (name);
+	}
+	
+}
+
+bool Nuria::FileTemplateLoader::addWatchedPath (const QString &path) {
+	QFileSystemWatcher *watcher = this->d_ptr->watcher;
+	if (!watcher) {
+		return false;
+	}
+	
+	return (watcher->files ().contains (path) || watcher->addPath (path));
+}
+
+void Nuria::FileTemplateLoader::templateFileChanged (const QString &path) {
+	QReadLocker locker (&this->d_ptr->lock);
+	QStringList names = this->d_ptr->watched.keys (path);
+	locker.unlock ();
+	
+	for (const QString &name : names) {
+		scheduleChange (name);
+	}
+	
+	// Files replaced by saving them atomically are dropped by the watcher.
+	// If the file is gone for good, it's checked by hasTemplateChanged()
+	// again.
+	if (!addWatchedPath (path)) {
+		QWriteLocker writeLocker (&this->d_ptr->lock);
+		for (const QString &name : names) {
+			this->d_ptr->watched.remove (name);
+		}
+		
+	}
+	
+}
+
+void Nuria::FileTemplateLoader::searchPathChanged () {
+	QReadLocker locker (&this->d_ptr->lock);
+	QHash< QString, QString > watched = this->d_ptr->watched;
+	locker.unlock ();
+	
+	// Find templates which now resolve to another or no file
+	for (auto it = watched.constBegin (); it != watched.constEnd (); ++it) {
+		QString path = findTemplatePath (it.key ());
+		if (path == it.value ()) {
+			continue;
+		}
+		
+		QWriteLocker writeLocker (&this->d_ptr->lock);
+		this->d_ptr->watched.remove (it.key ());
+		writeLocker.unlock ();
+		
+		if (!path.isEmpty ()) {
+			watchTemplate (it.key (), path, QFileInfo (path).lastModified ());
+		}
+		
+		scheduleChange (it.key ());
+	}
+	
+}
+
+void Nuria::FileTemplateLoader::scheduleChange (const QString &name) {
+	if (this->d_ptr->debounce.interval () <= 0) {
+		emit templateChanged (name);
+		return;
+	}
+	
+	// Restart the timer until things have calmed down
+	this->d_ptr->pendingChanges.insert (name);
+	this->d_ptr->debounce.start ();
+}
+
+void Nuria::FileTemplateLoader::emitPendingChanges () {
+	QSet< QString > changes;
+	changes.swap (this->d_ptr->pendingChanges);
+	
+	for (const QString &name : changes) {
+		emit templateChanged (name);
+	}
+	
+}
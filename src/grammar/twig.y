@@ -44,6 +44,8 @@
 %type array { MultipleValueNode * }
 %type forLoopEnd { ConditionEnd * }
 %type spaceless { SpacelessNode * }
+%type cacheTtl { ValueNode * }
+%type cache { CacheNode * }
 %type variable { VariableNode * }
 %type expression { ValueNode * }
 %type forLoopIf { ForLoopIf * }
@@ -135,6 +137,7 @@ baseNode(A) ::= embed(B). { A = B; }
 baseNode(A) ::= filter(B). { A = B; }
 baseNode(A) ::= autoescape(B). { A = B; }
 baseNode(A) ::= spaceless(B). { A = B; }
+baseNode(A) ::= cache(B). { A = B; }
 baseNode(A) ::= set(B). { A = B; }
 
 baseNodeList(A) ::= baseNodeList(B) baseNode(C). { B->nodes.append (C); A = B; }
@@ -259,6 +262,18 @@ autoescape(A) ::= commandBegin(U) AUTOESCAPE_BEGIN(B) STRING(C) commandEnd(V)
 	addTrim (dptr, D, U, Y, V, X);
 }
 
+/* cache */
+cache(A) ::= commandBegin(U) CACHE_BEGIN(B) expression(C) cacheTtl(D) commandEnd(V)
+                 baseNodeList(E)
+             commandBegin(X) CACHE_END commandEnd(Y). {
+	A = new CacheNode (toLoc (B), C, D, E);
+	addTrim (dptr, A, U, Y, V, X);
+	addTrim (dptr, E, U, Y, V, X);
+}
+
+cacheTtl(A) ::= . { A = nullptr; }
+cacheTtl(A) ::= TTL expression(B). { A = B; }
+
 /* embed */
 embed(A) ::= commandBegin(U) EMBED_BEGIN(B) expression(C) commandEnd(V)
                  baseNodeList(D)
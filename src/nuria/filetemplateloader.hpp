@@ -19,6 +19,7 @@
 
 #include "templateloader.hpp"
 #include "twig_global.hpp"
+#include <QDateTime>
 #include <QVector>
 #include <QDir>
 
@@ -40,6 +41,18 @@ class FileTemplateLoaderPrivate;
  * Directory traversal attacks, meaning traversing outside of the given
  * search paths, are not possible.
  * 
+ * \par Watching for changes
+ * 
+ * By default, hasTemplateChanged() checks the modification time of the
+ * template file, which is done for every dependency of a program each time
+ * it's requested from the TemplateEngine. If watching is enabled using
+ * setWatching(), the loader instead watches loaded templates and the search
+ * paths for changes and emits templateChanged(). hasTemplateChanged() then
+ * only has to check the file once for each template.
+ * 
+ * Changes can be debounced using setDebounceInterval(), which is useful as
+ * editors tend to write a file in multiple steps.
+ * 
  * \note If template names are case-sensitive or not depends on the platform.
  */
 class NURIA_TWIG_EXPORT FileTemplateLoader : public TemplateLoader {
@@ -76,6 +89,27 @@ public:
 	 */
 	void setSuffix (const QString &suffix);
 	
+	/** Returns \c true if the file-system is watched for changes. */
+	bool isWatching () const;
+	
+	/**
+	 * Enables or disables watching of the file-system for changes of
+	 * templates. The default is \c false.
+	 * 
+	 * \note Watching must be changed from the thread of the loader.
+	 */
+	void setWatching (bool watch);
+	
+	/** Returns the debounce interval in milliseconds. */
+	int debounceInterval () const;
+	
+	/**
+	 * Sets the debounce interval to \a msec. When watching, changes are
+	 * collected until no change happened for this time, and are then
+	 * emitted. The default is \c 0, emitting changes immediately.
+	 */
+	void setDebounceInterval (int msec);
+	
 	// 
 	QByteArray load (const QString &name) override;
 	bool hasTemplate (const QString &name) override;
@@ -85,6 +119,15 @@ private:
 	QString findTemplatePath (const QString &name) const;
 	bool pathContainsTemplate (const QDir &path, const QString &name, QString &filePath) const;
 	
+	void watchSearchPaths () const;
+	void watchTemplate (const QString &name, const QString &path, const QDateTime &modified);
+	Q_INVOKABLE void addWatchedFile (const QString &name, const QString &path, const QDateTime &modified);
+	bool addWatchedPath (const QString &path);
+	void templateFileChanged (const QString &path);
+	void searchPathChanged ();
+	void scheduleChange (const QString &name);
+	void emitPendingChanges ();
+	
 	FileTemplateLoaderPrivate *d_ptr;
 	
 };
@@ -22,6 +22,7 @@
 #include <QVariant>
 #include <QObject>
 
+#include "templatestatistics.hpp"
 #include "templateprogram.hpp"
 #include "templateerror.hpp"
 
@@ -109,10 +110,35 @@ class TemplateStack;
  * nDebug() << TemplateEngine ().render ("{{ 1 + 2 }}");
  * \endcode
  * 
+ * Arithmetic and comparisons are specialized for the types of their operands
+ * if these are known at compile-time, like for literals, loop fields and
+ * variables declared using setVariableType(). Integer arithmetic yields
+ * integers as long as the result fits into an \c int.
+ * 
  * \par Caching of programs
  * 
  * Another optimization worth noting is that programs are cached. You can
- * control this behaviour using setMaxCacheSize().
+ * control this behaviour using setMaxCacheSize() and setMaxCacheMemory().
+ * 
+ * The tokens of loaded templates are kept too. When a template changes, only
+ * this template is loaded and tokenized again to rebuild the programs using
+ * it.
+ * 
+ * \par Caching of fragments
+ * 
+ * Parts of a template can be cached using the \c cache tag. The rendered
+ * body is stored under the given key, optionally expiring after a time in
+ * seconds:
+ * \code
+ * {% cache "sidebar-" ~ user.id ttl 300 %} .. {% endcache %}
+ * \endcode
+ * 
+ * Keys are local to the rendered template, so two templates using the same
+ * key don't share their fragment. Fragments of included templates belong to
+ * the template including them. Internally, the key is prefixed with the
+ * name of the template and a colon, e.g. "index:sidebar-1".
+ * 
+ * Use invalidateFragments() to remove fragments when their data changes.
  * 
  * \par Variable inheritance and strictness
  * 
@@ -170,6 +196,17 @@ class TemplateStack;
  * \warning setLocale() has no effect on cached programs. To force this,
  * call flushCache() afterwards.
  * 
+ * \par Thread-safety
+ * 
+ * A single engine can be shared by multiple threads: program() and render()
+ * may be called concurrently, as can all methods changing values or
+ * functions. Cached programs are looked up without blocking each other.
+ * Different templates are compiled in parallel, while concurrent cache misses
+ * on the same template compile it only once. lastError() is kept per thread.
+ * 
+ * The used TemplateLoader must support being queried from multiple threads.
+ * Don't replace the loader while other threads are using the engine.
+ * 
  */
 class NURIA_TWIG_EXPORT TemplateEngine : public QObject {
 	Q_OBJECT
@@ -205,9 +242,81 @@ public:
 	/** Returns the amount of currently cached programs. */
 	int currentCacheSize () const;
 	
+	/**
+	 * Returns the maximum memory in bytes used by cached programs. \c 0
+	 * means there's no limit, which is the default.
+	 */
+	qint64 maxCacheMemory () const;
+	
+	/**
+	 * Limits the memory used by cached programs to \a bytes. The memory of
+	 * a program is estimated from its nodes, texts and variables. Programs
+	 * larger than \a bytes aren't cached at all.
+	 */
+	void setMaxCacheMemory (qint64 bytes);
+	
+	/** Returns the estimated memory used by cached programs in bytes. */
+	qint64 currentCacheMemory () const;
+	
+	/** Returns \c true if frequency-aware cache admission is enabled. */
+	bool isCacheAdmissionEnabled () const;
+	
+	/**
+	 * If \a enabled, a program is only cached when the cache is full if it
+	 * is requested more often than the program it would evict. This keeps
+	 * one-off templates from evicting often used ones. Defaults to
+	 * \c false.
+	 */
+	void setCacheAdmissionEnabled (bool enabled);
+	
 	/** Returns \c true if \a templateName is already cached. */
 	bool isTemplateInCache (const QString &templateName) const;
 	
+	/**
+	 * Returns the maximum memory in bytes used by cached fragments. The
+	 * default is 16MiB.
+	 */
+	qint64 maxFragmentCacheMemory () const;
+	
+	/**
+	 * Limits the memory used by cached fragments to \a bytes, evicting the
+	 * least recently used ones if needed. If \a bytes is \c 0, fragments
+	 * aren't cached.
+	 */
+	void setMaxFragmentCacheMemory (qint64 bytes);
+	
+	/** Returns the memory used by cached fragments in bytes. */
+	qint64 currentFragmentCacheMemory () const;
+	
+	/**
+	 * Removes all cached fragments whose key starts with \a prefix and
+	 * returns their count. Keys start with the name of the template and a
+	 * colon, e.g. "index:sidebar-". An empty \a prefix removes all
+	 * fragments.
+	 */
+	int invalidateFragments (const QString &prefix);
+	
+	/**
+	 * Returns the maximum memory in bytes used by memoized renders. \c 0,
+	 * the default, disables memoization.
+	 */
+	qint64 maxRenderMemoMemory () const;
+	
+	/**
+	 * Enables memoization of renders, using up to \a bytes of memory.
+	 * When a program is rendered with the same values as before, the
+	 * output of the earlier render is returned. Programs calling
+	 * non-deterministic functions like \c random() or \c date(), or
+	 * non-constant user-defined functions, are never memoized. Neither are
+	 * programs with values which can't be compared, like QObjects.
+	 * 
+	 * \sa TemplateProgram::isMemoizable
+	 */
+	void setMaxRenderMemoMemory (qint64 bytes);
+	
+	/** Returns the memory used by memoized renders in bytes. */
+	qint64 currentRenderMemoMemory () const;
+	
 	/**
 	 * Replaces the currently used template loader.
 	 * Ownership of \a loader is transferred to the environment.
@@ -249,6 +358,22 @@ public:
 	 */
 	bool hasFunction (const QString &name);
 	
+	/**
+	 * Declares that the variable \a name holds values of \a type, which is
+	 * one of QMetaType::Int, QMetaType::Double, QMetaType::QString or
+	 * QMetaType::Bool. Expressions using it are then compiled to code
+	 * specialized for this type. Values of other types still work, but
+	 * take the slower generic path. Pass QMetaType::UnknownType to remove
+	 * the declaration.
+	 * 
+	 * \note This has no effect on cached programs. To force this, call
+	 * flushCache() afterwards.
+	 */
+	void setVariableType (const QString &name, int type);
+	
+	/** Returns the declared type of \a name, or QMetaType::UnknownType. */
+	int variableType (const QString &name) const;
+	
 	/**
 	 * Loads and compiles a Twig template called \a templateName and returns
 	 * a TemplateProgram, which can be cached by the user if wanted.
@@ -273,7 +398,24 @@ public:
 	QString render (const QString &templateName);
 	
 	/**
-	 * Returns the last occured error.
+	 * Same as render(const QString&), but also stores the hash of the
+	 * output in \a contentHash, which can be used as ETag.
+	 * 
+	 * \sa TemplateProgram::render(QByteArray&)
+	 */
+	QString render (const QString &templateName, QByteArray &contentHash);
+	
+	/**
+	 * Loads the template \a templateName and renders it into \a device.
+	 * Returns \c true on success. On failure, \c false is returned and
+	 * lastError() is set.
+	 * 
+	 * \sa TemplateProgram::render(QIODevice*)
+	 */
+	bool render (const QString &templateName, QIODevice *device);
+	
+	/**
+	 * Returns the last occured error in the calling thread.
 	 * \note render() clears this.
 	 */
 	TemplateError lastError () const;
@@ -284,14 +426,62 @@ public:
 	 */
 	bool isProgramOutdated (const TemplateProgram &program);
 	
+	/**
+	 * Compiles the templates \a templateNames and writes the programs into
+	 * a bundle file at \a path. Loading the bundle using loadBundle() later
+	 * on saves tokenizing, parsing and compiling these templates.
+	 * 
+	 * Returns \c true on success. On failure, \c false is returned and
+	 * lastError() is set.
+	 * 
+	 * \note Results of constant functions are stored in the bundle.
+	 */
+	bool saveBundle (const QString &path, const QStringList &templateNames);
+	
+	/**
+	 * Memory-maps the bundle file at \a path, as written by saveBundle().
+	 * When a program of the bundle is requested, it's read from the
+	 * bundle instead of compiling it. If the template loader reports that
+	 * a template of it has changed since the bundle was written, the
+	 * template is compiled as usual.
+	 * 
+	 * Returns \c true on success, or \c false if the file couldn't be
+	 * read or was written by an incompatible version.
+	 */
+	bool loadBundle (const QString &path);
+	
+	/** Returns \c true if statistics are recorded. */
+	bool isRecordingStatistics () const;
+	
+	/**
+	 * Enables or disables recording of statistics for all templates of
+	 * this engine. This includes cache behaviour, and time spent in
+	 * tokenizing, parsing, compiling and rendering. The default is off.
+	 * 
+	 * Recording is cheap, but not free: Each render measures the time
+	 * and counts the written output.
+	 */
+	void setRecordingStatistics (bool enabled);
+	
+	/** Returns a snapshot of the statistics of all templates by name. */
+	QMap< QString, TemplateStatistics > statistics () const;
+	
+	/** Resets all statistics. */
+	void resetStatistics ();
+	
 	/** Clears the program cache. */
 	void flushCache ();
 	
 private:
 	
 	TemplateProgramPrivate *createProgram (const QString &templateName);
+	TemplateProgramPrivate *readProgramFromBundles (const QString &templateName);
+	void populateProgram (TemplateProgramPrivate *program, const QString &templateName);
+	bool hasDependencyChanged (const TemplateProgramPrivate *program);
 	void removeChangedTemplateFromCache (const QString &templateName);
-	TemplateProgram updateProgramVariables (const QString &templateName, TemplateProgram *prog);
+	void cacheProgram (const QString &templateName, const TemplateProgram &program, quint64 epoch);
+	TemplateProgram updateProgramVariables (const QString &templateName, const TemplateProgram &prog,
+	                                        quint64 epoch);
 	void connectToLoaderSignals ();
 	
 	TemplateEnginePrivate *d_ptr;
@@ -140,6 +140,12 @@ public:
 		/** Renderer: A needed variable is not set. */
 		VariableNotSet,
 		
+		/** Renderer: Writing the output into a device failed. */
+		WriteFailed,
+		
+		/** Engine: A bundle could not be written. */
+		BundleWriteFailed = 600,
+		
 	};
 	
 	/** Constructor. */
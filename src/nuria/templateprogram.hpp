@@ -23,8 +23,11 @@
 #include <QSharedData>
 #include <QStringList>
 
+class QIODevice;
+
 namespace Nuria {
 
+namespace Template { class Sink; }
 class TemplateProgramPrivate;
 class TemplateEngine;
 
@@ -56,6 +59,14 @@ class TemplateEngine;
  * 
  * \note The internal program is never copied nor changed by any operation.
  * 
+ * \par Thread-safety
+ * 
+ * Rendering does not modify the program: Each call to render() runs in its
+ * own execution context, so one program (or copies of it) can be rendered
+ * from multiple threads at the same time. Changing the program, e.g. by
+ * calling setValue(), while it is being rendered from another thread is not
+ * supported. Copy the program for each thread instead, which is cheap.
+ * 
  * \par Variables
  * 
  * By default, a program is in strict mode, meaning that all referenced
@@ -64,6 +75,9 @@ class TemplateEngine;
  * setting the last error accordingly. You can use neededVariables() to get a
  * list of variables needed by the program to execute.
  * 
+ * When setting the same variables often, look up their slots once using
+ * slotFor() and pass these to setValue() instead of the names.
+ * 
  * \sa neededVariables canRender render
  * 
  */
@@ -105,6 +119,22 @@ public:
 	 */
 	bool setValue (const QString &variable, const QVariant &value);
 	
+	/**
+	 * Returns the slot of \a variable, or \c -1 if this program doesn't
+	 * need \a variable. Setting a variable through its slot skips the
+	 * look-up by name. Slots stay valid for copies of this program.
+	 */
+	int slotFor (const QString &variable) const;
+	
+	/** Returns the current value of the variable in \a slot. */
+	QVariant value (int slot) const;
+	
+	/**
+	 * Sets the value of the variable in \a slot to \a value. Returns
+	 * \c false if \a slot is invalid.
+	 */
+	bool setValue (int slot, const QVariant &value);
+	
 	/** Returns the locale used by this program. */
 	QLocale locale () const;
 	
@@ -138,6 +168,16 @@ public:
 	 */
 	bool canRender () const;
 	
+	/**
+	 * Returns \c true if the output of this program only depends on its
+	 * values and locale, meaning that it doesn't call non-deterministic
+	 * functions like \c random() or non-constant user-defined functions.
+	 * Only these programs are memoized.
+	 * 
+	 * \sa TemplateEngine::setMaxRenderMemoMemory
+	 */
+	bool isMemoizable () const;
+	
 	/**
 	 * Executes the program and returns the result.
 	 * A empty result indicates an error.
@@ -146,7 +186,33 @@ public:
 	 */
 	QString render ();
 	
-	/** Returns the last error. */
+	/**
+	 * Executes the program, writing the result UTF-8 encoded into
+	 * \a device while rendering. The output is written in chunks, without
+	 * building the whole result in memory first. Returns \c true on
+	 * success. On failure, \c false is returned and lastError() is set.
+	 * 
+	 * \note If rendering fails, parts of the output may have been written
+	 * to \a device already.
+	 * 
+	 * \sa lastError
+	 */
+	bool render (QIODevice *device);
+	
+	/**
+	 * Executes the program and returns the result, like render(). The
+	 * hex-encoded SHA-1 hash of the result is stored in \a contentHash,
+	 * which can be used as ETag. If render memoization is enabled in the
+	 * engine and the program was rendered with the same values before,
+	 * the earlier result and hash are returned without rendering.
+	 */
+	QString render (QByteArray &contentHash);
+	
+	/**
+	 * Returns the last error. Errors of render() and canRender() are kept
+	 * per thread, for the instance which called them last on the current
+	 * thread.
+	 */
 	TemplateError lastError () const;
 	
 private:
@@ -156,6 +222,10 @@ private:
 	void refNode ();
 	void derefNode ();
 	bool checkVariable (int index) const;
+	bool canRender (TemplateError &error) const;
+	bool renderTo (Template::Sink &sink, TemplateError &error, QByteArray *contentHash = nullptr) const;
+	bool runProgram (Template::Sink &sink, TemplateError &error) const;
+	QString memoKey () const;
 	
 	QSharedDataPointer< TemplateProgramPrivate > d;
 	
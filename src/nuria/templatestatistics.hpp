@@ -0,0 +1,83 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NURIA_TEMPLATESTATISTICS_HPP
+#define NURIA_TEMPLATESTATISTICS_HPP
+
+#include "twig_global.hpp"
+#include <QString>
+#include <QMap>
+
+namespace Nuria {
+
+/**
+ * \brief Counters and timings of a single template.
+ * 
+ * Instances are returned by TemplateEngine::statistics() and are a snapshot
+ * of the counters at that point. All times are in nanoseconds.
+ * 
+ * Like Template::Location, this is a flat structure whose fields are accessed
+ * directly.
+ * 
+ * \note Tokenizing and parsing is accounted to the template which was read,
+ * compiling to the template which was requested. The compile time thus
+ * includes the time spent on loading included templates.
+ */
+struct NURIA_TWIG_EXPORT TemplateStatistics {
+	
+	/** Requests served from the program cache. */
+	quint64 cacheHits = 0;
+	
+	/** Requests which needed to compile the template. */
+	quint64 cacheMisses = 0;
+	
+	/** How often the program was evicted from the cache. */
+	quint64 cacheEvictions = 0;
+	
+	/** How often the loader was asked if the template has changed. */
+	quint64 stalenessChecks = 0;
+	
+	/** Time spent in tokenizing the template. */
+	quint64 tokenizeTime = 0;
+	
+	/** Time spent in parsing the template. */
+	quint64 parseTime = 0;
+	
+	/** Time spent in compiling the template. */
+	quint64 compileTime = 0;
+	
+	/** Count of renders. */
+	quint64 renders = 0;
+	
+	/** Time spent in rendering. */
+	quint64 renderTime = 0;
+	
+	/** Characters written while rendering. */
+	quint64 outputSize = 0;
+	
+	/**
+	 * Executed instructions while rendering by kind, like "text" or
+	 * "loop". Nodes rendered through the AST are counted as "node", values
+	 * evaluated through it as "value". Both are also counted by the class
+	 * of the node, like "node:filter" or "value:chain".
+	 */
+	QMap< QString, quint64 > nodes;
+	
+};
+
+}
+
+#endif // NURIA_TEMPLATESTATISTICS_HPP
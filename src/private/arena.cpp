@@ -0,0 +1,104 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "arena.hpp"
+
+#include <new>
+
+enum {
+	Alignment = alignof(std::max_align_t),
+	MinimumChunkSize = 4096,
+	MaximumChunkSize = 64 * 1024
+};
+
+static thread_local Nuria::Template::Arena *g_current = nullptr;
+
+static inline size_t alignedSize (size_t size) {
+	return (size + Alignment - 1) & ~size_t (Alignment - 1);
+}
+
+Nuria::Template::Arena::Scope::Scope (Arena *arena)
+	: previous (g_current)
+{
+	g_current = arena;
+}
+
+Nuria::Template::Arena::Scope::~Scope () {
+	g_current = this->previous;
+}
+
+Nuria::Template::Arena::~Arena () {
+	while (this->chunks) {
+		Chunk *next = this->chunks->next;
+		::operator delete (this->chunks);
+		this->chunks = next;
+	}
+	
+}
+
+Nuria::Template::Arena *Nuria::Template::Arena::current () {
+	return g_current;
+}
+
+void *Nuria::Template::Arena::create (size_t size) {
+	Arena *arena = g_current;
+	if (arena) {
+		return arena->allocate (size);
+	}
+	
+	return ::operator new (size);
+}
+
+void Nuria::Template::Arena::destroy (void *ptr) {
+	// Memory of arenas is released with the arena itself.
+	if (!g_current) {
+		::operator delete (ptr);
+	}
+	
+}
+
+void *Nuria::Template::Arena::allocate (size_t size) {
+	size = alignedSize (size);
+	this->allocated += size;
+	
+	// Fits into the current chunk?
+	Chunk *chunk = this->chunks;
+	if (chunk && chunk->size - chunk->used >= size) {
+		void *ptr = reinterpret_cast< char * > (chunk) + chunk->used;
+		chunk->used += size;
+		return ptr;
+	}
+	
+	// Chunks grow with the arena, large allocations get their own one.
+	size_t chunkSize = (chunk) ? qMin (chunk->size * 2, size_t (MaximumChunkSize)) : MinimumChunkSize;
+	size_t offset = alignedSize (sizeof(Chunk));
+	chunkSize = qMax (chunkSize, offset + size);
+	
+	Chunk *fresh = static_cast< Chunk * > (::operator new (chunkSize));
+	fresh->size = chunkSize;
+	fresh->used = offset + size;
+	
+	// Keep using the current chunk if the new one is already full
+	if (chunk && fresh->used == fresh->size && chunk->used < chunk->size) {
+		fresh->next = chunk->next;
+		chunk->next = fresh;
+	} else {
+		fresh->next = chunk;
+		this->chunks = fresh;
+	}
+	
+	return reinterpret_cast< char * > (fresh) + offset;
+}
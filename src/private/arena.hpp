@@ -0,0 +1,95 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NURIA_TEMPLATE_ARENA_HPP
+#define NURIA_TEMPLATE_ARENA_HPP
+
+#include <QSharedData>
+#include <cstddef>
+
+namespace Nuria {
+namespace Template {
+
+/**
+ * \internal
+ * \brief Monotonic allocator for the nodes of a program.
+ * 
+ * While a Scope is active, nodes created on the current thread are allocated
+ * from its arena. Memory is handed out sequentially from large chunks and
+ * only released all at once, keeping the nodes of a program close together
+ * and saving a free() for each of them.
+ * 
+ * Allocations don't carry any bookkeeping. Deleting a node while its arena
+ * is current only runs its destructor, the memory is released together with
+ * the arena. Nodes must thus be deleted while the arena they were created in
+ * is current, and before the arena itself.
+ */
+class Arena : public QSharedData {
+public:
+	
+	/** Makes \a arena the current arena of this thread while it exists. */
+	class Scope {
+	public:
+		Scope (Arena *arena);
+		~Scope ();
+		
+	private:
+		Q_DISABLE_COPY(Scope)
+		Arena *previous;
+	};
+	
+	Arena () { }
+	~Arena ();
+	
+	/** Returns the arena of the current thread, if any. */
+	static Arena *current ();
+	
+	/**
+	 * Allocates \a size bytes from the current arena, or from the heap if
+	 * there is none. Used by Node::operator new.
+	 */
+	static void *create (size_t size);
+	
+	/**
+	 * Releases \a ptr allocated by create(). Does nothing if there is a
+	 * current arena.
+	 */
+	static void destroy (void *ptr);
+	
+	/** Returns the amount of bytes allocated from this arena. */
+	size_t bytesAllocated () const
+	{ return this->allocated; }
+	
+private:
+	Q_DISABLE_COPY(Arena)
+	
+	struct Chunk {
+		Chunk *next;
+		size_t size;
+		size_t used;
+	};
+	
+	void *allocate (size_t size);
+	
+	Chunk *chunks = nullptr;
+	size_t allocated = 0;
+	
+};
+
+}
+}
+
+#endif // NURIA_TEMPLATE_ARENA_HPP
@@ -19,6 +19,7 @@
 #include <nuria/callback.hpp>
 #include <nuria/variant.hpp>
 #include <nuria/logger.hpp>
+#include <limits>
 
 #include "../nuria/templateloader.hpp"
 #include "variableaccessor.hpp"
@@ -44,6 +45,24 @@ static inline Nuria::Template::Node *swapAndDestroy (Left *&target, Right *newNo
 	return target;
 }
 
+// Template class, which keeps the value of a certain variable and resets the
+// variables value to the kept value when the instance is destroyed.
+template< typename T >
+class VariableKeeper {
+	T &variable;
+	T oldValue;
+public:
+	constexpr VariableKeeper (T &variable)
+	        : variable (variable), oldValue (variable)
+	{ }
+	
+	VariableKeeper (T &variable, const T &newValue)
+	        : variable (variable), oldValue (variable)
+	{ variable = newValue; }
+	
+	~VariableKeeper () { variable = oldValue; }
+};
+
 Nuria::Template::Node *Nuria::Template::Node::compile (Nuria::Template::Compiler *compiler,
                                                        TemplateProgramPrivate *dptr) {
 	Q_UNUSED(compiler);
@@ -51,14 +70,19 @@ Nuria::Template::Node *Nuria::Template::Node::compile (Nuria::Template::Compiler
 	return this;
 }
 
-QString Nuria::Template::ValueNode::render (TemplateProgramPrivate *dptr) {
-	QVariant v = evaluate (dptr);
-	
-	if (v.userType () != QMetaType::QString) {
-		v.convert (QMetaType::QString);
-	}
-	
-	return v.toString ();
+void Nuria::Template::Node::renderTo (ExecutionContext *dptr, Sink &sink) {
+	sink.write (render (dptr));
+}
+
+QString Nuria::Template::Node::renderIntoString (ExecutionContext *dptr) {
+	QString result;
+	StringSink sink (result);
+	renderTo (dptr, sink);
+	return result;
+}
+
+QString Nuria::Template::ValueNode::render (ExecutionContext *dptr) {
+	return evaluateValue (dptr).toString ();
 }
 
 Nuria::Template::Node *Nuria::Template::ValueNode::compile (Compiler *compiler, TemplateProgramPrivate *dptr) {
@@ -88,7 +112,7 @@ Nuria::Template::Node *Nuria::Template::MultipleValueNode::compile (Compiler *co
 	return this;
 }
 
-QVariantList Nuria::Template::MultipleValueNode::evaluateAll (TemplateProgramPrivate *dptr) {
+QVariantList Nuria::Template::MultipleValueNode::evaluateAll (ExecutionContext *dptr) {
 	QVariantList list;
 	
 	for (int i = 0; i < this->values.length (); i++) {
@@ -114,11 +138,24 @@ Nuria::Template::Node *Nuria::Template::MethodCallValueNode::compile (Compiler *
 	}
 	
 	// parent() is somewhat magic...
-	Builtins::Function builtin = Builtins::nameLookup (this->name->variable);
-	if (builtin == Builtins::Parent) {
+	this->builtin = Builtins::nameLookup (this->name->variable);
+	if (this->builtin == Builtins::Parent) {
 		return configureParentCall (dptr);
 	}
 	
+	// Resolve user-defined functions to a slot. Chained names are
+	// resolved at run-time.
+	if (this->builtin == Builtins::Unknown && this->name->isFunction) {
+		this->functionIndex = dptr->addOrGetFunctionPosition (this->name->variable);
+	}
+	
+	// Output of the program may change between renders?
+	if ((this->builtin == Builtins::Unknown && !this->name->isFunction) ||
+	    (this->builtin != Builtins::Unknown &&
+	     !Builtins::isBuiltinDeterministic (Builtins::Function (this->builtin)))) {
+		dptr->deterministic = false;
+	}
+	
 	// Done.
 	return this;
 }
@@ -145,23 +182,38 @@ Nuria::Template::Node *Nuria::Template::MethodCallValueNode::configureParentCall
 	return dptr->transferTrim (this, block);
 }
 
-QVariant Nuria::Template::MethodCallValueNode::evaluate (TemplateProgramPrivate *dptr) {
-	Builtins::Function builtin = Builtins::nameLookup (this->name->variable);
+QVariant Nuria::Template::MethodCallValueNode::evaluate (ExecutionContext *dptr) {
 	QVariantList args;
 	
+	// default() only evaluates the fallback if it's used
+	if (this->builtin == Builtins::Default && arguments && arguments->values.length () > 1) {
+		QVariant value = arguments->values.first ()->evaluate (dptr);
+		if (!Builtins::isDefaultNeeded (value)) {
+			return value;
+		}
+		
+		return arguments->values.at (1)->evaluate (dptr);
+	}
+	
 	if (arguments) {
 		args = arguments->evaluateAll (dptr);
 	}
 	
-	if (builtin != Builtins::Unknown) {
-		return Builtins::invokeBuiltin (builtin, args, dptr);
+	if (this->builtin != Builtins::Unknown) {
+		return Builtins::invokeBuiltin (Builtins::Function (this->builtin), args, dptr);
 	}
 	
 	return evaluateUserFunction (args, dptr);
 }
 
 QVariant Nuria::Template::MethodCallValueNode::evaluateUserFunction (const QVariantList &args,
-                                                                     TemplateProgramPrivate *dptr) {
+                                                                     ExecutionContext *dptr) {
+	if (this->functionIndex >= 0) {
+		const Callback &cb = dptr->program ()->functionSlots.at (this->functionIndex).callback;
+		return (cb.isValid ()) ? cb.invoke (args) : QVariant ();
+	}
+	
+	// 
 	bool isConst = false;
 	Callback cb = name->asFunction (dptr, isConst);
 	
@@ -179,19 +231,44 @@ bool Nuria::Template::MethodCallValueNode::isConstant (TemplateProgramPrivate *d
 	}
 	
 	// Check for a built-in function
-	Builtins::Function builtin = Builtins::nameLookup (this->name->variable);
-	if (builtin != Builtins::Unknown) {
-		return Builtins::isBuiltinConstant (builtin);
+	if (this->builtin != Builtins::Unknown) {
+		return Builtins::isBuiltinConstant (Builtins::Function (this->builtin));
 	}
 	
 	// Custom functions may be constant
-	auto it = dptr->functions.constFind (this->name->variable);
-	if (it == dptr->functions.constEnd ()) {
+	if (this->functionIndex < 0) {
 		return false;
 	}
 	
-	// See if this is one.
-	return it->isConstant;
+	return dptr->functionSlots.at (this->functionIndex).isConstant;
+}
+
+static bool compareNumbers (double l, double r, Nuria::Template::Operator op) {
+	using namespace Nuria::Template;
+	
+	switch (op) {
+	default: return false;
+	case Operator::Less: return (l < r);
+	case Operator::LessEqual: return (l <= r);
+	case Operator::Greater: return (l > r);
+	case Operator::GreaterEqual: return ( l >= r);
+	}
+	
+}
+
+static bool compareIntegers (int l, int r, Nuria::Template::Operator op) {
+	using namespace Nuria::Template;
+	
+	switch (op) {
+	default: return false;
+	case Operator::Equal: return (l == r);
+	case Operator::NotEqual: return (l != r);
+	case Operator::Less: return (l < r);
+	case Operator::LessEqual: return (l <= r);
+	case Operator::Greater: return (l > r);
+	case Operator::GreaterEqual: return (l >= r);
+	}
+	
 }
 
 static bool compareVariants (const QVariant &left, const QVariant &right, Nuria::Template::Operator op) {
@@ -207,42 +284,65 @@ static bool compareVariants (const QVariant &left, const QVariant &right, Nuria:
 		return false;
 	}
 	
-	// 
-	double l = left.toDouble ();
-	double r = right.toDouble ();
+	return compareNumbers (left.toDouble (), right.toDouble (), op);
+}
+
+// Integer results which don't fit into an int are returned as double
+static Nuria::Template::Value integerResult (qint64 value) {
+	using namespace Nuria::Template;
+	if (value < std::numeric_limits< int >::min () || value > std::numeric_limits< int >::max ()) {
+		return Value (double (value));
+	}
+	
+	return Value (int (value));
+}
+
+static Nuria::Template::Value doubleArithmetic (double l, double r, Nuria::Template::Operator op) {
+	using namespace Nuria::Template;
 	
 	switch (op) {
-	default: return false;
-	case Operator::Less: return (l < r);
-	case Operator::LessEqual: return (l <= r);
-	case Operator::Greater: return (l > r);
-	case Operator::GreaterEqual: return ( l >= r);
+	default: return Value (double (0));
+	case Operator::Add: return Value (l + r);
+	case Operator::Substract: return Value (l - r);
+	case Operator::Multiply: return Value (l * r);
+	case Operator::Divide: return Value (l / r);
+	case Operator::Modulo: return Value (fmod (l, r));
+	case Operator::Power: return Value (pow (l, r));
 	}
 	
-	return false;
 }
 
+static Nuria::Template::Value integerArithmetic (int l, int r, Nuria::Template::Operator op) {
+	using namespace Nuria::Template;
+	
+	switch (op) {
+	case Operator::Add: return integerResult (qint64 (l) + r);
+	case Operator::Substract: return integerResult (qint64 (l) - r);
+	case Operator::Multiply: return integerResult (qint64 (l) * r);
+	case Operator::Modulo:
+		if (r != 0) {
+			return integerResult (qint64 (l) % r);
+		}
+		
+		break;
+	default: break;
+	}
+	
+	// Divisions and powers result in doubles
+	return doubleArithmetic (l, r, op);
+}
 
 static QVariant variantArithmetic (const QVariant &left, const QVariant &right, Nuria::Template::Operator op) {
-	using namespace Nuria::Template;
-	if (!left.canConvert< double > () || !right.canConvert< double > ()) {
-		return 0;
+	if (left.userType () == QMetaType::Int && right.userType () == QMetaType::Int) {
+		return integerArithmetic (left.toInt (), right.toInt (), op).toVariant ();
 	}
 	
 	// 
-	double l = left.toDouble ();
-	double r = right.toDouble ();
-	
-	switch (op) {
-	default: return double (0);
-	case Operator::Add: return (l + r);
-	case Operator::Substract: return (l - r);
-	case Operator::Multiply: return (l * r);
-	case Operator::Divide: return (l / r);
-	case Operator::Modulo: return fmod (l, r);
-	case Operator::Power: return pow (l, r);
+	if (!left.canConvert< double > () || !right.canConvert< double > ()) {
+		return 0;
 	}
 	
+	return doubleArithmetic (left.toDouble (), right.toDouble (), op).toVariant ();
 }
 
 static bool isLeftInRight (const QVariant &left, const QVariant &right) {
@@ -270,7 +370,7 @@ static bool isLeftInRight (const QVariant &left, const QVariant &right) {
 	
 }
 
-static inline bool isValueTrue (const QVariant &value) {
+bool Nuria::Template::isValueTrue (const QVariant &value) {
 	if (value.isNull ()) {
 		return false;
 	}
@@ -283,12 +383,25 @@ static inline bool isValueTrue (const QVariant &value) {
 	return true;
 }
 
+Nuria::Template::ValueType Nuria::Template::valueTypeOf (int type) {
+	switch (type) {
+	case QMetaType::Bool: return ValueType::Bool;
+	case QMetaType::Int: return ValueType::Int;
+	case QMetaType::Double: return ValueType::Double;
+	case QMetaType::QString: return ValueType::String;
+	default: return ValueType::Unknown;
+	}
+	
+}
+
 static QVariant negateValue (const QVariant &value) {
-	if (value.userType () == QMetaType::Double || value.userType () == QMetaType::Int) {
+	if (value.userType () == QMetaType::Int) {
+		return integerResult (-qint64 (value.toInt ())).toVariant ();
+	} else if (value.userType () == QMetaType::Double) {
 		return -value.toDouble ();
 	}
 	
-	return !isValueTrue (value);
+	return !Nuria::Template::isValueTrue (value);
 }
 
 static bool evaluateStringTest (const QString &left, const QString &right, Nuria::Template::Operator op) {
@@ -355,6 +468,46 @@ static bool evaluateSingleArgumentTest (const QVariant &variant, Nuria::Template
 	
 }
 
+// Returns the type to specialize the binary expression for, if any
+static Nuria::Template::ValueType operandType (Nuria::Template::ValueType l, Nuria::Template::ValueType r,
+                                               Nuria::Template::Operator op) {
+	using namespace Nuria::Template;
+	bool numbers = (l == ValueType::Int || l == ValueType::Double) &&
+	               (r == ValueType::Int || r == ValueType::Double);
+	
+	switch (op) {
+	case Operator::Add:
+	case Operator::Substract:
+	case Operator::Multiply:
+	case Operator::Divide:
+	case Operator::Modulo:
+	case Operator::Power:
+	case Operator::Less:
+	case Operator::LessEqual:
+	case Operator::Greater:
+	case Operator::GreaterEqual:
+		if (l == ValueType::Int && r == ValueType::Int) {
+			return ValueType::Int;
+		}
+		
+		return numbers ? ValueType::Double : ValueType::Unknown;
+	case Operator::Equal:
+	case Operator::NotEqual:
+		// QVariant compares doubles fuzzily, leave that to it.
+		return (l == r && l != ValueType::Double) ? l : ValueType::Unknown;
+	case Operator::Concatenate:
+		return (l == ValueType::String && r == ValueType::String) ? l : ValueType::Unknown;
+	default:
+		return ValueType::Unknown;
+	}
+	
+}
+
+static bool isComparison (Nuria::Template::Operator op) {
+	using namespace Nuria::Template;
+	return (op >= Operator::Equal && op <= Operator::GreaterEqual);
+}
+
 Nuria::Template::Node *Nuria::Template::ExpressionNode::compile (Compiler *compiler, TemplateProgramPrivate *dptr) {
 	
 	swapAndDestroy (this->left, (ValueNode *)this->left->compile (compiler, dptr));
@@ -363,14 +516,37 @@ Nuria::Template::Node *Nuria::Template::ExpressionNode::compile (Compiler *compi
 	}
 	
 	// For constant folding. Does transferTrim().
-	return ValueNode::compile (compiler, dptr);
+	Node *result = ValueNode::compile (compiler, dptr);
+	if (result != this) {
+		return result;
+	}
+	
+	return specialize (dptr);
 }
 
-QVariant Nuria::Template::ExpressionNode::evaluate (TemplateProgramPrivate *dptr) {
-	QVariant l = left->evaluate (dptr);
-	QVariant r = (!right) ? QVariant () : right->evaluate (dptr);
+QVariant Nuria::Template::ExpressionNode::evaluate (ExecutionContext *dptr) {
+	return evaluateValue (dptr).toVariant ();
+}
+
+Nuria::Template::Value Nuria::Template::ExpressionNode::evaluateValue (ExecutionContext *dptr) {
+	Value l = left->evaluateValue (dptr);
 	
-	switch (action) {
+	// Only evaluate the right side if it decides the result
+	switch (this->action) {
+	case Operator::NoOp: return l;
+	case Operator::Not: return Value (!l.isTrue ());
+	case Operator::And: return Value (l.isTrue () && right->evaluateValue (dptr).isTrue ());
+	case Operator::Or: return Value (l.isTrue () || right->evaluateValue (dptr).isTrue ());
+	default: break;
+	}
+	
+	// 
+	Value r = (!right) ? Value () : right->evaluateValue (dptr);
+	return apply (l, r, this->action);
+}
+
+QVariant Nuria::Template::ExpressionNode::apply (const QVariant &l, const QVariant &r, Operator op) {
+	switch (op) {
 	case Operator::NoOp: return l;
 	case Operator::Not: return !isValueTrue (l);
 	case Operator::Negate: return negateValue (l);
@@ -380,7 +556,7 @@ QVariant Nuria::Template::ExpressionNode::evaluate (TemplateProgramPrivate *dptr
 	case Operator::Divide:
 	case Operator::Modulo:
 	case Operator::Power:
-		return variantArithmetic (l, r, action);
+		return variantArithmetic (l, r, op);
 	case Operator::Concatenate:
 		return (l.toString () + r.toString ());
 	case Operator::Equal:
@@ -389,20 +565,19 @@ QVariant Nuria::Template::ExpressionNode::evaluate (TemplateProgramPrivate *dptr
 	case Operator::LessEqual:
 	case Operator::Greater:
 	case Operator::GreaterEqual:
-		return compareVariants (l, r, action);
+		return compareVariants (l, r, op);
 	case Operator::In:
 		return isLeftInRight (l, r);
 	case Operator::NotIn:
 		return !isLeftInRight (l, r);
 	case Operator::And:
-		return (isValueTrue (l) && isValueTrue (r));
 	case Operator::Or:
-		return (isValueTrue (l) || isValueTrue (r));
+		break; // Handled in evaluateValue()
 	case Operator::DivisibleBy:
 		return isLeftDivisibleByRight (l.toDouble (), r.toDouble ());
 	case Operator::StartsWith:
 	case Operator::EndsWith:
-		return evaluateStringTest (l.toString (), r.toString (), action);
+		return evaluateStringTest (l.toString (), r.toString (), op);
 	case Operator::IsEmpty:
 		return isValueEmpty (l);
 	case Operator::IsDefined:
@@ -410,12 +585,172 @@ QVariant Nuria::Template::ExpressionNode::evaluate (TemplateProgramPrivate *dptr
 	case Operator::IsEven:
 	case Operator::IsOdd:
 	case Operator::IsIterable:
-		return evaluateSingleArgumentTest (l, action);
+		return evaluateSingleArgumentTest (l, op);
 	}
 	
 	return QVariant ();
 }
 
+Nuria::Template::Value Nuria::Template::ExpressionNode::apply (const Value &l, const Value &r, Operator op) {
+	bool integers = (l.kind () == Value::Int && r.kind () == Value::Int);
+	bool numbers = (l.isNumber () && r.isNumber ());
+	
+	switch (op) {
+	case Operator::NoOp: return l;
+	case Operator::Not: return Value (!l.isTrue ());
+	case Operator::Negate:
+		if (l.kind () == Value::Int) {
+			return integerResult (-qint64 (l.intValue ()));
+		} else if (l.kind () == Value::Double) {
+			return Value (-l.toDouble ());
+		}
+		
+		break;
+	case Operator::Add:
+	case Operator::Substract:
+	case Operator::Multiply:
+	case Operator::Divide:
+	case Operator::Modulo:
+	case Operator::Power:
+		if (integers) {
+			return integerArithmetic (l.intValue (), r.intValue (), op);
+		} else if (numbers) {
+			return doubleArithmetic (l.toDouble (), r.toDouble (), op);
+		}
+		
+		break;
+	case Operator::Concatenate:
+		return Value (QVariant (l.toString () + r.toString ()));
+	case Operator::Equal:
+	case Operator::NotEqual: {
+		bool equal = (op == Operator::Equal);
+		const QString *a = l.string ();
+		const QString *b = r.string ();
+		if (integers) {
+			return Value ((l.intValue () == r.intValue ()) == equal);
+		} else if (a && b) {
+			return Value ((*a == *b) == equal);
+		}
+		
+	} break;
+	case Operator::Less:
+	case Operator::LessEqual:
+	case Operator::Greater:
+	case Operator::GreaterEqual:
+		if (integers) {
+			return Value (compareIntegers (l.intValue (), r.intValue (), op));
+		} else if (numbers) {
+			return Value (compareNumbers (l.toDouble (), r.toDouble (), op));
+		}
+		
+		break;
+	default:
+		break;
+	}
+	
+	// Everything else works on QVariants
+	return Value (apply (l.toVariant (), r.toVariant (), op));
+}
+
+Nuria::Template::ValueType Nuria::Template::ExpressionNode::valueType (TemplateProgramPrivate *dptr) const {
+	switch (this->action) {
+	case Operator::NoOp:
+		return this->left->valueType (dptr);
+	case Operator::Negate: {
+		ValueType type = this->left->valueType (dptr);
+		return (type == ValueType::String) ? ValueType::Bool : type;
+	}
+	case Operator::Add:
+	case Operator::Substract:
+	case Operator::Multiply:
+	case Operator::Divide:
+	case Operator::Modulo:
+	case Operator::Power: {
+		ValueType type = operandType (this->left->valueType (dptr), this->right->valueType (dptr),
+		                              this->action);
+		bool integral = (this->action != Operator::Divide && this->action != Operator::Power);
+		return (type == ValueType::Int && !integral) ? ValueType::Double : type;
+	}
+	case Operator::Concatenate:
+		return ValueType::String;
+	default:
+		return ValueType::Bool;
+	}
+	
+}
+
+Nuria::Template::Node *Nuria::Template::ExpressionNode::specialize (TemplateProgramPrivate *dptr) {
+	if (!this->right) {
+		return this;
+	}
+	
+	ValueType type = operandType (this->left->valueType (dptr), this->right->valueType (dptr),
+	                              this->action);
+	if (type == ValueType::Unknown) {
+		return this;
+	}
+	
+	TRACE(nDebug() << "ExpressionNode" << this << "specialized for type" << int (type));
+	TypedExpressionNode *node = new TypedExpressionNode (this->loc, this->left, this->action,
+	                                                     this->right, type);
+	this->left = nullptr;
+	this->right = nullptr;
+	return dptr->transferTrim (this, node);
+}
+
+Nuria::Template::Value Nuria::Template::TypedExpressionNode::evaluateValue (ExecutionContext *dptr) {
+	Value l = this->left->evaluateValue (dptr);
+	Value r = this->right->evaluateValue (dptr);
+	
+	// Use the generic implementation if an operand isn't of the expected type
+	switch (this->operands) {
+	case ValueType::Int:
+		if (l.kind () == Value::Int && r.kind () == Value::Int) {
+			int a = l.intValue ();
+			int b = r.intValue ();
+			return isComparison (this->action) ? Value (compareIntegers (a, b, this->action))
+			                                   : integerArithmetic (a, b, this->action);
+		}
+		
+		break;
+	case ValueType::Double:
+		if (l.isNumber () && r.isNumber () &&
+		    (l.kind () == Value::Double || r.kind () == Value::Double)) {
+			double a = l.toDouble ();
+			double b = r.toDouble ();
+			return isComparison (this->action) ? Value (compareNumbers (a, b, this->action))
+			                                   : doubleArithmetic (a, b, this->action);
+		}
+		
+		break;
+	case ValueType::String: {
+		const QString *a = l.string ();
+		const QString *b = r.string ();
+		if (a && b) {
+			switch (this->action) {
+			case Operator::Equal: return Value (*a == *b);
+			case Operator::NotEqual: return Value (*a != *b);
+			default: return Value (QVariant (*a + *b));
+			}
+			
+		}
+		
+		break;
+	}
+	case ValueType::Bool:
+		if (l.kind () == Value::Bool && r.kind () == Value::Bool) {
+			bool equal = (l.isTrue () == r.isTrue ());
+			return Value ((this->action == Operator::Equal) ? equal : !equal);
+		}
+		
+		break;
+	case ValueType::Unknown:
+		break;
+	}
+	
+	return apply (l, r, this->action);
+}
+
 bool Nuria::Template::ExpressionNode::isConstant (TemplateProgramPrivate *dptr) const {
 	if (this->left && !this->left->isConstant (dptr)) return false;
 	if (this->right && !this->right->isConstant (dptr)) return false;
@@ -438,18 +773,27 @@ Nuria::Template::Node *Nuria::Template::VariableNode::compile (Compiler *compile
 	return this;
 }
 
-QVariant Nuria::Template::VariableNode::evaluate (TemplateProgramPrivate *dptr) {
+QVariant Nuria::Template::VariableNode::evaluate (ExecutionContext *dptr) {
         if (this->index < 0) {
 	        return QVariant ();
         }
         
         // 
-	return dptr->values[this->index];
+	return dptr->values.at (this->index);
 }
 
-Nuria::Callback Nuria::Template::VariableNode::asFunction (TemplateProgramPrivate *dptr, bool &isConst) {
-	auto it = dptr->functions.constFind (this->variable);
-	if (it == dptr->functions.constEnd ()) {
+Nuria::Template::Value Nuria::Template::VariableNode::evaluateValue (ExecutionContext *dptr) {
+	if (this->index < 0) {
+		return Value ();
+	}
+	
+	return Value::view (dptr->values.at (this->index));
+}
+
+Nuria::Callback Nuria::Template::VariableNode::asFunction (ExecutionContext *dptr, bool &isConst) {
+	const FunctionMap &functions = dptr->program ()->functions;
+	auto it = functions.constFind (this->variable);
+	if (it == functions.constEnd ()) {
 		return Callback ();
 	}
 	
@@ -458,7 +802,7 @@ Nuria::Callback Nuria::Template::VariableNode::asFunction (TemplateProgramPrivat
 	return it->callback;
 }
 
-void Nuria::Template::VariableNode::write (TemplateProgramPrivate *dptr, const QVariant &value) {
+void Nuria::Template::VariableNode::write (ExecutionContext *dptr, const QVariant &value) {
 	dptr->values[this->index] = value;
 }
 
@@ -473,6 +817,14 @@ bool Nuria::Template::VariableNode::isConstant (TemplateProgramPrivate *dptr) co
 	return (lastWrite >= 0 && dptr->usages.at (this->index).at (lastWrite).isConstant);
 }
 
+Nuria::Template::ValueType Nuria::Template::VariableNode::valueType (TemplateProgramPrivate *dptr) const {
+	if (this->isFunction || !dptr->info) {
+		return ValueType::Unknown;
+	}
+	
+	return valueTypeOf (dptr->info->variableTypes.value (this->variable, QMetaType::UnknownType));
+}
+
 int Nuria::Template::VariableNode::lastWriteAccessRecord (TemplateProgramPrivate *dptr) const {
 	const VariableUsageList &list = dptr->usages.at (this->index);
 	for (int i = list.length () - 1; i >= 0; i--) {
@@ -492,6 +844,13 @@ Nuria::Template::Node *Nuria::Template::ChainedVariableNode::compile (Compiler *
 	TRACE(nDebug() << "Compiling chain" << this->chain << "of ChainedValueNode" << this);
 	swapAndDestroy (this->chain, (MultipleValueNode *)this->chain->compile (compiler, dptr));
 	reduceChain (dptr);
+	prepareKeys ();
+	
+	// Fields of 'loop' are read from the loop state directly
+	Node *loopField = compileLoopField (dptr);
+	if (loopField) {
+		return dptr->transferTrim (this, loopField);
+	}
 	
 	// 
 	this->isFunction = false;
@@ -514,7 +873,52 @@ void Nuria::Template::ChainedVariableNode::reduceChain (TemplateProgramPrivate *
 	TRACE(nDebug() << "Reduced chain list of ChainedValueNode" << this << "to" << this->chainList);
 }
 
-QVariant Nuria::Template::ChainedVariableNode::evaluate (Nuria::TemplateProgramPrivate *dptr) {
+void Nuria::Template::ChainedVariableNode::prepareKeys () {
+	if (!this->chain) {
+		this->chainKeys = VariableAcessor::prepareChain (this->chainList, true);
+		return;
+	}
+	
+	// Cache look-ups of the constant parts
+	this->chainKeys.clear ();
+	for (ValueNode *cur : this->chain->values) {
+		LiteralValueNode *literal = dynamic_cast< LiteralValueNode * > (cur);
+		if (literal) {
+			this->chainKeys.append (VariableAcessor::Key (literal->value, true));
+		} else {
+			this->chainKeys.append (VariableAcessor::Key ());
+		}
+		
+	}
+	
+}
+
+Nuria::Template::Node *Nuria::Template::ChainedVariableNode::compileLoopField (TemplateProgramPrivate *dptr) {
+	if (this->isFunction || this->writeAccess || this->chain || dptr->info->loopDepth < 1 ||
+	    this->variable != QLatin1String ("loop")) {
+		return nullptr;
+	}
+	
+	// Accept "loop.field", "loop.parent.loop.field", ...
+	static const QString parentName = QStringLiteral("parent");
+	static const QString loopName = QStringLiteral("loop");
+	
+	int depth = 0;
+	int i = 0;
+	for (; i + 2 < this->chainList.length () && this->chainList.at (i).toString () == parentName &&
+	     this->chainList.at (i + 1).toString () == loopName; i += 2, depth++);
+	
+	LoopFieldNode::Field field;
+	if (i != this->chainList.length () - 1 || depth >= dptr->info->loopDepth ||
+	    !LoopFieldNode::fieldFromName (this->chainList.at (i).toString (), field)) {
+		return nullptr;
+	}
+	
+	TRACE(nDebug() << "ChainedValueNode" << this << "reads loop field" << field << "at depth" << depth);
+	return new LoopFieldNode (this->loc, field, depth);
+}
+
+QVariant Nuria::Template::ChainedVariableNode::evaluate (Nuria::Template::ExecutionContext *dptr) {
 	if (this->index < 0) {
 		return QVariant ();
 	}
@@ -522,36 +926,53 @@ QVariant Nuria::Template::ChainedVariableNode::evaluate (Nuria::TemplateProgramP
 	return evaluateChain (dptr);
 }
 
-Nuria::Callback Nuria::Template::ChainedVariableNode::asFunction (TemplateProgramPrivate *dptr, bool &isConst) {
+Nuria::Callback Nuria::Template::ChainedVariableNode::asFunction (ExecutionContext *dptr, bool &isConst) {
 	isConst = false;
 	return evaluate (dptr).value< Callback > ();
 }
 
-QVariant Nuria::Template::ChainedVariableNode::evaluateChain (TemplateProgramPrivate *dptr) {
-	QVariantList list = this->chainList;
-	if (list.isEmpty () && this->chain) {
-		list = this->chain->evaluateAll (dptr);
+QVariant Nuria::Template::ChainedVariableNode::evaluateChain (ExecutionContext *dptr) {
+	QVariant cur = dptr->values.at (this->index);
+	
+	if (!this->chain) {
+		if (!VariableAcessor::walkChain (cur, this->chainKeys)) {
+			// TODO: Output error
+			return QVariant ();
+		}
+		
+		return cur;
 	}
 	
-	QVariant cur = dptr->values[this->index];
-	if (!VariableAcessor::walkChain (cur, list, 0)) {
-		// TODO: Output error
-		return QVariant ();
+	// Dynamic keys are evaluated while walking the chain. Constant ones
+	// have been prepared, with their cache, by prepareKeys().
+	for (int i = 0; i < this->chainKeys.length (); i++) {
+		const VariableAcessor::Key &key = this->chainKeys.at (i);
+		bool found = false;
+		
+		if (key.cache) {
+			found = VariableAcessor::walkKey (cur, key);
+		} else {
+			VariableAcessor::Key dynamicKey (this->chain->values.at (i)->evaluate (dptr));
+			found = VariableAcessor::walkKey (cur, dynamicKey);
+		}
+		
+		if (!found) {
+			// TODO: Output error
+			return QVariant ();
+		}
+		
 	}
 	
 	return cur;
 }
 
-QString Nuria::Template::MultipleNodes::render (TemplateProgramPrivate *dptr) {
-	QString data;
-	
+void Nuria::Template::MultipleNodes::renderTo (ExecutionContext *dptr, Sink &sink) {
 	auto it = this->nodes.begin ();
 	auto end = this->nodes.end ();
 	for (; it != end; ++it) {
-		data.append ((*it)->render (dptr));
+		(*it)->renderTo (dptr, sink);
 	}
 	
-	return data;
 }
 
 Nuria::Template::Node *Nuria::Template::MultipleNodes::compile (Compiler *compiler, TemplateProgramPrivate *dptr) {
@@ -700,8 +1121,8 @@ Nuria::Template::Node *Nuria::Template::MultipleNodes::staticReduction () {
 	return this;
 }
 
-Nuria::Template::Node *Nuria::Template::IfClauseNode::evaluateAndReturnNode (TemplateProgramPrivate *dptr) {
-	bool success = isValueTrue (expression->evaluate (dptr));
+Nuria::Template::Node *Nuria::Template::IfClauseNode::evaluateAndReturnNode (ExecutionContext *dptr) {
+	bool success = expression->evaluateValue (dptr).isTrue ();
 	
 	if (success) {
 		return onSuccess;
@@ -710,14 +1131,13 @@ Nuria::Template::Node *Nuria::Template::IfClauseNode::evaluateAndReturnNode (Tem
 	return onFailure;
 }
 
-QString Nuria::Template::IfClauseNode::render (TemplateProgramPrivate *dptr) {
+void Nuria::Template::IfClauseNode::renderTo (ExecutionContext *dptr, Sink &sink) {
 	Node *node = evaluateAndReturnNode (dptr);
 	
 	if (node) {
-		return node->render (dptr);
+		node->renderTo (dptr, sink);
 	}
 	
-	return QString ();
 }
 
 Nuria::Template::Node *Nuria::Template::IfClauseNode::compileInternal (bool constantFolding, Compiler *compiler,
@@ -768,20 +1188,25 @@ Nuria::Template::Node *Nuria::Template::IfClauseNode::compile (Compiler *compile
 	return compileInternal (true, compiler, dptr);
 }
 
-QString Nuria::Template::ForLoopNode::render (TemplateProgramPrivate *dptr) {
+void Nuria::Template::ForLoopNode::renderTo (ExecutionContext *dptr, Sink &sink) {
 	QVariant result = expression->evaluate (dptr);
 	QVariant parent;
-	QString target;
+	
+	// Loop state, read by fields of 'loop'
+	LoopState state { 0, 0, !this->condition, dptr->currentLoop };
+	VariableKeeper< LoopState * > loopKeeper (dptr->currentLoop, &state);
+	Q_UNUSED(loopKeeper);
 	
 	// Else ?
 	if (!isValueTrue (result)) {
-		doElse (dptr, target);
-		return target;
+		doElse (dptr, sink);
+		return;
 	}
 	
 	// Save parent context
+	QVariant parentLoop;
 	if (this->loopVariable >= 0) {
-		QVariant parentLoop = dptr->values.at (this->loopVariable);
+		parentLoop = dptr->values.at (this->loopVariable);
 		QVariantMap parentMap { { QStringLiteral("loop"), parentLoop } };
 		parent = parentMap;
 	}
@@ -789,25 +1214,24 @@ QString Nuria::Template::ForLoopNode::render (TemplateProgramPrivate *dptr) {
 	// Then ..
 	int itemCount = 0;
 	if (result.canConvert< QVariantList > ()) {
-		itemCount = iterateList (dptr, result, target, parent);
+		itemCount = iterateList (dptr, result, sink, parent);
 	} else if (result.canConvert< QVariantMap > ()) {
-		itemCount = iterateMap (dptr, result, target, parent);
+		itemCount = iterateMap (dptr, result, sink, parent);
 	} else {
-		doRun (dptr, target, result, 0, 1, parent);
+		doRun (dptr, sink, result, 0, 1, parent);
 		itemCount = 1;
 	}
 	
 	// No hits?
 	if (itemCount < 1) {
-		doElse (dptr, target);
+		doElse (dptr, sink);
 	}
 	
 	// Restore parent context
 	if (this->loopVariable >= 0) {
-		dptr->values[this->loopVariable] = parent;
+		dptr->values[this->loopVariable] = parentLoop;
 	}
 	
-	return target;
 }
 
 Nuria::Template::Node *Nuria::Template::ForLoopNode::compile (Compiler *compiler, TemplateProgramPrivate *dptr) {
@@ -826,14 +1250,16 @@ Nuria::Template::Node *Nuria::Template::ForLoopNode::compile (Compiler *compiler
 	}
 	
 	// Compile the body
+	dptr->info->loopDepth++;
 	Node *result = compileInternal (false, compiler, dptr);
+	dptr->info->loopDepth--;
 	
 	setUpLoopVariable (dptr);
 	return result;
 }
 
-int Nuria::Template::ForLoopNode::iterateList (TemplateProgramPrivate *dptr, const QVariant &data,
-                                               QString &target, const QVariant &parent) {
+int Nuria::Template::ForLoopNode::iterateList (ExecutionContext *dptr, const QVariant &data,
+                                               Sink &sink, const QVariant &parent) {
 	QSequentialIterable iter = data.value< QSequentialIterable > ();
 	auto it = iter.begin ();
 	auto end = iter.end ();
@@ -841,14 +1267,14 @@ int Nuria::Template::ForLoopNode::iterateList (TemplateProgramPrivate *dptr, con
 	
 	int length = iter.size ();
 	for (; it != end; ++it) {
-		hits += doRun (dptr, target, *it, hits, length, parent);
+		hits += doRun (dptr, sink, *it, hits, length, parent);
 	}
 	
 	return hits;
 }
 
-int Nuria::Template::ForLoopNode::iterateMap (TemplateProgramPrivate *dptr, const QVariant &data,
-                                              QString &target, const QVariant &parent) {
+int Nuria::Template::ForLoopNode::iterateMap (ExecutionContext *dptr, const QVariant &data,
+                                              Sink &sink, const QVariant &parent) {
 	QAssociativeIterable iter = data.value< QAssociativeIterable > ();
 	auto it = iter.begin ();
 	auto end = iter.end ();
@@ -856,13 +1282,13 @@ int Nuria::Template::ForLoopNode::iterateMap (TemplateProgramPrivate *dptr, cons
 	
 	int length = iter.size ();
 	for (; it != end; ++it) {
-	        hits += doMapRun (dptr, target, it.key (), it.value (), hits, length, parent);
+	        hits += doMapRun (dptr, sink, it.key (), it.value (), hits, length, parent);
 	}
 	
 	return hits;
 }
 
-bool Nuria::Template::ForLoopNode::doRun (TemplateProgramPrivate *dptr, QString &target, const QVariant &current,
+bool Nuria::Template::ForLoopNode::doRun (ExecutionContext *dptr, Sink &sink, const QVariant &current,
                                           int index, int length, const QVariant &parent) {
 	variable->write (dptr, current);
 	
@@ -871,11 +1297,11 @@ bool Nuria::Template::ForLoopNode::doRun (TemplateProgramPrivate *dptr, QString
 	}
 	
 	updateLoopVariable (dptr, index, length, parent);
-	target.append (onSuccess->render (dptr));
+	onSuccess->renderTo (dptr, sink);
 	return true;
 }
 
-bool Nuria::Template::ForLoopNode::doMapRun (TemplateProgramPrivate *dptr, QString &target,
+bool Nuria::Template::ForLoopNode::doMapRun (ExecutionContext *dptr, Sink &sink,
                                              const QVariant &key, const QVariant &current,
                                              int index, int length, const QVariant &parent) {
 	variable->write (dptr, current);
@@ -889,21 +1315,25 @@ bool Nuria::Template::ForLoopNode::doMapRun (TemplateProgramPrivate *dptr, QStri
 	}
 	
 	updateLoopVariable (dptr, index, length, parent);
-	target.append (onSuccess->render (dptr));
+	onSuccess->renderTo (dptr, sink);
 	return true;
 }
 
-bool Nuria::Template::ForLoopNode::checkCurrentForMatch (TemplateProgramPrivate *dptr) {
+bool Nuria::Template::ForLoopNode::checkCurrentForMatch (ExecutionContext *dptr) {
 	if (!this->condition) {
 		return true;
 	}
 	
 	// Evaluate condition
-	return isValueTrue (this->condition->evaluate (dptr));
+	return this->condition->evaluateValue (dptr).isTrue ();
 }
 
-void Nuria::Template::ForLoopNode::updateLoopVariable (TemplateProgramPrivate *dptr, int index,
+void Nuria::Template::ForLoopNode::updateLoopVariable (ExecutionContext *dptr, int index,
                                                        int length, const QVariant &parent) {
+	dptr->currentLoop->index = index;
+	dptr->currentLoop->length = length;
+	
+	// The map is only needed if 'loop' is used as a whole
 	if (this->loopVariable < 0) {
 		return;
 	}
@@ -932,8 +1362,9 @@ void Nuria::Template::ForLoopNode::updateLoopVariable (TemplateProgramPrivate *d
 
 void Nuria::Template::ForLoopNode::setUpLoopVariable (TemplateProgramPrivate *dptr) {
 	
-	// Find index of the 'loop' variable if used anywhere
-	this->loopVariable = dptr->variables.indexOf (QStringLiteral("loop"));
+	// Find index of the 'loop' variable if used anywhere. Fields read
+	// through LoopFieldNode don't need it.
+	this->loopVariable = dptr->indexOfVariable (QStringLiteral("loop"));
 	
 	if (this->loopVariable < 0) {
 		return;
@@ -945,14 +1376,65 @@ void Nuria::Template::ForLoopNode::setUpLoopVariable (TemplateProgramPrivate *dp
 	
 }
 
-void Nuria::Template::ForLoopNode::doElse (TemplateProgramPrivate *dptr, QString &target) {
+void Nuria::Template::ForLoopNode::doElse (ExecutionContext *dptr, Sink &sink) {
 	if (onFailure) {
-		target.append (onFailure->render (dptr));
+		onFailure->renderTo (dptr, sink);
+	}
+	
+}
+
+bool Nuria::Template::LoopFieldNode::fieldFromName (const QString &name, Field &field) {
+	static const QMap< QString, Field > fields = {
+		{ QStringLiteral("index"), Index },
+		{ QStringLiteral("index0"), Index0 },
+		{ QStringLiteral("revindex"), RevIndex },
+		{ QStringLiteral("revindex0"), RevIndex0 },
+		{ QStringLiteral("first"), First },
+		{ QStringLiteral("last"), Last },
+		{ QStringLiteral("length"), Length }
+	};
+	
+	auto it = fields.constFind (name);
+	if (it == fields.constEnd ()) {
+		return false;
+	}
+	
+	field = *it;
+	return true;
+}
+
+Nuria::Template::Value Nuria::Template::LoopFieldNode::evaluateValue (ExecutionContext *dptr) {
+	LoopState *state = dptr->currentLoop;
+	for (int i = 0; i < this->depth && state; i++, state = state->parent);
+	
+	if (!state) {
+		return Value ();
+	}
+	
+	// 
+	switch (this->field) {
+	case Index: return Value (state->index + 1);
+	case Index0: return Value (state->index);
+	case First: return Value (state->index == 0);
+	default: break;
+	}
+	
+	// Some values are only available if we know the total length
+	if (!state->hasLength) {
+		return Value ();
+	}
+	
+	switch (this->field) {
+	case RevIndex: return Value (state->length - state->index);
+	case RevIndex0: return Value ((state->length - state->index) - 1);
+	case Length: return Value (state->length);
+	case Last: return Value (state->index == state->length - 1);
+	default: return Value ();
 	}
 	
 }
 
-QVariant Nuria::Template::ValueMapNode::evaluate (TemplateProgramPrivate *dptr) {
+QVariant Nuria::Template::ValueMapNode::evaluate (ExecutionContext *dptr) {
 	QVariantMap map;
 	
 	auto it = values.constBegin ();
@@ -1016,7 +1498,7 @@ Nuria::Template::BlockNode::~BlockNode () {
 	
 }
 
-QString Nuria::Template::BlockNode::render (TemplateProgramPrivate *dptr) {
+QString Nuria::Template::BlockNode::render (ExecutionContext *dptr) {
 	if (body) {
 		return body->render (dptr);
 	}
@@ -1024,6 +1506,13 @@ QString Nuria::Template::BlockNode::render (TemplateProgramPrivate *dptr) {
 	return QString ();
 }
 
+void Nuria::Template::BlockNode::renderTo (ExecutionContext *dptr, Sink &sink) {
+	if (body) {
+		body->renderTo (dptr, sink);
+	}
+	
+}
+
 Nuria::Template::Node *Nuria::Template::BlockNode::compile (Compiler *compiler, TemplateProgramPrivate *dptr) {
 	if (!body) {
 		return this;
@@ -1225,7 +1714,7 @@ Nuria::Template::Node *Nuria::Template::StringNode::compile (Compiler *compiler,
 	return this;
 }
 
-QString Nuria::Template::StringNode::render (TemplateProgramPrivate *dptr) {
+QString Nuria::Template::StringNode::render (ExecutionContext *dptr) {
 	if (this->values.isEmpty ()) {
 		return this->string;
 	}
@@ -1368,13 +1857,17 @@ Nuria::Template::Node *Nuria::Template::TernaryOperatorNode::compile (Compiler *
 	return dptr->transferTrim (this, new LiteralValueNode (this->loc, this->evaluate (dptr)));
 }
 
-QVariant Nuria::Template::TernaryOperatorNode::evaluate (TemplateProgramPrivate *dptr) {
-	QVariant value = this->expression->evaluate (dptr);
+QVariant Nuria::Template::TernaryOperatorNode::evaluate (ExecutionContext *dptr) {
+	return evaluateValue (dptr).toVariant ();
+}
+
+Nuria::Template::Value Nuria::Template::TernaryOperatorNode::evaluateValue (ExecutionContext *dptr) {
+	Value value = this->expression->evaluateValue (dptr);
 	
 	// value is 'true'
-	if (isValueTrue (value)) {
+	if (value.isTrue ()) {
 		if (onSuccess) {
-			return onSuccess->evaluate (dptr);
+			return onSuccess->evaluateValue (dptr);
 		}
 		
 		return value;
@@ -1382,11 +1875,11 @@ QVariant Nuria::Template::TernaryOperatorNode::evaluate (TemplateProgramPrivate
 	
 	// Else
 	if (onFailure) {
-		return onFailure->evaluate (dptr);
+		return onFailure->evaluateValue (dptr);
 	}
 	
 	// No failure node, return empty string.
-	return QString ();
+	return Value (QVariant (QString ()));
 }
 
 bool Nuria::Template::TernaryOperatorNode::isConstant (TemplateProgramPrivate *dptr) const {
@@ -1434,7 +1927,7 @@ Nuria::Template::Node *Nuria::Template::MatchesTestNode::compile (Compiler *comp
 	return this;
 }
 
-QVariant Nuria::Template::MatchesTestNode::evaluate (TemplateProgramPrivate *dptr) {
+QVariant Nuria::Template::MatchesTestNode::evaluate (ExecutionContext *dptr) {
 	QString value = this->value->evaluate (dptr).toString ();
 	
 	// Fast-path for constant regular expressions, like the case in 99% of all cases
@@ -1446,7 +1939,7 @@ QVariant Nuria::Template::MatchesTestNode::evaluate (TemplateProgramPrivate *dpt
 	return rx.match (value).hasMatch ();
 }
 
-QRegularExpression Nuria::Template::MatchesTestNode::evaluateRegEx (TemplateProgramPrivate *dptr) {
+QRegularExpression Nuria::Template::MatchesTestNode::evaluateRegEx (ExecutionContext *dptr) {
 	QString rxExpression = this->test->evaluate (dptr).toString ();
 	QRegularExpression rx (rxExpression);
 	
@@ -1503,19 +1996,24 @@ Nuria::Template::Node *Nuria::Template::FilterNode::compile (Compiler *compiler,
 	}
 	
 	// Prepare inner method to receive the body render result as argument.
-	innerMost->arguments->values.prepend (new LiteralValueNode (this->loc, QString ()));
+	innerMost->arguments->values.prepend (new FilterBodyNode (this->loc));
 	
 	return this;
 }
 
-QString Nuria::Template::FilterNode::render (TemplateProgramPrivate *dptr) {
+QVariant Nuria::Template::FilterBodyNode::evaluate (ExecutionContext *dptr) {
+	return dptr->filterBodies.last ();
+}
+
+QString Nuria::Template::FilterNode::render (ExecutionContext *dptr) {
 	
-	// Inject body result as first argument to the inner-most method
-	LiteralValueNode *value = dynamic_cast< LiteralValueNode * > (this->inner->arguments->values.first ());
-	value->value = this->body->render (dptr);
+	// Pass body result as first argument to the inner-most method
+	dptr->filterBodies.append (this->body->render (dptr));
 	
 	// Return result of the outer method
-	return this->outer->render (dptr);
+	QString result = this->outer->render (dptr);
+	dptr->filterBodies.removeLast ();
+	return result;
 }
 
 Nuria::Template::MethodCallValueNode *Nuria::Template::FilterNode::compileFunctions (Compiler *compiler,
@@ -1560,39 +2058,51 @@ Nuria::Template::Node *Nuria::Template::AutoescapeNode::compile (Compiler *compi
 		return nullptr;
 	}
 	
+	// Escape constant text once now, instead of on every render.
+	swapAndDestroy (this->body, escapeConstants (this->body));
+	
 	// Done.
 	return this;
 }
 
-// Template class, which keeps the value of a certain variable and resets the
-// variables value to the kept value when the instance is destroyed.
-template< typename T >
-class VariableKeeper {
-	T &variable;
-	T oldValue;
-public:
-	constexpr VariableKeeper (T &variable)
-	        : variable (variable), oldValue (variable)
-	{ }
-	
-	VariableKeeper (T &variable, const T &newValue)
-	        : variable (variable), oldValue (variable)
-	{ variable = newValue; }
-	
-	~VariableKeeper () { variable = oldValue; }
-};
-
-QString Nuria::Template::AutoescapeNode::render (TemplateProgramPrivate *dptr) {
+void Nuria::Template::AutoescapeNode::renderTo (ExecutionContext *dptr, Sink &sink) {
 
 	// Set current escape mode
 	VariableKeeper< EscapeMode > modeKeeper (dptr->escapeMode, this->escapeMode);
 	Q_UNUSED(modeKeeper);
 	
-	// Render and escape
-	QString result = Builtins::escape (this->body->render (dptr), this->escapeMode);
+	// Escape dynamic output while streaming it
+	EscapingSink escaping (sink, this->escapeMode);
+	this->body->renderTo (dptr, escaping);
+}
+
+Nuria::Template::Node *Nuria::Template::AutoescapeNode::escapeConstants (Node *node) {
+	if (!node) {
+		return nullptr;
+	}
 	
-	// Done.
-	return result;
+	// Only nodes passing the sink on to their children are descended
+	// into, so that escaped texts are always written to our EscapingSink.
+	if (TextNode *n = dynamic_cast< TextNode * > (node)) {
+		n->text = Builtins::escape (n->text, this->escapeMode);
+		n->escaped = true;
+	} else if (LiteralValueNode *n = dynamic_cast< LiteralValueNode * > (node)) {
+		TextNode *text = new TextNode (n->loc, Builtins::escape (n->render (nullptr), this->escapeMode));
+		text->escaped = true;
+		return text;
+	} else if (MultipleNodes *n = dynamic_cast< MultipleNodes * > (node)) {
+		for (int i = 0; i < n->nodes.length (); i++) {
+			swapAndDestroy (n->nodes[i], escapeConstants (n->nodes[i]));
+		}
+		
+	} else if (IfClauseNode *n = dynamic_cast< IfClauseNode * > (node)) {
+		swapAndDestroy (n->onSuccess, escapeConstants (n->onSuccess));
+		swapAndDestroy (n->onFailure, escapeConstants (n->onFailure));
+	} else if (SpacelessNode *n = dynamic_cast< SpacelessNode * > (node)) {
+		swapAndDestroy (n->body, escapeConstants (n->body));
+	}
+	
+	return node;
 }
 
 Nuria::Template::Node *Nuria::Template::SpacelessNode::compile (Compiler *compiler, TemplateProgramPrivate *dptr) {
@@ -1603,13 +2113,81 @@ Nuria::Template::Node *Nuria::Template::SpacelessNode::compile (Compiler *compil
 	return this;
 }
 
-QString Nuria::Template::SpacelessNode::render (TemplateProgramPrivate *dptr) {
+QString Nuria::Template::SpacelessNode::render (ExecutionContext *dptr) {
 	VariableKeeper< bool > spacelessKeeper (dptr->spaceless, true);
 	Q_UNUSED(spacelessKeeper);
 	
 	return this->body->render (dptr);
 }
 
+void Nuria::Template::SpacelessNode::renderTo (ExecutionContext *dptr, Sink &sink) {
+	VariableKeeper< bool > spacelessKeeper (dptr->spaceless, true);
+	Q_UNUSED(spacelessKeeper);
+	
+	this->body->renderTo (dptr, sink);
+}
+
+Nuria::Template::Node *Nuria::Template::CacheNode::compile (Compiler *compiler, TemplateProgramPrivate *dptr) {
+	TRACE(nDebug() << "CacheNode" << this << "compiling body" << this->body);
+	swapAndDestroy (this->key, (ValueNode *)this->key->compile (compiler, dptr));
+	
+	if (this->ttl) {
+		swapAndDestroy (this->ttl, (ValueNode *)this->ttl->compile (compiler, dptr));
+		if (!this->ttl) {
+			return nullptr;
+		}
+		
+	}
+	
+	// The body doesn't run on a cache hit
+	dptr->deterministic = false;
+	dptr->info->conditionBranchDepth++;
+	swapAndDestroy (this->body, this->body->compile (compiler, dptr));
+	dptr->info->conditionBranchDepth--;
+	
+	if (!this->key || !this->body) {
+		return nullptr;
+	}
+	
+	return this;
+}
+
+void Nuria::Template::CacheNode::renderTo (ExecutionContext *dptr, Sink &sink) {
+	FragmentCache *cache = dptr->program ()->fragments.data ();
+	if (!cache) {
+		this->body->renderTo (dptr, sink);
+		return;
+	}
+	
+	// Cached? Keys are local to the rendered template.
+	QString key = dptr->program ()->name + QLatin1Char (':') + this->key->render (dptr);
+	QString output;
+	if (!cache->lookup (key, output)) {
+		
+		// Evaluated first, so variables set by the body don't change it
+		int seconds = (this->ttl) ? this->ttl->evaluate (dptr).toInt () : 0;
+		StringSink target (output);
+		this->body->renderTo (dptr, target);
+		
+		// Don't keep the output of a failed render
+		if (!dptr->error.hasFailed ()) {
+			cache->insert (key, output, seconds);
+		}
+		
+	}
+	
+	sink.write (output);
+}
+
+void Nuria::Template::TextNode::renderTo (ExecutionContext *, Sink &sink) {
+	if (this->escaped) {
+		sink.writeEscaped (this->text);
+	} else {
+		sink.write (this->text);
+	}
+	
+}
+
 Nuria::Template::Node *Nuria::Template::TextNode::compile (Compiler *, TemplateProgramPrivate *dptr) {
 	if (dptr->spaceless) {
 		trimSpacesBetweenHtmlTags ();
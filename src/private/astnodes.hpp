@@ -19,6 +19,11 @@
 
 #include "../nuria/templateerror.hpp"
 #include "templateengine_p.hpp"
+#include "variableaccessor.hpp"
+#include "arena.hpp"
+#include "bytecode.hpp"
+#include "value.hpp"
+#include "sink.hpp"
 #include <nuria/callback.hpp>
 #include <QRegularExpression>
 #include <QSharedData>
@@ -34,6 +39,21 @@ namespace Template {
 
 class Compiler;
 
+/** Returns \c true if \a value is considered true in a condition. */
+bool isValueTrue (const QVariant &value);
+
+/** Type of the value of a ValueNode, as far as known at compile-time. */
+enum class ValueType : quint8 {
+	Unknown = 0,
+	Bool,
+	Int,
+	Double,
+	String
+};
+
+/** Returns the ValueType of values of the QMetaType \a type. */
+ValueType valueTypeOf (int type);
+
 /** \brief Abstract class for AST nodes in Twig code. */
 class Node {
 public:
@@ -44,8 +64,22 @@ public:
 	/** Destructor. */
 	virtual ~Node () { }
 	
+	/** Allocates nodes from the current Arena, if any. */
+	static void *operator new (size_t size)
+	{ return Arena::create (size); }
+	
+	static void operator delete (void *ptr)
+	{ Arena::destroy (ptr); }
+	
 	/** Renders the token itself. */
-	virtual QString render (TemplateProgramPrivate *dptr) = 0;
+	virtual QString render (ExecutionContext *dptr) = 0;
+	
+	/**
+	 * Renders the token into \a sink. The default implementation writes
+	 * the result of render() into the sink. Nodes containing other nodes
+	 * should override this to stream the output of their children.
+	 */
+	virtual void renderTo (ExecutionContext *dptr, Sink &sink);
 	
 	/**
 	 * Prepares this node for rendering, compiling against \a compiler.
@@ -65,6 +99,11 @@ public:
 	//
 	Location loc;
 	
+protected:
+	
+	/** Invokes renderTo() with a StringSink and returns the result. */
+	QString renderIntoString (ExecutionContext *dptr);
+	
 };
 
 class BlockNode;
@@ -74,10 +113,17 @@ public:
 	typedef QMap< QByteArray, Template::BlockNode * > BlockMap;
 	
 	SharedNode (Template::Node *n = nullptr) : node (n) { }
-	~SharedNode () { delete node; }
+	~SharedNode () {
+		Arena::Scope scope (this->arena.data ());
+		delete node;
+	}
 	
 	Template::Node *node;
 	BlockMap blocks;
+	Bytecode code;
+	
+	// Memory of the nodes
+	QExplicitlySharedDataPointer< Arena > arena;
 	
 };
 
@@ -91,7 +137,11 @@ public:
 	{ qDeleteAll (nodes); }
 	
 	/** Invokes render() on all \c nodes and returns the concatenated string. */
-	QString render (TemplateProgramPrivate *dptr) override;
+	QString render (ExecutionContext *dptr) override
+	{ return renderIntoString (dptr); }
+	
+	/** Invokes renderTo() on all \c nodes. */
+	void renderTo (ExecutionContext *dptr, Sink &sink) override;
 	
 	Node *compile (Compiler *compiler, TemplateProgramPrivate *dptr) override;
 	void trimInner (TemplateProgramPrivate *dptr);
@@ -116,14 +166,18 @@ public:
 	
 	Node *compile (Compiler *, TemplateProgramPrivate *dptr) override;
 	
-	QString render (TemplateProgramPrivate *) override
+	QString render (ExecutionContext *) override
 	{ return text; }
 	
+	void renderTo (ExecutionContext *dptr, Sink &sink) override;
 	void trimSpacesBetweenHtmlTags ();
 	
 	// 
 	QString text;
 	
+	/** \c true if \a text has been escaped by the enclosing autoescape block. */
+	bool escaped = false;
+	
 };
 
 /** Represents a evaluate-able value. */
@@ -133,16 +187,33 @@ public:
 	ValueNode (Location l) : Node (l) { }
 	
 	/** Returns the evaluated variant converted to a QString. */
-	QString render (TemplateProgramPrivate *dptr) override;
+	QString render (ExecutionContext *dptr) override;
 	
 	/** Returns the value as evaluated variant. */
-	virtual QVariant evaluate (TemplateProgramPrivate *dptr) = 0;
+	virtual QVariant evaluate (ExecutionContext *dptr) = 0;
+	
+	/**
+	 * Returns the value as Value, which may refer to data of the node or
+	 * of \a dptr. Used between nodes to avoid copying QVariants. The
+	 * default implementation takes the result of evaluate().
+	 */
+	virtual Value evaluateValue (ExecutionContext *dptr)
+	{ return Value (evaluate (dptr)); }
 	
 	Node *compile (Compiler *compiler, TemplateProgramPrivate *dptr) override;
 	
 	/** Returns if the value of the value node is constant. */
 	virtual bool isConstant (TemplateProgramPrivate *dptr) const
 	{ Q_UNUSED(dptr); return true; }
+	
+	/**
+	 * Returns the type evaluate() is expected to return. This is only a
+	 * hint, users must still handle values of other types. Only valid
+	 * while compiling. The default implementation returns
+	 * ValueType::Unknown.
+	 */
+	virtual ValueType valueType (TemplateProgramPrivate *dptr) const
+	{ Q_UNUSED(dptr); return ValueType::Unknown; }
 };
 
 /** Dummy node doing nothing. */
@@ -154,10 +225,10 @@ public:
 	Node *compile (Compiler *, TemplateProgramPrivate *) override
 	{ return this; }
 	
-	QString render (TemplateProgramPrivate *) override
+	QString render (ExecutionContext *) override
 	{ return QString (); }
 	
-	QVariant evaluate (TemplateProgramPrivate *) override
+	QVariant evaluate (ExecutionContext *) override
 	{ return QVariant (); }
 	
 };
@@ -175,7 +246,7 @@ public:
 	{ qDeleteAll (values); }
 	
 	/** Evaluates all nodes and returns a QVariantMap. */
-	QVariant evaluate (TemplateProgramPrivate *dptr) override;
+	QVariant evaluate (ExecutionContext *dptr) override;
 	
 	Node *compile (Compiler *compiler, TemplateProgramPrivate *dptr) override;
 	bool isConstant (TemplateProgramPrivate *dptr) const override;
@@ -191,12 +262,18 @@ class LiteralValueNode : public ValueNode {
 public:
 	LiteralValueNode (Location l, QVariant v) : ValueNode (l), value (v) {}
 	
-	QVariant evaluate (TemplateProgramPrivate *) override
+	QVariant evaluate (ExecutionContext *) override
 	{ return value; }
 	
+	Value evaluateValue (ExecutionContext *) override
+	{ return Value::view (value); }
+	
 	Node *compile (Compiler *, TemplateProgramPrivate *) override
 	{ return this; }
 	
+	ValueType valueType (TemplateProgramPrivate *) const override
+	{ return valueTypeOf (value.userType ()); }
+	
 	// 
 	QVariant value;
 	
@@ -216,12 +293,15 @@ public:
 	{ clear (); }
 	
 	Node *compile (Compiler *compiler, TemplateProgramPrivate *dptr) override;
-	QString render (TemplateProgramPrivate *dptr) override;
-	QVariant evaluate (TemplateProgramPrivate *dptr) override
+	QString render (ExecutionContext *dptr) override;
+	QVariant evaluate (ExecutionContext *dptr) override
 	{ return render (dptr); }
 	
 	bool isConstant (TemplateProgramPrivate *) const override;
 	
+	ValueType valueType (TemplateProgramPrivate *) const override
+	{ return ValueType::String; }
+	
 	bool populateIndexes (Compiler *compiler, TemplateProgramPrivate *dptr);
 	int addInterpolation (Compiler *compiler, TemplateProgramPrivate *dptr, int index);
 	Node *inlineCompile (QByteArray code, int offset, Compiler *compiler,
@@ -278,8 +358,28 @@ public:
 	}
 	
 	Node *compile (Compiler *compiler, TemplateProgramPrivate *dptr) override;
-	QVariant evaluate (TemplateProgramPrivate *dptr) override;
+	QVariant evaluate (ExecutionContext *dptr) override;
+	Value evaluateValue (ExecutionContext *dptr) override;
 	bool isConstant (TemplateProgramPrivate *dptr) const override;
+	ValueType valueType (TemplateProgramPrivate *dptr) const override;
+	
+	/**
+	 * Replaces this node by a TypedExpressionNode if the types of the
+	 * operands are known.
+	 */
+	Node *specialize (TemplateProgramPrivate *dptr);
+	
+	/**
+	 * Applies \a op on the values \a l and \a r. \c And and \c Or are
+	 * short-circuited by evaluateValue() and not handled here.
+	 */
+	static QVariant apply (const QVariant &l, const QVariant &r, Operator op);
+	
+	/**
+	 * Same as apply(const QVariant&, const QVariant&, Operator), but
+	 * numbers and strings are handled without creating QVariants.
+	 */
+	static Value apply (const Value &l, const Value &r, Operator op);
 	
 	// 
 	ValueNode *left;
@@ -287,6 +387,25 @@ public:
 	Operator action;
 };
 
+/**
+ * A binary expression specialized for operands of type \a operands. If the
+ * operands turn out to be of another type, the generic implementation of
+ * ExpressionNode is used instead.
+ */
+class TypedExpressionNode : public ExpressionNode {
+public:
+	TypedExpressionNode (Location l, ValueNode *lhs, Operator op, ValueNode *rhs, ValueType type)
+	        : ExpressionNode (l, lhs, op, rhs), operands (type) {}
+	
+	Node *compile (Compiler *, TemplateProgramPrivate *) override
+	{ return this; }
+	
+	Value evaluateValue (ExecutionContext *dptr) override;
+	
+	// 
+	ValueType operands;
+};
+
 /** 'x' matches 'y' */
 class MatchesTestNode : public ValueNode {
 public:
@@ -301,11 +420,11 @@ public:
 	}
 	
 	Node *compile (Compiler *compiler, TemplateProgramPrivate *dptr);
-	QVariant evaluate (TemplateProgramPrivate *dptr) override;
+	QVariant evaluate (ExecutionContext *dptr) override;
 	bool isConstant (TemplateProgramPrivate *) const override
 	{ return false; }
 	
-	QRegularExpression evaluateRegEx (TemplateProgramPrivate *dptr);
+	QRegularExpression evaluateRegEx (ExecutionContext *dptr);
 	
 	// 
 	ValueNode *value;
@@ -324,10 +443,10 @@ public:
 	Node *compile (Compiler *compiler, TemplateProgramPrivate *dptr) override;
 	
 	/** Calls evalue() on all values, returning all results. */
-	QVariantList evaluateAll (TemplateProgramPrivate *dptr);
+	QVariantList evaluateAll (ExecutionContext *dptr);
 	
 	/** Calls evalue() on all values, returning a QVariantList. */
-	QVariant evaluate (TemplateProgramPrivate *dptr) override
+	QVariant evaluate (ExecutionContext *dptr) override
 	{ return evaluateAll (dptr); }
 	
 	bool isConstant (TemplateProgramPrivate *dptr) const override;
@@ -349,7 +468,8 @@ public:
 	
 	Node *compile (Compiler *compiler, TemplateProgramPrivate *dptr) override;
 	void compileSubNodes (Compiler *compiler, TemplateProgramPrivate *dptr);
-	QVariant evaluate (TemplateProgramPrivate *dptr) override;
+	QVariant evaluate (ExecutionContext *dptr) override;
+	Value evaluateValue (ExecutionContext *dptr) override;
 	bool isConstant (TemplateProgramPrivate *dptr) const override;
 	void clear ();
 	
@@ -370,15 +490,21 @@ public:
 	Node *compile (Compiler *compiler, TemplateProgramPrivate *dptr) override;
 	
 	/** Reads the value. */
-	QVariant evaluate (TemplateProgramPrivate *dptr) override;
+	QVariant evaluate (ExecutionContext *dptr) override;
 	
-	virtual Callback asFunction (TemplateProgramPrivate *dptr, bool &isConst);
+	/** Reads the value without copying it. */
+	Value evaluateValue (ExecutionContext *dptr) override;
+	
+	virtual Callback asFunction (ExecutionContext *dptr, bool &isConst);
 	
 	/** Writes the value. */
-	void write (TemplateProgramPrivate *dptr, const QVariant &value);
+	void write (ExecutionContext *dptr, const QVariant &value);
 	
 	/** Checks if the variable is constant up to this point. */
 	bool isConstant (TemplateProgramPrivate *dptr) const override;
+	
+	/** Returns the type declared using TemplateEngine::setVariableType(). */
+	ValueType valueType (TemplateProgramPrivate *dptr) const override;
 	int lastWriteAccessRecord (TemplateProgramPrivate *dptr) const;
 	
 	// 
@@ -401,19 +527,64 @@ public:
 	
 	Node *compile (Compiler *compiler, TemplateProgramPrivate *dptr) override;
 	void reduceChain (TemplateProgramPrivate *dptr);
+	void prepareKeys ();
+	Node *compileLoopField (TemplateProgramPrivate *dptr);
 	
 	bool isConstant (TemplateProgramPrivate *) const
 	{ return false; }
 	
+	ValueType valueType (TemplateProgramPrivate *) const override
+	{ return ValueType::Unknown; }
+	
 	/** Reads the value. */
-	QVariant evaluate (TemplateProgramPrivate *dptr) override;
-	Callback asFunction (TemplateProgramPrivate *dptr, bool &isConst) override;
-	QVariant evaluateChain (TemplateProgramPrivate *dptr);
+	QVariant evaluate (ExecutionContext *dptr) override;
+	Callback asFunction (ExecutionContext *dptr, bool &isConst) override;
+	
+	Value evaluateValue (ExecutionContext *dptr) override
+	{ return Value (evaluate (dptr)); }
+	QVariant evaluateChain (ExecutionContext *dptr);
 	
 	// 
 	MultipleValueNode *chain;
 	QVariantList chainList;
 	
+	/**
+	 * Keys of chainList, or of the literals in chain. Keys of other
+	 * elements of chain don't have a cache and are replaced when
+	 * evaluating.
+	 */
+	VariableAcessor::Chain chainKeys;
+	
+};
+
+/** Reads a field like 'loop.index' of the current for-loop. */
+class LoopFieldNode : public ValueNode {
+public:
+	enum Field { Index, Index0, RevIndex, RevIndex0, First, Last, Length };
+	
+	LoopFieldNode (Location l, Field f, int d)
+	        : ValueNode (l), field (f), depth (d) {}
+	
+	Node *compile (Compiler *, TemplateProgramPrivate *) override
+	{ return this; }
+	
+	QVariant evaluate (ExecutionContext *dptr) override
+	{ return evaluateValue (dptr).toVariant (); }
+	
+	Value evaluateValue (ExecutionContext *dptr) override;
+	
+	bool isConstant (TemplateProgramPrivate *) const override
+	{ return false; }
+	
+	ValueType valueType (TemplateProgramPrivate *) const override
+	{ return (field == First || field == Last) ? ValueType::Bool : ValueType::Int; }
+	
+	static bool fieldFromName (const QString &name, Field &field);
+	
+	// 
+	Field field;
+	int depth; // Count of '.parent.loop' steps
+	
 };
 
 /** A stand-alone method. */
@@ -431,8 +602,8 @@ public:
 	Node *configureParentCall (TemplateProgramPrivate *dptr);
 	
 	/** Invokes the method and returns the result. */
-	QVariant evaluate (TemplateProgramPrivate *dptr) override;
-	QVariant evaluateUserFunction (const QVariantList &args, TemplateProgramPrivate *dptr);
+	QVariant evaluate (ExecutionContext *dptr) override;
+	QVariant evaluateUserFunction (const QVariantList &args, ExecutionContext *dptr);
 	
 	bool isConstant (TemplateProgramPrivate *dptr) const override;
 	
@@ -440,6 +611,10 @@ public:
 	MultipleValueNode *arguments;
 	VariableNode *name;
 	
+	// Resolved at compile-time
+	int builtin = 0; // Builtins::Function
+	int functionIndex = -1;
+	
 };
 
 /** {% set X = Y %} */
@@ -455,11 +630,14 @@ public:
 	}
 	
 	// Renders to nothing, but sets the value of 'variable'
-	QString render (TemplateProgramPrivate *dptr) override {
+	QString render (ExecutionContext *dptr) override {
 		variable->write (dptr, value->evaluate (dptr));
 		return QString ();
 	}
 	
+	void renderTo (ExecutionContext *dptr, Sink &) override
+	{ variable->write (dptr, value->evaluate (dptr)); }
+	
 	// 
 	Node *compile (Compiler *compiler, TemplateProgramPrivate *dptr) override;
 	
@@ -484,8 +662,11 @@ public:
 		delete onFailure;
 	}
 	
-	Node *evaluateAndReturnNode (TemplateProgramPrivate *dptr);
-	QString render (TemplateProgramPrivate *dptr) override;
+	Node *evaluateAndReturnNode (ExecutionContext *dptr);
+	QString render (ExecutionContext *dptr) override
+	{ return renderIntoString (dptr); }
+	
+	void renderTo (ExecutionContext *dptr, Sink &sink) override;
 	Node *compileInternal (bool constantFolding, Compiler *compiler, TemplateProgramPrivate *dptr);
 	Node *compile (Compiler *compiler, TemplateProgramPrivate *dptr) override;
 	
@@ -515,17 +696,17 @@ public:
 		delete key;
 	}
 	
-	QString render (TemplateProgramPrivate *dptr) override;
+	void renderTo (ExecutionContext *dptr, Sink &sink) override;
 	Node *compile (Compiler *compiler, TemplateProgramPrivate *dptr) override;
-	int iterateList (TemplateProgramPrivate *dptr, const QVariant &data, QString &target, const QVariant &parent);
-	int iterateMap (TemplateProgramPrivate *dptr, const QVariant &data, QString &target, const QVariant &parent);
-	bool doRun (TemplateProgramPrivate *dptr, QString &target, const QVariant &current,
+	int iterateList (ExecutionContext *dptr, const QVariant &data, Sink &sink, const QVariant &parent);
+	int iterateMap (ExecutionContext *dptr, const QVariant &data, Sink &sink, const QVariant &parent);
+	bool doRun (ExecutionContext *dptr, Sink &sink, const QVariant &current,
 	            int index, int length, const QVariant &parent);
-	bool doMapRun (TemplateProgramPrivate *dptr, QString &target, const QVariant &key,
+	bool doMapRun (ExecutionContext *dptr, Sink &sink, const QVariant &key,
 	               const QVariant &current, int index, int length, const QVariant &parent);
-	void doElse (TemplateProgramPrivate *dptr, QString &target);
-	bool checkCurrentForMatch (TemplateProgramPrivate *dptr);
-	void updateLoopVariable (TemplateProgramPrivate *dptr, int index, int length, const QVariant &parent);
+	void doElse (ExecutionContext *dptr, Sink &sink);
+	bool checkCurrentForMatch (ExecutionContext *dptr);
+	void updateLoopVariable (ExecutionContext *dptr, int index, int length, const QVariant &parent);
 	void setUpLoopVariable (TemplateProgramPrivate *dptr);
 	
 	// 
@@ -545,14 +726,15 @@ public:
 	        : ValueNode (l), name (n), body (b) {}
 	~BlockNode () override;
 	
-	QString render (TemplateProgramPrivate *dptr) override;
+	QString render (ExecutionContext *dptr) override;
+	void renderTo (ExecutionContext *dptr, Sink &sink) override;
 	Node *compile (Compiler *compiler, TemplateProgramPrivate *dptr) override;
 	BlockNode *storeBlockIfFirst (TemplateProgramPrivate *dptr);
 	
 	// BlockNode is a ValueNode so we can replace a call to parent()
 	// which is a MethodCallValueNode with a BlockNode at compile-time
 	// without breaking things. 
-	QVariant evaluate (TemplateProgramPrivate *dptr) override
+	QVariant evaluate (ExecutionContext *dptr) override
 	{ return render (dptr); }
 	
 	bool isConstant (TemplateProgramPrivate *) const override
@@ -576,11 +758,14 @@ public:
 		delete subNode;
 	}
 	
-	QString render (TemplateProgramPrivate *dptr) override {
+	QString render (ExecutionContext *dptr) override {
 		if (subNode) return subNode->render (dptr);
 		return QString ();
 	}
 	
+	void renderTo (ExecutionContext *dptr, Sink &sink) override
+	{ if (subNode) subNode->renderTo (dptr, sink); }
+	
 	Node *compile (Compiler *compiler, TemplateProgramPrivate *dptr) override;
 	Node *loadAndCompileTemplate (Compiler *compiler, TemplateProgramPrivate *dptr);
 	bool templateNames (TemplateProgramPrivate *dptr, QStringList &names);
@@ -609,6 +794,22 @@ public:
 	
 };
 
+/** Evaluates to the rendered body of the inner-most active filter block. */
+class FilterBodyNode : public ValueNode {
+public:
+	
+	FilterBodyNode (Location l) : ValueNode (l) {}
+	
+	Node *compile (Compiler *, TemplateProgramPrivate *) override
+	{ return this; }
+	
+	QVariant evaluate (ExecutionContext *dptr) override;
+	
+	bool isConstant (TemplateProgramPrivate *) const override
+	{ return false; }
+	
+};
+
 /** {% filter .. %} .. {% endfilter %} */
 class FilterNode : public Node {
 public:
@@ -621,7 +822,7 @@ public:
 	}
 	
 	Node *compile (Compiler *compiler, TemplateProgramPrivate *dptr) override;
-	QString render (TemplateProgramPrivate *dptr) override;
+	QString render (ExecutionContext *dptr) override;
 	
 	MethodCallValueNode *compileFunctions (Compiler *compiler, TemplateProgramPrivate *dptr);
 	
@@ -644,7 +845,11 @@ public:
 	{ delete body; }
 	
 	Node *compile (Compiler *compiler, TemplateProgramPrivate *dptr) override;
-	QString render (TemplateProgramPrivate *dptr) override;
+	QString render (ExecutionContext *dptr) override
+	{ return renderIntoString (dptr); }
+	
+	void renderTo (ExecutionContext *dptr, Sink &sink) override;
+	Node *escapeConstants (Node *node);
 	
 	// 
 	Node *body;
@@ -664,10 +869,40 @@ public:
 	{ delete body; }
 	
 	Node *compile (Compiler *compiler, TemplateProgramPrivate *dptr) override;
-	QString render (TemplateProgramPrivate *dptr) override;
+	QString render (ExecutionContext *dptr) override;
+	void renderTo (ExecutionContext *dptr, Sink &sink) override;
+	
+	// 
+	Node *body;
+};
+
+/**
+ * {% cache key [ttl seconds] %} .. {% endcache %}
+ * 
+ * The rendered body is stored in the fragment cache of the engine, under the
+ * name of the rendered template and the key. While it's cached, the body is
+ * not run, so variables set inside it aren't set.
+ */
+class CacheNode : public Node {
+public:
+	
+	CacheNode (Location l, ValueNode *key, ValueNode *ttl, Node *body)
+	        : Node (l), key (key), ttl (ttl), body (body) { }
+	
+	~CacheNode () override
+	{ delete key; delete ttl; delete body; }
+	
+	Node *compile (Compiler *compiler, TemplateProgramPrivate *dptr) override;
+	QString render (ExecutionContext *dptr) override
+	{ return renderIntoString (dptr); }
+	
+	void renderTo (ExecutionContext *dptr, Sink &sink) override;
 	
 	// 
+	ValueNode *key;
+	ValueNode *ttl;
 	Node *body;
+	
 };
 
 }
@@ -22,6 +22,7 @@
 #include <QRegularExpression>
 #include <QJsonDocument>
 #include "astnodes.hpp"
+#include "escaper.hpp"
 #include <QDateTime>
 #include <climits>
 #include <cmath>
@@ -91,8 +92,21 @@ bool Nuria::Template::Builtins::isBuiltinConstant (Function func) {
 	
 }
 
+bool Nuria::Template::Builtins::isBuiltinDeterministic (Function func) {
+	switch (func) {
+	case Block: // Blocks of the program
+	case NumberFormat: // Locale of the program
+	case Parent:
+		return true;
+		
+		// Same as for constant folding
+	default: return isBuiltinConstant (func);
+	}
+	
+}
+
 QVariant Nuria::Template::Builtins::invokeBuiltin (Function func, const QVariantList &args,
-                                                   TemplateProgramPrivate *dptr) {
+                                                   ExecutionContext *dptr) {
 	if (args.isEmpty () && func != Date && func != Dump && func != Random) {
 		return QVariant ();
 	}
@@ -145,30 +159,8 @@ QVariant Nuria::Template::Builtins::invokeBuiltin (Function func, const QVariant
 	
 }
 
-QString Nuria::Template::Builtins::escape (QString data, EscapeMode mode) {
-	static const QByteArray included = QByteArrayLiteral("-._~");
-	
-	switch (mode) {
-	case EscapeMode::Verbatim: return QString ();
-	case EscapeMode::Html: return data.toHtmlEscaped ();
-	case EscapeMode::JavaScript:
-	case EscapeMode::Css:
-		data.replace (QLatin1Char ('"'), QLatin1String ("\\\""));
-		data.replace (QLatin1Char ('\''), QLatin1String ("\\'"));
-		data.replace (QLatin1Char ('\r'), QLatin1String ("\\r"));
-		data.replace (QLatin1Char ('\n'), QLatin1String ("\\n"));
-		data.replace (QLatin1Char ('\t'), QLatin1String ("\\t"));
-		return data;
-	case EscapeMode::Url:
-		return QString::fromLatin1 (QUrl::toPercentEncoding (data));
-	case EscapeMode::HtmlAttr:
-		return QString::fromLatin1 (data.toUtf8 ().toPercentEncoding (QByteArray (), included)
-		                            .replace ('%', "&#x"));
-	}
-	
-	// 
-	return QString ();
-	
+QString Nuria::Template::Builtins::escape (const QString &data, EscapeMode mode) {
+	return Escaper::escape (data, mode);
 }
 
 QVariant Nuria::Template::Builtins::filterBatch (const QVariantList &args) {
@@ -218,7 +210,7 @@ QVariant Nuria::Template::Builtins::filterCycle (const QVariantList &args) {
 	
 }
 
-QVariant Nuria::Template::Builtins::filterDate (TemplateProgramPrivate *dptr, const QVariantList &args) {
+QVariant Nuria::Template::Builtins::filterDate (ExecutionContext *dptr, const QVariantList &args) {
 	QDateTime dateTime;
 	
 	// Get datetime
@@ -241,38 +233,29 @@ QVariant Nuria::Template::Builtins::filterDate (TemplateProgramPrivate *dptr, co
 	}
 	
 	// Use locale format
-	return dptr->locale.toString (dateTime);
+	return dptr->program ()->locale.toString (dateTime);
 }
 
 QVariant Nuria::Template::Builtins::filterDefault (const QVariantList &args) {
 	if (args.length () < 2) return QVariant ();
-	
-	const QVariant &value = args.first ();
-	if (!value.isValid ()) return args.at (1);
+	return isDefaultNeeded (args.first ()) ? args.at (1) : args.first ();
+}
+
+bool Nuria::Template::Builtins::isDefaultNeeded (const QVariant &value) {
+	if (!value.isValid ()) return true;
 	
 	// Empty check
 	int type = value.userType ();
 	if (type == QMetaType::QString) {
-		if (!value.toString ().isEmpty ()) {
-			return value;
-		}
-		
+		return value.toString ().isEmpty ();
 	} else if (value.canConvert< QVariantList > ()) {
-		QSequentialIterable it = value.value< QSequentialIterable > ();
-		if (it.size () > 0) {
-			return value;
-		}
-		
+		return (value.value< QSequentialIterable > ().size () < 1);
 	} else if (value.canConvert< QVariantMap > ()) {
-		QAssociativeIterable it = value.value< QAssociativeIterable > ();
-		if (it.size () > 0) {
-			return value;
-		}
-		
+		return (value.value< QAssociativeIterable > ().size () < 1);
 	}
 	
-	// Value is empty.
-	return args.at (1);
+	// Other values are treated as empty.
+	return true;
 }
 
 static void dumpVariable (const QVariant &variable, QString &into) {
@@ -280,17 +263,17 @@ static void dumpVariable (const QVariant &variable, QString &into) {
 	printer << variable;
 }
 
-static void dumpEnvironment (Nuria::TemplateProgramPrivate *dptr, QString &into) {
+static void dumpEnvironment (Nuria::Template::ExecutionContext *dptr, QString &into) {
 	QVariantMap map;
 	for (int i = 0; i < dptr->values.length (); i++) {
-		map.insert (dptr->variables.at (i), dptr->values.at (i));
+		map.insert (dptr->program ()->variables.at (i), dptr->values.at (i));
 	}
 	
 	// 
 	dumpVariable (map, into);
 }
 
-QVariant Nuria::Template::Builtins::functionDump (TemplateProgramPrivate *dptr, const QVariantList &args) {
+QVariant Nuria::Template::Builtins::functionDump (ExecutionContext *dptr, const QVariantList &args) {
 	QString result;
 	
 	if (args.isEmpty ()) {
@@ -336,7 +319,7 @@ Nuria::EscapeMode Nuria::Template::Builtins::parseEscapeMode (const QString &nam
 	return EscapeMode::Verbatim;
 }
 
-QVariant Nuria::Template::Builtins::filterEscape (TemplateProgramPrivate *dptr, const QVariantList &args) {
+QVariant Nuria::Template::Builtins::filterEscape (ExecutionContext *dptr, const QVariantList &args) {
 	QString modeName;
 	
 	if (args.length () > 1) {
@@ -487,7 +470,7 @@ QVariant Nuria::Template::Builtins::filterNl2Br (const QVariantList &args) {
 	return string;
 }
 
-QVariant Nuria::Template::Builtins::filterNumberFormat (TemplateProgramPrivate *dptr, const QVariantList &args) {
+QVariant Nuria::Template::Builtins::filterNumberFormat (ExecutionContext *dptr, const QVariantList &args) {
 	double num = args.first ().toDouble ();
 	
 	// Count digits before comma
@@ -501,16 +484,17 @@ QVariant Nuria::Template::Builtins::filterNumberFormat (TemplateProgramPrivate *
 	// 
 	int decimals = 0;
 	if (args.length () > 1) decimals = args.at (1).toInt ();
-	QString numStr = dptr->locale.toString (num, 'g', decimals + digits);
+	const QLocale &locale = dptr->program ()->locale;
+	QString numStr = locale.toString (num, 'g', decimals + digits);
 	
 	// TODO: Fails if the third argument is used and the second argument is equal to the group separator.
 	if (args.length () > 2) {
-		numStr.replace (dptr->locale.decimalPoint (), args.at (2).toString ());
+		numStr.replace (locale.decimalPoint (), args.at (2).toString ());
 	}
 	
 	// 
 	if (args.length () > 3) {
-		numStr.replace (dptr->locale.groupSeparator (), args.at (3).toString ());
+		numStr.replace (locale.groupSeparator (), args.at (3).toString ());
 	}
 	
 	// 
@@ -1005,8 +989,8 @@ QVariant Nuria::Template::Builtins::filterUrlEncode (const QVariantList &args) {
 	return stringToUrlEncoded (args.first ().toString ());
 }
 
-QVariant Nuria::Template::Builtins::functionBlock (TemplateProgramPrivate *dptr, const QVariantList &args) {
-	BlockNode *block = dptr->root->blocks.value (args.first ().toString ().toUtf8 ());
+QVariant Nuria::Template::Builtins::functionBlock (ExecutionContext *dptr, const QVariantList &args) {
+	BlockNode *block = dptr->program ()->root->blocks.value (args.first ().toString ().toUtf8 ());
 	
 	if (!block) {
 		return QString ();
@@ -86,11 +86,12 @@ public:
 	// 
 	static Function nameLookup (const QString &name);
 	static bool isBuiltinConstant (Function func);
+	static bool isBuiltinDeterministic (Function func);
 	static QVariant invokeBuiltin (Function func, const QVariantList &args,
-	                               TemplateProgramPrivate *dptr);
+	                               ExecutionContext *dptr);
 	
 	// 
-	static QString escape (QString data, EscapeMode mode);
+	static QString escape (const QString &data, EscapeMode mode);
 	static EscapeMode parseEscapeMode (const QString &name);
 	
 	// 
@@ -98,12 +99,13 @@ public:
 	static QVariant filterCapitalize (const QVariantList &args);
 	static QVariant filterCycle (const QVariantList &args);
 	static QVariant filterAbs (const QVariantList &args);
-	static QVariant functionBlock (TemplateProgramPrivate *dptr, const QVariantList &args);
-	static QVariant filterDate (TemplateProgramPrivate *dptr, const QVariantList &args);
+	static QVariant functionBlock (ExecutionContext *dptr, const QVariantList &args);
+	static QVariant filterDate (ExecutionContext *dptr, const QVariantList &args);
 //	static QVariant filterDateModify (const QVariantList &args);
 	static QVariant filterDefault (const QVariantList &args);
-	static QVariant functionDump (TemplateProgramPrivate *dptr, const QVariantList &args);
-	static QVariant filterEscape (TemplateProgramPrivate *dptr, const QVariantList &args);
+	static bool isDefaultNeeded (const QVariant &value);
+	static QVariant functionDump (ExecutionContext *dptr, const QVariantList &args);
+	static QVariant filterEscape (ExecutionContext *dptr, const QVariantList &args);
 	static QVariant filterFirst (const QVariantList &args);
 	static QVariant filterFormat (const QVariantList &args);
 	static QVariant filterJoin (const QVariantList &args);
@@ -113,7 +115,7 @@ public:
 	static QVariant filterLength (const QVariantList &args);
 	static QVariant filterLower (const QVariantList &args);
 	static QVariant filterNl2Br (const QVariantList &args);
-	static QVariant filterNumberFormat (TemplateProgramPrivate *dptr, const QVariantList &args);
+	static QVariant filterNumberFormat (ExecutionContext *dptr, const QVariantList &args);
 	static QVariant functionMax (const QVariantList &args);
 	static QVariant filterMerge (const QVariantList &args);
 	static QVariant functionMin (const QVariantList &args);
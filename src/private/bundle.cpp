@@ -0,0 +1,758 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "bundle.hpp"
+
+#include "templateengine_p.hpp"
+#include "astnodes.hpp"
+
+// Magic number at the beginning of bundle files: "NTWB"
+enum { BundleMagic = 0x4E545742 };
+
+// Serialization is independent of the Qt version in use.
+static const QDataStream::Version g_streamVersion = QDataStream::Qt_5_0;
+
+namespace Nuria {
+namespace Template {
+
+// Type tags of serialized nodes
+enum class NodeType : quint8 {
+	Null = 0,
+	MultipleNodes,
+	Text,
+	Noop,
+	ValueMap,
+	Literal,
+	String,
+	Expression,
+	MatchesTest,
+	MultipleValue,
+	TernaryOperator,
+	Variable,
+	ChainedVariable,
+	LoopField,
+	MethodCall,
+	Set,
+	IfClause,
+	ForLoop,
+	Block,
+	Filter,
+	FilterBody,
+	Autoescape,
+	Spaceless,
+	Cache,
+	TypedExpression
+};
+
+static QDataStream &operator<< (QDataStream &stream, const Location &loc) {
+	return stream << qint32 (loc.row) << qint32 (loc.column);
+}
+
+static QDataStream &operator>> (QDataStream &stream, Location &loc) {
+	qint32 row = 0;
+	qint32 column = 0;
+	
+	stream >> row >> column;
+	loc = Location (row, column);
+	return stream;
+}
+
+class NodeWriter {
+public:
+	
+	NodeWriter (QDataStream &s) : stream (s) { }
+	
+	void writeNode (Node *node);
+	void writeType (NodeType type, Node *node);
+	void writeVariable (VariableNode *node);
+	void writeBlock (BlockNode *node);
+	void writeBlockMap (const SharedNode::BlockMap &map);
+	
+	// 
+	QDataStream &stream;
+	QHash< Node *, qint32 > bodies;
+	QHash< BlockNode *, qint32 > blocks;
+	bool failed = false;
+	
+};
+
+class NodeReader {
+public:
+	
+	NodeReader (QDataStream &s) : stream (s) { }
+	
+	Node *readNode ();
+	Node *readNode (NodeType type, Location loc);
+	bool readVariable (VariableNode *node);
+	BlockNode *readBlock (Location loc);
+	bool readBlockMap (SharedNode *root);
+	
+	template< typename T >
+	bool readNode (T *&target) {
+		Node *node = readNode ();
+		target = dynamic_cast< T * > (node);
+		
+		if (node && !target) {
+			delete node;
+			this->failed = true;
+		}
+		
+		return !this->failed;
+	}
+	
+	// 
+	QDataStream &stream;
+	QHash< qint32, std::shared_ptr< Node > > bodies;
+	QVector< BlockNode * > blocks;
+	bool failed = false;
+	
+};
+
+}
+}
+
+void Nuria::Template::NodeWriter::writeType (NodeType type, Node *node) {
+	this->stream << quint8 (type) << node->loc;
+}
+
+void Nuria::Template::NodeWriter::writeNode (Node *node) {
+	if (!node) {
+		this->stream << quint8 (NodeType::Null);
+		return;
+	}
+	
+	// Classes are checked before the classes they inherit
+	if (MultipleNodes *n = dynamic_cast< MultipleNodes * > (node)) {
+		writeType (NodeType::MultipleNodes, n);
+		this->stream << qint32 (n->nodes.length ());
+		for (Node *cur : n->nodes) {
+			writeNode (cur);
+		}
+		
+	} else if (TextNode *n = dynamic_cast< TextNode * > (node)) {
+		writeType (NodeType::Text, n);
+		this->stream << n->text << n->escaped;
+	} else if (NoopNode *n = dynamic_cast< NoopNode * > (node)) {
+		writeType (NodeType::Noop, n);
+	} else if (ValueMapNode *n = dynamic_cast< ValueMapNode * > (node)) {
+		writeType (NodeType::ValueMap, n);
+		this->stream << qint32 (n->values.size ());
+		for (auto it = n->values.constBegin (), end = n->values.constEnd (); it != end; ++it) {
+			this->stream << it.key ();
+			writeNode (it.value ());
+		}
+		
+	} else if (LiteralValueNode *n = dynamic_cast< LiteralValueNode * > (node)) {
+		writeType (NodeType::Literal, n);
+		this->stream << n->value;
+	} else if (StringNode *n = dynamic_cast< StringNode * > (node)) {
+		writeType (NodeType::String, n);
+		this->stream << n->string << qint32 (n->values.length ());
+		for (const StringNode::Insert &cur : n->values) {
+			this->stream << qint32 (cur.index) << qint32 (cur.length);
+			writeNode (cur.value);
+		}
+		
+	} else if (TypedExpressionNode *n = dynamic_cast< TypedExpressionNode * > (node)) {
+		writeType (NodeType::TypedExpression, n);
+		this->stream << qint32 (n->action) << quint8 (n->operands);
+		writeNode (n->left);
+		writeNode (n->right);
+	} else if (ExpressionNode *n = dynamic_cast< ExpressionNode * > (node)) {
+		writeType (NodeType::Expression, n);
+		this->stream << qint32 (n->action);
+		writeNode (n->left);
+		writeNode (n->right);
+	} else if (MatchesTestNode *n = dynamic_cast< MatchesTestNode * > (node)) {
+		writeType (NodeType::MatchesTest, n);
+		this->stream << n->regularExpr;
+		writeNode (n->value);
+		writeNode (n->test);
+	} else if (MultipleValueNode *n = dynamic_cast< MultipleValueNode * > (node)) {
+		writeType (NodeType::MultipleValue, n);
+		this->stream << qint32 (n->values.length ());
+		for (ValueNode *cur : n->values) {
+			writeNode (cur);
+		}
+		
+	} else if (TernaryOperatorNode *n = dynamic_cast< TernaryOperatorNode * > (node)) {
+		writeType (NodeType::TernaryOperator, n);
+		writeNode (n->expression);
+		writeNode (n->onSuccess);
+		writeNode (n->onFailure);
+	} else if (ChainedVariableNode *n = dynamic_cast< ChainedVariableNode * > (node)) {
+		writeType (NodeType::ChainedVariable, n);
+		writeVariable (n);
+		this->stream << n->chainList;
+		writeNode (n->chain);
+	} else if (VariableNode *n = dynamic_cast< VariableNode * > (node)) {
+		writeType (NodeType::Variable, n);
+		writeVariable (n);
+	} else if (LoopFieldNode *n = dynamic_cast< LoopFieldNode * > (node)) {
+		writeType (NodeType::LoopField, n);
+		this->stream << qint32 (n->field) << qint32 (n->depth);
+	} else if (MethodCallValueNode *n = dynamic_cast< MethodCallValueNode * > (node)) {
+		writeType (NodeType::MethodCall, n);
+		this->stream << qint32 (n->builtin) << qint32 (n->functionIndex);
+		writeNode (n->name);
+		writeNode (n->arguments);
+	} else if (SetNode *n = dynamic_cast< SetNode * > (node)) {
+		writeType (NodeType::Set, n);
+		writeNode (n->variable);
+		writeNode (n->value);
+	} else if (ForLoopNode *n = dynamic_cast< ForLoopNode * > (node)) {
+		writeType (NodeType::ForLoop, n);
+		this->stream << qint32 (n->loopVariable);
+		writeNode (n->expression);
+		writeNode (n->onSuccess);
+		writeNode (n->onFailure);
+		writeNode (n->variable);
+		writeNode (n->key);
+		writeNode (n->condition);
+	} else if (IfClauseNode *n = dynamic_cast< IfClauseNode * > (node)) {
+		writeType (NodeType::IfClause, n);
+		writeNode (n->expression);
+		writeNode (n->onSuccess);
+		writeNode (n->onFailure);
+	} else if (BlockNode *n = dynamic_cast< BlockNode * > (node)) {
+		writeType (NodeType::Block, n);
+		writeBlock (n);
+	} else if (FilterNode *n = dynamic_cast< FilterNode * > (node)) {
+		writeType (NodeType::Filter, n);
+		writeNode (n->outer);
+		writeNode (n->body);
+	} else if (FilterBodyNode *n = dynamic_cast< FilterBodyNode * > (node)) {
+		writeType (NodeType::FilterBody, n);
+	} else if (AutoescapeNode *n = dynamic_cast< AutoescapeNode * > (node)) {
+		writeType (NodeType::Autoescape, n);
+		this->stream << n->mode << qint32 (n->escapeMode);
+		writeNode (n->body);
+	} else if (SpacelessNode *n = dynamic_cast< SpacelessNode * > (node)) {
+		writeType (NodeType::Spaceless, n);
+		writeNode (n->body);
+	} else if (CacheNode *n = dynamic_cast< CacheNode * > (node)) {
+		writeType (NodeType::Cache, n);
+		writeNode (n->key);
+		writeNode (n->ttl);
+		writeNode (n->body);
+	} else {
+		
+		// Includes and embeds are always replaced while compiling
+		this->failed = true;
+	}
+	
+}
+
+void Nuria::Template::NodeWriter::writeVariable (VariableNode *node) {
+	this->stream << node->variable << qint32 (node->index) << node->isFunction
+	             << node->writeAccess << node->constantValue;
+}
+
+void Nuria::Template::NodeWriter::writeBlock (BlockNode *node) {
+	qint32 blockId = this->blocks.size ();
+	this->blocks.insert (node, blockId);
+	this->stream << node->name;
+	
+	// Bodies may be shared by multiple blocks, so they're only written once.
+	Node *body = node->body.get ();
+	if (!body) {
+		this->stream << qint32 (-1);
+		return;
+	}
+	
+	auto it = this->bodies.constFind (body);
+	if (it != this->bodies.constEnd ()) {
+		this->stream << *it;
+		return;
+	}
+	
+	qint32 bodyId = this->bodies.size ();
+	this->bodies.insert (body, bodyId);
+	this->stream << bodyId;
+	writeNode (body);
+}
+
+void Nuria::Template::NodeWriter::writeBlockMap (const SharedNode::BlockMap &map) {
+	this->stream << qint32 (map.size ());
+	
+	for (auto it = map.constBegin (), end = map.constEnd (); it != end; ++it) {
+		this->stream << it.key () << this->blocks.value (it.value (), -1);
+	}
+	
+}
+
+Nuria::Template::Node *Nuria::Template::NodeReader::readNode () {
+	if (this->failed) {
+		return nullptr;
+	}
+	
+	// 
+	quint8 type = 0;
+	Location loc;
+	this->stream >> type;
+	
+	if (type != quint8 (NodeType::Null)) {
+		this->stream >> loc;
+	}
+	
+	if (this->stream.status () != QDataStream::Ok) {
+		this->failed = true;
+		return nullptr;
+	}
+	
+	if (type == quint8 (NodeType::Null)) {
+		return nullptr;
+	}
+	
+	// A truncated stream leaves the node partially read. It's still
+	// returned, so that it's deleted along with the rest of the tree.
+	Node *node = readNode (NodeType (type), loc);
+	if (!node || this->stream.status () != QDataStream::Ok) {
+		this->failed = true;
+	}
+	
+	return node;
+}
+
+Nuria::Template::Node *Nuria::Template::NodeReader::readNode (NodeType type, Location loc) {
+	qint32 count = 0;
+	qint32 a = 0;
+	qint32 b = 0;
+	
+	switch (type) {
+	case NodeType::Null:
+		return nullptr;
+	case NodeType::MultipleNodes: {
+		MultipleNodes *n = new MultipleNodes (loc);
+		this->stream >> count;
+		for (int i = 0; i < count && !this->failed; i++) {
+			n->nodes.append (readNode ());
+		}
+		
+		return n;
+	}
+	case NodeType::Text: {
+		TextNode *n = new TextNode (loc, QString ());
+		this->stream >> n->text >> n->escaped;
+		return n;
+	}
+	case NodeType::Noop:
+		return new NoopNode (loc);
+	case NodeType::ValueMap: {
+		ValueMapNode *n = new ValueMapNode (loc);
+		this->stream >> count;
+		for (int i = 0; i < count && !this->failed; i++) {
+			QString key;
+			ValueNode *value = nullptr;
+			
+			this->stream >> key;
+			readNode (value);
+			n->values.insert (key, value);
+		}
+		
+		return n;
+	}
+	case NodeType::Literal: {
+		LiteralValueNode *n = new LiteralValueNode (loc, QVariant ());
+		this->stream >> n->value;
+		return n;
+	}
+	case NodeType::String: {
+		StringNode *n = new StringNode (loc, QString ());
+		this->stream >> n->string >> count;
+		for (int i = 0; i < count && !this->failed; i++) {
+			this->stream >> a >> b;
+			n->values.append ({ a, b, readNode () });
+		}
+		
+		return n;
+	}
+	case NodeType::Expression: {
+		ExpressionNode *n = new ExpressionNode (loc, nullptr, Operator::NoOp, nullptr);
+		this->stream >> a;
+		n->action = Operator (a);
+		readNode (n->left);
+		readNode (n->right);
+		return n;
+	}
+	case NodeType::TypedExpression: {
+		TypedExpressionNode *n = new TypedExpressionNode (loc, nullptr, Operator::NoOp, nullptr,
+		                                                  ValueType::Unknown);
+		quint8 operands = 0;
+		this->stream >> a >> operands;
+		n->action = Operator (a);
+		n->operands = ValueType (operands);
+		readNode (n->left);
+		readNode (n->right);
+		return n;
+	}
+	case NodeType::MatchesTest: {
+		MatchesTestNode *n = new MatchesTestNode (loc, nullptr, nullptr);
+		this->stream >> n->regularExpr;
+		readNode (n->value);
+		readNode (n->test);
+		return n;
+	}
+	case NodeType::MultipleValue: {
+		MultipleValueNode *n = new MultipleValueNode (loc);
+		this->stream >> count;
+		for (int i = 0; i < count && !this->failed; i++) {
+			ValueNode *value = nullptr;
+			readNode (value);
+			n->values.append (value);
+		}
+		
+		return n;
+	}
+	case NodeType::TernaryOperator: {
+		TernaryOperatorNode *n = new TernaryOperatorNode (loc, nullptr, nullptr, nullptr);
+		readNode (n->expression);
+		readNode (n->onSuccess);
+		readNode (n->onFailure);
+		return n;
+	}
+	case NodeType::Variable: {
+		VariableNode *n = new VariableNode (loc, QString ());
+		readVariable (n);
+		return n;
+	}
+	case NodeType::ChainedVariable: {
+		ChainedVariableNode *n = new ChainedVariableNode (loc, QString (), nullptr);
+		readVariable (n);
+		this->stream >> n->chainList;
+		readNode (n->chain);
+		n->prepareKeys ();
+		return n;
+	}
+	case NodeType::LoopField:
+		this->stream >> a >> b;
+		return new LoopFieldNode (loc, LoopFieldNode::Field (a), b);
+	case NodeType::MethodCall: {
+		MethodCallValueNode *n = new MethodCallValueNode (loc, nullptr, nullptr);
+		this->stream >> n->builtin >> n->functionIndex;
+		readNode (n->name);
+		readNode (n->arguments);
+		return n;
+	}
+	case NodeType::Set: {
+		SetNode *n = new SetNode (loc, nullptr, nullptr);
+		readNode (n->variable);
+		readNode (n->value);
+		return n;
+	}
+	case NodeType::ForLoop: {
+		ForLoopNode *n = new ForLoopNode (loc, nullptr, nullptr, nullptr);
+		this->stream >> n->loopVariable;
+		readNode (n->expression);
+		readNode (n->onSuccess);
+		readNode (n->onFailure);
+		readNode (n->variable);
+		readNode (n->key);
+		readNode (n->condition);
+		return n;
+	}
+	case NodeType::IfClause: {
+		IfClauseNode *n = new IfClauseNode (loc, nullptr, nullptr);
+		readNode (n->expression);
+		readNode (n->onSuccess);
+		readNode (n->onFailure);
+		return n;
+	}
+	case NodeType::Block:
+		return readBlock (loc);
+	case NodeType::Filter: {
+		FilterNode *n = new FilterNode (loc);
+		readNode (n->outer);
+		readNode (n->body);
+		
+		if (!n->outer || !n->body) {
+			delete n;
+			return nullptr;
+		}
+		
+		return n;
+	}
+	case NodeType::FilterBody:
+		return new FilterBodyNode (loc);
+	case NodeType::Autoescape: {
+		AutoescapeNode *n = new AutoescapeNode (loc, nullptr);
+		this->stream >> n->mode >> a;
+		n->escapeMode = EscapeMode (a);
+		readNode (n->body);
+		
+		if (!n->body) {
+			delete n;
+			return nullptr;
+		}
+		
+		return n;
+	}
+	case NodeType::Spaceless: {
+		SpacelessNode *n = new SpacelessNode (loc, nullptr);
+		readNode (n->body);
+		
+		if (!n->body) {
+			delete n;
+			return nullptr;
+		}
+		
+		return n;
+	}
+	case NodeType::Cache: {
+		CacheNode *n = new CacheNode (loc, nullptr, nullptr, nullptr);
+		readNode (n->key);
+		readNode (n->ttl);
+		readNode (n->body);
+		
+		// The time to live is optional
+		if (!n->key || !n->body) {
+			delete n;
+			return nullptr;
+		}
+		
+		return n;
+	}
+	}
+	
+	// Unknown type
+	return nullptr;
+}
+
+bool Nuria::Template::NodeReader::readVariable (VariableNode *node) {
+	this->stream >> node->variable >> node->index >> node->isFunction
+	             >> node->writeAccess >> node->constantValue;
+	return (this->stream.status () == QDataStream::Ok);
+}
+
+Nuria::Template::BlockNode *Nuria::Template::NodeReader::readBlock (Location loc) {
+	QByteArray name;
+	qint32 bodyId = -1;
+	
+	this->stream >> name >> bodyId;
+	BlockNode *node = new BlockNode (loc, name, nullptr);
+	this->blocks.append (node);
+	
+	if (bodyId < 0 || this->stream.status () != QDataStream::Ok) {
+		return node;
+	}
+	
+	// Read the body if it's not known yet
+	auto it = this->bodies.constFind (bodyId);
+	if (it != this->bodies.constEnd ()) {
+		node->body = *it;
+	} else {
+		node->body.reset (readNode ());
+		this->bodies.insert (bodyId, node->body);
+	}
+	
+	return node;
+}
+
+bool Nuria::Template::NodeReader::readBlockMap (SharedNode *root) {
+	qint32 count = 0;
+	this->stream >> count;
+	
+	for (int i = 0; i < count && this->stream.status () == QDataStream::Ok; i++) {
+		QByteArray name;
+		qint32 blockId = -1;
+		
+		this->stream >> name >> blockId;
+		if (blockId < 0 || blockId >= this->blocks.length ()) {
+			return false;
+		}
+		
+		// 
+		BlockNode *block = this->blocks.at (blockId);
+		block->d_ptr = root;
+		root->blocks.insert (name, block);
+	}
+	
+	return (this->stream.status () == QDataStream::Ok);
+}
+
+bool Nuria::Template::Serializer::write (QDataStream &stream, const TemplateProgramPrivate *program) {
+	if (!program->root || !program->root->node || program->error.hasFailed ()) {
+		return false;
+	}
+	
+	// 
+	stream.setVersion (g_streamVersion);
+	stream << program->variables << program->dependencies << program->compiledAt
+	       << program->functionNames << program->deterministic;
+	
+	// Variable usage records
+	stream << qint32 (program->usages.length ());
+	for (const VariableUsageList &list : program->usages) {
+		stream << qint32 (list.length ());
+		for (const VariableUsage &usage : list) {
+			stream << usage.location << usage.isConstant << usage.isWriting;
+		}
+		
+	}
+	
+	// The AST
+	NodeWriter writer (stream);
+	writer.writeNode (program->root->node);
+	writer.writeBlockMap (program->root->blocks);
+	
+	return (!writer.failed && stream.status () == QDataStream::Ok);
+}
+
+Nuria::TemplateProgramPrivate *Nuria::Template::Serializer::read (QDataStream &stream) {
+	TemplateProgramPrivate *program = new TemplateProgramPrivate;
+	
+	stream.setVersion (g_streamVersion);
+	stream >> program->variables >> program->dependencies >> program->compiledAt
+	       >> program->functionNames >> program->deterministic;
+	
+	program->indexVariables ();
+	program->values.resize (program->variables.length ());
+	program->functionSlots.resize (program->functionNames.length ());
+	
+	// Variable usage records
+	qint32 count = 0;
+	stream >> count;
+	for (int i = 0; i < count && stream.status () == QDataStream::Ok; i++) {
+		qint32 usages = 0;
+		VariableUsageList list;
+		
+		stream >> usages;
+		for (int j = 0; j < usages && stream.status () == QDataStream::Ok; j++) {
+			VariableUsage usage;
+			stream >> usage.location >> usage.isConstant >> usage.isWriting;
+			list.append (usage);
+		}
+		
+		program->usages.append (list);
+	}
+	
+	if (stream.status () != QDataStream::Ok) {
+		delete program;
+		return nullptr;
+	}
+	
+	// The AST, allocated from the arena of the program
+	QExplicitlySharedDataPointer< Arena > arena (new Arena);
+	Arena::Scope arenaScope (arena.data ());
+	
+	NodeReader reader (stream);
+	program->root = new SharedNode (reader.readNode ());
+	program->root->arena = arena;
+	
+	if (reader.failed || !program->root->node || !reader.readBlockMap (program->root.data ()) ||
+	    program->usages.length () != program->variables.length ()) {
+		delete program;
+		return nullptr;
+	}
+	
+	program->root->code.lower (program->root->node);
+	return program;
+}
+
+Nuria::Template::Bundle::~Bundle () {
+	if (this->data) {
+		this->file.unmap (this->data);
+	}
+	
+}
+
+bool Nuria::Template::Bundle::open (const QString &path) {
+	this->file.setFileName (path);
+	if (!this->file.open (QIODevice::ReadOnly)) {
+		return false;
+	}
+	
+	// Map the whole file. The index is read right away, the programs are
+	// read only when they're needed.
+	this->size = this->file.size ();
+	this->data = this->file.map (0, this->size);
+	if (!this->data) {
+		return false;
+	}
+	
+	QByteArray raw = QByteArray::fromRawData (reinterpret_cast< const char * > (this->data), this->size);
+	QDataStream stream (raw);
+	stream.setVersion (g_streamVersion);
+	
+	quint32 magic = 0;
+	quint32 version = 0;
+	qint32 count = 0;
+	stream >> magic >> version >> count;
+	
+	if (magic != BundleMagic || version != Serializer::FormatVersion) {
+		return false;
+	}
+	
+	// Read index. Offsets are relative to the end of the index.
+	for (int i = 0; i < count && stream.status () == QDataStream::Ok; i++) {
+		QString name;
+		qint64 offset = 0;
+		qint64 length = 0;
+		
+		stream >> name >> offset >> length;
+		this->index.insert (name, qMakePair (offset, length));
+	}
+	
+	qint64 dataStart = stream.device ()->pos ();
+	for (auto it = this->index.begin (), end = this->index.end (); it != end; ++it) {
+		it->first += dataStart;
+		if (it->first < dataStart || it->first + it->second > this->size) {
+			stream.setStatus (QDataStream::ReadCorruptData);
+		}
+		
+	}
+	
+	return (stream.status () == QDataStream::Ok);
+}
+
+bool Nuria::Template::Bundle::contains (const QString &name) const {
+	return this->index.contains (name);
+}
+
+QByteArray Nuria::Template::Bundle::program (const QString &name) const {
+	auto it = this->index.constFind (name);
+	if (it == this->index.constEnd ()) {
+		return QByteArray ();
+	}
+	
+	return QByteArray::fromRawData (reinterpret_cast< const char * > (this->data + it->first), it->second);
+}
+
+bool Nuria::Template::Bundle::write (const QString &path, const QMap< QString, QByteArray > &programs) {
+	QFile file (path);
+	if (!file.open (QIODevice::WriteOnly | QIODevice::Truncate)) {
+		return false;
+	}
+	
+	// Header and index
+	QDataStream stream (&file);
+	stream.setVersion (g_streamVersion);
+	stream << quint32 (BundleMagic) << quint32 (Serializer::FormatVersion) << qint32 (programs.size ());
+	
+	qint64 offset = 0;
+	for (auto it = programs.constBegin (), end = programs.constEnd (); it != end; ++it) {
+		stream << it.key () << offset << qint64 (it->length ());
+		offset += it->length ();
+	}
+	
+	// Programs
+	for (const QByteArray &cur : programs) {
+		stream.writeRawData (cur.constData (), cur.length ());
+	}
+	
+	return (stream.status () == QDataStream::Ok);
+}
@@ -0,0 +1,99 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef NURIA_TEMPLATE_BUNDLE_HPP
+#define NURIA_TEMPLATE_BUNDLE_HPP
+
+#include <QDataStream>
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QPair>
+#include <QMap>
+
+namespace Nuria {
+
+class TemplateProgramPrivate;
+
+namespace Template {
+
+/**
+ * \internal
+ * \brief Serializes compiled programs into a binary format and back.
+ * 
+ * The format stores the compiled AST, the variable table, the variable usage
+ * records, the function table and the dependencies of a program.
+ */
+class Serializer {
+public:
+	
+	/** Version of the format. Must be increased on changes to the format. */
+	enum { FormatVersion = 5 };
+	
+	/**
+	 * Writes \a program into \a stream. Returns \c false if the program
+	 * contains something which can't be serialized.
+	 */
+	static bool write (QDataStream &stream, const TemplateProgramPrivate *program);
+	
+	/** Reads a program from \a stream. Returns \c nullptr on failure. */
+	static TemplateProgramPrivate *read (QDataStream &stream);
+	
+};
+
+/**
+ * \internal
+ * \brief Memory-mapped file of serialized programs.
+ * 
+ * A bundle file starts with a header, followed by an index mapping template
+ * names to the location of their serialized program in the file. Programs
+ * are only deserialized when they're requested.
+ */
+class Bundle {
+public:
+	
+	/** Destructor. */
+	~Bundle ();
+	
+	/** Maps the file at \a path and reads its index. */
+	bool open (const QString &path);
+	
+	/** Returns \c true if \a name is in this bundle. */
+	bool contains (const QString &name) const;
+	
+	/**
+	 * Returns the serialized program \a name, or an empty byte array if
+	 * it's unknown. The data is not copied out of the mapped file.
+	 */
+	QByteArray program (const QString &name) const;
+	
+	/** Writes \a programs, mapping names to serialized programs, to \a path. */
+	static bool write (const QString &path, const QMap< QString, QByteArray > &programs);
+	
+private:
+	
+	QFile file;
+	uchar *data = nullptr;
+	qint64 size = 0;
+	QHash< QString, QPair< qint64, qint64 > > index;
+	
+};
+
+}
+}
+
+#endif // NURIA_TEMPLATE_BUNDLE_HPP
@@ -0,0 +1,587 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bytecode.hpp"
+
+#include <QVarLengthArray>
+#include <QAtomicInt>
+
+#include "templateengine_p.hpp"
+#include "astnodes.hpp"
+#include "builtins.hpp"
+#include "sink.hpp"
+
+static QAtomicInt g_enabled (qEnvironmentVariableIsEmpty ("NURIA_TWIG_NO_BYTECODE"));
+
+namespace Nuria {
+namespace Template {
+
+// Interpreter state of a running for-loop. The iterated container is kept in
+// 'iterable' and read in place, only the iterator matching 'source' is used.
+struct LoopFrame {
+	enum Source { List, Sequence, Map, Hash, Association, Scalar };
+	
+	LoopFrame ()
+	        : sequence (QtMetaTypePrivate::QSequentialIterableImpl ())
+	{ }
+	
+	ForLoopNode *node;
+	LoopState state;
+	QVariant iterable;
+	QVariant parent;
+	QVariant parentLoop;
+	
+	const QVariantList *list;
+	QSequentialIterable sequence;
+	QVariantMap::const_iterator mapIt;
+	QVariantHash::const_iterator hashIt;
+	std::unique_ptr< QAssociativeIterable::const_iterator > associationIt;
+	
+	Source source;
+	int position;
+	int hits;
+	int length;
+	bool restore;
+};
+
+}
+}
+
+static bool beginLoop (Nuria::Template::ExecutionContext *dptr, Nuria::Template::LoopFrame &frame,
+                       Nuria::Template::ForLoopNode *node) {
+	using Nuria::Template::LoopFrame;
+	frame.iterable = node->expression->evaluate (dptr);
+	const QVariant &result = frame.iterable;
+	
+	frame.node = node;
+	frame.state = Nuria::LoopState { 0, 0, !node->condition, dptr->currentLoop };
+	frame.position = 0;
+	frame.hits = 0;
+	frame.restore = false;
+	dptr->currentLoop = &frame.state;
+	
+	// Else ?
+	if (!Nuria::Template::isValueTrue (result)) {
+		return false;
+	}
+	
+	// Save parent context
+	if (node->loopVariable >= 0) {
+		frame.parentLoop = dptr->values.at (node->loopVariable);
+		frame.parent = QVariantMap { { QStringLiteral("loop"), frame.parentLoop } };
+		frame.restore = true;
+	}
+	
+	// Iterate the container in place
+	int type = result.userType ();
+	if (type == QMetaType::QVariantList) {
+		frame.source = LoopFrame::List;
+		frame.list = static_cast< const QVariantList * > (result.constData ());
+		frame.length = frame.list->length ();
+	} else if (result.canConvert< QVariantList > ()) {
+		frame.source = LoopFrame::Sequence;
+		frame.sequence = result.value< QSequentialIterable > ();
+		frame.length = frame.sequence.size ();
+	} else if (type == QMetaType::QVariantMap) {
+		const QVariantMap *map = static_cast< const QVariantMap * > (result.constData ());
+		frame.source = LoopFrame::Map;
+		frame.mapIt = map->constBegin ();
+		frame.length = map->size ();
+	} else if (type == QMetaType::QVariantHash) {
+		const QVariantHash *hash = static_cast< const QVariantHash * > (result.constData ());
+		frame.source = LoopFrame::Hash;
+		frame.hashIt = hash->constBegin ();
+		frame.length = hash->size ();
+	} else if (result.canConvert< QVariantMap > ()) {
+		QAssociativeIterable iter = result.value< QAssociativeIterable > ();
+		frame.source = LoopFrame::Association;
+		frame.associationIt.reset (new QAssociativeIterable::const_iterator (iter.begin ()));
+		frame.length = iter.size ();
+	} else {
+		frame.source = LoopFrame::Scalar;
+		frame.length = 1;
+	}
+	
+	return true;
+}
+
+static void writeLoopItem (Nuria::Template::ExecutionContext *dptr, Nuria::Template::LoopFrame &frame) {
+	using Nuria::Template::LoopFrame;
+	Nuria::Template::ForLoopNode *node = frame.node;
+	int i = frame.position++;
+	
+	switch (frame.source) {
+	case LoopFrame::List:
+		node->variable->write (dptr, frame.list->at (i));
+		break;
+	case LoopFrame::Sequence:
+		node->variable->write (dptr, frame.sequence.at (i));
+		break;
+	case LoopFrame::Map:
+		node->variable->write (dptr, frame.mapIt.value ());
+		if (node->key) {
+			node->key->write (dptr, frame.mapIt.key ());
+		}
+		
+		++frame.mapIt;
+		break;
+	case LoopFrame::Hash:
+		node->variable->write (dptr, frame.hashIt.value ());
+		if (node->key) {
+			node->key->write (dptr, frame.hashIt.key ());
+		}
+		
+		++frame.hashIt;
+		break;
+	case LoopFrame::Association:
+		node->variable->write (dptr, frame.associationIt->value ());
+		if (node->key) {
+			node->key->write (dptr, frame.associationIt->key ());
+		}
+		
+		++*frame.associationIt;
+		break;
+	case LoopFrame::Scalar:
+		node->variable->write (dptr, frame.iterable);
+		break;
+	}
+	
+}
+
+static bool nextLoopItem (Nuria::Template::ExecutionContext *dptr, Nuria::Template::LoopFrame &frame) {
+	Nuria::Template::ForLoopNode *node = frame.node;
+	
+	while (frame.position < frame.length) {
+		writeLoopItem (dptr, frame);
+		
+		if (!node->checkCurrentForMatch (dptr)) {
+			continue;
+		}
+		
+		node->updateLoopVariable (dptr, frame.hits, frame.length, frame.parent);
+		frame.hits++;
+		return true;
+	}
+	
+	// A single value counts as hit, even if it didn't match.
+	if (frame.source == Nuria::Template::LoopFrame::Scalar) {
+		frame.hits = 1;
+	}
+	
+	return false;
+}
+
+static void endLoop (Nuria::Template::ExecutionContext *dptr, Nuria::Template::LoopFrame &frame) {
+	dptr->currentLoop = frame.state.parent;
+	
+	// Restore parent context
+	if (frame.restore) {
+		dptr->values[frame.node->loopVariable] = frame.parentLoop;
+	}
+	
+	// Release the container
+	frame.associationIt.reset ();
+	frame.iterable.clear ();
+}
+
+// Moves the top-most 'count' values of 'stack' into a list of arguments
+static QVariantList popArguments (Nuria::Template::Value *stack, int &sp, int count) {
+	QVariantList args;
+	args.reserve (count);
+	
+	sp -= count;
+	for (int i = 0; i < count; i++) {
+		args.append (stack[sp + i].toVariant ());
+		stack[sp + i] = Nuria::Template::Value ();
+	}
+	
+	return args;
+}
+
+void Nuria::Template::Bytecode::lower (Node *root) {
+	this->code.clear ();
+	this->texts.clear ();
+	this->constants.clear ();
+	this->loopDepth = 0;
+	this->stackDepth = 0;
+	this->lastLabel = 0;
+	
+	lowerNode (root, 0);
+	emit (Halt);
+	
+}
+
+void Nuria::Template::Bytecode::execute (ExecutionContext *dptr, Sink &sink, quint64 *profile) const {
+	if (profile) {
+		run< true > (dptr, sink, profile);
+	} else {
+		run< false > (dptr, sink, nullptr);
+	}
+	
+}
+
+QString Nuria::Template::Bytecode::opcodeName (Opcode op) {
+	switch (op) {
+	case Halt: return QStringLiteral("halt");
+	case EmitText: return QStringLiteral("text");
+	case EmitSlot: return QStringLiteral("variable");
+	case RenderNode: return QStringLiteral("node");
+	case PushSlot: return QStringLiteral("load");
+	case PushConst: return QStringLiteral("constant");
+	case PushNode: return QStringLiteral("value");
+	case Apply: return QStringLiteral("operator");
+	case CallBuiltin: return QStringLiteral("builtin");
+	case CallFunction: return QStringLiteral("function");
+	case EmitValue: return QStringLiteral("output");
+	case StoreSlot: return QStringLiteral("set");
+	case Jump: return QStringLiteral("jump");
+	case JumpIfFalse: return QStringLiteral("condition");
+	case IterateBegin: return QStringLiteral("loop");
+	case IterateNext: return QStringLiteral("iteration");
+	case IterateEnd: return QStringLiteral("loopEnd");
+	}
+	
+	return QString ();
+}
+
+Nuria::Template::Bytecode::NodeKind Nuria::Template::Bytecode::nodeKind (Node *node) {
+	
+	// Sub-classes are tested before their base classes
+	if (dynamic_cast< ChainedVariableNode * > (node)) return ChainedVariable;
+	if (dynamic_cast< TypedExpressionNode * > (node)) return TypedExpression;
+	if (dynamic_cast< ExpressionNode * > (node)) return Expression;
+	if (dynamic_cast< MethodCallValueNode * > (node)) return MethodCall;
+	if (dynamic_cast< TernaryOperatorNode * > (node)) return TernaryOperator;
+	if (dynamic_cast< MatchesTestNode * > (node)) return MatchesTest;
+	if (dynamic_cast< LoopFieldNode * > (node)) return LoopField;
+	if (dynamic_cast< StringNode * > (node)) return String;
+	if (dynamic_cast< ValueMapNode * > (node)) return ValueMap;
+	if (dynamic_cast< FilterNode * > (node)) return Filter;
+	if (dynamic_cast< AutoescapeNode * > (node)) return Autoescape;
+	if (dynamic_cast< CacheNode * > (node)) return Cache;
+	if (dynamic_cast< BlockNode * > (node)) return Block;
+	return OtherNode;
+}
+
+QString Nuria::Template::Bytecode::nodeKindName (NodeKind kind) {
+	switch (kind) {
+	case OtherNode: return QStringLiteral("other");
+	case ChainedVariable: return QStringLiteral("chain");
+	case TypedExpression: return QStringLiteral("typed");
+	case Expression: return QStringLiteral("expression");
+	case MethodCall: return QStringLiteral("call");
+	case TernaryOperator: return QStringLiteral("ternary");
+	case MatchesTest: return QStringLiteral("matches");
+	case LoopField: return QStringLiteral("loopField");
+	case String: return QStringLiteral("string");
+	case ValueMap: return QStringLiteral("map");
+	case Filter: return QStringLiteral("filter");
+	case Autoescape: return QStringLiteral("autoescape");
+	case Cache: return QStringLiteral("cache");
+	case Block: return QStringLiteral("block");
+	case NodeKindCount: break;
+	}
+	
+	return QString ();
+}
+
+template< bool Profile >
+void Nuria::Template::Bytecode::run (ExecutionContext *dptr, Sink &sink, quint64 *profile) const {
+	QVarLengthArray< LoopFrame, 8 > frames (this->loopDepth);
+	QVarLengthArray< Value, 16 > values (this->stackDepth);
+	Value *stack = values.data ();
+	int depth = -1;
+	int sp = 0;
+	
+	const Instruction *base = this->code.constData ();
+	const Instruction *ip = base;
+	
+	for (;;) {
+		if (Profile) {
+			profile[ip->op]++;
+		}
+		
+		switch (ip->op) {
+		case Halt:
+			return;
+		case EmitText:
+			sink.write (this->texts.at (ip->arg));
+			ip++;
+			break;
+		case EmitSlot:
+			sink.write (Value::view (dptr->values.at (ip->arg)).toString ());
+			ip++;
+			break;
+		case RenderNode:
+			if (Profile) {
+				profile[RenderedNodes + ip->arg]++;
+			}
+			
+			ip->node->renderTo (dptr, sink);
+			ip++;
+			break;
+		case PushSlot:
+			stack[sp++] = Value::view (dptr->values.at (ip->arg));
+			ip++;
+			break;
+		case PushConst:
+			stack[sp++] = Value::view (this->constants.at (ip->arg));
+			ip++;
+			break;
+		case PushNode:
+			if (Profile) {
+				profile[EvaluatedNodes + ip->arg]++;
+			}
+			
+			stack[sp++] = static_cast< ValueNode * > (ip->node)->evaluateValue (dptr);
+			ip++;
+			break;
+		case Apply: {
+			Value r;
+			if (ip->alt > 1) {
+				r = std::move (stack[--sp]);
+			}
+			
+			stack[sp - 1] = ExpressionNode::apply (stack[sp - 1], r, Operator (ip->arg));
+			ip++;
+		} break;
+		case CallBuiltin: {
+			QVariantList args = popArguments (stack, sp, ip->alt);
+			stack[sp++] = Value (Builtins::invokeBuiltin (Builtins::Function (ip->arg), args, dptr));
+			ip++;
+		} break;
+		case CallFunction: {
+			QVariantList args = popArguments (stack, sp, ip->alt);
+			const Callback &cb = dptr->program ()->functionSlots.at (ip->arg).callback;
+			stack[sp++] = (cb.isValid ()) ? Value (cb.invoke (args)) : Value ();
+			ip++;
+		} break;
+		case EmitValue:
+			sink.write (stack[--sp].toString ());
+			stack[sp] = Value ();
+			ip++;
+			break;
+		case StoreSlot: {
+			QVariant value = stack[--sp].toVariant ();
+			stack[sp] = Value ();
+			dptr->values[ip->arg] = value;
+			ip++;
+		} break;
+		case Jump:
+			ip = base + ip->arg;
+			break;
+		case JumpIfFalse:
+			if (static_cast< ValueNode * > (ip->node)->evaluateValue (dptr).isTrue ()) {
+				ip++;
+			} else {
+				ip = base + ip->arg;
+			}
+			
+			break;
+		case IterateBegin:
+			depth++;
+			if (beginLoop (dptr, frames[depth], static_cast< ForLoopNode * > (ip->node))) {
+				ip++;
+			} else {
+				ip = base + ip->arg;
+			}
+			
+			break;
+		case IterateNext:
+			if (nextLoopItem (dptr, frames[depth])) {
+				ip++;
+			} else {
+				ip = base + ((frames[depth].hits > 0) ? ip->arg : ip->alt);
+			}
+			
+			break;
+		case IterateEnd:
+			endLoop (dptr, frames[depth]);
+			depth--;
+			ip++;
+			break;
+		}
+		
+	}
+	
+}
+
+bool Nuria::Template::Bytecode::isEnabled () {
+	return g_enabled.load ();
+}
+
+void Nuria::Template::Bytecode::setEnabled (bool enabled) {
+	g_enabled.store (enabled);
+}
+
+void Nuria::Template::Bytecode::lowerNode (Node *node, int depth) {
+	if (!node) {
+		return;
+	}
+	
+	if (MultipleNodes *n = dynamic_cast< MultipleNodes * > (node)) {
+		for (Node *cur : n->nodes) {
+			lowerNode (cur, depth);
+		}
+		
+	} else if (TextNode *n = dynamic_cast< TextNode * > (node)) {
+		emitText (n->text);
+	} else if (LiteralValueNode *n = dynamic_cast< LiteralValueNode * > (node)) {
+		emitText (n->render (nullptr));
+	} else if (dynamic_cast< NoopNode * > (node)) {
+		// Renders to nothing.
+	} else if (dynamic_cast< ChainedVariableNode * > (node)) {
+		emit (RenderNode, ChainedVariable, node);
+	} else if (VariableNode *n = dynamic_cast< VariableNode * > (node)) {
+		if (n->index >= 0) {
+			emit (EmitSlot, n->index);
+		}
+		
+	} else if (SetNode *n = dynamic_cast< SetNode * > (node)) {
+		lowerValue (n->value, 0);
+		emit (StoreSlot, n->variable->index);
+	} else if (ForLoopNode *n = dynamic_cast< ForLoopNode * > (node)) {
+		this->loopDepth = qMax (this->loopDepth, depth + 1);
+		
+		int begin = emit (IterateBegin, 0, n);
+		int next = emit (IterateNext, 0, n);
+		lowerNode (n->onSuccess, depth + 1);
+		emit (Jump, next);
+		
+		int elseBranch = label ();
+		lowerNode (n->onFailure, depth + 1);
+		int end = label ();
+		emit (IterateEnd, 0, n);
+		
+		this->code[begin].arg = elseBranch;
+		this->code[next].arg = end;
+		this->code[next].alt = elseBranch;
+	} else if (IfClauseNode *n = dynamic_cast< IfClauseNode * > (node)) {
+		int condition = emit (JumpIfFalse, 0, n->expression);
+		lowerNode (n->onSuccess, depth);
+		
+		if (!n->onFailure) {
+			this->code[condition].arg = label ();
+			return;
+		}
+		
+		int jump = emit (Jump);
+		this->code[condition].arg = label ();
+		lowerNode (n->onFailure, depth);
+		this->code[jump].arg = label ();
+	} else if (BlockNode *n = dynamic_cast< BlockNode * > (node)) {
+		lowerNode (n->body.get (), depth);
+	} else if (IncludeNode *n = dynamic_cast< IncludeNode * > (node)) {
+		lowerNode (n->subNode, depth);
+	} else if (SpacelessNode *n = dynamic_cast< SpacelessNode * > (node)) {
+		// Spaces are removed at compile-time already.
+		lowerNode (n->body, depth);
+	} else if (dynamic_cast< ExpressionNode * > (node) || dynamic_cast< MethodCallValueNode * > (node)) {
+		lowerValue (static_cast< ValueNode * > (node), 0);
+		emit (EmitValue);
+	} else {
+		emit (RenderNode, nodeKind (node), node);
+	}
+	
+}
+
+// Returns true if 'op' takes the value of both operands, whatever they are.
+static bool isStrictOperator (Nuria::Template::Operator op) {
+	using Nuria::Template::Operator;
+	return (op != Operator::NoOp && op != Operator::Not && op != Operator::And && op != Operator::Or);
+}
+
+// Returns true if 'node' evaluates all of its arguments before calling a
+// built-in or user-defined function.
+static bool isStrictCall (Nuria::Template::MethodCallValueNode *node) {
+	using Nuria::Template::Builtins;
+	
+	if (node->builtin == Builtins::Unknown) {
+		return (node->functionIndex >= 0);
+	}
+	
+	return (node->builtin != Builtins::Default);
+}
+
+void Nuria::Template::Bytecode::lowerValue (ValueNode *node, int depth) {
+	this->stackDepth = qMax (this->stackDepth, depth + 1);
+	
+	ExpressionNode *expr = dynamic_cast< ExpressionNode * > (node);
+	MethodCallValueNode *call = dynamic_cast< MethodCallValueNode * > (node);
+	
+	if (dynamic_cast< ChainedVariableNode * > (node) || dynamic_cast< TypedExpressionNode * > (node)) {
+		// These are fastest evaluated by the node itself.
+		emit (PushNode, nodeKind (node), node);
+	} else if (VariableNode *n = dynamic_cast< VariableNode * > (node)) {
+		if (n->index >= 0) {
+			emit (PushSlot, n->index);
+		} else {
+			this->constants.append (QVariant ());
+			emit (PushConst, this->constants.length () - 1);
+		}
+		
+	} else if (LiteralValueNode *n = dynamic_cast< LiteralValueNode * > (node)) {
+		this->constants.append (n->value);
+		emit (PushConst, this->constants.length () - 1);
+	} else if (expr && isStrictOperator (expr->action)) {
+		lowerValue (expr->left, depth);
+		if (expr->right) {
+			lowerValue (expr->right, depth + 1);
+		}
+		
+		int apply = emit (Apply, int (expr->action));
+		this->code[apply].alt = (expr->right) ? 2 : 1;
+	} else if (call && isStrictCall (call)) {
+		int count = (call->arguments) ? call->arguments->values.length () : 0;
+		for (int i = 0; i < count; i++) {
+			lowerValue (call->arguments->values.at (i), depth + i);
+		}
+		
+		bool builtin = (call->builtin != Builtins::Unknown);
+		int invoke = emit (builtin ? CallBuiltin : CallFunction,
+		                   builtin ? call->builtin : call->functionIndex);
+		this->code[invoke].alt = count;
+	} else {
+		emit (PushNode, nodeKind (node), node);
+	}
+	
+}
+
+int Nuria::Template::Bytecode::emit (Opcode op, int arg, Node *node) {
+	this->code.append (Instruction { op, arg, 0, node });
+	return this->code.length () - 1;
+}
+
+void Nuria::Template::Bytecode::emitText (const QString &text) {
+	if (text.isEmpty ()) {
+		return;
+	}
+	
+	// Merge with the previous text, as long as it's not a jump target.
+	int last = this->code.length () - 1;
+	if (last >= this->lastLabel && last >= 0 && this->code.at (last).op == EmitText) {
+		this->texts[this->code.at (last).arg].append (text);
+		return;
+	}
+	
+	this->texts.append (text);
+	emit (EmitText, this->texts.length () - 1);
+}
+
+int Nuria::Template::Bytecode::label () {
+	this->lastLabel = this->code.length ();
+	return this->lastLabel;
+}
@@ -0,0 +1,199 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NURIA_TEMPLATE_BYTECODE_HPP
+#define NURIA_TEMPLATE_BYTECODE_HPP
+
+#include <QVariant>
+#include <QVector>
+#include <QString>
+
+namespace Nuria {
+namespace Template {
+
+struct ExecutionContext;
+class ValueNode;
+class Node;
+class Sink;
+
+/**
+ * \internal
+ * \brief Flat instruction stream of a compiled program.
+ * 
+ * After compilation, the AST of a program is lowered into a list of
+ * instructions, which is then run by execute() in a single loop instead of
+ * walking the tree. Operators and calls of functions are lowered onto a
+ * stack of values. Nodes without instructions of their own are rendered or
+ * evaluated through the AST by a RenderNode or PushNode instruction.
+ */
+class Bytecode {
+public:
+	
+	enum Opcode : quint8 {
+		Halt = 0,
+		
+		/** Writes texts[arg] */
+		EmitText,
+		
+		/** Writes the value of the variable in slot arg */
+		EmitSlot,
+		
+		/** Renders node using the AST. arg is its NodeKind */
+		RenderNode,
+		
+		/** Pushes the variable in slot arg */
+		PushSlot,
+		
+		/** Pushes constants[arg] */
+		PushConst,
+		
+		/** Pushes the value of the ValueNode node. arg is its NodeKind */
+		PushNode,
+		
+		/** Pops alt operands and pushes the result of the Operator arg */
+		Apply,
+		
+		/** Pops alt arguments and pushes the result of the built-in function arg */
+		CallBuiltin,
+		
+		/** Pops alt arguments and pushes the result of the function in slot arg */
+		CallFunction,
+		
+		/** Pops a value and writes it */
+		EmitValue,
+		
+		/** Pops a value and stores it in slot arg */
+		StoreSlot,
+		
+		/** Continues at arg */
+		Jump,
+		
+		/** Continues at arg if the ValueNode node evaluates to false */
+		JumpIfFalse,
+		
+		/** Starts the ForLoopNode node. Continues at arg if there's nothing to iterate */
+		IterateBegin,
+		
+		/**
+		 * Moves to the next item of the inner-most loop. When done,
+		 * continues at arg if there were items, else at alt.
+		 */
+		IterateNext,
+		
+		/** Leaves the inner-most loop */
+		IterateEnd
+	};
+	
+	/** Classes of nodes run through the AST, for statistics. */
+	enum NodeKind {
+		OtherNode = 0,
+		ChainedVariable,
+		TypedExpression,
+		Expression,
+		MethodCall,
+		TernaryOperator,
+		MatchesTest,
+		LoopField,
+		String,
+		ValueMap,
+		Filter,
+		Autoescape,
+		Cache,
+		Block,
+		NodeKindCount
+	};
+	
+	enum {
+		OpcodeCount = IterateEnd + 1,
+		
+		// Layout of the profile passed to execute()
+		RenderedNodes = OpcodeCount,
+		EvaluatedNodes = RenderedNodes + NodeKindCount,
+		ProfileSize = EvaluatedNodes + NodeKindCount
+	};
+	
+	struct Instruction {
+		Opcode op;
+		int arg;
+		int alt;
+		Node *node;
+	};
+	
+	/** Returns \c true if there's code to execute. */
+	bool isValid () const
+	{ return !this->code.isEmpty (); }
+	
+	/**
+	 * Lowers the compiled AST \a root into instructions. The nodes must
+	 * outlive this instance.
+	 */
+	void lower (Node *root);
+	
+	/**
+	 * Runs the instructions in context of \a dptr, writing into \a sink.
+	 * If \a profile is not \c nullptr, it's treated as array of
+	 * ProfileSize counters. The first OpcodeCount are incremented for each
+	 * executed instruction. RenderNode and PushNode instructions are
+	 * counted again by NodeKind, starting at RenderedNodes and
+	 * EvaluatedNodes respectively.
+	 */
+	void execute (ExecutionContext *dptr, Sink &sink, quint64 *profile = nullptr) const;
+	
+	/** Returns a short name of \a op for statistics. */
+	static QString opcodeName (Opcode op);
+	
+	/** Returns the NodeKind of \a node. */
+	static NodeKind nodeKind (Node *node);
+	
+	/** Returns a short name of \a kind for statistics. */
+	static QString nodeKindName (NodeKind kind);
+	
+	/**
+	 * Returns \c true if programs shall be run using execute(). This can
+	 * be disabled by setting the environment variable
+	 * \c NURIA_TWIG_NO_BYTECODE, in which case the AST is rendered.
+	 */
+	static bool isEnabled ();
+	
+	/** Enables or disables the use of bytecode. */
+	static void setEnabled (bool enabled);
+	
+	// 
+	QVector< Instruction > code;
+	QVector< QString > texts;
+	QVector< QVariant > constants;
+	int loopDepth = 0;
+	int stackDepth = 0;
+	
+private:
+	
+	template< bool Profile >
+	void run (ExecutionContext *dptr, Sink &sink, quint64 *profile) const;
+	
+	void lowerNode (Node *node, int depth);
+	void lowerValue (ValueNode *node, int depth);
+	int emit (Opcode op, int arg = 0, Node *node = nullptr);
+	void emitText (const QString &text);
+	int label ();
+	
+	int lastLabel = 0;
+	
+};
+
+}
+}
+
+#endif // NURIA_TEMPLATE_BYTECODE_HPP
@@ -22,6 +22,8 @@
 #include "tokenizer.hpp"
 #include "astnodes.hpp"
 #include "parser.hpp"
+#include <QElapsedTimer>
+#include <QMutexLocker>
 #include <QDateTime>
 
 Nuria::Template::Compiler::Compiler (TemplateEngine *engine, TemplateEnginePrivate *dptr)
@@ -43,14 +45,29 @@ bool Nuria::Template::Compiler::compile (TemplateProgramPrivate *program) {
 		program->root->node = result;
 	}
 	
+	// Lower into bytecode for rendering
+	if (result) {
+		program->root->code.lower (result);
+	}
+	
 	program->compiledAt = QDateTime::currentDateTime ();
 	return result;
 }
 
 Nuria::Template::Node *Nuria::Template::Compiler::loadAndParse (const QString &templateName, TemplateProgramPrivate *dptr) {
-	QByteArray templ = this->d_ptr->loader->load (templateName);
 	dptr->dependencies.append (templateName);
 	
+	// Unchanged templates are parsed from the tokens of their last load
+	QVector< Token > tokens;
+	if (findTokens (templateName, tokens)) {
+		dptr->error = TemplateError ();
+		return parseTokens (tokens, dptr, templateName);
+	}
+	
+	// 
+	QDateTime loadedAt = QDateTime::currentDateTime ();
+	QByteArray templ = this->d_ptr->loader->load (templateName);
+	
 	if (templ.isEmpty ()) {
 		dptr->error = TemplateError (TemplateError::Loader,
 		                             TemplateError::TemplateNotFound,
@@ -59,23 +76,104 @@ Nuria::Template::Node *Nuria::Template::Compiler::loadAndParse (const QString &t
 	}
 	
 	// 
-	return parseCode (templ, dptr);
+	Tokenizer tokenizer;
+	Node *node = parseCode (tokenizer, templ, dptr, templateName);
+	storeTokens (templateName, tokenizer.allTokens (), loadedAt);
+	return node;
 }
 
-Nuria::Template::Node *Nuria::Template::Compiler::parseCode (const QByteArray &code, TemplateProgramPrivate *dptr) {
+Nuria::Template::Node *Nuria::Template::Compiler::parseCode (const QByteArray &code, TemplateProgramPrivate *dptr,
+                                                             const QString &templateName) {
+	Tokenizer tokenizer;
+	return parseCode (tokenizer, code, dptr, templateName);
+}
 
+Nuria::Template::Node *Nuria::Template::Compiler::parseCode (Tokenizer &tokenizer, const QByteArray &code,
+                                                             TemplateProgramPrivate *dptr,
+                                                             const QString &templateName) {
+	Statistics *statistics = this->d_ptr->statistics.data ();
+	bool measure = (statistics && statistics->isEnabled () && !templateName.isEmpty ());
+	QElapsedTimer timer;
+	if (measure) {
+		timer.start ();
+	}
+	
 	// Tokenize ..
 	dptr->error = TemplateError ();
-	this->d_ptr->tokenizer->read (code);
+	tokenizer.read (code);
+	
+	if (measure) {
+		statistics->add (templateName, Statistics::TokenizeTime, timer.nsecsElapsed ());
+	}
 	
 	// Parse ..
-	if (!this->d_ptr->parser->parse (this->d_ptr->tokenizer->allTokens (), dptr)) {
-		dptr->error = this->d_ptr->parser->lastError ();
+	return parseTokens (tokenizer.allTokens (), dptr, templateName);
+}
+
+void Nuria::Template::Compiler::removeTokens (const QString &templateName) {
+	QMutexLocker locker (&this->d_ptr->parsedLock);
+	
+	if (templateName.isEmpty ()) {
+		this->d_ptr->parsed.clear ();
+	} else {
+		this->d_ptr->parsed.remove (templateName);
+	}
+	
+}
+
+void Nuria::Template::Compiler::storeTokens (const QString &templateName, const QVector< Token > &tokens,
+                                             const QDateTime &loadedAt) {
+	int maximum = this->d_ptr->cache.maxSize ();
+	QMutexLocker locker (&this->d_ptr->parsedLock);
+	
+	// Keep about as many templates as programs are cached
+	this->d_ptr->parsed.setMaxCost (qMax (maximum, 0));
+	this->d_ptr->parsed.insert (templateName, new ParsedTemplate { tokens, loadedAt });
+}
+
+bool Nuria::Template::Compiler::findTokens (const QString &templateName, QVector< Token > &tokens) {
+	QMutexLocker locker (&this->d_ptr->parsedLock);
+	ParsedTemplate *found = this->d_ptr->parsed.object (templateName);
+	if (!found) {
+		return false;
+	}
+	
+	// The loader may signal changes, so don't hold the lock while asking it.
+	ParsedTemplate parsed = *found;
+	locker.unlock ();
+	
+	if (this->d_ptr->loader->hasTemplateChanged (templateName, parsed.loadedAt)) {
+		removeTokens (templateName);
+		return false;
+	}
+	
+	tokens = parsed.tokens;
+	return true;
+}
+
+Nuria::Template::Node *Nuria::Template::Compiler::parseTokens (const QVector< Token > &tokens, TemplateProgramPrivate *dptr,
+                                                               const QString &templateName) {
+	Statistics *statistics = this->d_ptr->statistics.data ();
+	bool measure = (statistics && statistics->isEnabled () && !templateName.isEmpty ());
+	QElapsedTimer timer;
+	if (measure) {
+		timer.start ();
+	}
+	
+	Parser parser (this->d_ptr->q_ptr);
+	bool success = parser.parse (tokens, dptr);
+	
+	if (measure) {
+		statistics->add (templateName, Statistics::ParseTime, timer.nsecsElapsed ());
+	}
+	
+	if (!success) {
+		dptr->error = parser.lastError ();
 		return nullptr;
 	}
 	
 	// Get node
-	return this->d_ptr->parser->stealBaseNode ();
+	return parser.stealBaseNode ();
 }
 
 Nuria::TemplateEngine *Nuria::Template::Compiler::engine () const {
@@ -18,11 +18,14 @@
 #define NURIA_TEMPLATE_COMPILER_HPP
 
 #include "../nuria/templateerror.hpp"
+#include <QDateTime>
 #include <QVariant>
+#include <QVector>
 #include <QObject>
 
 namespace Nuria {
 
+class Token;
 class TemplateProgramPrivate;
 class TemplateEnginePrivate;
 class TemplateProgram;
@@ -31,6 +34,7 @@ class TemplateLoader;
 
 namespace Template {
 
+class Tokenizer;
 class Node;
 
 /**
@@ -55,6 +59,9 @@ public:
 	 * Loads and parses \a templateName, returning \c nullptr and setting
 	 * \a error on failure. Else, the parsed node is returned.
 	 * 
+	 * The tokens of the template are kept, so it's not loaded and
+	 * tokenized again until it changes or removeTokens() is called.
+	 * 
 	 * \note Ownership of the returned instance is transferred to the
 	 * caller.
 	 * \note The returned node is not compiled.
@@ -63,17 +70,34 @@ public:
 	
 	/**
 	 * Like loadAndParse(), but takes a \a code snippet instead of a template.
+	 * If \a templateName is given, time spent in tokenizing and parsing is
+	 * recorded for it.
 	 */
-	Node *parseCode (const QByteArray &code, TemplateProgramPrivate *dptr);
+	Node *parseCode (const QByteArray &code, TemplateProgramPrivate *dptr,
+	                 const QString &templateName = QString ());
 	
 	/** Compiles \a program and returns \c true on success. */
 	bool compile (TemplateProgramPrivate *program);
 	
+	/**
+	 * Forgets the tokens of \a templateName kept by loadAndParse(). If
+	 * \a templateName is empty, those of all templates are removed.
+	 */
+	void removeTokens (const QString &templateName = QString ());
+	
 	TemplateEngine *engine () const;
 	TemplateLoader *loader () const;
 	
 private:
 	
+	void storeTokens (const QString &templateName, const QVector< Token > &tokens,
+	                  const QDateTime &loadedAt);
+	bool findTokens (const QString &templateName, QVector< Token > &tokens);
+	Node *parseCode (Tokenizer &tokenizer, const QByteArray &code, TemplateProgramPrivate *dptr,
+	                 const QString &templateName);
+	Node *parseTokens (const QVector< Token > &tokens, TemplateProgramPrivate *dptr,
+	                   const QString &templateName);
+	
 	TemplateEnginePrivate *d_ptr;
 	
 };
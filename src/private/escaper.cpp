@@ -0,0 +1,289 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "escaper.hpp"
+
+#include <QtAlgorithms>
+
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#  define NURIA_ESCAPER_SIMD
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define NURIA_ESCAPER_SIMD
+#endif
+
+namespace {
+
+#if defined(NURIA_ESCAPER_SIMD) && defined(__AVX2__)
+// 16 UTF-16 code units per vector
+typedef __m256i Vector;
+enum { VectorLength = 16 };
+
+inline Vector load (const ushort *ptr) { return _mm256_loadu_si256 (reinterpret_cast< const Vector * > (ptr)); }
+inline Vector splat (short value) { return _mm256_set1_epi16 (value); }
+inline Vector equal (Vector a, short b) { return _mm256_cmpeq_epi16 (a, splat (b)); }
+inline Vector greater (Vector a, Vector b) { return _mm256_cmpgt_epi16 (a, b); }
+inline Vector either (Vector a, Vector b) { return _mm256_or_si256 (a, b); }
+inline Vector both (Vector a, Vector b) { return _mm256_and_si256 (a, b); }
+inline Vector invert (Vector a) { return _mm256_xor_si256 (a, splat (-1)); }
+inline uint bitmask (Vector a) { return uint (_mm256_movemask_epi8 (a)); }
+#elif defined(NURIA_ESCAPER_SIMD)
+// 8 UTF-16 code units per vector
+typedef __m128i Vector;
+enum { VectorLength = 8 };
+
+inline Vector load (const ushort *ptr) { return _mm_loadu_si128 (reinterpret_cast< const Vector * > (ptr)); }
+inline Vector splat (short value) { return _mm_set1_epi16 (value); }
+inline Vector equal (Vector a, short b) { return _mm_cmpeq_epi16 (a, splat (b)); }
+inline Vector greater (Vector a, Vector b) { return _mm_cmpgt_epi16 (a, b); }
+inline Vector either (Vector a, Vector b) { return _mm_or_si128 (a, b); }
+inline Vector both (Vector a, Vector b) { return _mm_and_si128 (a, b); }
+inline Vector invert (Vector a) { return _mm_xor_si128 (a, splat (-1)); }
+inline uint bitmask (Vector a) { return uint (_mm_movemask_epi8 (a)); }
+#endif
+
+#ifdef NURIA_ESCAPER_SIMD
+// Comparisons are signed, so code units >= 0x8000 are never in range.
+inline Vector inRange (Vector v, short low, short high) {
+	return both (greater (v, splat (low - 1)), greater (splat (high + 1), v));
+}
+
+inline Vector isAlphaNumeric (Vector v) {
+	return either (inRange (either (v, splat (0x20)), 'a', 'z'), inRange (v, '0', '9'));
+}
+#endif
+
+inline bool isAlphaNumeric (ushort c) {
+	return ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || (c >= '0' && c <= '9');
+}
+
+inline void appendHex (QString &out, uchar byte) {
+	static const char digits[] = "0123456789ABCDEF";
+	out.append (QLatin1Char (digits[byte >> 4]));
+	out.append (QLatin1Char (digits[byte & 0xF]));
+}
+
+// Appends the percent-encoded UTF-8 representation of the character at
+// 'it' using 'prefix' for each byte. Returns the next character.
+const ushort *appendPercentEncoded (QString &out, const ushort *it, const ushort *end,
+                                    QLatin1String prefix) {
+	uchar bytes[4];
+	int count = 0;
+	uint c = *it++;
+	
+	if (c < 0x80) {
+		bytes[count++] = uchar (c);
+	} else if (c < 0x800) {
+		bytes[count++] = uchar (0xC0 | (c >> 6));
+		bytes[count++] = uchar (0x80 | (c & 0x3F));
+	} else if (QChar::isHighSurrogate (c) && it != end && QChar::isLowSurrogate (*it)) {
+		c = QChar::surrogateToUcs4 (ushort (c), *it++);
+		bytes[count++] = uchar (0xF0 | (c >> 18));
+		bytes[count++] = uchar (0x80 | ((c >> 12) & 0x3F));
+		bytes[count++] = uchar (0x80 | ((c >> 6) & 0x3F));
+		bytes[count++] = uchar (0x80 | (c & 0x3F));
+	} else if (QChar::isSurrogate (c)) {
+		
+		// Let Qt decide what an unpaired surrogate becomes
+		QByteArray utf8 = QString (QChar (ushort (c))).toUtf8 ();
+		for (char byte : utf8) {
+			out.append (prefix);
+			appendHex (out, uchar (byte));
+		}
+		
+		return it;
+	} else {
+		bytes[count++] = uchar (0xE0 | (c >> 12));
+		bytes[count++] = uchar (0x80 | ((c >> 6) & 0x3F));
+		bytes[count++] = uchar (0x80 | (c & 0x3F));
+	}
+	
+	for (int i = 0; i < count; i++) {
+		out.append (prefix);
+		appendHex (out, bytes[i]);
+	}
+	
+	return it;
+}
+
+// Escapes <, >, & and ", like QString::toHtmlEscaped()
+struct HtmlKernel {
+	static bool isSpecial (ushort c)
+	{ return c == '<' || c == '>' || c == '&' || c == '"'; }
+
+#ifdef NURIA_ESCAPER_SIMD
+	static Vector special (Vector v)
+	{ return either (either (equal (v, '<'), equal (v, '>')), either (equal (v, '&'), equal (v, '"'))); }
+#endif
+
+	static const ushort *append (QString &out, const ushort *it, const ushort *) {
+		switch (*it) {
+		case '<': out.append (QLatin1String ("&lt;")); break;
+		case '>': out.append (QLatin1String ("&gt;")); break;
+		case '&': out.append (QLatin1String ("&amp;")); break;
+		case '"': out.append (QLatin1String ("&quot;")); break;
+		}
+		
+		return it + 1;
+	}
+	
+};
+
+// Escapes quotes and line-breaks for JavaScript and CSS strings
+struct ScriptKernel {
+	static bool isSpecial (ushort c)
+	{ return c == '"' || c == '\'' || c == '\r' || c == '\n' || c == '\t'; }
+
+#ifdef NURIA_ESCAPER_SIMD
+	static Vector special (Vector v) {
+		return either (either (equal (v, '"'), equal (v, '\'')),
+		               either (equal (v, '\r'), either (equal (v, '\n'), equal (v, '\t'))));
+	}
+#endif
+
+	static const ushort *append (QString &out, const ushort *it, const ushort *) {
+		switch (*it) {
+		case '"': out.append (QLatin1String ("\\\"")); break;
+		case '\'': out.append (QLatin1String ("\\'")); break;
+		case '\r': out.append (QLatin1String ("\\r")); break;
+		case '\n': out.append (QLatin1String ("\\n")); break;
+		case '\t': out.append (QLatin1String ("\\t")); break;
+		}
+		
+		return it + 1;
+	}
+	
+};
+
+// Percent-encodes all but the unreserved characters of RFC 3986, like
+// QUrl::toPercentEncoding()
+struct UrlKernel {
+	static bool isSpecial (ushort c)
+	{ return !isAlphaNumeric (c) && c != '-' && c != '.' && c != '_' && c != '~'; }
+
+#ifdef NURIA_ESCAPER_SIMD
+	static Vector special (Vector v) {
+		Vector extra = either (either (equal (v, '-'), equal (v, '.')), either (equal (v, '_'), equal (v, '~')));
+		return invert (either (isAlphaNumeric (v), extra));
+	}
+#endif
+
+	static const ushort *append (QString &out, const ushort *it, const ushort *end)
+	{ return appendPercentEncoded (out, it, end, QLatin1String ("%")); }
+	
+};
+
+// Encodes all but alpha-numeric characters as "&#xHH" for each UTF-8 byte
+struct HtmlAttrKernel {
+	static bool isSpecial (ushort c)
+	{ return !isAlphaNumeric (c); }
+
+#ifdef NURIA_ESCAPER_SIMD
+	static Vector special (Vector v)
+	{ return invert (isAlphaNumeric (v)); }
+#endif
+
+	static const ushort *append (QString &out, const ushort *it, const ushort *end)
+	{ return appendPercentEncoded (out, it, end, QLatin1String ("&#x")); }
+	
+};
+
+template< typename Kernel >
+const ushort *findSpecial (const ushort *it, const ushort *end) {
+#ifdef NURIA_ESCAPER_SIMD
+	for (; end - it >= VectorLength; it += VectorLength) {
+		uint mask = bitmask (Kernel::special (load (it)));
+		if (mask) {
+			return it + qCountTrailingZeroBits (mask) / 2;
+		}
+		
+	}
+#endif
+
+	// Scalar fallback and tail
+	while (it != end && !Kernel::isSpecial (*it)) {
+		++it;
+	}
+	
+	return it;
+}
+
+template< typename Kernel >
+QString escapeWith (const QString &data) {
+	const ushort *begin = data.utf16 ();
+	const ushort *end = begin + data.length ();
+	const ushort *it = findSpecial< Kernel > (begin, end);
+	
+	// Nothing to do?
+	if (it == end) {
+		return data;
+	}
+	
+	// Copy runs of characters in between of special ones
+	QString result;
+	result.reserve (data.length () + data.length () / 4 + 16);
+	
+	const ushort *run = begin;
+	while (it != end) {
+		result.append (reinterpret_cast< const QChar * > (run), int (it - run));
+		run = it = Kernel::append (result, it, end);
+		it = findSpecial< Kernel > (it, end);
+	}
+	
+	result.append (reinterpret_cast< const QChar * > (run), int (end - run));
+	return result;
+}
+
+template< typename Kernel >
+int indexOfSpecialWith (const QString &data) {
+	const ushort *begin = data.utf16 ();
+	const ushort *end = begin + data.length ();
+	const ushort *it = findSpecial< Kernel > (begin, end);
+	return (it == end) ? -1 : int (it - begin);
+}
+
+}
+
+QString Nuria::Template::Escaper::escape (const QString &data, EscapeMode mode) {
+	switch (mode) {
+	case EscapeMode::Verbatim: return QString ();
+	case EscapeMode::Html: return escapeWith< HtmlKernel > (data);
+	case EscapeMode::JavaScript:
+	case EscapeMode::Css: return escapeWith< ScriptKernel > (data);
+	case EscapeMode::Url: return escapeWith< UrlKernel > (data);
+	case EscapeMode::HtmlAttr: return escapeWith< HtmlAttrKernel > (data);
+	}
+	
+	// 
+	return QString ();
+	
+}
+
+int Nuria::Template::Escaper::indexOfSpecial (const QString &data, EscapeMode mode) {
+	switch (mode) {
+	case EscapeMode::Verbatim: return -1;
+	case EscapeMode::Html: return indexOfSpecialWith< HtmlKernel > (data);
+	case EscapeMode::JavaScript:
+	case EscapeMode::Css: return indexOfSpecialWith< ScriptKernel > (data);
+	case EscapeMode::Url: return indexOfSpecialWith< UrlKernel > (data);
+	case EscapeMode::HtmlAttr: return indexOfSpecialWith< HtmlAttrKernel > (data);
+	}
+	
+	// 
+	return -1;
+	
+}
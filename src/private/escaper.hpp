@@ -0,0 +1,56 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NURIA_TEMPLATE_ESCAPER_HPP
+#define NURIA_TEMPLATE_ESCAPER_HPP
+
+#include "templateengine_p.hpp"
+#include <QString>
+
+namespace Nuria {
+namespace Template {
+
+/**
+ * \internal
+ * \brief Single-pass escaping of strings.
+ * 
+ * Each escape mode has its own kernel, which scans the input for characters
+ * which need escaping. On x86, this is done using SSE2, or AVX2 if the
+ * library has been built for it, looking at 8 or 16 characters at once.
+ * Other platforms use a scalar loop.
+ */
+class Escaper {
+public:
+	
+	/**
+	 * Escapes \a data for \a mode. If nothing needs escaping, \a data is
+	 * returned as-is without copying it. Returns an empty string for
+	 * EscapeMode::Verbatim.
+	 */
+	static QString escape (const QString &data, EscapeMode mode);
+	
+	/**
+	 * Returns the index of the first character in \a data which needs
+	 * escaping for \a mode, or \c -1 if there's none.
+	 */
+	static int indexOfSpecial (const QString &data, EscapeMode mode);
+	
+};
+
+}
+}
+
+#endif // NURIA_TEMPLATE_ESCAPER_HPP
@@ -0,0 +1,132 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "fragmentcache.hpp"
+
+#include <QMutexLocker>
+
+Nuria::Template::FragmentCache::FragmentCache ()
+	: maximum (DefaultMaxSize)
+{
+	this->clock.start ();
+}
+
+qint64 Nuria::Template::FragmentCache::maxSize () const {
+	return this->maximum.load ();
+}
+
+void Nuria::Template::FragmentCache::setMaxSize (qint64 bytes) {
+	QMutexLocker locker (&this->lock);
+	this->maximum.store (qMax (qint64 (0), bytes));
+	evict ();
+}
+
+qint64 Nuria::Template::FragmentCache::size () const {
+	QMutexLocker locker (&this->lock);
+	return this->used;
+}
+
+int Nuria::Template::FragmentCache::count () const {
+	QMutexLocker locker (&this->lock);
+	return this->entries.size ();
+}
+
+bool Nuria::Template::FragmentCache::lookup (const QString &key, QString &output, QByteArray *tag) {
+	QMutexLocker locker (&this->lock);
+	
+	auto it = this->entries.find (key);
+	if (it == this->entries.end ()) {
+		return false;
+	}
+	
+	// Expired?
+	if (it->expiresAt > 0 && it->expiresAt <= this->clock.elapsed ()) {
+		removeEntry (it);
+		return false;
+	}
+	
+	// Mark as most recently used
+	this->usage.remove (it->lastUse);
+	it->lastUse = ++this->useCounter;
+	this->usage.insert (it->lastUse, key);
+	
+	output = it->output;
+	if (tag) {
+		*tag = it->tag;
+	}
+	
+	return true;
+}
+
+void Nuria::Template::FragmentCache::insert (const QString &key, const QString &output, int ttl,
+                                             const QByteArray &tag) {
+	qint64 size = (key.size () + output.size ()) * qint64 (sizeof(QChar)) + tag.size ()
+	              + qint64 (sizeof(Entry));
+	QMutexLocker locker (&this->lock);
+	
+	auto it = this->entries.find (key);
+	if (it != this->entries.end ()) {
+		removeEntry (it);
+	}
+	
+	if (size > this->maximum.load ()) {
+		return;
+	}
+	
+	qint64 expiresAt = (ttl > 0) ? this->clock.elapsed () + qint64 (ttl) * 1000 : 0;
+	quint64 lastUse = ++this->useCounter;
+	
+	this->entries.insert (key, Entry { output, tag, expiresAt, lastUse, size });
+	this->usage.insert (lastUse, key);
+	this->used += size;
+	evict ();
+}
+
+int Nuria::Template::FragmentCache::removeByPrefix (const QString &prefix) {
+	QMutexLocker locker (&this->lock);
+	int removed = 0;
+	
+	// Keys are sorted, so all matching keys follow each other.
+	auto it = this->entries.lowerBound (prefix);
+	while (it != this->entries.end () && it.key ().startsWith (prefix)) {
+		it = removeEntry (it);
+		removed++;
+	}
+	
+	return removed;
+}
+
+void Nuria::Template::FragmentCache::clear () {
+	QMutexLocker locker (&this->lock);
+	this->entries.clear ();
+	this->usage.clear ();
+	this->used = 0;
+}
+
+Nuria::Template::FragmentCache::EntryMap::iterator
+Nuria::Template::FragmentCache::removeEntry (EntryMap::iterator it) {
+	this->usage.remove (it->lastUse);
+	this->used -= it->size;
+	return this->entries.erase (it);
+}
+
+void Nuria::Template::FragmentCache::evict () {
+	while (this->used > this->maximum.load () && !this->usage.isEmpty ()) {
+		removeEntry (this->entries.find (this->usage.first ()));
+	}
+	
+}
@@ -0,0 +1,115 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef NURIA_TEMPLATE_FRAGMENTCACHE_HPP
+#define NURIA_TEMPLATE_FRAGMENTCACHE_HPP
+
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QByteArray>
+#include <QString>
+#include <QMutex>
+#include <QMap>
+
+namespace Nuria {
+namespace Template {
+
+/**
+ * \internal
+ * \brief Thread-safe cache of rendered fragments.
+ * 
+ * Stores the output of {% cache %} blocks by their key, shared by all
+ * programs of an engine. The engine also uses an instance to memoize whole
+ * renders. A fragment may expire after a time-to-live. When the fragments use
+ * more memory than allowed, the least recently used ones are evicted.
+ */
+class FragmentCache {
+public:
+	
+	/** Default of maxSize(): 16MiB. */
+	enum { DefaultMaxSize = 16 * 1024 * 1024 };
+	
+	/** Constructor. */
+	FragmentCache ();
+	
+	/** Returns the maximum memory used by fragments in bytes. */
+	qint64 maxSize () const;
+	
+	/**
+	 * Sets the maximum memory used by fragments to \a bytes, evicting if
+	 * needed. If \a bytes is \c 0, nothing is cached.
+	 */
+	void setMaxSize (qint64 bytes);
+	
+	/** Returns the memory used by all fragments in bytes. */
+	qint64 size () const;
+	
+	/** Returns the count of cached fragments. */
+	int count () const;
+	
+	/**
+	 * Looks up \a key. If found and not expired, stores it in \a output,
+	 * and its tag in \a tag if not \c nullptr, and returns \c true. Else
+	 * \c false is returned.
+	 */
+	bool lookup (const QString &key, QString &output, QByteArray *tag = nullptr);
+	
+	/**
+	 * Inserts or replaces \a key with \a output and an optional \a tag.
+	 * If \a ttl is greater than \c 0, the fragment expires after \a ttl
+	 * seconds.
+	 */
+	void insert (const QString &key, const QString &output, int ttl = 0,
+	             const QByteArray &tag = QByteArray ());
+	
+	/** Removes all fragments with a key starting with \a prefix. */
+	int removeByPrefix (const QString &prefix);
+	
+	/** Removes all fragments. */
+	void clear ();
+	
+private:
+	struct Entry {
+		QString output;
+		QByteArray tag;
+		qint64 expiresAt;
+		quint64 lastUse;
+		qint64 size;
+	};
+	
+	typedef QMap< QString, Entry > EntryMap;
+	
+	EntryMap::iterator removeEntry (EntryMap::iterator it);
+	void evict ();
+	
+	mutable QMutex lock;
+	EntryMap entries;
+	
+	// Keys by their last use, oldest first
+	QMap< quint64, QString > usage;
+	quint64 useCounter = 0;
+	
+	QElapsedTimer clock;
+	QAtomicInteger< qint64 > maximum;
+	qint64 used = 0;
+	
+};
+
+}
+}
+
+#endif // NURIA_TEMPLATE_FRAGMENTCACHE_HPP
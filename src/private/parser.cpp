@@ -91,7 +91,7 @@ namespace {
 }
 
 Nuria::Template::Parser::Parser (TemplateEngine *engine)
-        : QObject (engine), d_ptr (new ParserPrivate)
+        : d_ptr (new ParserPrivate)
 {
 	
 	this->d_ptr->engine = engine;
@@ -0,0 +1,420 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "programcache.hpp"
+#include "statistics.hpp"
+
+#include <QMutexLocker>
+#include <QReadLocker>
+#include <QWriteLocker>
+#include <limits>
+
+// Seeds of the rows of FrequencySketch
+static const uint g_sketchSeeds[] = { 0x9E3779B1u, 0x85EBCA77u, 0xC2B2AE3Du, 0x27D4EB2Fu };
+
+// Time stamp of shards without programs
+static const quint64 g_unused = std::numeric_limits< quint64 >::max ();
+
+void Nuria::Template::FrequencySketch::increment (const QString &name) {
+	uint hash = qHash (name);
+	
+	// Counters saturate. Lost updates by concurrent increments are fine.
+	for (int i = 0; i < Depth; i++) {
+		QAtomicInt &counter = this->counters[i][indexOf (hash, i)];
+		int value = counter.load ();
+		if (value < MaxCount) {
+			counter.testAndSetRelaxed (value, value + 1);
+		}
+		
+	}
+	
+	if (this->additions.fetchAndAddRelaxed (1) + 1 >= SampleSize) {
+		age ();
+	}
+	
+}
+
+int Nuria::Template::FrequencySketch::frequency (const QString &name) const {
+	uint hash = qHash (name);
+	int result = MaxCount;
+	
+	for (int i = 0; i < Depth; i++) {
+		result = qMin (result, this->counters[i][indexOf (hash, i)].load ());
+	}
+	
+	return result;
+}
+
+void Nuria::Template::FrequencySketch::clear () {
+	for (int i = 0; i < Depth; i++) {
+		for (int j = 0; j < Width; j++) {
+			this->counters[i][j].store (0);
+		}
+		
+	}
+	
+	this->additions.store (0);
+}
+
+int Nuria::Template::FrequencySketch::indexOf (uint hash, int row) {
+	uint h = hash * g_sketchSeeds[row];
+	h ^= h >> 15;
+	return h & (Width - 1);
+}
+
+void Nuria::Template::FrequencySketch::age () {
+	this->additions.store (0);
+	
+	for (int i = 0; i < Depth; i++) {
+		for (int j = 0; j < Width; j++) {
+			this->counters[i][j].store (this->counters[i][j].load () >> 1);
+		}
+		
+	}
+	
+}
+
+Nuria::Template::ProgramCache::ProgramCache ()
+        : maximum (100)
+{
+	
+	for (int i = 0; i < ShardCount; i++) {
+		this->shards[i].oldestUse.store (g_unused);
+	}
+	
+}
+
+Nuria::Template::ProgramCache::~ProgramCache () {
+	clear ();
+}
+
+int Nuria::Template::ProgramCache::maxSize () const {
+	return this->maximum.load ();
+}
+
+void Nuria::Template::ProgramCache::setMaxSize (int size) {
+	this->maximum.store (size);
+	evict ();
+}
+
+int Nuria::Template::ProgramCache::count () const {
+	return this->size.load ();
+}
+
+qint64 Nuria::Template::ProgramCache::maxCost () const {
+	return this->maximumCost.load ();
+}
+
+void Nuria::Template::ProgramCache::setMaxCost (qint64 cost) {
+	this->maximumCost.store (qMax (cost, qint64 (0)));
+	evict ();
+}
+
+qint64 Nuria::Template::ProgramCache::totalCost () const {
+	return this->costSum.load ();
+}
+
+bool Nuria::Template::ProgramCache::isAdmissionEnabled () const {
+	return this->admission.load ();
+}
+
+void Nuria::Template::ProgramCache::setAdmissionEnabled (bool enabled) {
+	this->admission.store (enabled);
+	this->sketch.clear ();
+}
+
+bool Nuria::Template::ProgramCache::contains (const QString &name) const {
+	Shard &shard = shardFor (name);
+	QReadLocker locker (&shard.lock);
+	return shard.entries.contains (name);
+}
+
+bool Nuria::Template::ProgramCache::lookup (const QString &name, TemplateProgram &program) {
+	Shard &shard = shardFor (name);
+	QReadLocker locker (&shard.lock);
+	
+	Entry *entry = shard.entries.value (name);
+	if (!entry) {
+		return false;
+	}
+	
+	// Only the atomic time stamp is written to, so the read lock is enough
+	entry->lastUse.store (this->clock.fetchAndAddRelaxed (1));
+	program = entry->program;
+	locker.unlock ();
+	
+	if (this->admission.load ()) {
+		this->sketch.increment (name);
+	}
+	
+	return true;
+}
+
+void Nuria::Template::ProgramCache::insert (const QString &name, const TemplateProgram &program, qint64 cost) {
+	qint64 budget = this->maximumCost.load ();
+	if (this->maximum.load () < 1 || (budget > 0 && cost > budget)) {
+		return;
+	}
+	
+	// New programs count as access, as they're inserted after a miss.
+	if (this->admission.load () && !contains (name) && !admit (name, cost)) {
+		return;
+	}
+	
+	// 
+	Shard &shard = shardFor (name);
+	QWriteLocker locker (&shard.lock);
+	
+	Entry *&entry = shard.entries[name];
+	if (!entry) {
+		entry = new Entry;
+		entry->name = name;
+		this->size.ref ();
+	} else {
+		removeFromIndex (name, entry->program.dependencies ());
+		this->costSum.fetchAndAddRelaxed (-entry->cost);
+		unlink (shard, entry);
+	}
+	
+	entry->program = program;
+	entry->cost = cost;
+	this->costSum.fetchAndAddRelaxed (cost);
+	addToIndex (name, program.dependencies ());
+	entry->lastUse.store (this->clock.fetchAndAddRelaxed (1));
+	link (shard, entry);
+	updateOldestUse (shard);
+	locker.unlock ();
+	
+	// 
+	evict ();
+}
+
+void Nuria::Template::ProgramCache::remove (const QString &name) {
+	Shard &shard = shardFor (name);
+	QWriteLocker locker (&shard.lock);
+	
+	Entry *entry = shard.entries.value (name);
+	if (entry) {
+		removeEntry (shard, entry);
+	}
+	
+}
+
+void Nuria::Template::ProgramCache::removeDependents (const QString &templateName) {
+	QMutexLocker locker (&this->indexLock);
+	QSet< QString > names = this->dependents.value (templateName);
+	locker.unlock ();
+	
+	for (const QString &name : names) {
+		remove (name);
+	}
+	
+}
+
+void Nuria::Template::ProgramCache::clear () {
+	for (int i = 0; i < ShardCount; i++) {
+		Shard &shard = this->shards[i];
+		QWriteLocker locker (&shard.lock);
+		
+		for (auto it = shard.entries.constBegin (), end = shard.entries.constEnd (); it != end; ++it) {
+			removeFromIndex (it.key (), (*it)->program.dependencies ());
+			this->costSum.fetchAndAddRelaxed (-(*it)->cost);
+		}
+		
+		this->size.fetchAndAddRelaxed (-shard.entries.size ());
+		qDeleteAll (shard.entries);
+		shard.entries.clear ();
+		shard.head = nullptr;
+		shard.tail = nullptr;
+		shard.oldestUse.store (g_unused);
+	}
+	
+}
+
+void Nuria::Template::ProgramCache::setStatistics (Statistics *statistics) {
+	this->statistics = statistics;
+}
+
+Nuria::Template::ProgramCache::Shard &Nuria::Template::ProgramCache::shardFor (const QString &name) const {
+	return this->shards[qHash (name) % ShardCount];
+}
+
+void Nuria::Template::ProgramCache::link (Shard &shard, Entry *entry) {
+	entry->linkedAt = entry->lastUse.load ();
+	entry->prev = nullptr;
+	entry->next = shard.head;
+	
+	if (shard.head) {
+		shard.head->prev = entry;
+	} else {
+		shard.tail = entry;
+	}
+	
+	shard.head = entry;
+}
+
+void Nuria::Template::ProgramCache::unlink (Shard &shard, Entry *entry) {
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		shard.head = entry->next;
+	}
+	
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		shard.tail = entry->prev;
+	}
+	
+}
+
+Nuria::Template::ProgramCache::Entry *Nuria::Template::ProgramCache::leastRecentlyUsed (Shard &shard) {
+	
+	// Move entries which were looked up since they were linked to the head.
+	// Look-ups need the read lock, so each entry is moved at most once.
+	Entry *entry = shard.tail;
+	while (entry && entry->lastUse.load () != entry->linkedAt) {
+		unlink (shard, entry);
+		link (shard, entry);
+		entry = shard.tail;
+	}
+	
+	updateOldestUse (shard);
+	return entry;
+}
+
+void Nuria::Template::ProgramCache::updateOldestUse (Shard &shard) {
+	shard.oldestUse.store (shard.tail ? shard.tail->lastUse.load () : g_unused);
+}
+
+void Nuria::Template::ProgramCache::removeEntry (Shard &shard, Entry *entry) {
+	shard.entries.remove (entry->name);
+	unlink (shard, entry);
+	updateOldestUse (shard);
+	
+	removeFromIndex (entry->name, entry->program.dependencies ());
+	this->costSum.fetchAndAddRelaxed (-entry->cost);
+	this->size.deref ();
+	delete entry;
+}
+
+void Nuria::Template::ProgramCache::addToIndex (const QString &name, const QStringList &dependencies) {
+	QMutexLocker locker (&this->indexLock);
+	
+	for (const QString &cur : dependencies) {
+		this->dependents[cur].insert (name);
+	}
+	
+}
+
+void Nuria::Template::ProgramCache::removeFromIndex (const QString &name, const QStringList &dependencies) {
+	QMutexLocker locker (&this->indexLock);
+	
+	for (const QString &cur : dependencies) {
+		auto it = this->dependents.find (cur);
+		if (it == this->dependents.end ()) {
+			continue;
+		}
+		
+		it->remove (name);
+		if (it->isEmpty ()) {
+			this->dependents.erase (it);
+		}
+		
+	}
+	
+}
+
+bool Nuria::Template::ProgramCache::findLeastRecentlyUsed (QString &name, bool remove) {
+	for (int attempt = 0; attempt <= ShardCount; attempt++) {
+		
+		// Choose the shard by the published time stamps of their tails
+		int index = -1;
+		quint64 oldestUse = g_unused;
+		for (int i = 0; i < ShardCount; i++) {
+			quint64 cur = this->shards[i].oldestUse.load ();
+			if (cur < oldestUse) {
+				oldestUse = cur;
+				index = i;
+			}
+			
+		}
+		
+		if (index < 0) {
+			return false;
+		}
+		
+		// The tail may have been looked up since its time stamp was
+		// published. If so, choose again with the updated time stamp.
+		Shard &shard = this->shards[index];
+		QWriteLocker locker (&shard.lock);
+		Entry *entry = leastRecentlyUsed (shard);
+		if (!entry || (entry->lastUse.load () != oldestUse && attempt < ShardCount)) {
+			continue;
+		}
+		
+		// Removing with the lock still held, so no other thread can use
+		// the entry in between.
+		name = entry->name;
+		if (remove) {
+			removeEntry (shard, entry);
+		}
+		
+		return true;
+	}
+	
+	return false;
+}
+
+bool Nuria::Template::ProgramCache::removeLeastRecentlyUsed () {
+	QString oldestName;
+	if (!findLeastRecentlyUsed (oldestName, true)) {
+		return false;
+	}
+	
+	// 
+	if (this->statistics) {
+		this->statistics->add (oldestName, Statistics::CacheEvictions);
+	}
+	
+	return true;
+}
+
+bool Nuria::Template::ProgramCache::isFull (qint64 cost) const {
+	qint64 budget = this->maximumCost.load ();
+	return (this->size.load () >= this->maximum.load () ||
+	        (budget > 0 && this->costSum.load () + cost > budget));
+}
+
+bool Nuria::Template::ProgramCache::admit (const QString &name, qint64 cost) {
+	this->sketch.increment (name);
+	
+	// TinyLFU: Keep the program which would be evicted if it's used at least
+	// as often as the new one.
+	QString victim;
+	if (!isFull (cost) || !findLeastRecentlyUsed (victim)) {
+		return true;
+	}
+	
+	return (this->sketch.frequency (name) > this->sketch.frequency (victim));
+}
+
+void Nuria::Template::ProgramCache::evict () {
+	while ((this->size.load () > this->maximum.load () ||
+	        (this->maximumCost.load () > 0 && this->costSum.load () > this->maximumCost.load ())) &&
+	       removeLeastRecentlyUsed ());
+}
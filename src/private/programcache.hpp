@@ -0,0 +1,215 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef NURIA_TEMPLATE_PROGRAMCACHE_HPP
+#define NURIA_TEMPLATE_PROGRAMCACHE_HPP
+
+#include "../nuria/templateprogram.hpp"
+#include <QReadWriteLock>
+#include <QAtomicInteger>
+#include <QStringList>
+#include <QMutex>
+#include <QHash>
+#include <QSet>
+
+namespace Nuria {
+namespace Template {
+
+class Statistics;
+
+/**
+ * \internal
+ * \brief Approximate access counts of templates.
+ * 
+ * A count-min sketch with small saturating counters. All counters are halved
+ * after a number of increments, so the frequencies follow recent accesses.
+ */
+class FrequencySketch {
+public:
+	enum {
+		Width = 1024,
+		Depth = 4,
+		MaxCount = 15,
+		SampleSize = 10 * Width
+	};
+	
+	/** Counts an access to \a name. */
+	void increment (const QString &name);
+	
+	/** Returns the estimated access count of \a name. */
+	int frequency (const QString &name) const;
+	
+	/** Resets all counters. */
+	void clear ();
+	
+private:
+	static int indexOf (uint hash, int row);
+	void age ();
+	
+	QAtomicInt counters[Depth][Width];
+	QAtomicInt additions;
+	
+};
+
+/**
+ * \internal
+ * \brief Thread-safe cache of compiled programs.
+ * 
+ * The cache is split into shards, each guarded by its own read-write lock.
+ * Look-ups only take the read lock of a single shard, so concurrent look-ups
+ * don't block each other. When the cache grows beyond its maximum size, the
+ * least recently used program is evicted.
+ * 
+ * Each shard keeps its programs in a list, the least recently used one at
+ * its tail. Look-ups only update the time stamp of a program, so a program
+ * which was used since it was put into the list gets moved to its head
+ * when it reaches the tail. The time stamp of the tail is published per
+ * shard, so finding the program to evict only locks the shard it's in.
+ * 
+ * For invalidation, the cache keeps an index of which cached programs depend
+ * on which template.
+ * 
+ * Each program has a cost, its estimated memory usage in bytes. Besides the
+ * count of programs, the sum of costs can be limited. If admission is
+ * enabled, a new program is only cached if it's used more often than the
+ * program it would evict.
+ */
+class ProgramCache {
+public:
+	
+	/** Constructor. */
+	ProgramCache ();
+	
+	/** Destructor. */
+	~ProgramCache ();
+	
+	/** Returns the maximum count of cached programs. */
+	int maxSize () const;
+	
+	/** Sets the maximum count of cached programs, evicting if needed. */
+	void setMaxSize (int size);
+	
+	/** Returns the count of cached programs. */
+	int count () const;
+	
+	/** Returns the maximum sum of costs. \c 0 means there's no limit. */
+	qint64 maxCost () const;
+	
+	/** Sets the maximum sum of costs, evicting if needed. */
+	void setMaxCost (qint64 cost);
+	
+	/** Returns the sum of costs of all cached programs. */
+	qint64 totalCost () const;
+	
+	/** Returns \c true if frequency-aware admission is enabled. */
+	bool isAdmissionEnabled () const;
+	
+	/** Enables or disables frequency-aware admission of new programs. */
+	void setAdmissionEnabled (bool enabled);
+	
+	/** Returns \c true if \a name is cached. */
+	bool contains (const QString &name) const;
+	
+	/**
+	 * Looks up \a name. If found, stores it in \a program and returns
+	 * \c true. Else \c false is returned.
+	 */
+	bool lookup (const QString &name, TemplateProgram &program);
+	
+	/**
+	 * Inserts or replaces \a name with the cost \a cost. Does nothing if
+	 * the cache is disabled, if \a cost exceeds maxCost() or if the program
+	 * isn't admitted.
+	 */
+	void insert (const QString &name, const TemplateProgram &program, qint64 cost = 1);
+	
+	/** Removes \a name. */
+	void remove (const QString &name);
+	
+	/** Removes all programs depending on \a templateName. */
+	void removeDependents (const QString &templateName);
+	
+	/** Removes all programs. */
+	void clear ();
+	
+	/** Sets where evictions are recorded to. */
+	void setStatistics (Statistics *statistics);
+	
+private:
+	enum { ShardCount = 16 };
+	
+	struct Entry {
+		QString name;
+		TemplateProgram program;
+		QAtomicInteger< quint64 > lastUse;
+		quint64 linkedAt;
+		qint64 cost;
+		
+		// Neighbours in the list of the shard
+		Entry *prev;
+		Entry *next;
+	};
+	
+	struct Shard {
+		mutable QReadWriteLock lock;
+		QHash< QString, Entry * > entries;
+		
+		// Most recently used entry at the head. Only changed with the
+		// write lock held.
+		Entry *head = nullptr;
+		Entry *tail = nullptr;
+		
+		// Time stamp of the tail, readable without locking
+		QAtomicInteger< quint64 > oldestUse;
+	};
+	
+	Shard &shardFor (const QString &name) const;
+	static void link (Shard &shard, Entry *entry);
+	static void unlink (Shard &shard, Entry *entry);
+	static Entry *leastRecentlyUsed (Shard &shard);
+	static void updateOldestUse (Shard &shard);
+	void removeEntry (Shard &shard, Entry *entry);
+	void addToIndex (const QString &name, const QStringList &dependencies);
+	void removeFromIndex (const QString &name, const QStringList &dependencies);
+	bool findLeastRecentlyUsed (QString &name, bool remove = false);
+	bool removeLeastRecentlyUsed ();
+	bool isFull (qint64 cost) const;
+	bool admit (const QString &name, qint64 cost);
+	void evict ();
+	
+	mutable Shard shards[ShardCount];
+	
+	// Names of cached programs by template they depend on. Locked after
+	// the lock of a shard.
+	QMutex indexLock;
+	QHash< QString, QSet< QString > > dependents;
+	
+	QAtomicInt size;
+	QAtomicInt maximum;
+	QAtomicInteger< qint64 > costSum;
+	QAtomicInteger< qint64 > maximumCost;
+	QAtomicInteger< quint64 > clock;
+	QAtomicInt admission;
+	FrequencySketch sketch;
+	Statistics *statistics = nullptr;
+	
+};
+
+}
+}
+
+#endif // NURIA_TEMPLATE_PROGRAMCACHE_HPP
@@ -0,0 +1,59 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sink.hpp"
+
+#include <QIODevice>
+#include "escaper.hpp"
+
+// Amount of characters collected before they're written to the device
+enum { FlushThreshold = 8192 };
+
+void Nuria::Template::EscapingSink::write (const QString &data) {
+	this->target.write (Escaper::escape (data, this->mode));
+}
+
+Nuria::Template::DeviceSink::~DeviceSink () {
+	flush ();
+}
+
+void Nuria::Template::DeviceSink::write (const QString &data) {
+	
+	// Large chunks are written directly to avoid copying them around.
+	if (data.length () >= FlushThreshold) {
+		flush ();
+		this->failed |= (this->device->write (data.toUtf8 ()) < 0);
+		return;
+	}
+	
+	// Collect small chunks
+	this->buffer.append (data);
+	if (this->buffer.length () >= FlushThreshold) {
+		flush ();
+	}
+	
+}
+
+bool Nuria::Template::DeviceSink::flush () {
+	if (!this->buffer.isEmpty ()) {
+		this->failed |= (this->device->write (this->buffer.toUtf8 ()) < 0);
+		
+		// Keep the allocated memory for the next chunk
+		this->buffer.resize (0);
+	}
+	
+	return !this->failed;
+}
@@ -0,0 +1,128 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NURIA_TEMPLATE_SINK_HPP
+#define NURIA_TEMPLATE_SINK_HPP
+
+#include <QString>
+
+class QIODevice;
+
+namespace Nuria {
+
+enum class EscapeMode;
+
+namespace Template {
+
+/**
+ * \brief Output interface used by Node::renderTo().
+ * 
+ * Nodes write their output piece by piece into a sink instead of building
+ * and returning intermediate strings.
+ */
+class Sink {
+public:
+	
+	/** Destructor. */
+	virtual ~Sink () { }
+	
+	/** Writes \a data to the sink. */
+	virtual void write (const QString &data) = 0;
+	
+	/**
+	 * Writes \a data, which has already been escaped for the inner-most
+	 * autoescape block. The default implementation calls write().
+	 */
+	virtual void writeEscaped (const QString &data)
+	{ write (data); }
+	
+};
+
+/** Sink appending all data to a QString. */
+class StringSink : public Sink {
+public:
+	
+	StringSink (QString &target) : target (target) { }
+	
+	void write (const QString &data) override
+	{ target.append (data); }
+	
+	// 
+	QString &target;
+	
+};
+
+/** Sink passing all data on to \a target, counting the written characters. */
+class CountingSink : public Sink {
+public:
+	
+	CountingSink (Sink &target) : target (target) { }
+	
+	void write (const QString &data) override
+	{ count += data.length (); target.write (data); }
+	
+	// 
+	Sink &target;
+	quint64 count = 0;
+	
+};
+
+/**
+ * Sink escaping all data written to it using \a mode, passing it on to
+ * \a target. Already escaped data is passed on as-is.
+ */
+class EscapingSink : public Sink {
+public:
+	
+	EscapingSink (Sink &target, EscapeMode mode) : target (target), mode (mode) { }
+	
+	void write (const QString &data) override;
+	
+	void writeEscaped (const QString &data) override
+	{ target.write (data); }
+	
+	// 
+	Sink &target;
+	EscapeMode mode;
+	
+};
+
+/**
+ * Sink writing all data UTF-8 encoded into a QIODevice. Small writes are
+ * collected in a buffer which is flushed once it reaches a certain size.
+ */
+class DeviceSink : public Sink {
+public:
+	
+	DeviceSink (QIODevice *device) : device (device) { }
+	~DeviceSink () override;
+	
+	void write (const QString &data) override;
+	
+	/** Writes the buffer to the device. Returns \c false on failure. */
+	bool flush ();
+	
+	// 
+	QIODevice *device;
+	QString buffer;
+	bool failed = false;
+	
+};
+
+}
+}
+
+#endif // NURIA_TEMPLATE_SINK_HPP
@@ -0,0 +1,135 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "statistics.hpp"
+
+#include <QReadLocker>
+#include <QWriteLocker>
+
+Nuria::Template::Statistics::~Statistics () {
+	qDeleteAll (this->entries);
+}
+
+void Nuria::Template::Statistics::setEnabled (bool enabled) {
+	this->enabled.store (enabled);
+}
+
+template< typename Func >
+void Nuria::Template::Statistics::update (const QString &name, Func func) {
+	
+	// Counters are atomic, so updating them only needs the read lock.
+	QReadLocker readLocker (&this->lock);
+	Entry *e = this->entries.value (name);
+	if (e) {
+		func (e);
+		return;
+	}
+	
+	readLocker.unlock ();
+	
+	// First use of this template
+	QWriteLocker writeLocker (&this->lock);
+	Entry *&slot = this->entries[name];
+	if (!slot) {
+		slot = new Entry;
+	}
+	
+	func (slot);
+}
+
+void Nuria::Template::Statistics::add (const QString &name, Counter counter, quint64 value) {
+	if (!isEnabled () || name.isEmpty ()) {
+		return;
+	}
+	
+	update (name, [counter, value](Entry *e) {
+		e->counters[counter].fetchAndAddRelaxed (value);
+	});
+	
+}
+
+void Nuria::Template::Statistics::addInstructions (const QString &name, const quint64 *counts) {
+	if (!isEnabled () || name.isEmpty ()) {
+		return;
+	}
+	
+	update (name, [counts](Entry *e) {
+		for (int i = 0; i < Bytecode::ProfileSize; i++) {
+			if (counts[i] > 0) {
+				e->counters[Instructions + i].fetchAndAddRelaxed (counts[i]);
+			}
+			
+		}
+		
+	});
+	
+}
+
+QMap< QString, Nuria::TemplateStatistics > Nuria::Template::Statistics::snapshot () const {
+	QMap< QString, TemplateStatistics > result;
+	QReadLocker locker (&this->lock);
+	
+	for (auto it = this->entries.constBegin (); it != this->entries.constEnd (); ++it) {
+		const QAtomicInteger< quint64 > *counters = (*it)->counters;
+		TemplateStatistics stats;
+		
+		stats.cacheHits = counters[CacheHits].load ();
+		stats.cacheMisses = counters[CacheMisses].load ();
+		stats.cacheEvictions = counters[CacheEvictions].load ();
+		stats.stalenessChecks = counters[StalenessChecks].load ();
+		stats.tokenizeTime = counters[TokenizeTime].load ();
+		stats.parseTime = counters[ParseTime].load ();
+		stats.compileTime = counters[CompileTime].load ();
+		stats.renders = counters[Renders].load ();
+		stats.renderTime = counters[RenderTime].load ();
+		stats.outputSize = counters[OutputSize].load ();
+		
+		// Instruction breakdown
+		for (int i = Bytecode::EmitText; i < Bytecode::OpcodeCount; i++) {
+			quint64 count = counters[Instructions + i].load ();
+			if (count > 0) {
+				stats.nodes.insert (Bytecode::opcodeName (Bytecode::Opcode (i)), count);
+			}
+			
+		}
+		
+		// Nodes run through the AST by their class
+		for (int i = 0; i < Bytecode::NodeKindCount; i++) {
+			QString kind = Bytecode::nodeKindName (Bytecode::NodeKind (i));
+			quint64 rendered = counters[Instructions + Bytecode::RenderedNodes + i].load ();
+			quint64 evaluated = counters[Instructions + Bytecode::EvaluatedNodes + i].load ();
+			
+			if (rendered > 0) {
+				stats.nodes.insert (QStringLiteral("node:") + kind, rendered);
+			}
+			
+			if (evaluated > 0) {
+				stats.nodes.insert (QStringLiteral("value:") + kind, evaluated);
+			}
+			
+		}
+		
+		result.insert (it.key (), stats);
+	}
+	
+	return result;
+}
+
+void Nuria::Template::Statistics::reset () {
+	QWriteLocker locker (&this->lock);
+	qDeleteAll (this->entries);
+	this->entries.clear ();
+}
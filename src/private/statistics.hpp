@@ -0,0 +1,100 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NURIA_TEMPLATE_STATISTICS_HPP
+#define NURIA_TEMPLATE_STATISTICS_HPP
+
+#include "../nuria/templatestatistics.hpp"
+#include "bytecode.hpp"
+#include <QReadWriteLock>
+#include <QAtomicInteger>
+#include <QHash>
+
+namespace Nuria {
+namespace Template {
+
+/**
+ * \internal
+ * \brief Thread-safe per-template counters.
+ * 
+ * Counters are atomic integers, so concurrent updates of a template only
+ * share a read lock. Nothing is recorded while the statistics are disabled.
+ */
+class Statistics {
+public:
+	
+	enum Counter {
+		CacheHits = 0,
+		CacheMisses,
+		CacheEvictions,
+		StalenessChecks,
+		TokenizeTime,
+		ParseTime,
+		CompileTime,
+		Renders,
+		RenderTime,
+		OutputSize,
+		
+		// Executed instructions, laid out like the profile of
+		// Bytecode::execute()
+		Instructions,
+		CounterCount = Instructions + Bytecode::ProfileSize
+	};
+	
+	/** Destructor. */
+	~Statistics ();
+	
+	/** Returns \c true if counters are recorded. */
+	bool isEnabled () const
+	{ return this->enabled.load (); }
+	
+	/** Enables or disables recording. */
+	void setEnabled (bool enabled);
+	
+	/** Adds \a value to \a counter of template \a name, if it's not empty. */
+	void add (const QString &name, Counter counter, quint64 value = 1);
+	
+	/**
+	 * Adds \a counts, a profile of Bytecode::execute(), to template
+	 * \a name.
+	 */
+	void addInstructions (const QString &name, const quint64 *counts);
+	
+	/** Returns the current counters of all templates. */
+	QMap< QString, TemplateStatistics > snapshot () const;
+	
+	/** Resets all counters. */
+	void reset ();
+	
+private:
+	
+	struct Entry {
+		QAtomicInteger< quint64 > counters[CounterCount];
+	};
+	
+	template< typename Func >
+	void update (const QString &name, Func func);
+	
+	QAtomicInt enabled;
+	mutable QReadWriteLock lock;
+	QHash< QString, Entry * > entries;
+	
+};
+
+}
+}
+
+#endif // NURIA_TEMPLATE_STATISTICS_HPP
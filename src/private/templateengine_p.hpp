@@ -18,13 +18,26 @@
 #define NURIA_TEMPLATENGINE_PRIVATE_HPP
 
 #include "../nuria/templateerror.hpp"
+#include <nuria/tokenizer.hpp>
 #include <nuria/callback.hpp>
+#include "fragmentcache.hpp"
+#include "programcache.hpp"
+#include "statistics.hpp"
+#include "bundle.hpp"
 #include "astnodes.hpp"
+#include <QReadWriteLock>
+#include <QThreadStorage>
+#include <QSharedPointer>
+#include <QWaitCondition>
+#include <QAtomicInteger>
 #include <QSharedData>
 #include <QDateTime>
 #include <QVariant>
-#include <QVector>
 #include <QCache>
+#include <QHash>
+#include <QVector>
+#include <QMutex>
+#include <QSet>
 #include <memory>
 
 namespace Nuria {
@@ -53,25 +66,66 @@ struct Function {
 
 typedef QMap< QString, Function > FunctionMap;
 
+namespace Template {
+
+// Tokens of a loaded template
+struct ParsedTemplate {
+	QVector< Token > tokens;
+	QDateTime loadedAt;
+};
+
+}
+
 class TemplateEnginePrivate {
 public:
 	
 	TemplateEngine *q_ptr = nullptr;
 	
-	TemplateError lastError;
-	Template::Parser *parser;
-	Template::Tokenizer *tokenizer;
+	// Each thread sees its own last error
+	QThreadStorage< TemplateError > lastError;
+	
+	// Guards the loader and bundles. Programs are compiled while holding
+	// it for reading, so different templates are compiled in parallel.
+	QReadWriteLock compileLock;
 	Template::Compiler *renderer;
 	TemplateLoader *loader;
+	QVector< Template::Bundle * > bundles;
+	
+	// Names of templates currently being compiled. Threads missing one of
+	// these wait for compileDone instead of compiling it again.
+	QMutex flightLock;
+	QWaitCondition compileDone;
+	QSet< QString > compiling;
+	
+	// Epochs of the last change of each template and of the last flush.
+	// Programs are only cached if none of their dependencies changed since
+	// the epoch they were compiled or updated in. Written under flightLock.
+	QAtomicInteger< quint64 > epoch;
+	QHash< QString, quint64 > changedAt;
+	quint64 flushedAt = 0;
+	
+	// Tokens of loaded templates. Programs are rebuilt from these, so only
+	// changed templates are loaded and tokenized again. The least recently
+	// used ones are dropped first.
+	QMutex parsedLock;
+	QCache< QString, Template::ParsedTemplate > parsed;
+	
+	// Guards values, functions, variable types and locale
+	mutable QReadWriteLock stateLock;
 	QVariantMap values;
 	FunctionMap functions;
+	QHash< QString, int > variableTypes;
 	QLocale locale;
 	
 	// For tracking of variable changes between cached programs and the
 	// engine.
-	int versionId = 0;
+	QAtomicInt versionId;
 	
-	QCache< QString, TemplateProgram > cache;
+	// Shared with all programs of the engine, as these may outlive it.
+	QSharedPointer< Template::Statistics > statistics;
+	QSharedPointer< Template::FragmentCache > fragments;
+	QSharedPointer< Template::FragmentCache > memo;
+	Template::ProgramCache cache;
 	
 };
 
@@ -116,51 +170,141 @@ struct CompileInformation {
 	
 	
 	int conditionBranchDepth = 0;
+	int loopDepth = 0;
 	Template::BlockNode *currentParentBlock = nullptr;
 	
-	QMap< Template::Node *, int > trim;
+	QHash< Template::Node *, int > trim;
+	
+	// Types of variables declared by the user
+	QHash< QString, int > variableTypes;
+	
+};
+
+// State of a running for-loop
+struct LoopState {
+	int index;
+	int length;
+	bool hasLength;
+	LoopState *parent;
+};
+
+namespace Template {
+
+// State of a single render. The compiled program is read through program().
+struct ExecutionContext {
+	
+	mutable TemplateError error;
+	
+	// Currently active escape mode. Needed at runtime for escape().
+	EscapeMode escapeMode = EscapeMode::Verbatim;
+	bool spaceless = false;
+	
+	// Rendered bodies of the currently active filter blocks
+	QVector< QString > filterBodies;
+	
+	// The inner-most running for-loop
+	LoopState *currentLoop = nullptr;
+	
+	// Variable values, indexed by slot
+	QVector< QVariant > values;
+	
+	// The rendered program, or nullptr if this is the program itself
+	const TemplateProgramPrivate *compiled = nullptr;
+	
+	inline const TemplateProgramPrivate *program () const;
 	
 };
 
-class TemplateProgramPrivate : public QSharedData {
+}
+
+class TemplateProgramPrivate : public QSharedData, public Template::ExecutionContext {
 public:
 	
 	QExplicitlySharedDataPointer< Template::SharedNode > root;
-	mutable TemplateError error;
 	QDateTime compiledAt;
 	QLocale locale;
 	
 	// List of needed templates
 	QStringList dependencies;
 	
-	// Currently active escape mode. Needed at runtime for escape().
-	EscapeMode escapeMode = EscapeMode::Verbatim;
-	bool spaceless = false;
-	
 	QStringList variables;
-	QVector< QVariant > values;
+	QHash< QString, int > variableSlots;
 	FunctionMap functions;
 	int versionId = -1;
 	
+	// Set to false at compile-time if the output may differ for the same
+	// values, e.g. by calling random().
+	bool deterministic = true;
+	
+	// User-defined functions used by the program, resolved from 'functions'
+	QStringList functionNames;
+	QVector< Function > functionSlots;
+	
 	// Variable usage book-keeping
 	QVector< VariableUsageList > usages;
 	
 	// Only used during compilation
 	CompileInformation *info = nullptr;
 	
+	// Name of the template and where to record statistics to
+	QString name;
+	QSharedPointer< Template::Statistics > statistics;
+	
+	// Output of {% cache %} blocks and memoized renders, shared with the
+	// engine
+	QSharedPointer< Template::FragmentCache > fragments;
+	QSharedPointer< Template::FragmentCache > memo;
+	
+	// Returns the slot of variable 'name', or -1
+	int indexOfVariable (const QString &name) const {
+		return variableSlots.value (name, -1);
+	}
+	
 	// 
 	int addOrGetVariablePosition (const QString &name) {
-		int idx = variables.indexOf (name);
+		auto it = variableSlots.constFind (name);
+		if (it != variableSlots.constEnd ()) {
+			return *it;
+		}
+		
+		int idx = variables.length ();
+		variables.append (name);
+		variableSlots.insert (name, idx);
+		values.append (QVariant ());
+		this->usages.append (VariableUsageList ());
+		return idx;
+	}
+	
+	// Rebuilds 'variableSlots' after 'variables' has been replaced
+	void indexVariables () {
+		variableSlots.clear ();
+		variableSlots.reserve (variables.length ());
+		for (int i = 0; i < variables.length (); i++) {
+			variableSlots.insert (variables.at (i), i);
+		}
+		
+	}
+	
+	// 
+	int addOrGetFunctionPosition (const QString &name) {
+		int idx = functionNames.indexOf (name);
 		if (idx < 0) {
-			idx = variables.length ();
-			variables.append (name);
-			values.append (QVariant ());
-			this->usages.append (VariableUsageList ());
+			idx = functionNames.length ();
+			functionNames.append (name);
+			functionSlots.append (functions.value (name));
 		}
 		
 		return idx;
 	}
 	
+	// Resolves all function slots again after 'functions' has changed
+	void updateFunctionSlots () {
+		for (int i = 0; i < functionNames.length (); i++) {
+			functionSlots[i] = functions.value (functionNames.at (i));
+		}
+		
+	}
+	
 	// 
 	void addUsageRecord (int variableId, Template::Location location,
 	                     bool writeAccess = false, bool isConstant = false) {
@@ -192,6 +336,14 @@ public:
 	
 };
 
+inline const TemplateProgramPrivate *Template::ExecutionContext::program () const {
+	if (this->compiled) {
+		return this->compiled;
+	}
+	
+	return static_cast< const TemplateProgramPrivate * > (this);
+}
+
 }
 
 #endif // NURIA_TEMPLATENGINE_PRIVATE_HPP
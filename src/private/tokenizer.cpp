@@ -23,15 +23,12 @@
 // As generated by LEMON from grammar/twig.y
 #include "../grammar/twig.h"
 
-static const QString g_commandBlockRule = QStringLiteral("command");
-
 namespace Nuria {
 class Template::TokenizerPrivate {
 public:
 	
 	int position = 0;
 	QVector< Token > tokens;
-	Nuria::Tokenizer *tokenizer;
 	
 	// 
 	QByteArray commandBegin = QByteArrayLiteral("{%");
@@ -54,172 +51,105 @@ enum FindState {
 	FoundComment = 3
 };
 
-// Forward declarations
-static const char *findEndOfString (const char *from, Nuria::Template::Location &loc);
-static QByteArray parseStringLiteral (QByteArray literal);
+// Character classes of the expression lexer
+enum CharClass : quint8 {
+	InvalidChar = 0,
+	SpaceChar,
+	WordChar,
+	DigitChar,
+	QuoteChar,
+	OperatorChar
+};
 
-static bool tokenizeString (Nuria::Token &tok, Nuria::Tokenizer *tokenizer) {
-	QByteArray data = tokenizer->tokenizeData ();
-	const char *raw = data.constData ();
-	
-	// Find end of string
-	int pos = tokenizer->currentPosition () - 1;
-	Nuria::Template::Location loc (tokenizer->currentRow (), tokenizer->currentColumn ());
-	const char *end = findEndOfString (raw + pos, loc);
-	
-	// Update tokenizer position
-	int endPos = end - raw;
-	tokenizer->setPosition (endPos, loc.column - 1, loc.row);
+struct CharClassTable {
+	quint8 classes[256];
 	
-	// Sanity check for a string not ended
-	if (endPos > data.length ()) {
-		return false;
+	CharClassTable () {
+		::memset (classes, InvalidChar, sizeof(classes));
+		
+		for (int i = 'a'; i <= 'z'; i++) classes[i] = WordChar;
+		for (int i = 'A'; i <= 'Z'; i++) classes[i] = WordChar;
+		for (int i = '0'; i <= '9'; i++) classes[i] = DigitChar;
+		for (const char *c = " \t\n\v\f\r"; *c; c++) classes[quint8 (*c)] = SpaceChar;
+		for (const char *c = "=!<>&|+-*/%~,:.()[]{}?"; *c; c++) classes[quint8 (*c)] = OperatorChar;
+		
+		classes[quint8 ('_')] = WordChar;
+		classes[quint8 ('"')] = QuoteChar;
+		classes[quint8 ('\'')] = QuoteChar;
 	}
 	
-	// 
-	QByteArray literal = parseStringLiteral (QByteArray::fromRawData (raw + pos, endPos - pos));
-	tok.value = QString::fromUtf8 (literal);
-	return true;
-}
-
-static bool convertNumber (Nuria::Token &tok, Nuria::Tokenizer *) {
-	QByteArray v = tok.value.toByteArray ();
+	inline CharClass operator[] (char c) const
+	{ return CharClass (classes[quint8 (c)]); }
 	
-	bool ok = false;
-	if (v.contains ('.') || v.contains ('e')) {
-		tok.value = v.toDouble (&ok);
-	} else {
-		tok.value = v.toInt (&ok);
-		tok.tokenId = TOK_INTEGER;
-	}
+	inline bool isWordChar (char c) const
+	{ return classes[quint8 (c)] == WordChar || classes[quint8 (c)] == DigitChar; }
 	
-	return ok;
-}
+};
 
-static bool convertBool (Nuria::Token &tok, Nuria::Tokenizer *) {
-	tok.value = (tok.tokenId == TOK_TRUE);
-	return true;
-}
+static const CharClassTable g_charClass;
 
-static void addConversionHandlers (Nuria::TokenizerRules &rules) {
-	rules.setTokenAction (TOK_NUMBER, convertNumber);
-	rules.setTokenAction (TOK_STRING, tokenizeString);
-	rules.setTokenAction (TOK_TRUE, convertBool);
-	rules.setTokenAction (TOK_FALSE, convertBool);
-	
-}
+struct Keyword {
+	const char *name;
+	int length;
+	int token;
+};
 
-static Nuria::TokenizerRules basicTokenizerRules () {
-	Nuria::TokenizerRules rules;
-	addConversionHandlers (rules);
-	
-	// For inline-if in for loops
-	rules.addRegexToken (TOK_IF_BEGIN, QByteArrayLiteral("if\\b"));
-	
-	rules.addRegexToken (TOK_STARTS, QByteArrayLiteral("starts\\b"));
-	rules.addRegexToken (TOK_ENDS, QByteArrayLiteral("ends\\b"));
-	rules.addRegexToken (TOK_WITH, QByteArrayLiteral("with\\b"));
-	rules.addRegexToken (TOK_MATCHES, QByteArrayLiteral("matches\\b"));
-	rules.addRegexToken (TOK_DEFINED, QByteArrayLiteral("defined\\b"));
-	rules.addRegexToken (TOK_NULL, QByteArrayLiteral("null\\b"));
-	rules.addRegexToken (TOK_DIVISIBLE, QByteArrayLiteral("divisible\\b"));
-	rules.addRegexToken (TOK_ITERABLE, QByteArrayLiteral("iterable\\b"));
-	rules.addRegexToken (TOK_EVEN, QByteArrayLiteral("even\\b"));
-	rules.addRegexToken (TOK_ODD, QByteArrayLiteral("odd\\b"));
-	rules.addRegexToken (TOK_EMPTY, QByteArrayLiteral("empty\\b"));
-	rules.addRegexToken (TOK_IS, QByteArrayLiteral("is\\b"));
-	rules.addRegexToken (TOK_BY, QByteArrayLiteral("by\\b"));
-	
-	rules.addRegexToken (TOK_AND, QByteArrayLiteral("and\\b"));
-	rules.addRegexToken (TOK_OR, QByteArrayLiteral("or\\b"));
-	rules.addRegexToken (TOK_IN, QByteArrayLiteral("in\\b"));
-	rules.addRegexToken (TOK_NOT, QByteArrayLiteral("not\\b"));
-	
-	// Types
-	rules.addRegexToken (TOK_NUMBER, QByteArrayLiteral("[0-9]+(?:\\.[0-9]*)?(?:e[0-9]+)?"));
-	rules.addRegexToken (TOK_STRING, QByteArrayLiteral("[\"']")); // Strings are handled in the token handler
-	rules.addRegexToken (TOK_TRUE, QByteArrayLiteral("true\\b"));
-	rules.addRegexToken (TOK_FALSE, QByteArrayLiteral("false\\b"));
-	rules.addRegexToken (TOK_SYMBOL, QByteArrayLiteral("[a-zA-Z_][a-zA-Z0-9_]*"));
-	
-	// String tokens
-	rules.addStringToken (TOK_EQUALS, QByteArrayLiteral("=="));
-	rules.addStringToken (TOK_NOT_EQUALS, QByteArrayLiteral("!="));
-	rules.addStringToken (TOK_NOT, QByteArrayLiteral("!"));
-	rules.addStringToken (TOK_LESS_EQUAL, QByteArrayLiteral("<="));
-	rules.addStringToken (TOK_LESS, QByteArrayLiteral("<"));
-	rules.addStringToken (TOK_GREATER_EQUAL, QByteArrayLiteral(">="));
-	rules.addStringToken (TOK_GREATER, QByteArrayLiteral(">"));
-	rules.addStringToken (TOK_AND, QByteArrayLiteral("&&"));
-	rules.addStringToken (TOK_OR, QByteArrayLiteral("||"));
-	
-	rules.addStringToken (TOK_ASSIGN, QByteArrayLiteral("="));
-	
-	rules.addStringToken (TOK_PLUS, QByteArrayLiteral("+"));
-	rules.addStringToken (TOK_MINUS, QByteArrayLiteral("-"));
-	rules.addStringToken (TOK_POWER, QByteArrayLiteral("**"));
-	rules.addStringToken (TOK_MULTIPLY, QByteArrayLiteral("*"));
-	rules.addStringToken (TOK_ROUND, QByteArrayLiteral("//"));
-	rules.addStringToken (TOK_DIVIDE, QByteArrayLiteral("/"));
-	rules.addStringToken (TOK_MODULO, QByteArrayLiteral("%"));
-	rules.addStringToken (TOK_CONCAT, QByteArrayLiteral("~"));
-	
-	rules.addStringToken (TOK_COMMA, QByteArrayLiteral(","));
-	rules.addStringToken (TOK_COLON, QByteArrayLiteral(":"));
-	rules.addStringToken (TOK_PERIOD_PERIOD, QByteArrayLiteral(".."));
-	rules.addStringToken (TOK_PERIOD, QByteArrayLiteral("."));
-	rules.addStringToken (TOK_PIPE, QByteArrayLiteral("|"));
-	
-	rules.addStringToken (TOK_PAREN_OPEN, QByteArrayLiteral("("));
-	rules.addStringToken (TOK_PAREN_CLOSE, QByteArrayLiteral(")"));
-	rules.addStringToken (TOK_ARRAY_BEGIN, QByteArrayLiteral("["));
-	rules.addStringToken (TOK_ARRAY_END, QByteArrayLiteral("]"));
-	rules.addStringToken (TOK_OBJECT_BEGIN, QByteArrayLiteral("{"));
-	rules.addStringToken (TOK_OBJECT_END, QByteArrayLiteral("}"));
-	rules.addStringToken (TOK_QUESTION_COLON, QByteArrayLiteral("?:"));
-	rules.addStringToken (TOK_QUESTION, QByteArrayLiteral("?"));
-	
-	return rules;
-}
+#define KEYWORD(Name, Token) { Name, sizeof(Name) - 1, Token }
+
+// Words which are not symbols. Matched as whole word only.
+static const Keyword g_keywords[] = {
+	KEYWORD("if", TOK_IF_BEGIN), // For inline-if in for loops
+	KEYWORD("starts", TOK_STARTS),
+	KEYWORD("ends", TOK_ENDS),
+	KEYWORD("with", TOK_WITH),
+	KEYWORD("matches", TOK_MATCHES),
+	KEYWORD("defined", TOK_DEFINED),
+	KEYWORD("null", TOK_NULL),
+	KEYWORD("divisible", TOK_DIVISIBLE),
+	KEYWORD("iterable", TOK_ITERABLE),
+	KEYWORD("even", TOK_EVEN),
+	KEYWORD("odd", TOK_ODD),
+	KEYWORD("empty", TOK_EMPTY),
+	KEYWORD("is", TOK_IS),
+	KEYWORD("by", TOK_BY),
+	KEYWORD("and", TOK_AND),
+	KEYWORD("or", TOK_OR),
+	KEYWORD("in", TOK_IN),
+	KEYWORD("not", TOK_NOT),
+	KEYWORD("true", TOK_TRUE),
+	KEYWORD("false", TOK_FALSE)
+};
 
-static Nuria::TokenizerRules commandPrefixRules () {
-	Nuria::TokenizerRules rules;
-	
-	rules.addStringToken (TOK_SET, QByteArrayLiteral("set"));
-	rules.addStringToken (TOK_EXTENDS, QByteArrayLiteral("extends"));
-	rules.addStringToken (TOK_INCLUDE, QByteArrayLiteral("include"));
-	rules.addStringToken (TOK_EMBED_BEGIN, QByteArrayLiteral("embed"));
-	rules.addStringToken (TOK_EMBED_END, QByteArrayLiteral("endembed"));
-	rules.addStringToken (TOK_FILTER_BEGIN, QByteArrayLiteral("filter"));
-	rules.addStringToken (TOK_FILTER_END, QByteArrayLiteral("endfilter"));
-	rules.addStringToken (TOK_SPACELESS_BEGIN, QByteArrayLiteral("spaceless"));
-	rules.addStringToken (TOK_SPACELESS_END, QByteArrayLiteral("endspaceless"));
-	rules.addStringToken (TOK_AUTOESCAPE_BEGIN, QByteArrayLiteral("autoescape"));
-	rules.addStringToken (TOK_AUTOESCAPE_END, QByteArrayLiteral("endautoescape"));
-	rules.addStringToken (TOK_BLOCK_BEGIN, QByteArrayLiteral("block"));
-	rules.addStringToken (TOK_BLOCK_END, QByteArrayLiteral("endblock"));
-	rules.addStringToken (TOK_FOR_BEGIN, QByteArrayLiteral("for"));
-	rules.addStringToken (TOK_FOR_END, QByteArrayLiteral("endfor"));
-	rules.addStringToken (TOK_IF_BEGIN, QByteArrayLiteral("if"));
-	rules.addStringToken (TOK_IF_END, QByteArrayLiteral("endif"));
-	rules.addStringToken (TOK_ELSE, QByteArrayLiteral("else"));
-	
-	return rules;
-}
+// The first token of a command. Matched as prefix.
+static const Keyword g_commandPrefixes[] = {
+	KEYWORD("set", TOK_SET),
+	KEYWORD("extends", TOK_EXTENDS),
+	KEYWORD("include", TOK_INCLUDE),
+	KEYWORD("embed", TOK_EMBED_BEGIN),
+	KEYWORD("endembed", TOK_EMBED_END),
+	KEYWORD("filter", TOK_FILTER_BEGIN),
+	KEYWORD("endfilter", TOK_FILTER_END),
+	KEYWORD("spaceless", TOK_SPACELESS_BEGIN),
+	KEYWORD("endspaceless", TOK_SPACELESS_END),
+	KEYWORD("autoescape", TOK_AUTOESCAPE_BEGIN),
+	KEYWORD("endautoescape", TOK_AUTOESCAPE_END),
+	KEYWORD("cache", TOK_CACHE_BEGIN),
+	KEYWORD("endcache", TOK_CACHE_END),
+	KEYWORD("block", TOK_BLOCK_BEGIN),
+	KEYWORD("endblock", TOK_BLOCK_END),
+	KEYWORD("for", TOK_FOR_BEGIN),
+	KEYWORD("endfor", TOK_FOR_END),
+	KEYWORD("if", TOK_IF_BEGIN),
+	KEYWORD("endif", TOK_IF_END),
+	KEYWORD("else", TOK_ELSE)
+};
 
-static void setUpTokenizer (Nuria::Tokenizer *tokenizer) {
-	tokenizer->setDefaultTokenizerRules (basicTokenizerRules ());
-	tokenizer->addTokenizerRules (g_commandBlockRule, commandPrefixRules ());
-	
-}
+#undef KEYWORD
 
 Nuria::Template::Tokenizer::Tokenizer (QObject *parent)
         : QObject (parent), d_ptr (new Template::TokenizerPrivate)
 {
 	
-	this->d_ptr->tokenizer = new Nuria::Tokenizer (this);
-	setUpTokenizer (this->d_ptr->tokenizer);
-	
 }
 
 Nuria::Template::Tokenizer::~Tokenizer () {
@@ -445,6 +375,193 @@ static QByteArray parseStringLiteral (QByteArray literal) {
 	return literal;
 }
 
+
+template< size_t N >
+static int findKeyword (const Keyword (&table)[N], const char *word, int length, bool prefix) {
+	for (const Keyword &cur : table) {
+		if ((prefix) ? cur.length <= length : cur.length == length) {
+			if (!::memcmp (cur.name, word, cur.length)) {
+				return int (&cur - table);
+			}
+			
+		}
+		
+	}
+	
+	return -1;
+}
+
+// Returns the operator token at \a cur, or -1. Sets \a length accordingly.
+static int lexOperator (const char *cur, const char *end, int &length) {
+	char next = (cur + 1 < end) ? cur[1] : '\0';
+	length = 1;
+	
+	switch (*cur) {
+	case '=': if (next == '=') { length = 2; return TOK_EQUALS; } return TOK_ASSIGN;
+	case '!': if (next == '=') { length = 2; return TOK_NOT_EQUALS; } return TOK_NOT;
+	case '<': if (next == '=') { length = 2; return TOK_LESS_EQUAL; } return TOK_LESS;
+	case '>': if (next == '=') { length = 2; return TOK_GREATER_EQUAL; } return TOK_GREATER;
+	case '&': if (next == '&') { length = 2; return TOK_AND; } return -1;
+	case '|': if (next == '|') { length = 2; return TOK_OR; } return TOK_PIPE;
+	case '*': if (next == '*') { length = 2; return TOK_POWER; } return TOK_MULTIPLY;
+	case '/': if (next == '/') { length = 2; return TOK_ROUND; } return TOK_DIVIDE;
+	case '.': if (next == '.') { length = 2; return TOK_PERIOD_PERIOD; } return TOK_PERIOD;
+	case '?': if (next == ':') { length = 2; return TOK_QUESTION_COLON; } return TOK_QUESTION;
+	case '+': return TOK_PLUS;
+	case '-': return TOK_MINUS;
+	case '%': return TOK_MODULO;
+	case '~': return TOK_CONCAT;
+	case ',': return TOK_COMMA;
+	case ':': return TOK_COLON;
+	case '(': return TOK_PAREN_OPEN;
+	case ')': return TOK_PAREN_CLOSE;
+	case '[': return TOK_ARRAY_BEGIN;
+	case ']': return TOK_ARRAY_END;
+	case '{': return TOK_OBJECT_BEGIN;
+	case '}': return TOK_OBJECT_END;
+	}
+	
+	return -1;
+}
+
+// Matches [0-9]+(\.[0-9]*)?(e[0-9]+)?
+static const char *findEndOfNumber (const char *cur, const char *end, bool &isInteger) {
+	isInteger = true;
+	while (cur < end && g_charClass[*cur] == DigitChar) cur++;
+	
+	if (cur < end && *cur == '.') {
+		isInteger = false;
+		for (cur++; cur < end && g_charClass[*cur] == DigitChar; cur++);
+	}
+	
+	if (cur + 1 < end && *cur == 'e' && g_charClass[cur[1]] == DigitChar) {
+		isInteger = false;
+		for (cur += 2; cur < end && g_charClass[*cur] == DigitChar; cur++);
+	}
+	
+	return cur;
+}
+
+/**
+ * Tokenizes the expression code from \a cur to \a end into \a tokens. Token
+ * locations are relative to \a base. If \a command is \c true, the first token
+ * is a command name. \a loc is advanced by the consumed code. Returns
+ * \c false if an unknown or malformed token was encountered.
+ */
+static bool lexExpression (const char *cur, const char *end, bool command,
+                           const Nuria::Template::Location &base,
+                           Nuria::Template::Location &loc, QVector< Nuria::Token > &tokens) {
+	int commandToken = -1;
+	
+	while (cur < end) {
+		const char *begin = cur;
+		QVariant value;
+		int token = -1;
+		
+		switch (g_charClass[*cur]) {
+		case SpaceChar:
+			advanceLocation (loc, *cur);
+			cur++;
+			continue;
+		case InvalidChar:
+			return false;
+		default:
+			break;
+		}
+		
+		// 
+		if (command) {
+			int idx = findKeyword (g_commandPrefixes, cur, end - cur, true);
+			if (idx < 0) {
+				return false;
+			}
+			
+			token = g_commandPrefixes[idx].token;
+			cur += g_commandPrefixes[idx].length;
+			value = QByteArray (begin, cur - begin);
+			commandToken = token;
+			command = false;
+		} else {
+			switch (g_charClass[*cur]) {
+			case WordChar: {
+				for (cur++; cur < end && g_charClass.isWordChar (*cur); cur++);
+				int idx = findKeyword (g_keywords, begin, cur - begin, false);
+				token = (idx < 0) ? TOK_SYMBOL : g_keywords[idx].token;
+				
+				// 'ttl' is only a keyword in cache commands
+				if (token == TOK_SYMBOL && commandToken == TOK_CACHE_BEGIN &&
+				    cur - begin == 3 && !::memcmp (begin, "ttl", 3)) {
+					token = TOK_TTL;
+				}
+				
+				if (token == TOK_TRUE || token == TOK_FALSE) {
+					value = (token == TOK_TRUE);
+				} else {
+					value = QByteArray (begin, cur - begin);
+				}
+				
+			} break;
+			case DigitChar: {
+				bool isInteger = false;
+				bool ok = false;
+				cur = findEndOfNumber (cur, end, isInteger);
+				
+				QByteArray number = QByteArray::fromRawData (begin, cur - begin);
+				if (isInteger) {
+					token = TOK_INTEGER;
+					value = number.toInt (&ok);
+				} else {
+					token = TOK_NUMBER;
+					value = number.toDouble (&ok);
+				}
+				
+				if (!ok) {
+					return false;
+				}
+				
+			} break;
+			case QuoteChar: {
+				for (cur++; cur < end && *cur != *begin; cur++) {
+					if (*cur == '\\' && cur + 1 < end) {
+						cur++;
+					}
+					
+				}
+				
+				// String not ended?
+				if (cur >= end) {
+					return false;
+				}
+				
+				cur++;
+				token = TOK_STRING;
+				value = QString::fromUtf8 (parseStringLiteral (QByteArray (begin, cur - begin)));
+			} break;
+			default: {
+				int length = 0;
+				token = lexOperator (cur, end, length);
+				if (token < 0) {
+					return false;
+				}
+				
+				cur += length;
+				value = QByteArray (begin, length);
+			} break;
+			}
+			
+		}
+		
+		// 
+		tokens.append (Nuria::Token (token, base.row + loc.row, base.column + loc.column, value));
+		for (; begin < cur; begin++) {
+			advanceLocation (loc, *begin);
+		}
+		
+	}
+	
+	return true;
+}
+
 bool Nuria::Template::Tokenizer::hasTrimTokenStart (const QByteArray &code) {
 	if (!code.isEmpty () && code.at (0) == '-') {
 		return true;
@@ -461,57 +578,34 @@ bool Nuria::Template::Tokenizer::hasTrimTokenEnd (const QByteArray &code) {
 	return false;
 }
 
-bool Nuria::Template::Tokenizer::tokenizeAndPush (QByteArray code, Location &loc, bool switchToDefault) {
+bool Nuria::Template::Tokenizer::tokenizeAndPush (const QByteArray &code, Location &loc, bool command) {
 	if (code.isEmpty ()) {
 		return true;
 	}
 	
 	// Trimmer
+	const char *begin = code.constData ();
+	const char *end = begin + code.length ();
 	Location base = loc;
 	bool pushEndTrimmer = hasTrimTokenEnd (code);
 	
 	if (pushEndTrimmer) {
-		code.chop (1);
+		end--;
 	}
 	
-	if (hasTrimTokenStart (code)) {
+	if (begin < end && hasTrimTokenStart (code)) {
 		base.column++;
-		code = code.mid (1);
+		begin++;
 		this->d_ptr->tokens.append (Token (TOK_TRIM, base.row, base.column));
 	}
 	
-	// 
-	this->d_ptr->tokenizer->tokenize (code);
-	
 	// Read 'code'
-	while (!this->d_ptr->tokenizer->atEnd ()) {
-		
-		// Tokenize and error check
-		Token tok = this->d_ptr->tokenizer->nextToken ();
-		if (this->d_ptr->tokenizer->hasError ()) {
-			break;
-		}
-		
-		// Success. Calculate location
-		tok.column += base.column;
-		tok.row += base.row;
-		
-		// Store if this token is not ignored
-		if (tok.tokenId >= 0) {
-			this->d_ptr->tokens.append (tok);
-		}
-		
-		// Switch back to default rule-set
-		if (switchToDefault) {
-			switchToDefault = false;
-			this->d_ptr->tokenizer->setCurrentTokenizerRules (QString ());
-		}
-		
-	}
+	Location consumed;
+	bool success = lexExpression (begin, end, command, base, consumed, this->d_ptr->tokens);
 	
 	// Adjust location
-	loc.column += this->d_ptr->tokenizer->currentColumn ();
-	loc.row += this->d_ptr->tokenizer->currentRow ();
+	loc.column += consumed.column;
+	loc.row += consumed.row;
 	
 	// Push trimmer?
 	if (pushEndTrimmer) {
@@ -520,7 +614,7 @@ bool Nuria::Template::Tokenizer::tokenizeAndPush (QByteArray code, Location &loc
 	}
 	
 	// Done.
-	return !this->d_ptr->tokenizer->hasError ();
+	return success;
 }
 
 void Nuria::Template::Tokenizer::pushTextToken (Token token, int previousTokId) {
@@ -582,7 +676,6 @@ bool Nuria::Template::Tokenizer::tokenizeExpansionsAndCommands () {
 			break;
 		case FoundCommand:
 			removeTrailingEmptyLineInLastTextToken ();
-			this->d_ptr->tokenizer->setCurrentTokenizerRules (g_commandBlockRule);
 			
 			this->d_ptr->tokens.append (Token (TOK_COMMAND_BEGIN, loc.row, loc.column));
 			loc.column += this->d_ptr->commandBegin.length ();
@@ -62,7 +62,7 @@ public:
 private:
 	
 	void pushTextToken (Token token, int previousTokId);
-	bool tokenizeAndPush (QByteArray code, Location &loc, bool switchToDefault);
+	bool tokenizeAndPush (const QByteArray &code, Location &loc, bool command);
 	bool hasTrimTokenStart (const QByteArray &code);
 	bool hasTrimTokenEnd (const QByteArray &code);
 	void parseFirstStage (const QByteArray &data);
@@ -0,0 +1,176 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "value.hpp"
+
+#include "astnodes.hpp"
+#include <new>
+
+Nuria::Template::Value::Value (QVariant value) : type (Null) {
+	if (!value.isNull ()) {
+		switch (value.userType ()) {
+		case QMetaType::Bool: this->type = Bool; this->data.b = value.toBool (); return;
+		case QMetaType::Int: this->type = Int; this->data.i = value.toInt (); return;
+		case QMetaType::Double: this->type = Double; this->data.d = value.toDouble (); return;
+		}
+		
+	} else if (!value.isValid ()) {
+		return;
+	}
+	
+	new (&this->data.owned) QVariant (std::move (value));
+	this->type = Owned;
+}
+
+Nuria::Template::Value Nuria::Template::Value::view (const QVariant &value) {
+	if (!value.isNull ()) {
+		switch (value.userType ()) {
+		case QMetaType::Bool: return Value (value.toBool ());
+		case QMetaType::Int: return Value (value.toInt ());
+		case QMetaType::Double: return Value (value.toDouble ());
+		}
+		
+	} else if (!value.isValid ()) {
+		return Value ();
+	}
+	
+	Value result;
+	result.type = Borrowed;
+	result.data.ref = &value;
+	return result;
+}
+
+Nuria::Template::Value &Nuria::Template::Value::operator= (const Value &other) {
+	if (this != &other) {
+		clear ();
+		assign (other);
+	}
+	
+	return *this;
+}
+
+Nuria::Template::Value &Nuria::Template::Value::operator= (Value &&other) {
+	if (this != &other) {
+		clear ();
+		take (other);
+	}
+	
+	return *this;
+}
+
+void Nuria::Template::Value::assign (const Value &other) {
+	switch (other.type) {
+	case Null: break;
+	case Bool: this->data.b = other.data.b; break;
+	case Int: this->data.i = other.data.i; break;
+	case Double: this->data.d = other.data.d; break;
+	case Borrowed: this->data.ref = other.data.ref; break;
+	case Owned: new (&this->data.owned) QVariant (other.data.owned); break;
+	}
+	
+	this->type = other.type;
+}
+
+void Nuria::Template::Value::take (Value &other) {
+	if (other.type != Owned) {
+		assign (other);
+		return;
+	}
+	
+	new (&this->data.owned) QVariant (std::move (other.data.owned));
+	this->type = Owned;
+	other.clear ();
+}
+
+void Nuria::Template::Value::clear () {
+	if (this->type == Owned) {
+		this->data.owned.~QVariant ();
+	}
+	
+	this->type = Null;
+}
+
+int Nuria::Template::Value::userType () const {
+	switch (this->type) {
+	case Null: return QMetaType::UnknownType;
+	case Bool: return QMetaType::Bool;
+	case Int: return QMetaType::Int;
+	case Double: return QMetaType::Double;
+	case Borrowed:
+	case Owned: break;
+	}
+	
+	return variant ().userType ();
+}
+
+double Nuria::Template::Value::toDouble () const {
+	switch (this->type) {
+	case Null: return 0;
+	case Bool: return this->data.b;
+	case Int: return this->data.i;
+	case Double: return this->data.d;
+	case Borrowed:
+	case Owned: break;
+	}
+	
+	return variant ().toDouble ();
+}
+
+bool Nuria::Template::Value::isTrue () const {
+	switch (this->type) {
+	case Null: return false;
+	case Bool: return this->data.b;
+	case Int:
+	case Double: return true;
+	case Borrowed:
+	case Owned: break;
+	}
+	
+	return isValueTrue (variant ());
+}
+
+const QString *Nuria::Template::Value::string () const {
+	if ((this->type != Borrowed && this->type != Owned) || variant ().userType () != QMetaType::QString) {
+		return nullptr;
+	}
+	
+	return static_cast< const QString * > (variant ().constData ());
+}
+
+QString Nuria::Template::Value::toString () const {
+	if (const QString *str = string ()) {
+		return *str;
+	}
+	
+	// 
+	QVariant v = toVariant ();
+	v.convert (QMetaType::QString);
+	return v.toString ();
+}
+
+QVariant Nuria::Template::Value::toVariant () const {
+	switch (this->type) {
+	case Null: return QVariant ();
+	case Bool: return this->data.b;
+	case Int: return this->data.i;
+	case Double: return this->data.d;
+	case Borrowed:
+	case Owned: break;
+	}
+	
+	return variant ();
+}
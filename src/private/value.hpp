@@ -0,0 +1,138 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef NURIA_TEMPLATE_VALUE_HPP
+#define NURIA_TEMPLATE_VALUE_HPP
+
+#include <QVariant>
+#include <QString>
+
+namespace Nuria {
+namespace Template {
+
+/**
+ * \internal
+ * \brief Compact value passed between nodes while evaluating.
+ * 
+ * Booleans and numbers are stored inline. Other values either refer to an
+ * existing QVariant, like a literal or the slot of a variable, or are owned
+ * by the instance. All of these share the same storage. This avoids copying
+ * QVariants, and with it allocations and reference counting, for
+ * intermediate results. A QVariant is only created when the value is passed
+ * to a function or stored.
+ */
+class Value {
+public:
+	
+	enum Kind : quint8 {
+		Null = 0,
+		Bool,
+		Int,
+		Double,
+		
+		/** Refers to a QVariant owned by someone else */
+		Borrowed,
+		
+		/** Owns a QVariant */
+		Owned
+	};
+	
+	/** Constructs a null value. */
+	Value () : type (Null) { }
+	
+	Value (const Value &other) : type (Null) { assign (other); }
+	Value (Value &&other) : type (Null) { take (other); }
+	~Value () { clear (); }
+	
+	Value &operator= (const Value &other);
+	Value &operator= (Value &&other);
+	
+	explicit Value (bool value) : type (Bool) { data.b = value; }
+	explicit Value (int value) : type (Int) { data.i = value; }
+	explicit Value (double value) : type (Double) { data.d = value; }
+	
+	/** Takes \a value, storing booleans and numbers inline. */
+	explicit Value (QVariant value);
+	
+	/**
+	 * Returns a value referring to \a value, which must outlive it.
+	 * Booleans and numbers are copied.
+	 */
+	static Value view (const QVariant &value);
+	
+	/** Returns the kind of storage. */
+	Kind kind () const
+	{ return this->type; }
+	
+	/** Returns the QMetaType of the value. */
+	int userType () const;
+	
+	/** Returns \c true if this is an inline int or double. */
+	bool isNumber () const
+	{ return (this->type == Int || this->type == Double); }
+	
+	/** Returns the inline int. Only valid if kind() is Int. */
+	int intValue () const
+	{ return this->data.i; }
+	
+	/** Returns the value as double. */
+	double toDouble () const;
+	
+	/**
+	 * Returns \c true if the value is considered true in a condition. Like
+	 * isValueTrue(), all numbers are true, including \c 0.
+	 */
+	bool isTrue () const;
+	
+	/** Returns the stored string without copying it, or \c nullptr. */
+	const QString *string () const;
+	
+	/** Returns the value converted to a QString. */
+	QString toString () const;
+	
+	/** Returns the value as QVariant. */
+	QVariant toVariant () const;
+	
+private:
+	
+	// Returns the QVariant of a Borrowed or Owned value
+	const QVariant &variant () const
+	{ return (this->type == Borrowed) ? *this->data.ref : this->data.owned; }
+	
+	void assign (const Value &other);
+	void take (Value &other);
+	void clear ();
+	
+	union Data {
+		Data () { }
+		~Data () { }
+		
+		bool b;
+		int i;
+		double d;
+		const QVariant *ref;
+		QVariant owned;
+	} data;
+	
+	Kind type;
+	
+};
+
+}
+}
+
+#endif // NURIA_TEMPLATE_VALUE_HPP
@@ -20,6 +20,8 @@
 #include <QSequentialIterable>
 #include <nuria/metaobject.hpp>
 #include <QMetaProperty>
+#include <QReadWriteLock>
+#include <QHash>
 
 static Nuria::MetaObject *metaObjectForType (const QByteArray &typeName) {
 	Nuria::MetaObject *meta = Nuria::MetaObject::byName (typeName);
@@ -30,167 +32,266 @@ static Nuria::MetaObject *metaObjectForType (const QByteArray &typeName) {
 	return meta;
 }
 
-bool Nuria::Template::VariableAcessor::walkChain (QVariant &cur, const QVariantList &chain, int index) {
-	
-	if (index >= chain.length ()) {
-		return true;
-	}
+// Looking up meta objects by type name is slow, so found ones are cached by
+// type id. Misses are not cached, as meta objects may be registered later.
+static Nuria::MetaObject *metaObjectForType (int type) {
+	static QReadWriteLock lock;
+	static QHash< int, Nuria::MetaObject * > cache;
 	
-	// 
-	int type = cur.userType ();
-	
-	// List access
-	if (type == QMetaType::QVariantList) {
-		return walkList (cur, chain, index);
-	}
+	QReadLocker readLocker (&lock);
+	Nuria::MetaObject *meta = cache.value (type);
+	readLocker.unlock ();
 	
-	if (cur.canConvert< QVariantList > ()) {
-		return walkListType (cur, chain, index);
+	if (!meta) {
+		meta = metaObjectForType (QByteArray (QMetaType::typeName (type)));
+		if (meta) {
+			QWriteLocker writeLocker (&lock);
+			cache.insert (type, meta);
+		}
+		
 	}
 	
-	// Map access
-	if (type == QMetaType::QVariantMap) {
-		return walkMap (cur, chain, index);
+	return meta;
+}
+
+// Replaces 'cur' with 'next'. 'next' may point into the data of 'cur'.
+static inline bool advance (QVariant &cur, const QVariant &next) {
+	QVariant copy (next);
+	cur.swap (copy);
+	return true;
+}
+
+static inline QObject *qobjectOf (const QVariant &cur) {
+	return *static_cast< QObject *const * > (cur.constData ());
+}
+
+Nuria::Template::VariableAcessor::InlineCache::~InlineCache () {
+	for (const QAtomicPointer< const Access > &cur : this->entries) {
+		delete cur.load ();
 	}
 	
-	if (cur.canConvert< QVariantMap > ()) {
-		return walkMapType (cur, chain, index);
+}
+
+const Nuria::Template::VariableAcessor::Access *
+Nuria::Template::VariableAcessor::InlineCache::find (int type, const QVariant &cur) const {
+	for (const QAtomicPointer< const Access > &entry : this->entries) {
+		const Access *access = entry.loadAcquire ();
+		if (!access) {
+			return nullptr;
+		}
+		
+		if (access->type != type) {
+			continue;
+		}
+		
+		// The property index depends on the actual class of the object
+		if (access->kind == Access::QObjectProperty) {
+			QObject *object = qobjectOf (cur);
+			if (!object || object->metaObject () != access->qobjectMeta) {
+				continue;
+			}
+			
+		}
+		
+		return access;
 	}
 	
-	if (type == QMetaType::QVariantMap) {
-		return walkMap (cur, chain, index);
+	return nullptr;
+}
+
+void Nuria::Template::VariableAcessor::InlineCache::insert (const Access &access) {
+	Access *copy = new Access (access);
+	for (QAtomicPointer< const Access > &entry : this->entries) {
+		if (entry.testAndSetOrdered (nullptr, copy)) {
+			return;
+		}
+		
 	}
 	
-	// MetaObject type
-	MetaObject *meta = metaObjectForType (QMetaType::typeName (type));
-	if (meta) {
-		return walkMetaObject (meta, cur, chain, index);
+	// Megamorphic access site.
+	delete copy;
+}
+
+Nuria::Template::VariableAcessor::Key::Key (const QVariant &key, bool withCache)
+	: value (key), string (key.toString ()), name (string.toLatin1 ())
+{
+	bool ok = false;
+	int at = key.toInt (&ok);
+	if (ok && at >= 0) {
+		this->index = at;
 	}
 	
-	// QObject
-	if (QMetaType::typeFlags (type) & QMetaType::PointerToQObject) {
-		return walkQObject (cur, chain, index);
+	if (withCache) {
+		this->cache = QSharedPointer< InlineCache >::create ();
 	}
 	
-	// Unknown
-	return false;
 }
 
-bool Nuria::Template::VariableAcessor::walkList (QVariant &cur, const QVariantList &chain, int index) {
-	const QVariant &name = chain.at (index);
-	QVariantList list = cur.toList ();
-	bool ok = false;
-	
-	int at = name.toInt (&ok);
-	if (!ok || at < 0 || at >= list.length ()) {
-		// TODO: Output error
-		return false;
+Nuria::Template::VariableAcessor::Chain
+Nuria::Template::VariableAcessor::prepareChain (const QVariantList &chain, bool withCache) {
+	Chain result;
+	result.reserve (chain.length ());
+	for (const QVariant &cur : chain) {
+		result.append (Key (cur, withCache));
 	}
 	
-	// 
-	cur = list.at (at);
-	return walkChain (cur, chain, index + 1);
-	
+	return result;
 }
 
-bool Nuria::Template::VariableAcessor::walkMap (QVariant &cur, const QVariantList &chain, int index) {
-	const QVariant &name = chain.at (index);
-	QVariantMap map = cur.toMap ();
-	
-	QString key = name.toString ();
-	if (key.isEmpty () || !map.contains (key)) {
-		// TODO: Output error
-		return false;
+bool Nuria::Template::VariableAcessor::walkChain (QVariant &cur, const QVariantList &chain, int index) {
+	return walkChain (cur, prepareChain (chain), index);
+}
+
+bool Nuria::Template::VariableAcessor::walkChain (QVariant &cur, const Chain &chain, int index) {
+	for (int i = index; i < chain.length (); i++) {
+		if (!walkKey (cur, chain.at (i))) {
+			return false;
+		}
+		
 	}
 	
-	// 
-	cur = map.value (key);
-	return walkChain (cur, chain, index + 1);
-	
+	return true;
 }
 
-bool Nuria::Template::VariableAcessor::walkListType (QVariant &cur, const QVariantList &chain, int index) {
-	QSequentialIterable iter = cur.value< QSequentialIterable > ();
-	const QVariant &name = chain.at (index);
-	bool ok = false;
+bool Nuria::Template::VariableAcessor::walkKey (QVariant &cur, const Key &key) {
+	int type = cur.userType ();
 	
-	// Get index
-	int at = name.toInt (&ok);
-	if (!ok || at < 0 || at >= iter.size ()) {
+	// Fast path: Seen this type here before
+	const Access *cached = (key.cache) ? key.cache->find (type, cur) : nullptr;
+	if (cached) {
+		return read (cur, *cached, key);
+	}
+	
+	// Slow path
+	Access access;
+	if (!resolve (cur, type, key, access)) {
 		// TODO: Output error
 		return false;
 	}
 	
-	// 
-	cur = *(iter.begin () + at);
-	return walkChain (cur, chain, index + 1);
+	if (key.cache) {
+		key.cache->insert (access);
+	}
+	
+	return read (cur, access, key);
 }
 
-bool Nuria::Template::VariableAcessor::walkMapType (QVariant &cur, const QVariantList &chain, int index) {
-	QAssociativeIterable iter = cur.value< QAssociativeIterable > ();
-	const QVariant &name = chain.at (index);
+bool Nuria::Template::VariableAcessor::resolve (const QVariant &cur, int type, const Key &key, Access &access) {
+	access.type = type;
 	
-	// Get key
-	cur = iter.value (name);
-	if (!cur.isValid ()) {
-		// TODO: Output error
+	// Lists and maps are resolved by type alone
+	if (type == QMetaType::QVariantList) {
+		access.kind = Access::List;
+	} else if (cur.canConvert< QVariantList > ()) {
+		access.kind = Access::ListType;
+	} else if (type == QMetaType::QVariantMap) {
+		access.kind = Access::Map;
+	} else if (cur.canConvert< QVariantMap > ()) {
+		access.kind = Access::MapType;
+	} else if (MetaObject *meta = metaObjectForType (type)) {
+		return resolveMetaObject (meta, cur, key, access);
+	} else if (QMetaType::typeFlags (type) & QMetaType::PointerToQObject) {
+		return resolveQObject (cur, key, access);
+	} else {
+		
+		// Unknown
 		return false;
 	}
 	
-	// 
-	return walkChain (cur, chain, index + 1);
-	
+	return true;
 }
 
-bool Nuria::Template::VariableAcessor::walkMetaObject (MetaObject *meta, QVariant &cur,
-                                                       const QVariantList &chain, int index) {
-	QByteArray name = chain.at (index).toString ().toLatin1 ();
-	void *object = const_cast< void * > (cur.constData ());
-	if (name.isEmpty () || !object) {
+bool Nuria::Template::VariableAcessor::resolveMetaObject (MetaObject *meta, const QVariant &cur,
+                                                          const Key &key, Access &access) {
+	if (key.name.isEmpty () || !cur.constData ()) {
 		return false;
 	}
 	
-	// 
-	
 	// See if it's a field
-	MetaField field = meta->fieldByName (name);
-	if (field.isValid ()) {
-		cur = field.read (object);
-		return walkChain (cur, chain, index + 1);
+	access.meta = meta;
+	access.field = meta->fieldByName (key.name);
+	if (access.field.isValid ()) {
+		access.kind = Access::MetaObjectField;
+		return true;
 	}
 	
 	// Function?
-	int begin = meta->methodLowerBound (name);
-//	int end = meta->methodUpperBound (name);
+	access.method = meta->methodLowerBound (key.name);
+//	int end = meta->methodUpperBound (key.name);
 	
-	if (begin >= 0) {
+	if (access.method >= 0) {
 		// TODO: Warn if there are multiple functions with this name
-		cur = QVariant::fromValue (meta->method (begin).callback (object));
-		return walkChain (cur, chain, index + 1);
+		access.kind = Access::MetaObjectMethod;
+		return true;
 	}
 	
 	// Not found.
 	return false;
 }
 
-bool Nuria::Template::VariableAcessor::walkQObject (QVariant &cur, const QVariantList &chain, int index) {
-	QByteArray name = chain.at (index).toString ().toLatin1 ();
+bool Nuria::Template::VariableAcessor::resolveQObject (const QVariant &cur, const Key &key, Access &access) {
 	QObject *object = cur.value< QObject * > ();
-	if (name.isEmpty () || !object) {
+	if (key.name.isEmpty () || !object) {
 		return false;
 	}
 	
 	// Only properties are supported right now.
 	// TODO: Should QObjects support functions?
-	const QMetaObject *meta = object->metaObject ();
-	int idx = meta->indexOfProperty (name.constData ());
+	access.kind = Access::QObjectProperty;
+	access.qobjectMeta = object->metaObject ();
+	access.property = access.qobjectMeta->indexOfProperty (key.name.constData ());
 	
-	if (idx < 0) {
-		// TODO: Issue error
-		return false;
+	// TODO: Issue error if not found
+	return (access.property >= 0);
+}
+
+bool Nuria::Template::VariableAcessor::read (QVariant &cur, const Access &access, const Key &key) {
+	switch (access.kind) {
+	case Access::List: {
+		const QVariantList &list = *static_cast< const QVariantList * > (cur.constData ());
+		if (key.index < 0 || key.index >= list.length ()) {
+			return false;
+		}
+		
+		return advance (cur, list.at (key.index));
+	}
+	case Access::Map: {
+		const QVariantMap &map = *static_cast< const QVariantMap * > (cur.constData ());
+		auto it = map.constFind (key.string);
+		if (key.string.isEmpty () || it == map.constEnd ()) {
+			return false;
+		}
+		
+		return advance (cur, *it);
+	}
+	case Access::ListType: {
+		QSequentialIterable iter = cur.value< QSequentialIterable > ();
+		if (key.index < 0 || key.index >= iter.size ()) {
+			return false;
+		}
+		
+		return advance (cur, *(iter.begin () + key.index));
+	}
+	case Access::MapType: {
+		QVariant value = cur.value< QAssociativeIterable > ().value (key.value);
+		if (!value.isValid ()) {
+			return false;
+		}
+		
+		cur.swap (value);
+		return true;
+	}
+	case Access::MetaObjectField: {
+		MetaField field = access.field;
+		return advance (cur, field.read (const_cast< void * > (cur.constData ())));
+	}
+	case Access::MetaObjectMethod: {
+		void *object = const_cast< void * > (cur.constData ());
+		return advance (cur, QVariant::fromValue (access.meta->method (access.method).callback (object)));
+	}
+	case Access::QObjectProperty:
+		return advance (cur, access.qobjectMeta->property (access.property).read (qobjectOf (cur)));
 	}
 	
-	// 
-	cur = meta->property (idx).read (object);
-	return walkChain (cur, chain, index + 1);
+	return false;
 }
@@ -17,12 +17,13 @@
 #ifndef NURIA_TEMPLATE_VARIABLEACCESSOR_HPP
 #define NURIA_TEMPLATE_VARIABLEACCESSOR_HPP
 
+#include <nuria/metaobject.hpp>
+#include <QSharedPointer>
+#include <QAtomicPointer>
 #include <QVariant>
+#include <QVector>
 
 namespace Nuria {
-
-class MetaObject;
-
 namespace Template {
 
 class Node;
@@ -34,16 +35,98 @@ class Node;
 class VariableAcessor {
 public:
 	
+	/** How a chain element has been resolved for a type. */
+	struct Access {
+		enum Kind {
+			List,
+			Map,
+			ListType,
+			MapType,
+			MetaObjectField,
+			MetaObjectMethod,
+			QObjectProperty
+		};
+		
+		int type;
+		Kind kind;
+		MetaObject *meta = nullptr;
+		MetaField field;
+		int method = -1;
+		const QMetaObject *qobjectMeta = nullptr;
+		int property = -1;
+	};
+	
+	/**
+	 * Polymorphic inline cache of a chain element. It remembers how the
+	 * element has been resolved for the first \c Size types seen, which
+	 * saves the look-ups when the same types come by again. Entries are
+	 * never changed once added, so the cache can be used from multiple
+	 * threads without locking.
+	 */
+	class InlineCache {
+	public:
+		enum { Size = 4 };
+		
+		InlineCache () { }
+		~InlineCache ();
+		
+		/** Returns the access for \a cur of \a type, or \c nullptr. */
+		const Access *find (int type, const QVariant &cur) const;
+		
+		/** Adds \a access, if there's space left. */
+		void insert (const Access &access);
+		
+	private:
+		Q_DISABLE_COPY(InlineCache)
+		QAtomicPointer< const Access > entries[Size];
+	};
+	
+	/**
+	 * Element of a chain like a.b[0], with the conversions needed by the
+	 * different kinds of containers and objects done beforehand.
+	 */
+	struct Key {
+		Key () { }
+		explicit Key (const QVariant &key, bool withCache = false);
+		
+		QVariant value;
+		QString string;
+		QByteArray name;
+		int index = -1;
+		
+		/** Shared by copies of this key. May be \c nullptr. */
+		QSharedPointer< InlineCache > cache;
+	};
+	
+	typedef QVector< Key > Chain;
+	
+	/**
+	 * Converts the elements of \a chain into keys. If \a withCache is
+	 * \c true, the keys get an InlineCache, which is useful if the chain
+	 * is walked repeatedly.
+	 */
+	static Chain prepareChain (const QVariantList &chain, bool withCache = false);
+	
+	/**
+	 * Walks \a chain, starting at \a index, from \a cur, storing the
+	 * result in \a cur. Returns \c false if an element was not found.
+	 */
+	static bool walkChain (QVariant &cur, const Chain &chain, int index = 0);
 	static bool walkChain (QVariant &cur, const QVariantList &chain, int index);
-	static bool walkList (QVariant &cur, const QVariantList &chain, int index);
-	static bool walkMap (QVariant &cur, const QVariantList &chain, int index);
-	static bool walkListType (QVariant &cur, const QVariantList &chain, int index);
-	static bool walkMapType (QVariant &cur, const QVariantList &chain, int index);
-	static bool walkMetaObject (MetaObject *meta, QVariant &cur, const QVariantList &chain, int index);
-	static bool walkQObject (QVariant &cur, const QVariantList &chain, int index);
+	
+	/**
+	 * Walks the single element \a key from \a cur, storing the result in
+	 * \a cur. Returns \c false if it was not found.
+	 */
+	static bool walkKey (QVariant &cur, const Key &key);
 	
 private:
 	
+	static bool resolve (const QVariant &cur, int type, const Key &key, Access &access);
+	static bool resolveMetaObject (MetaObject *meta, const QVariant &cur, const Key &key, Access &access);
+	static bool resolveQObject (const QVariant &cur, const Key &key, Access &access);
+	static bool read (QVariant &cur, const Access &access, const Key &key);
+	
 	// No way to construct this class.
 	VariableAcessor () = delete;
 	
@@ -23,30 +23,66 @@
 #include "private/tokenizer.hpp"
 #include "private/compiler.hpp"
 #include "private/parser.hpp"
+#include <QElapsedTimer>
+#include <QWriteLocker>
+#include <QReadLocker>
+#include <QMutexLocker>
+
+// Estimated memory used by a compiled program in bytes
+static qint64 programCost (const Nuria::TemplateProgramPrivate *program) {
+	qint64 bytes = sizeof(Nuria::TemplateProgramPrivate);
+	
+	if (Nuria::Template::SharedNode *root = program->root.data ()) {
+		const Nuria::Template::Bytecode &code = root->code;
+		bytes += sizeof(Nuria::Template::SharedNode);
+		bytes += code.code.size () * sizeof(Nuria::Template::Bytecode::Instruction);
+		
+		if (root->arena) {
+			bytes += root->arena->bytesAllocated ();
+		}
+		
+		for (const QString &text : code.texts) {
+			bytes += text.size () * sizeof(QChar);
+		}
+		
+	}
+	
+	for (const QString &name : program->variables) {
+		bytes += sizeof(QVariant) + name.size () * sizeof(QChar);
+	}
+	
+	return bytes;
+}
 
 Nuria::TemplateEngine::TemplateEngine (QObject *parent)
 	: QObject (parent), d_ptr (new TemplateEnginePrivate)
 {
 	
 	this->d_ptr->q_ptr = this;
+	this->d_ptr->statistics = QSharedPointer< Template::Statistics >::create ();
+	this->d_ptr->cache.setStatistics (this->d_ptr->statistics.data ());
+	this->d_ptr->fragments = QSharedPointer< Template::FragmentCache >::create ();
+	this->d_ptr->memo = QSharedPointer< Template::FragmentCache >::create ();
+	this->d_ptr->memo->setMaxSize (0);
 	this->d_ptr->renderer = new Template::Compiler (this, this->d_ptr);
 	
-	this->d_ptr->parser = new Template::Parser (this);
-	this->d_ptr->tokenizer = new Template::Tokenizer (this);
 	this->d_ptr->loader = new TemplateLoader (this);
 	connectToLoaderSignals ();
 	
 }
 
 Nuria::TemplateEngine::~TemplateEngine () {
+	qDeleteAll (this->d_ptr->bundles);
 	delete this->d_ptr;
 }
 
 QLocale Nuria::TemplateEngine::locale () const {
+	QReadLocker locker (&this->d_ptr->stateLock);
 	return this->d_ptr->locale;
 }
 
 void Nuria::TemplateEngine::setLocale (const QLocale &locale) {
+	QWriteLocker locker (&this->d_ptr->stateLock);
 	this->d_ptr->locale = locale;
 }
 
@@ -55,26 +91,77 @@ Nuria::TemplateLoader *Nuria::TemplateEngine::loader () const {
 }
 
 int Nuria::TemplateEngine::maxCacheSize () const {
-	return this->d_ptr->cache.maxCost ();
+	return this->d_ptr->cache.maxSize ();
 }
 
 void Nuria::TemplateEngine::setMaxCacheSize (int size) {
-	this->d_ptr->cache.setMaxCost (size);
+	this->d_ptr->cache.setMaxSize (size);
 }
 
 int Nuria::TemplateEngine::currentCacheSize () const {
 	return this->d_ptr->cache.count ();
 }
 
+qint64 Nuria::TemplateEngine::maxCacheMemory () const {
+	return this->d_ptr->cache.maxCost ();
+}
+
+void Nuria::TemplateEngine::setMaxCacheMemory (qint64 bytes) {
+	this->d_ptr->cache.setMaxCost (bytes);
+}
+
+qint64 Nuria::TemplateEngine::currentCacheMemory () const {
+	return this->d_ptr->cache.totalCost ();
+}
+
+bool Nuria::TemplateEngine::isCacheAdmissionEnabled () const {
+	return this->d_ptr->cache.isAdmissionEnabled ();
+}
+
+void Nuria::TemplateEngine::setCacheAdmissionEnabled (bool enabled) {
+	this->d_ptr->cache.setAdmissionEnabled (enabled);
+}
+
 bool Nuria::TemplateEngine::isTemplateInCache (const QString &templateName) const {
 	return this->d_ptr->cache.contains (templateName);
 }
 
+qint64 Nuria::TemplateEngine::maxFragmentCacheMemory () const {
+	return this->d_ptr->fragments->maxSize ();
+}
+
+void Nuria::TemplateEngine::setMaxFragmentCacheMemory (qint64 bytes) {
+	this->d_ptr->fragments->setMaxSize (bytes);
+}
+
+qint64 Nuria::TemplateEngine::currentFragmentCacheMemory () const {
+	return this->d_ptr->fragments->size ();
+}
+
+int Nuria::TemplateEngine::invalidateFragments (const QString &prefix) {
+	return this->d_ptr->fragments->removeByPrefix (prefix);
+}
+
+qint64 Nuria::TemplateEngine::maxRenderMemoMemory () const {
+	return this->d_ptr->memo->maxSize ();
+}
+
+void Nuria::TemplateEngine::setMaxRenderMemoMemory (qint64 bytes) {
+	this->d_ptr->memo->setMaxSize (bytes);
+}
+
+qint64 Nuria::TemplateEngine::currentRenderMemoMemory () const {
+	return this->d_ptr->memo->size ();
+}
+
 void Nuria::TemplateEngine::setLoader (Nuria::TemplateLoader *loader) {
+	QWriteLocker locker (&this->d_ptr->compileLock);
+	
 	if (loader != this->d_ptr->loader) {
 		delete this->d_ptr->loader;
 		this->d_ptr->loader = loader;
 		loader->setParent (this);
+		this->d_ptr->renderer->removeTokens ();
 		
 		connectToLoaderSignals ();
 	}
@@ -82,20 +169,24 @@ void Nuria::TemplateEngine::setLoader (Nuria::TemplateLoader *loader) {
 }
 
 QVariant Nuria::TemplateEngine::value (const QString &name) const {
+	QReadLocker locker (&this->d_ptr->stateLock);
 	return this->d_ptr->values.value (name);
 }
 
 QVariantMap Nuria::TemplateEngine::values () const {
+	QReadLocker locker (&this->d_ptr->stateLock);
 	return this->d_ptr->values;
 }
 
 void Nuria::TemplateEngine::setValues (const QVariantMap &map) {
-	this->d_ptr->versionId++;
+	QWriteLocker locker (&this->d_ptr->stateLock);
+	this->d_ptr->versionId.ref ();
 	this->d_ptr->values = map;
 }
 
 void Nuria::TemplateEngine::mergeValues (const QVariantMap &map) {
-	this->d_ptr->versionId++;
+	QWriteLocker locker (&this->d_ptr->stateLock);
+	this->d_ptr->versionId.ref ();
 	
 	auto it = map.constBegin ();
 	auto end = map.constEnd ();
@@ -106,134 +197,298 @@ void Nuria::TemplateEngine::mergeValues (const QVariantMap &map) {
 }
 
 void Nuria::TemplateEngine::setValue (const QString &name, const QVariant &value) {
-	this->d_ptr->versionId++;
+	QWriteLocker locker (&this->d_ptr->stateLock);
+	this->d_ptr->versionId.ref ();
 	this->d_ptr->values.insert (name, value);
 }
 
 void Nuria::TemplateEngine::addFunction (const QString &name, const Nuria::Callback &function, bool isConstant) {
-	this->d_ptr->versionId++;
+	QWriteLocker locker (&this->d_ptr->stateLock);
+	this->d_ptr->versionId.ref ();
 	this->d_ptr->functions.insert (name, { function, isConstant });
 }
 
 bool Nuria::TemplateEngine::hasFunction (const QString &name) {
+	QReadLocker locker (&this->d_ptr->stateLock);
 	return this->d_ptr->functions.contains (name);
 }
 
+void Nuria::TemplateEngine::setVariableType (const QString &name, int type) {
+	QWriteLocker locker (&this->d_ptr->stateLock);
+	if (type == QMetaType::UnknownType) {
+		this->d_ptr->variableTypes.remove (name);
+	} else {
+		this->d_ptr->variableTypes.insert (name, type);
+	}
+	
+}
+
+int Nuria::TemplateEngine::variableType (const QString &name) const {
+	QReadLocker locker (&this->d_ptr->stateLock);
+	return this->d_ptr->variableTypes.value (name, QMetaType::UnknownType);
+}
+
 Nuria::TemplateProgram Nuria::TemplateEngine::program (const QString &templateName) {
-	TemplateProgram *ptr = this->d_ptr->cache.object (templateName);
-	if (ptr && !isProgramOutdated (*ptr)) {
-		return updateProgramVariables (templateName, ptr);
+	quint64 epoch = this->d_ptr->epoch.load ();
+	TemplateProgram cached;
+	if (this->d_ptr->cache.lookup (templateName, cached) && !isProgramOutdated (cached)) {
+		this->d_ptr->statistics->add (templateName, Template::Statistics::CacheHits);
+		return updateProgramVariables (templateName, cached, epoch);
 	}
 	
-	// Cache miss, load and compile the program.
+	// Cache miss. If another thread is compiling this template already,
+	// wait for it and use its program. This way, concurrent misses on the
+	// same template compile it only once.
+	QMutexLocker locker (&this->d_ptr->flightLock);
+	if (this->d_ptr->compiling.contains (templateName)) {
+		while (this->d_ptr->compiling.contains (templateName)) {
+			this->d_ptr->compileDone.wait (&this->d_ptr->flightLock);
+		}
+		
+		epoch = this->d_ptr->epoch.load ();
+		if (this->d_ptr->cache.lookup (templateName, cached)) {
+			locker.unlock ();
+			this->d_ptr->statistics->add (templateName, Template::Statistics::CacheHits);
+			return updateProgramVariables (templateName, cached, epoch);
+		}
+		
+	}
+	
+	this->d_ptr->compiling.insert (templateName);
+	epoch = this->d_ptr->epoch.load ();
+	locker.unlock ();
+	
+	// Load and compile the program. Other templates may be compiled at the
+	// same time.
+	this->d_ptr->statistics->add (templateName, Template::Statistics::CacheMisses);
+	QReadLocker compileLocker (&this->d_ptr->compileLock);
 	TemplateProgram program (createProgram (templateName));
+	compileLocker.unlock ();
 	
-	if (this->d_ptr->cache.maxCost () > 0) {
-		this->d_ptr->cache.insert (templateName, new TemplateProgram (program));
-	}
+	cacheProgram (templateName, program, epoch);
 	
+	// Wake up threads waiting for this template
+	locker.relock ();
+	this->d_ptr->compiling.remove (templateName);
+	this->d_ptr->compileDone.wakeAll ();
 	return program;
 }
 
 QString Nuria::TemplateEngine::render (const QString &templateName) {
 	TemplateProgram instance = program (templateName);
-	this->d_ptr->lastError = instance.lastError ();
+	TemplateError error = instance.lastError ();
+	this->d_ptr->lastError.setLocalData (error);
 	
 	// Error check
-	if (this->d_ptr->lastError.hasFailed ()) {
+	if (error.hasFailed ()) {
 		return QString ();
 	}
 	
 	// Render.
 	QString result = instance.render ();
-	this->d_ptr->lastError = instance.lastError ();
+	this->d_ptr->lastError.setLocalData (instance.lastError ());
+	return result;
+}
+
+QString Nuria::TemplateEngine::render (const QString &templateName, QByteArray &contentHash) {
+	TemplateProgram instance = program (templateName);
+	TemplateError error = instance.lastError ();
+	this->d_ptr->lastError.setLocalData (error);
+	
+	// Error check
+	if (error.hasFailed ()) {
+		contentHash.clear ();
+		return QString ();
+	}
+	
+	// Render.
+	QString result = instance.render (contentHash);
+	this->d_ptr->lastError.setLocalData (instance.lastError ());
+	return result;
+}
+
+bool Nuria::TemplateEngine::render (const QString &templateName, QIODevice *device) {
+	TemplateProgram instance = program (templateName);
+	TemplateError error = instance.lastError ();
+	this->d_ptr->lastError.setLocalData (error);
+	
+	// Error check
+	if (error.hasFailed ()) {
+		return false;
+	}
+	
+	// Render.
+	bool result = instance.render (device);
+	this->d_ptr->lastError.setLocalData (instance.lastError ());
 	return result;
 }
 
 Nuria::TemplateError Nuria::TemplateEngine::lastError () const {
-	return this->d_ptr->lastError;
+	return this->d_ptr->lastError.localData ();
 }
 
 Nuria::TemplateProgramPrivate *Nuria::TemplateEngine::createProgram (const QString &templateName) {
-	TemplateProgramPrivate *program = new TemplateProgramPrivate;
+	TemplateProgramPrivate *program = readProgramFromBundles (templateName);
+	if (program) {
+		return program;
+	}
+	
+	// Compile
+	program = new TemplateProgramPrivate;
 	program->info = new CompileInformation;
 	
+	// Nodes of the program are allocated from its own arena
+	QExplicitlySharedDataPointer< Template::Arena > arena (new Template::Arena);
+	Template::Arena::Scope arenaScope (arena.data ());
+	
 	Template::Node *node = this->d_ptr->renderer->loadAndParse (templateName, program);
 	if (!node) {
-		if (!program->error.hasFailed ()) {
-			program->error = this->d_ptr->parser->lastError ();
-		}
-		
 		delete program->info;
 		program->info = nullptr;	
 		return program;
 	}
 	
 	// Copy function map to allow for custom constant functions
+	QReadLocker locker (&this->d_ptr->stateLock);
 	program->functions = this->d_ptr->functions;
+	program->info->variableTypes = this->d_ptr->variableTypes;
+	locker.unlock ();
 	
 	// Compile
+	bool measure = this->d_ptr->statistics->isEnabled ();
+	QElapsedTimer timer;
+	if (measure) {
+		timer.start ();
+	}
+	
 	program->root = new Template::SharedNode (node);
+	program->root->arena = arena;
 	this->d_ptr->renderer->compile (program);
 	
+	if (measure) {
+		this->d_ptr->statistics->add (templateName, Template::Statistics::CompileTime,
+		                              timer.nsecsElapsed ());
+	}
+	
+	
 	// Cleanup
 	delete program->info;
 	program->info = nullptr;	
 	
+	// Done.
+	populateProgram (program, templateName);
+	return program;
+}
+
+Nuria::TemplateProgramPrivate *Nuria::TemplateEngine::readProgramFromBundles (const QString &templateName) {
+	for (int i = this->d_ptr->bundles.length () - 1; i >= 0; i--) {
+		QByteArray data = this->d_ptr->bundles.at (i)->program (templateName);
+		if (data.isEmpty ()) {
+			continue;
+		}
+		
+		// Deserialize
+		QDataStream stream (data);
+		TemplateProgramPrivate *program = Template::Serializer::read (stream);
+		if (!program) {
+			continue;
+		}
+		
+		// Don't use the program if a template changed in the meantime
+		program->name = templateName;
+		if (hasDependencyChanged (program)) {
+			delete program;
+			continue;
+		}
+		
+		// Done.
+		populateProgram (program, templateName);
+		return program;
+	}
+	
+	return nullptr;
+}
+
+void Nuria::TemplateEngine::populateProgram (TemplateProgramPrivate *program, const QString &templateName) {
+	program->name = templateName;
+	program->statistics = this->d_ptr->statistics;
+	program->fragments = this->d_ptr->fragments;
+	program->memo = this->d_ptr->memo;
+	
+	QReadLocker locker (&this->d_ptr->stateLock);
+	
+	program->functions = this->d_ptr->functions;
+	program->updateFunctionSlots ();
+	program->versionId = this->d_ptr->versionId.load ();
+	
 	// Populate variables
 	for (int i = 0; i < program->variables.length (); i++) {
 		const QString &name = program->variables.at (i);
 		program->values[i] = this->d_ptr->values.value (name);
 	}
 	
-	// Done.
-	return program;
 }
 
 void Nuria::TemplateEngine::removeChangedTemplateFromCache (const QString &templateName) {
+	QMutexLocker locker (&this->d_ptr->flightLock);
+	this->d_ptr->changedAt.insert (templateName, this->d_ptr->epoch.fetchAndAddOrdered (1) + 1);
+	locker.unlock ();
+	
+	this->d_ptr->renderer->removeTokens (templateName);
 	this->d_ptr->cache.remove (templateName);
 	
 	// Remove all templates which depend on the changed template.
-	QStringList allTemplates = this->d_ptr->cache.keys ();
-	for (int i = 0, total = allTemplates.length (); i < total; ++i) {
-		TemplateProgram *prog = this->d_ptr->cache.object (allTemplates.at (i));
-		
-		// Does 'prog' depend on the changed template?
-		if (prog && prog->d->dependencies.contains (templateName)) {
-			this->d_ptr->cache.remove (allTemplates.at (i));
+	this->d_ptr->cache.removeDependents (templateName);
+	
+}
+
+void Nuria::TemplateEngine::cacheProgram (const QString &templateName, const TemplateProgram &program,
+                                          quint64 epoch) {
+	QMutexLocker locker (&this->d_ptr->flightLock);
+	
+	// Don't bring back a program removeChangedTemplateFromCache() or
+	// flushCache() removed after the program was compiled or updated.
+	if (this->d_ptr->flushedAt > epoch || this->d_ptr->changedAt.value (templateName) > epoch) {
+		return;
+	}
+	
+	for (const QString &cur : program.d->dependencies) {
+		if (this->d_ptr->changedAt.value (cur) > epoch) {
+			return;
 		}
 		
 	}
 	
+	this->d_ptr->cache.insert (templateName, program, programCost (program.d.constData ()));
 }
 
 Nuria::TemplateProgram Nuria::TemplateEngine::updateProgramVariables (const QString &templateName,
-                                                                      TemplateProgram *prog) {
-	if (prog->d->versionId == this->d_ptr->versionId) {
-		return *prog;
+                                                                      const TemplateProgram &prog,
+                                                                      quint64 epoch) {
+	if (prog.d->versionId == this->d_ptr->versionId.load ()) {
+		return prog;
 	}
 	
-	// NOTE: If TemplateEngine would become thread-safe, this is a place where things could go wrong.
-	
-	// Version mismatch
-	// Only copy if we're not the only one holding a reference.
-	if (prog->d->ref.load () > 1) {
-		TemplateProgram *instance = new TemplateProgram (*prog);
-		this->d_ptr->cache.insert (templateName, instance);
-		prog = instance;
-	}
+	// Version mismatch. The cached program may be in use by other threads,
+	// so it's never changed. Instead, update a copy and cache that one.
+	TemplateProgram instance (prog);
+	QReadLocker locker (&this->d_ptr->stateLock);
 	
 	// Update functions
-	prog->d->functions = this->d_ptr->functions;
+	instance.d->functions = this->d_ptr->functions;
+	instance.d->updateFunctionSlots ();
 	
 	// Update variables
-	for (int i = 0; i < prog->d->variables.length (); i++) {
-		prog->d->values.replace (i, this->d_ptr->values.value (prog->d->variables.at (i)));
+	for (int i = 0; i < instance.d->variables.length (); i++) {
+		instance.d->values.replace (i, this->d_ptr->values.value (instance.d->variables.at (i)));
 	}
 	
 	// Done
-	prog->d->versionId = this->d_ptr->versionId;
-	return *prog;
+	instance.d->versionId = this->d_ptr->versionId.load ();
+	locker.unlock ();
+	
+	cacheProgram (templateName, instance, epoch);
+	return instance;
 }
 
 void Nuria::TemplateEngine::connectToLoaderSignals () {
@@ -244,11 +499,17 @@ void Nuria::TemplateEngine::connectToLoaderSignals () {
 }
 
 bool Nuria::TemplateEngine::isProgramOutdated (const TemplateProgram &program) {
-	auto it = program.d->dependencies.constBegin ();
-	auto end = program.d->dependencies.constEnd ();
+	return hasDependencyChanged (program.d.constData ());
+}
+
+bool Nuria::TemplateEngine::hasDependencyChanged (const TemplateProgramPrivate *program) {
+	this->d_ptr->statistics->add (program->name, Template::Statistics::StalenessChecks);
+	
+	auto it = program->dependencies.constBegin ();
+	auto end = program->dependencies.constEnd ();
 	
 	for (; it != end; ++it) {
-		if (this->d_ptr->loader->hasTemplateChanged (*it, program.d->compiledAt)) {
+		if (this->d_ptr->loader->hasTemplateChanged (*it, program->compiledAt)) {
 			return true;
 		}
 		
@@ -257,6 +518,74 @@ bool Nuria::TemplateEngine::isProgramOutdated (const TemplateProgram &program) {
 	return false;
 }
 
+bool Nuria::TemplateEngine::saveBundle (const QString &path, const QStringList &templateNames) {
+	QMap< QString, QByteArray > programs;
+	
+	for (const QString &name : templateNames) {
+		TemplateProgram instance = program (name);
+		if (instance.lastError ().hasFailed ()) {
+			this->d_ptr->lastError.setLocalData (instance.lastError ());
+			return false;
+		}
+		
+		// Serialize
+		QByteArray data;
+		QDataStream stream (&data, QIODevice::WriteOnly);
+		if (!Template::Serializer::write (stream, instance.d.constData ())) {
+			this->d_ptr->lastError.setLocalData (TemplateError (TemplateError::Engine,
+			                                                    TemplateError::BundleWriteFailed,
+			                                                    name));
+			return false;
+		}
+		
+		programs.insert (name, data);
+	}
+	
+	// Write the bundle
+	if (!Template::Bundle::write (path, programs)) {
+		this->d_ptr->lastError.setLocalData (TemplateError (TemplateError::Engine,
+		                                                    TemplateError::BundleWriteFailed, path));
+		return false;
+	}
+	
+	this->d_ptr->lastError.setLocalData (TemplateError ());
+	return true;
+}
+
+bool Nuria::TemplateEngine::loadBundle (const QString &path) {
+	Template::Bundle *bundle = new Template::Bundle;
+	if (!bundle->open (path)) {
+		delete bundle;
+		return false;
+	}
+	
+	// 
+	QWriteLocker locker (&this->d_ptr->compileLock);
+	this->d_ptr->bundles.append (bundle);
+	return true;
+}
+
+bool Nuria::TemplateEngine::isRecordingStatistics () const {
+	return this->d_ptr->statistics->isEnabled ();
+}
+
+void Nuria::TemplateEngine::setRecordingStatistics (bool enabled) {
+	this->d_ptr->statistics->setEnabled (enabled);
+}
+
+QMap< QString, Nuria::TemplateStatistics > Nuria::TemplateEngine::statistics () const {
+	return this->d_ptr->statistics->snapshot ();
+}
+
+void Nuria::TemplateEngine::resetStatistics () {
+	this->d_ptr->statistics->reset ();
+}
+
 void Nuria::TemplateEngine::flushCache () {
+	QMutexLocker locker (&this->d_ptr->flightLock);
+	this->d_ptr->flushedAt = this->d_ptr->epoch.fetchAndAddOrdered (1) + 1;
+	locker.unlock ();
+	
+	this->d_ptr->renderer->removeTokens ();
 	this->d_ptr->cache.clear ();
 }
@@ -124,6 +124,8 @@ QString Nuria::TemplateError::errorName (Nuria::TemplateError::Error error) {
 	case InvalidEscapeMode: return QStringLiteral("InvalidEscapeMode");
 	case NoProgram: return QStringLiteral("NoProgram");
 	case VariableNotSet: return QStringLiteral("VariableNotSet");
+	case WriteFailed: return QStringLiteral("WriteFailed");
+	case BundleWriteFailed: return QStringLiteral("BundleWriteFailed");
 	}
 	
 }
@@ -18,6 +18,26 @@
 
 #include "private/templateengine_p.hpp"
 #include "private/astnodes.hpp"
+#include "private/sink.hpp"
+
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QDataStream>
+#include <QIODevice>
+
+// Error of the last render on this thread, and the instance which rendered.
+// Keeping it out of TemplateProgram lets threads share one instance.
+struct LastError {
+	const Nuria::TemplateProgram *program = nullptr;
+	Nuria::TemplateError error;
+};
+
+static thread_local LastError g_lastError;
+
+static void setLastError (const Nuria::TemplateProgram *program, const Nuria::TemplateError &error) {
+	g_lastError.program = program;
+	g_lastError.error = error;
+}
 
 Nuria::TemplateProgram::TemplateProgram ()
         : d (nullptr)
@@ -39,15 +59,17 @@ Nuria::TemplateProgram::TemplateProgram (TemplateProgramPrivate *dptr)
 }
 
 void Nuria::TemplateProgram::refNode () {
-	if (this->d && this->d->root) {
-		this->d->root->ref.ref ();
+	const TemplateProgramPrivate *dptr = this->d.constData ();
+	if (dptr && dptr->root) {
+		dptr->root->ref.ref ();
 	}
 	
 }
 
 void Nuria::TemplateProgram::derefNode () {
-	if (this->d && this->d->root) {
-		this->d->root->ref.deref ();
+	const TemplateProgramPrivate *dptr = this->d.constData ();
+	if (dptr && dptr->root) {
+		dptr->root->ref.deref ();
 	}
 	
 }
@@ -63,6 +85,10 @@ Nuria::TemplateProgram &Nuria::TemplateProgram::operator= (const TemplateProgram
 }
 
 Nuria::TemplateProgram::~TemplateProgram () {
+	if (g_lastError.program == this) {
+		setLastError (nullptr, TemplateError ());
+	}
+	
 	derefNode ();
 }
 
@@ -87,31 +113,36 @@ QStringList Nuria::TemplateProgram::neededVariables () const {
 }
 
 QVariant Nuria::TemplateProgram::value (const QString &variable) const {
-	if (!this->d) {
+	return value (slotFor (variable));
+}
+
+QVariant Nuria::TemplateProgram::value (int slot) const {
+	if (!this->d || slot < 0 || slot >= this->d->values.length ()) {
 		return QVariant ();
 	}
 	
-	int idx = this->d->variables.indexOf (variable);
-	if (idx >= 0) {
-		return this->d->values.at (idx);
-	}
-	
-	return QVariant ();
+	return this->d->values.at (slot);
 }
 
 bool Nuria::TemplateProgram::setValue (const QString &variable, const QVariant &value) {
-	if (!this->d) {
+	return setValue (slotFor (variable), value);
+}
+
+bool Nuria::TemplateProgram::setValue (int slot, const QVariant &value) {
+	if (!this->d || slot < 0 || slot >= this->d->values.length ()) {
 		return false;
 	}
 	
-	int idx = this->d->variables.indexOf (variable);
-	if (idx >= 0) {
-		this->d->values.replace (idx, value);
-		return true;
+	this->d->values.replace (slot, value);
+	return true;
+}
+
+int Nuria::TemplateProgram::slotFor (const QString &variable) const {
+	if (!this->d) {
+		return -1;
 	}
 	
-	return false;
-	
+	return this->d->indexOfVariable (variable);
 }
 
 QLocale Nuria::TemplateProgram::locale () const {
@@ -132,6 +163,7 @@ void Nuria::TemplateProgram::setLocale (const QLocale &locale) {
 void Nuria::TemplateProgram::addFunction (const QString &name, const Nuria::Callback &function) {
 	if (this->d) {
 		this->d->functions.insert (name, { function, false });
+		this->d->updateFunctionSlots ();
 	}
 	
 }
@@ -145,23 +177,30 @@ bool Nuria::TemplateProgram::hasFunction (const QString &name) {
 }
 
 bool Nuria::TemplateProgram::canRender () const {
+	TemplateError error;
+	bool result = canRender (error);
+	setLastError (this, error);
+	return result;
+}
+
+bool Nuria::TemplateProgram::canRender (TemplateError &error) const {
 	if (!this->d) {
 		return false;
 	}
 	
 	// Program
 	if (!this->d->root || !this->d->root->node) {
-		this->d->error = TemplateError (TemplateError::Renderer, TemplateError::NoProgram,
-		                                QStringLiteral("There's no program to render"),
-		                                Template::Location ());
+		error = TemplateError (TemplateError::Renderer, TemplateError::NoProgram,
+		                       QStringLiteral("There's no program to render"),
+		                       Template::Location ());
 		return false;
 	}
 	
 	// Variable check
 	for (int i = 0; i < this->d->values.length (); i++) {
 		if (!checkVariable (i)) {
-			this->d->error = TemplateError (TemplateError::Renderer, TemplateError::VariableNotSet,
-			                                this->d->variables.at (i), Template::Location ());
+			error = TemplateError (TemplateError::Renderer, TemplateError::VariableNotSet,
+			                       this->d->variables.at (i), Template::Location ());
 			return false;
 		}
 		
@@ -172,6 +211,21 @@ bool Nuria::TemplateProgram::canRender () const {
 	
 }
 
+bool Nuria::TemplateProgram::isMemoizable () const {
+	if (!this->d || !this->d->deterministic) {
+		return false;
+	}
+	
+	for (const Function &cur : this->d->functionSlots) {
+		if (!cur.isConstant) {
+			return false;
+		}
+		
+	}
+	
+	return true;
+}
+
 bool Nuria::TemplateProgram::checkVariable (int index) const {
 	if (this->d->values.at (index).isValid ()) {
 		return true;
@@ -182,15 +236,223 @@ bool Nuria::TemplateProgram::checkVariable (int index) const {
 	return this->d->isFirstUsageRecordWriting (index);
 }
 
+// Renders the program of 'context' into 'sink', preferring the bytecode.
+static void renderProgram (Nuria::Template::ExecutionContext *context, Nuria::Template::Sink &sink,
+                           quint64 *profile) {
+	const Nuria::Template::SharedNode *root = context->program ()->root.constData ();
+	
+	if (root->code.isValid () && Nuria::Template::Bytecode::isEnabled ()) {
+		root->code.execute (context, sink, profile);
+	} else {
+		root->node->renderTo (context, sink);
+	}
+	
+}
+
+// Writes 'value' into 'stream' to compare it to values of other renders.
+// Returns false if it can't be compared this way, e.g. for QObjects.
+static bool writeMemoValue (QDataStream &stream, const QVariant &value) {
+	int type = value.userType ();
+	stream << qint32 (type);
+	
+	switch (type) {
+	case QMetaType::UnknownType:
+		return true;
+	case QMetaType::Bool:
+	case QMetaType::Int:
+	case QMetaType::UInt:
+	case QMetaType::LongLong:
+	case QMetaType::ULongLong:
+	case QMetaType::Double:
+	case QMetaType::QString:
+	case QMetaType::QByteArray:
+	case QMetaType::QStringList:
+	case QMetaType::QDate:
+	case QMetaType::QTime:
+	case QMetaType::QDateTime:
+		stream << value;
+		return true;
+	case QMetaType::QVariantList: {
+		QVariantList list = value.toList ();
+		stream << qint32 (list.length ());
+		for (const QVariant &cur : list) {
+			if (!writeMemoValue (stream, cur)) {
+				return false;
+			}
+			
+		}
+		
+		return true;
+	}
+	case QMetaType::QVariantMap: {
+		QVariantMap map = value.toMap ();
+		stream << qint32 (map.size ());
+		for (auto it = map.constBegin (), end = map.constEnd (); it != end; ++it) {
+			stream << it.key ();
+			if (!writeMemoValue (stream, it.value ())) {
+				return false;
+			}
+			
+		}
+		
+		return true;
+	}
+	}
+	
+	return false;
+}
+
+QString Nuria::TemplateProgram::memoKey () const {
+	Template::FragmentCache *memo = this->d->memo.data ();
+	if (!memo || memo->maxSize () < 1 || !isMemoizable ()) {
+		return QString ();
+	}
+	
+	// The key is the hash of everything the output depends on. The version
+	// changes when functions of the engine are replaced.
+	QByteArray data;
+	QDataStream stream (&data, QIODevice::WriteOnly);
+	stream << this->d->compiledAt << this->d->versionId << this->d->locale.name ();
+	
+	for (const QVariant &cur : this->d->values) {
+		if (!writeMemoValue (stream, cur)) {
+			return QString ();
+		}
+		
+	}
+	
+	QByteArray hash = QCryptographicHash::hash (data, QCryptographicHash::Sha1).toHex ();
+	return this->d->name + QLatin1Char ('/') + QString::fromLatin1 (hash);
+}
+
+bool Nuria::TemplateProgram::renderTo (Template::Sink &sink, TemplateError &error,
+                                        QByteArray *contentHash) const {
+	if (!canRender (error)) {
+		return false;
+	}
+	
+	// Stream the output if it's not needed as a whole
+	QString key = memoKey ();
+	if (key.isEmpty () && !contentHash) {
+		return runProgram (sink, error);
+	}
+	
+	// Memoized?
+	Template::FragmentCache *memo = this->d->memo.data ();
+	QString output;
+	QByteArray hash;
+	
+	if (key.isEmpty () || !memo->lookup (key, output, &hash)) {
+		Template::StringSink buffer (output);
+		if (!runProgram (buffer, error)) {
+			return false;
+		}
+		
+		
+		QByteArray data = QByteArray::fromRawData (reinterpret_cast< const char * > (output.constData ()),
+		                                           output.size () * int (sizeof(QChar)));
+		hash = QCryptographicHash::hash (data, QCryptographicHash::Sha1).toHex ();
+		
+		if (!key.isEmpty ()) {
+			memo->insert (key, output, 0, hash);
+		}
+		
+	}
+	
+	if (contentHash) {
+		*contentHash = hash;
+	}
+	
+	sink.write (output);
+	return true;
+}
+
+bool Nuria::TemplateProgram::runProgram (Template::Sink &sink, TemplateError &error) const {
+	
+	// Render using an execution context of our own. It reads the compiled
+	// program of this instance, but modifications done while rendering stay
+	// local to it.
+	const TemplateProgramPrivate *program = this->d.constData ();
+	Template::ExecutionContext context;
+	context.compiled = program;
+	context.escapeMode = program->escapeMode;
+	context.spaceless = program->spaceless;
+	context.values = program->values;
+	
+	Template::Statistics *statistics = program->statistics.data ();
+	if (!statistics || !statistics->isEnabled ()) {
+		renderProgram (&context, sink, nullptr);
+	} else {
+		
+		// Record time, output size and executed instructions
+		quint64 profile[Template::Bytecode::ProfileSize] = { };
+		Template::CountingSink counter (sink);
+		QElapsedTimer timer;
+		timer.start ();
+		
+		renderProgram (&context, counter, profile);
+		
+		statistics->add (program->name, Template::Statistics::RenderTime, timer.nsecsElapsed ());
+		statistics->add (program->name, Template::Statistics::Renders);
+		statistics->add (program->name, Template::Statistics::OutputSize, counter.count);
+		statistics->addInstructions (program->name, profile);
+	}
+	
+	// Report errors which occured during rendering to the caller
+	if (context.error.hasFailed ()) {
+		error = context.error;
+		return false;
+	}
+	
+	return true;
+}
+
 QString Nuria::TemplateProgram::render () {
-	if (!canRender ()) {
+	QString result;
+	Template::StringSink sink (result);
+	
+	TemplateError error;
+	bool success = renderTo (sink, error);
+	setLastError (this, error);
+	
+	if (!success) {
 		return QString ();
 	}
 	
-	// Render.
-	TemplateProgramPrivate *dptr = const_cast< TemplateProgramPrivate * > (this->d.constData ());
-	return this->d->root->node->render (dptr);
+	return result;
+}
+
+QString Nuria::TemplateProgram::render (QByteArray &contentHash) {
+	QString result;
+	Template::StringSink sink (result);
+	
+	TemplateError error;
+	bool success = renderTo (sink, error, &contentHash);
+	setLastError (this, error);
+	
+	if (!success) {
+		contentHash.clear ();
+		return QString ();
+	}
+	
+	return result;
+}
+
+bool Nuria::TemplateProgram::render (QIODevice *device) {
+	Template::DeviceSink sink (device);
 	
+	TemplateError error;
+	bool success = renderTo (sink, error);
+	
+	// Write remaining output
+	if (success && !sink.flush ()) {
+		error = TemplateError (TemplateError::Renderer, TemplateError::WriteFailed,
+		                       device->errorString (), Template::Location ());
+		success = false;
+	}
+	
+	setLastError (this, error);
+	return success;
 }
 
 Nuria::TemplateError Nuria::TemplateProgram::lastError () const {
@@ -200,5 +462,11 @@ Nuria::TemplateError Nuria::TemplateProgram::lastError () const {
                                       Template::Location ());
 	}
 	
+	// Errors of the last render on this thread, if done by this instance.
+	// Else, the compile error of the program.
+	if (g_lastError.program == this && g_lastError.error.hasFailed ()) {
+		return g_lastError.error;
+	}
+	
 	return this->d->error;
 }
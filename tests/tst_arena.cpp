@@ -0,0 +1,165 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "private/templateengine_p.hpp"
+#include "private/astnodes.hpp"
+#include "private/arena.hpp"
+#include <nuria/logger.hpp>
+#include <QtTest/QTest>
+#include <cstring>
+
+using namespace Nuria;
+using namespace Nuria::Template;
+
+// 
+class ArenaTest : public QObject {
+	Q_OBJECT
+private slots:
+	
+	void noArenaByDefault ();
+	void scopesNest ();
+	void nodesOutsideOfScopeUseHeap ();
+	void nodesAreAllocatedFromArena ();
+	void allocationsAreAligned ();
+	void largeAllocations ();
+	void deletingInsideOfScopeKeepsMemory ();
+	void programNodesShareArena ();
+	void heapTreeInsideOfScope ();
+	
+};
+
+void ArenaTest::noArenaByDefault () {
+	QVERIFY(!Arena::current ());
+}
+
+void ArenaTest::scopesNest () {
+	Arena outer;
+	Arena inner;
+	
+	{
+		Arena::Scope outerScope (&outer);
+		QCOMPARE(Arena::current (), &outer);
+		
+		{
+			Arena::Scope innerScope (&inner);
+			QCOMPARE(Arena::current (), &inner);
+		}
+		
+		QCOMPARE(Arena::current (), &outer);
+	}
+	
+	QVERIFY(!Arena::current ());
+}
+
+void ArenaTest::nodesOutsideOfScopeUseHeap () {
+	QExplicitlySharedDataPointer< Arena > arena (new Arena);
+	Node *node = new TextNode (Location (), "foo");
+	
+	QCOMPARE(arena->bytesAllocated (), size_t (0));
+	delete node;
+}
+
+void ArenaTest::nodesAreAllocatedFromArena () {
+	QExplicitlySharedDataPointer< Arena > arena (new Arena);
+	Arena::Scope scope (arena.data ());
+	
+	TextNode *first = new TextNode (Location (), "foo");
+	TextNode *second = new TextNode (Location (), "bar");
+	QVERIFY(arena->bytesAllocated () >= 2 * sizeof(TextNode));
+	
+	// Nodes are put next to each other
+	quintptr distance = quintptr (second) - quintptr (first);
+	QVERIFY(distance < 2 * sizeof(TextNode) + 64);
+	
+	delete first;
+	delete second;
+}
+
+void ArenaTest::allocationsAreAligned () {
+	QExplicitlySharedDataPointer< Arena > arena (new Arena);
+	Arena::Scope scope (arena.data ());
+	
+	for (size_t size = 1; size < 100; size += 7) {
+		void *ptr = Arena::create (size);
+		QCOMPARE(quintptr (ptr) % alignof(std::max_align_t), quintptr (0));
+		Arena::destroy (ptr);
+	}
+	
+}
+
+void ArenaTest::largeAllocations () {
+	QExplicitlySharedDataPointer< Arena > arena (new Arena);
+	Arena::Scope scope (arena.data ());
+	
+	char *small = static_cast< char * > (Arena::create (16));
+	char *large = static_cast< char * > (Arena::create (256 * 1024));
+	char *next = static_cast< char * > (Arena::create (16));
+	memset (large, 0xAB, 256 * 1024);
+	
+	// The small allocations still share their chunk
+	QVERIFY(next > small && next - small < 128);
+	
+	Arena::destroy (small);
+	Arena::destroy (large);
+	Arena::destroy (next);
+}
+
+void ArenaTest::deletingInsideOfScopeKeepsMemory () {
+	QExplicitlySharedDataPointer< Arena > arena (new Arena);
+	Arena::Scope scope (arena.data ());
+	
+	Node *first = new TextNode (Location (), "foo");
+	size_t bytes = arena->bytesAllocated ();
+	delete first;
+	
+	// The memory is not reused, but released with the arena
+	Node *second = new TextNode (Location (), "bar");
+	QVERIFY(second != first);
+	QVERIFY(arena->bytesAllocated () > bytes);
+	delete second;
+}
+
+void ArenaTest::programNodesShareArena () {
+	QExplicitlySharedDataPointer< Arena > arena (new Arena);
+	SharedNode *root = nullptr;
+	
+	{
+		Arena::Scope scope (arena.data ());
+		MultipleNodes *nodes = new MultipleNodes (Location ());
+		nodes->nodes.append (new TextNode (Location (), "a"));
+		nodes->nodes.append (new TextNode (Location (), "b"));
+		
+		root = new SharedNode (nodes);
+		root->arena = arena;
+	}
+	
+	QCOMPARE(int (arena->ref.load ()), 2);
+	delete root;
+	QCOMPARE(int (arena->ref.load ()), 1);
+}
+
+void ArenaTest::heapTreeInsideOfScope () {
+	SharedNode *root = new SharedNode (new TextNode (Location (), "foo"));
+	QExplicitlySharedDataPointer< Arena > arena (new Arena);
+	Arena::Scope scope (arena.data ());
+	
+	// The tree has no arena, so it is released to the heap
+	delete root;
+	QCOMPARE(arena->bytesAllocated (), size_t (0));
+}
+
+QTEST_MAIN(ArenaTest)
+#include "tst_arena.moc"
@@ -0,0 +1,151 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "nuria/memorytemplateloader.hpp"
+#include "nuria/templateengine.hpp"
+#include "private/templateengine_p.hpp"
+#include "private/astnodes.hpp"
+#include "private/bundle.hpp"
+#include <nuria/logger.hpp>
+#include <QTemporaryDir>
+#include <QtTest/QTest>
+#include <QFile>
+
+using namespace Nuria;
+using namespace Nuria::Template;
+
+// 
+class BundleTest : public QObject {
+	Q_OBJECT
+private slots:
+	
+	void initTestCase ();
+	void readProgram ();
+	void readTruncatedProgram ();
+	void readNodesWithoutChildren ();
+	void loadTruncatedBundle ();
+	
+private:
+	QTemporaryDir dir;
+	QString path;
+	
+};
+
+void BundleTest::initTestCase () {
+	TemplateEngine engine;
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	engine.setLoader (loader);
+	
+	loader->addTemplate ("base", "<{% block body %}base{% endblock %}>");
+	loader->addTemplate ("a", "{% extends 'base' %}{% block body %}"
+	                          "{% for i in items %}{{ loop.index }}{{ i|upper }}{% endfor %}"
+	                          "{% if 1 + n > 2 %}{{ \"x #{n}\" }}{% endif %}{% endblock %}");
+	
+	this->path = this->dir.path () + "/test.bundle";
+	QVERIFY(engine.saveBundle (this->path, { "a" }));
+}
+
+void BundleTest::readProgram () {
+	Bundle bundle;
+	QVERIFY(bundle.open (this->path));
+	
+	QDataStream stream (bundle.program ("a"));
+	TemplateProgramPrivate *program = Serializer::read (stream);
+	QVERIFY(program);
+	delete program;
+}
+
+void BundleTest::readTruncatedProgram () {
+	Bundle bundle;
+	QVERIFY(bundle.open (this->path));
+	
+	// Every prefix of the program must be rejected
+	QByteArray data = bundle.program ("a");
+	QVERIFY(!data.isEmpty ());
+	
+	for (int i = 0; i < data.length (); i++) {
+		QDataStream stream (data.left (i));
+		TemplateProgramPrivate *program = Serializer::read (stream);
+		
+		if (program) {
+			delete program;
+			QFAIL(qPrintable(QString ("Accepted a program truncated to %1 bytes").arg (i)));
+		}
+		
+	}
+	
+}
+
+static QByteArray writeProgram (Node *node) {
+	TemplateProgramPrivate program;
+	program.root = new SharedNode (node);
+	
+	QByteArray data;
+	QDataStream stream (&data, QIODevice::WriteOnly);
+	if (!Serializer::write (stream, &program)) {
+		return QByteArray ();
+	}
+	
+	return data;
+}
+
+void BundleTest::readNodesWithoutChildren () {
+	FilterNode *filter = new FilterNode (Location ());
+	filter->body = new TextNode (Location (), "x");
+	
+	// Nodes missing a child they need to render
+	QVector< Node * > nodes {
+		filter,
+		new AutoescapeNode (Location (), nullptr, "html"),
+		new SpacelessNode (Location (), nullptr),
+		new CacheNode (Location (), nullptr, nullptr, new TextNode (Location (), "x")),
+		new CacheNode (Location (), new LiteralValueNode (Location (), "key"), nullptr, nullptr)
+	};
+	
+	for (Node *node : nodes) {
+		QByteArray data = writeProgram (node);
+		QVERIFY(!data.isEmpty ());
+		
+		QDataStream stream (data);
+		TemplateProgramPrivate *program = Serializer::read (stream);
+		
+		if (program) {
+			delete program;
+			QFAIL("Accepted a node without a required child");
+		}
+		
+	}
+	
+}
+
+void BundleTest::loadTruncatedBundle () {
+	QFile file (this->path);
+	QVERIFY(file.open (QIODevice::ReadOnly));
+	QByteArray data = file.readAll ();
+	
+	QString truncatedPath = this->dir.path () + "/truncated.bundle";
+	QFile truncated (truncatedPath);
+	QVERIFY(truncated.open (QIODevice::WriteOnly));
+	truncated.write (data.left (data.length () - 16));
+	truncated.close ();
+	
+	TemplateEngine engine;
+	QVERIFY(!engine.loadBundle (truncatedPath));
+}
+
+QTEST_MAIN(BundleTest)
+#include "tst_bundle.moc"
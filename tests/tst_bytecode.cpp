@@ -0,0 +1,224 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nuria/memorytemplateloader.hpp"
+#include "nuria/templateengine.hpp"
+#include "private/templateengine_p.hpp"
+#include "private/astnodes.hpp"
+#include "private/builtins.hpp"
+#include "private/bytecode.hpp"
+#include <nuria/logger.hpp>
+#include <QJsonDocument>
+#include <QtTest/QTest>
+#include <QDir>
+
+#define TESTS_PATH_PREFIX ":/test-cases"
+
+using namespace Nuria;
+
+using namespace Nuria::Template;
+
+// 
+class BytecodeTest : public QObject {
+	Q_OBJECT
+private slots:
+	
+	void cleanup ();
+	
+	void sameOutputAsAst_data ();
+	void sameOutputAsAst ();
+	
+	void valuesAreLowered ();
+	void lazyValuesUseNodes ();
+	void loopOverMap ();
+	
+};
+
+static QStringList listOfTests () {
+	QStringList list;
+	
+	QDir testDir (TESTS_PATH_PREFIX);
+	QStringList files = testDir.entryList ({ "*.json" });
+	
+	for (const QString &cur : files) {
+		list.append (testDir.absoluteFilePath (cur));
+	}
+	
+	return list;
+}
+
+static TemplateEngine *createEngine (const QVariantMap &data) {
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	TemplateEngine *engine = new TemplateEngine;
+	
+	QVariant templateData = data.value (QStringLiteral("template"));
+	if (templateData.userType () == QMetaType::QVariantMap) {
+		QVariantMap map = templateData.toMap ();
+		for (auto it = map.constBegin (); it != map.constEnd (); ++it) {
+			loader->addTemplate (it.key (), it.value ().toString ().toUtf8 ());
+		}
+		
+	} else {
+		loader->addTemplate ("main", templateData.toString ().toUtf8 ());
+	}
+	
+	engine->setValues (data.value (QStringLiteral("variables")).toMap ());
+	engine->setLoader (loader);
+	return engine;
+}
+
+static QVector< QPair< QByteArray, QVariantMap > > loadCorpus () {
+	QVector< QPair< QByteArray, QVariantMap > > corpus;
+	
+	for (const QString &path : listOfTests ()) {
+		QFile file (path);
+		file.open (QIODevice::ReadOnly);
+		
+		QVariantMap data = QJsonDocument::fromJson (file.readAll ()).toVariant ().toMap ();
+		if (data.value (QStringLiteral("skip")).toBool () ||
+		    !data.value (QStringLiteral("error")).toString ().isEmpty ()) {
+			continue;
+		}
+		
+		QString name = path.section (QLatin1Char ('/'), -1).section (QLatin1Char ('.'), 0, 0);
+		corpus.append (qMakePair (name.toLatin1 (), data));
+	}
+	
+	return corpus;
+}
+
+void BytecodeTest::cleanup () {
+	Bytecode::setEnabled (true);
+}
+
+void BytecodeTest::sameOutputAsAst_data () {
+	QTest::addColumn< QVariantMap > ("data");
+	
+	for (const auto &testCase : loadCorpus ()) {
+		QTest::newRow (testCase.first.constData ()) << testCase.second;
+	}
+	
+}
+
+void BytecodeTest::sameOutputAsAst () {
+	QFETCH(QVariantMap, data);
+	
+	// Use an engine per run, so cached fragments aren't shared
+	QScopedPointer< TemplateEngine > astEngine (createEngine (data));
+	QScopedPointer< TemplateEngine > bytecodeEngine (createEngine (data));
+	TemplateProgram astProgram = astEngine->program ("main");
+	TemplateProgram bytecodeProgram = bytecodeEngine->program ("main");
+	QVERIFY(astProgram.isValid ());
+	QVERIFY(bytecodeProgram.isValid ());
+	
+	Bytecode::setEnabled (false);
+	QString ast = astProgram.render ();
+	
+	Bytecode::setEnabled (true);
+	QString bytecode = bytecodeProgram.render ();
+	
+	QCOMPARE(bytecode, ast);
+	QCOMPARE(bytecode, data.value (QStringLiteral("output")).toString ());
+}
+
+static bool containsOpcode (const Bytecode &code, Bytecode::Opcode op) {
+	for (const Bytecode::Instruction &cur : code.code) {
+		if (cur.op == op) {
+			return true;
+		}
+		
+	}
+	
+	return false;
+}
+
+static VariableNode *slotNode (const QString &name, int index) {
+	VariableNode *node = new VariableNode (Location (), name);
+	node->index = index;
+	return node;
+}
+
+void BytecodeTest::valuesAreLowered () {
+	TemplateProgramPrivate dptr;
+	dptr.values = { 3, QStringLiteral("foo") };
+	
+	// {{ a + 2 }}-{{ b|upper }}
+	MethodCallValueNode *upper = new MethodCallValueNode (Location (), new VariableNode (Location (), "upper"),
+	                                                      new MultipleValueNode (Location (), { slotNode ("b", 1) }));
+	upper->builtin = Builtins::Upper;
+	
+	MultipleNodes root (Location (), {
+		new ExpressionNode (Location (), slotNode ("a", 0), Operator::Add,
+		                    new LiteralValueNode (Location (), 2)),
+		new TextNode (Location (), "-"),
+		upper
+	});
+	
+	Bytecode code;
+	code.lower (&root);
+	QVERIFY(!containsOpcode (code, Bytecode::RenderNode));
+	QVERIFY(!containsOpcode (code, Bytecode::PushNode));
+	QVERIFY(containsOpcode (code, Bytecode::Apply));
+	QVERIFY(containsOpcode (code, Bytecode::CallBuiltin));
+	QCOMPARE(code.stackDepth, 2);
+	
+	QString result;
+	StringSink sink (result);
+	code.execute (&dptr, sink);
+	QCOMPARE(result, QString ("5-FOO"));
+}
+
+void BytecodeTest::lazyValuesUseNodes () {
+	TemplateProgramPrivate dptr;
+	dptr.values = { QVariant (), QStringLiteral("b") };
+	
+	// {{ a|default(b) }}: The fallback is only evaluated if it's needed
+	MethodCallValueNode *call = new MethodCallValueNode (Location (), new VariableNode (Location (), "default"),
+	                                                     new MultipleValueNode (Location (), {
+	                                                             slotNode ("a", 0), slotNode ("b", 1) }));
+	call->builtin = Builtins::Default;
+	MultipleNodes root (Location (), { call });
+	
+	Bytecode code;
+	code.lower (&root);
+	QVERIFY(containsOpcode (code, Bytecode::PushNode));
+	QVERIFY(!containsOpcode (code, Bytecode::CallBuiltin));
+	
+	QString result;
+	StringSink sink (result);
+	code.execute (&dptr, sink);
+	QCOMPARE(result, QString ("b"));
+}
+
+void BytecodeTest::loopOverMap () {
+	QVariantMap data { { "a", 1 }, { "b", 2 } };
+	QVariantHash hash { { "c", 3 } };
+	
+	TemplateEngine engine;
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	loader->addTemplate ("main", "{% for k,v in map %}{{ k }}={{ v }};{% endfor %}"
+	                             "{% for k,v in hash %}{{ k }}={{ v }};{% endfor %}"
+	                             "{% for v in list %}{{ v }}{% else %}empty{% endfor %}");
+	engine.setLoader (loader);
+	engine.setValue ("map", data);
+	engine.setValue ("hash", hash);
+	engine.setValue ("list", QStringList ());
+	
+	QCOMPARE(engine.render ("main"), QString ("a=1;b=2;c=3;empty"));
+}
+
+QTEST_MAIN(BytecodeTest)
+#include "tst_bytecode.moc"
@@ -0,0 +1,184 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "private/templateengine_p.hpp"
+#include "private/escaper.hpp"
+#include <nuria/logger.hpp>
+#include <QtTest/QTest>
+#include <QUrl>
+
+using namespace Nuria;
+
+// Compares the escaping kernels to the multi-pass implementation they
+// replaced, and benchmarks both.
+class EscaperTest : public QObject {
+	Q_OBJECT
+private slots:
+	
+	void sameResultAsReference_data ();
+	void sameResultAsReference ();
+	
+	void returnsInputIfNothingToEscape ();
+	void verbatimReturnsEmptyString ();
+	void indexOfSpecial ();
+	
+	void benchmark_data ();
+	void benchmark ();
+	
+};
+
+Q_DECLARE_METATYPE(Nuria::EscapeMode)
+
+static QString referenceEscape (QString data, EscapeMode mode) {
+	static const QByteArray included = QByteArrayLiteral("-._~");
+	
+	switch (mode) {
+	case EscapeMode::Verbatim: return QString ();
+	case EscapeMode::Html: return data.toHtmlEscaped ();
+	case EscapeMode::JavaScript:
+	case EscapeMode::Css:
+		data.replace (QLatin1Char ('"'), QLatin1String ("\\\""));
+		data.replace (QLatin1Char ('\''), QLatin1String ("\\'"));
+		data.replace (QLatin1Char ('\r'), QLatin1String ("\\r"));
+		data.replace (QLatin1Char ('\n'), QLatin1String ("\\n"));
+		data.replace (QLatin1Char ('\t'), QLatin1String ("\\t"));
+		return data;
+	case EscapeMode::Url:
+		return QString::fromLatin1 (QUrl::toPercentEncoding (data));
+	case EscapeMode::HtmlAttr:
+		return QString::fromLatin1 (data.toUtf8 ().toPercentEncoding (QByteArray (), included)
+		                            .replace ('%', "&#x"));
+	}
+	
+	return QString ();
+}
+
+static const QVector< QPair< const char *, EscapeMode > > &modes () {
+	static const QVector< QPair< const char *, EscapeMode > > list {
+		{ "html", EscapeMode::Html }, { "js", EscapeMode::JavaScript },
+		{ "css", EscapeMode::Css }, { "url", EscapeMode::Url },
+		{ "html_attr", EscapeMode::HtmlAttr }
+	};
+	
+	return list;
+}
+
+static QString cleanText () {
+	return QString ("TheQuickBrownFoxJumpsOverTheLazyDog0123456789").repeated (20);
+}
+
+static QString dirtyText () {
+	return QString ("<a href=\"/foo?a=1&b='2'\">\tLine\r\n</a> ").repeated (20);
+}
+
+void EscaperTest::sameResultAsReference_data () {
+	QTest::addColumn< EscapeMode > ("mode");
+	QTest::addColumn< QString > ("input");
+	
+	const QVector< QPair< const char *, QString > > inputs {
+		{ "empty", QString () },
+		{ "clean", cleanText () },
+		{ "dirty", dirtyText () },
+		{ "special at end", QString ("abcdefghijklmnopqrstuvwxyz0123456789\"") },
+		{ "special at start", QString ("'abcdefghijklmnopqrstuvwxyz0123456789") },
+		{ "only specials", QString ("<>&\"'\r\n\t -._~%#").repeated (5) },
+		{ "boundaries", QString ("@[`{/:AZaz09") },
+		{ "latin1", QString::fromUtf8 ("Gr\xC3\xBC\xC3\x9F" "e aus K\xC3\xB6ln") },
+		{ "cjk", QString::fromUtf8 ("\xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E<b>") },
+		{ "surrogate pair", QString::fromUtf8 ("x\xF0\x9F\x98\x80y\xF0\x9F\x98\x80") },
+		{ "unpaired surrogate", QString ("ab") + QChar (0xD800) + QString ("cd") + QChar (0xDC00) },
+		{ "high code units", QString (QChar (0x8000)) + QChar (0xFFFF) + QChar (0x803C) }
+	};
+	
+	for (const auto &mode : modes ()) {
+		for (const auto &input : inputs) {
+			QByteArray name = QByteArray (mode.first) + ": " + input.first;
+			QTest::newRow (name.constData ()) << mode.second << input.second;
+		}
+		
+	}
+	
+}
+
+void EscaperTest::sameResultAsReference () {
+	QFETCH(EscapeMode, mode);
+	QFETCH(QString, input);
+	
+	QCOMPARE(Template::Escaper::escape (input, mode), referenceEscape (input, mode));
+}
+
+void EscaperTest::returnsInputIfNothingToEscape () {
+	QString input = cleanText ();
+	
+	for (const auto &mode : modes ()) {
+		QString result = Template::Escaper::escape (input, mode.second);
+		QCOMPARE(result.constData (), input.constData ());
+	}
+	
+}
+
+void EscaperTest::verbatimReturnsEmptyString () {
+	QCOMPARE(Template::Escaper::escape ("<foo>", EscapeMode::Verbatim), QString ());
+}
+
+void EscaperTest::indexOfSpecial () {
+	QCOMPARE(Template::Escaper::indexOfSpecial (cleanText (), EscapeMode::Html), -1);
+	QCOMPARE(Template::Escaper::indexOfSpecial (cleanText () + "<", EscapeMode::Html), cleanText ().length ());
+	QCOMPARE(Template::Escaper::indexOfSpecial ("abc def", EscapeMode::Url), 3);
+	QCOMPARE(Template::Escaper::indexOfSpecial ("abc-def", EscapeMode::HtmlAttr), 3);
+	QCOMPARE(Template::Escaper::indexOfSpecial ("abc-def", EscapeMode::Url), -1);
+}
+
+void EscaperTest::benchmark_data () {
+	QTest::addColumn< EscapeMode > ("mode");
+	QTest::addColumn< QString > ("input");
+	QTest::addColumn< bool > ("reference");
+	
+	const QVector< QPair< const char *, QString > > inputs {
+		{ "clean", cleanText () }, { "dirty", dirtyText () }
+	};
+	
+	for (const auto &mode : modes ()) {
+		for (const auto &input : inputs) {
+			QByteArray name = QByteArray (mode.first) + ":" + input.first;
+			QByteArray reference = name + ":reference";
+			QByteArray kernel = name + ":kernel";
+			QTest::newRow (reference.constData ()) << mode.second << input.second << true;
+			QTest::newRow (kernel.constData ()) << mode.second << input.second << false;
+		}
+		
+	}
+	
+}
+
+void EscaperTest::benchmark () {
+	QFETCH(EscapeMode, mode);
+	QFETCH(QString, input);
+	QFETCH(bool, reference);
+	
+	QString (*escape) (const QString &, EscapeMode) = &Template::Escaper::escape;
+	if (reference) {
+		escape = [](const QString &data, EscapeMode mode) { return referenceEscape (data, mode); };
+	}
+	
+	QBENCHMARK {
+		escape (input, mode);
+	}
+	
+}
+
+QTEST_MAIN(EscaperTest)
+#include "tst_escaper.moc"
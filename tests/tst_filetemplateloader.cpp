@@ -17,11 +17,16 @@
 #include "nuria/filetemplateloader.hpp"
 #include <nuria/logger.hpp>
 #include <QTemporaryFile>
+#include <QTemporaryDir>
 #include <QtTest/QTest>
+#include <QSignalSpy>
 #include <QThread>
 
 using namespace Nuria;
 
+// Debounce interval used by tests, in milliseconds
+static const int DebounceInterval = 500;
+
 // 
 class FileTemplateLoaderTest : public QObject {
 	Q_OBJECT
@@ -33,9 +38,16 @@ private slots:
 	void findTemplateWithSuffix ();
 	void preventDirectoryTraversal ();
 	void verifyTemplateChanged ();
+	void watchingEmitsTemplateChanged ();
+	void watchingDebouncesChanges ();
 	
 };
 
+static bool writeFile (const QString &path, const QByteArray &data) {
+	QFile file (path);
+	return file.open (QIODevice::WriteOnly) && file.write (data) == data.length ();
+}
+
 void FileTemplateLoaderTest::noSearchPathsFindsNothing () {
 	FileTemplateLoader loader;
 	QVERIFY(!loader.hasTemplate ("foo"));
@@ -99,5 +111,52 @@ void FileTemplateLoaderTest::verifyTemplateChanged () {
 	
 }
 
+void FileTemplateLoaderTest::watchingEmitsTemplateChanged () {
+	QTemporaryDir dir;
+	QVERIFY(dir.isValid ());
+	QVERIFY(writeFile (dir.filePath ("a"), "1"));
+	
+	FileTemplateLoader loader (QDir (dir.path ()));
+	loader.setWatching (true);
+	QVERIFY(loader.isWatching ());
+	QCOMPARE(loader.load ("a"), QByteArray ("1"));
+	
+	// Watched templates don't hit the file-system anymore
+	QVERIFY(!loader.hasTemplateChanged ("a", QDateTime ()));
+	
+	QSignalSpy spy (&loader, &TemplateLoader::templateChanged);
+	QVERIFY(writeFile (dir.filePath ("a"), "2"));
+	QVERIFY(spy.wait ());
+	QCOMPARE(spy.at (0).at (0).toString (), QString ("a"));
+	QCOMPARE(loader.load ("a"), QByteArray ("2"));
+	
+}
+
+void FileTemplateLoaderTest::watchingDebouncesChanges () {
+	QTemporaryDir dir;
+	QVERIFY(dir.isValid ());
+	QVERIFY(writeFile (dir.filePath ("a"), "1"));
+	
+	FileTemplateLoader loader (QDir (dir.path ()));
+	loader.setWatching (true);
+	loader.setDebounceInterval (DebounceInterval);
+	QCOMPARE(loader.debounceInterval (), DebounceInterval);
+	loader.load ("a");
+	
+	// Changes are only seen by the event loop, so both are collected
+	QSignalSpy spy (&loader, &TemplateLoader::templateChanged);
+	QVERIFY(writeFile (dir.filePath ("a"), "2"));
+	QVERIFY(writeFile (dir.filePath ("a"), "3"));
+	QVERIFY(spy.isEmpty ());
+	
+	QTRY_COMPARE_WITH_TIMEOUT(spy.length (), 1, 10 * DebounceInterval);
+	QCOMPARE(spy.at (0).at (0).toString (), QString ("a"));
+	
+	// Nothing is left to be emitted
+	QVERIFY(!spy.wait (2 * DebounceInterval));
+	QCOMPARE(spy.length (), 1);
+	
+}
+
 QTEST_MAIN(FileTemplateLoaderTest)
 #include "tst_filetemplateloader.moc"
@@ -20,6 +20,7 @@
 #include <QJsonParseError>
 #include <QJsonDocument>
 #include <QtTest/QTest>
+#include <QBuffer>
 #include <QDir>
 
 #define TESTS_PATH_PREFIX ":/test-cases"
@@ -174,6 +175,12 @@ void TemplateEngineTest::run () {
 			qWarning() << "Error   :" << engine.lastError ();
 			QFAIL("Result did not match expected output.");
 		}
+		
+		// Streaming into a device must produce the same output
+		QBuffer buffer;
+		buffer.open (QIODevice::WriteOnly);
+		QVERIFY(engine.render ("main", &buffer));
+		QCOMPARE(QString::fromUtf8 (buffer.data ()), testCase.output);
 	} else {
 		// Failure path
 		TemplateError error = engine.lastError ();
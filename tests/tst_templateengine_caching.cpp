@@ -28,8 +28,23 @@ private slots:
 	
 	void onTemplateChangedSignal ();
 	void onTemplateChangedSignalInDependencies ();
+	void onTemplateChangedSignalKeepsUnrelated ();
 	void onAllTemplatesChangedSignal ();
+	void rebuildOnlyLoadsChangedTemplate ();
 	void loaderHasTemplateChangedCheck ();
+	void memoryLimitEvictsPrograms ();
+	void admissionKeepsFrequentlyUsedPrograms ();
+	void fragmentsAreKeyedByTemplate ();
+	void fragmentMemoryLimit ();
+	void failedFragmentIsNotCached ();
+	void concurrentMissesCompileOnce ();
+	void evictsLeastRecentlyUsedProgram ();
+	void concurrentEvictionsKeepMaxSize ();
+	void loadBundleSkipsCompilation ();
+	void loadBundleIgnoresChangedTemplates ();
+	void statisticsAreOffByDefault ();
+	void statisticsAreRecorded ();
+	void statisticsCountNodesByClass ();
 	
 };
 
@@ -62,6 +77,34 @@ void TemplateEngineCachingTest::onTemplateChangedSignalInDependencies () {
 	
 }
 
+void TemplateEngineCachingTest::onTemplateChangedSignalKeepsUnrelated () {
+	TemplateEngine engine;
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	engine.setLoader (loader);
+	
+	loader->addTemplate ("a", "a{% include 'b' %}");
+	loader->addTemplate ("b", "b");
+	loader->addTemplate ("c", "c{% include 'd' %}");
+	loader->addTemplate ("d", "d");
+	
+	engine.render ("a");
+	engine.render ("c");
+	
+	emit engine.loader ()->templateChanged ("b");
+	QVERIFY(!engine.isTemplateInCache ("a"));
+	QVERIFY(engine.isTemplateInCache ("c"));
+	
+	// Re-compiled programs are tracked again
+	engine.render ("a");
+	emit engine.loader ()->templateChanged ("b");
+	QVERIFY(!engine.isTemplateInCache ("a"));
+	
+	emit engine.loader ()->templateChanged ("d");
+	QVERIFY(!engine.isTemplateInCache ("c"));
+	QCOMPARE(engine.currentCacheSize (), 0);
+	
+}
+
 void TemplateEngineCachingTest::onAllTemplatesChangedSignal () {
 	TemplateEngine engine;
 	
@@ -77,6 +120,46 @@ void TemplateEngineCachingTest::onAllTemplatesChangedSignal () {
 	
 }
 
+class RecordingLoader : public MemoryTemplateLoader {
+public:
+	
+	QStringList loaded;
+	
+	QByteArray load (const QString &name) override {
+		loaded.append (name);
+		return MemoryTemplateLoader::load (name);
+	}
+	
+};
+
+void TemplateEngineCachingTest::rebuildOnlyLoadsChangedTemplate () {
+	TemplateEngine engine;
+	RecordingLoader *loader = new RecordingLoader;
+	engine.setLoader (loader);
+	
+	loader->addTemplate ("base", "<{% block body %}{% endblock %}>");
+	loader->addTemplate ("header", "H");
+	loader->addTemplate ("page", "{% extends 'base' %}{% block body %}"
+	                             "{% include 'header' %}P{% endblock %}");
+	
+	QCOMPARE(engine.render ("page"), QString ("<HP>"));
+	QCOMPARE(loader->loaded.length (), 3);
+	loader->loaded.clear ();
+	
+	loader->addTemplate ("header", "X");
+	QVERIFY(!engine.isTemplateInCache ("page"));
+	
+	QCOMPARE(engine.render ("page"), QString ("<XP>"));
+	QCOMPARE(loader->loaded, QStringList ({ "header" }));
+	
+	// Flushing the cache forgets all templates
+	loader->loaded.clear ();
+	engine.flushCache ();
+	QCOMPARE(engine.render ("page"), QString ("<XP>"));
+	QCOMPARE(loader->loaded.length (), 3);
+	
+}
+
 class NonCachingLoader : public TemplateLoader {
 public:
 	
@@ -106,5 +189,406 @@ void TemplateEngineCachingTest::loaderHasTemplateChangedCheck () {
 	
 }
 
+void TemplateEngineCachingTest::memoryLimitEvictsPrograms () {
+	TemplateEngine engine;
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	engine.setLoader (loader);
+	
+	loader->addTemplate ("small", "a");
+	loader->addTemplate ("large", QByteArray (200 * 1024, 'x'));
+	QCOMPARE(engine.maxCacheMemory (), qint64 (0));
+	
+	engine.render ("small");
+	qint64 smallSize = engine.currentCacheMemory ();
+	QVERIFY(smallSize > 0);
+	
+	engine.render ("large");
+	QVERIFY(engine.isTemplateInCache ("large"));
+	QVERIFY(engine.currentCacheMemory () > smallSize + 200 * 1024);
+	
+	// Too large for the cache
+	engine.render ("small");
+	engine.setMaxCacheMemory (100 * 1024);
+	QVERIFY(!engine.isTemplateInCache ("large"));
+	QVERIFY(engine.isTemplateInCache ("small"));
+	QCOMPARE(engine.currentCacheMemory (), smallSize);
+	
+	engine.render ("large");
+	QVERIFY(!engine.isTemplateInCache ("large"));
+	
+}
+
+void TemplateEngineCachingTest::admissionKeepsFrequentlyUsedPrograms () {
+	TemplateEngine engine;
+	engine.setMaxCacheSize (2);
+	engine.setCacheAdmissionEnabled (true);
+	QVERIFY(engine.isCacheAdmissionEnabled ());
+	
+	for (int i = 0; i < 5; i++) {
+		engine.render ("a");
+		engine.render ("b");
+	}
+	
+	// A one-off template doesn't evict the others
+	QCOMPARE(engine.render ("c"), QString ("c"));
+	QVERIFY(!engine.isTemplateInCache ("c"));
+	QVERIFY(engine.isTemplateInCache ("a"));
+	QVERIFY(engine.isTemplateInCache ("b"));
+	
+	// .. but a frequently used one does
+	for (int i = 0; i < 10; i++) {
+		engine.render ("c");
+	}
+	
+	QVERIFY(engine.isTemplateInCache ("c"));
+	QCOMPARE(engine.currentCacheSize (), 2);
+	
+}
+
+class CountingLoader : public TemplateLoader {
+public:
+	
+	QAtomicInt loadCount;
+	
+	QByteArray load (const QString &name) override {
+		loadCount.ref ();
+		QThread::msleep (50);
+		return name.toUtf8 ();
+	}
+	
+};
+
+class RenderThread : public QThread {
+public:
+	
+	RenderThread (TemplateEngine *engine) : engine (engine) { }
+	
+	void run () override
+	{ result = engine->render ("a"); }
+	
+	TemplateEngine *engine;
+	QString result;
+	
+};
+
+void TemplateEngineCachingTest::fragmentsAreKeyedByTemplate () {
+	TemplateEngine engine;
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	engine.setLoader (loader);
+	
+	loader->addTemplate ("a", "a{% cache 'side-' ~ id ttl 300 %}<{{ id }}{{ x }}>{% endcache %}");
+	loader->addTemplate ("b", "b{% cache 'side-' ~ id %}[{{ id }}{{ x }}]{% endcache %}");
+	engine.setValue ("id", 1);
+	engine.setValue ("x", "foo");
+	
+	QCOMPARE(engine.render ("a"), QString ("a<1foo>"));
+	QVERIFY(engine.currentFragmentCacheMemory () > 0);
+	
+	// Body isn't run on a hit
+	engine.setValue ("x", "bar");
+	QCOMPARE(engine.render ("a"), QString ("a<1foo>"));
+	
+	// The same key in another template
+	QCOMPARE(engine.render ("b"), QString ("b[1bar]"));
+	
+	// Other key
+	engine.setValue ("id", 2);
+	QCOMPARE(engine.render ("b"), QString ("b[2bar]"));
+	
+	// Invalidate by prefix
+	engine.setValue ("id", 1);
+	engine.setValue ("x", "baz");
+	QCOMPARE(engine.invalidateFragments ("a:side-1"), 1);
+	QCOMPARE(engine.render ("a"), QString ("a<1baz>"));
+	QCOMPARE(engine.render ("b"), QString ("b[1bar]"));
+	
+	QCOMPARE(engine.invalidateFragments (QString ()), 3);
+	QCOMPARE(engine.currentFragmentCacheMemory (), qint64 (0));
+	
+}
+
+void TemplateEngineCachingTest::fragmentMemoryLimit () {
+	TemplateEngine engine;
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	engine.setLoader (loader);
+	
+	loader->addTemplate ("a", "{% cache 'a' %}{{ x }}{% endcache %}");
+	loader->addTemplate ("b", "{% cache 'b' %}{{ x }}{% endcache %}");
+	engine.setValue ("x", QString (1024, 'x'));
+	
+	engine.render ("a");
+	qint64 size = engine.currentFragmentCacheMemory ();
+	QVERIFY(size > 2048);
+	
+	// Only room for one fragment, 'a' is evicted
+	engine.setMaxFragmentCacheMemory (size + 100);
+	engine.render ("b");
+	QCOMPARE(engine.currentFragmentCacheMemory (), size);
+	
+	engine.setValue ("x", "y");
+	QCOMPARE(engine.render ("a"), QString ("y"));
+	QCOMPARE(engine.render ("b"), QString (1024, 'x'));
+	
+	// Disabled
+	engine.setMaxFragmentCacheMemory (0);
+	QCOMPARE(engine.currentFragmentCacheMemory (), qint64 (0));
+	QCOMPARE(engine.render ("b"), QString ("y"));
+	QCOMPARE(engine.currentFragmentCacheMemory (), qint64 (0));
+	
+}
+
+void TemplateEngineCachingTest::failedFragmentIsNotCached () {
+	TemplateEngine engine;
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	engine.setLoader (loader);
+	
+	loader->addTemplate ("a", "{% cache 'a' %}{{ x|escape(mode) }}{% endcache %}");
+	engine.setValue ("x", "foo");
+	engine.setValue ("mode", "invalid");
+	
+	TemplateProgram program = engine.program ("a");
+	QCOMPARE(program.render (), QString ());
+	QVERIFY(program.lastError ().hasFailed ());
+	QCOMPARE(engine.currentFragmentCacheMemory (), qint64 (0));
+	
+	engine.setValue ("mode", "html");
+	QCOMPARE(engine.render ("a"), QString ("foo"));
+	QVERIFY(engine.currentFragmentCacheMemory () > 0);
+	
+}
+
+void TemplateEngineCachingTest::concurrentMissesCompileOnce () {
+	TemplateEngine engine;
+	CountingLoader *loader = new CountingLoader;
+	engine.setLoader (loader);
+	
+	QVector< RenderThread * > threads;
+	for (int i = 0; i < 8; i++) {
+		threads.append (new RenderThread (&engine));
+	}
+	
+	for (RenderThread *thread : threads) {
+		thread->start ();
+	}
+	
+	for (RenderThread *thread : threads) {
+		thread->wait ();
+		QCOMPARE(thread->result, QString ("a"));
+	}
+	
+	qDeleteAll (threads);
+	QCOMPARE(loader->loadCount.load (), 1);
+	QVERIFY(engine.isTemplateInCache ("a"));
+	
+}
+
+void TemplateEngineCachingTest::evictsLeastRecentlyUsedProgram () {
+	TemplateEngine engine;
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	engine.setLoader (loader);
+	engine.setMaxCacheSize (3);
+	
+	for (int i = 0; i < 4; i++) {
+		loader->addTemplate (QString ("t%1").arg (i), QByteArray::number (i));
+	}
+	
+	engine.render ("t0");
+	engine.render ("t1");
+	engine.render ("t2");
+	
+	// t0 was used more recently than t1
+	engine.render ("t0");
+	engine.render ("t3");
+	
+	QCOMPARE(engine.currentCacheSize (), 3);
+	QVERIFY(engine.isTemplateInCache ("t0"));
+	QVERIFY(!engine.isTemplateInCache ("t1"));
+	QVERIFY(engine.isTemplateInCache ("t2"));
+	QVERIFY(engine.isTemplateInCache ("t3"));
+	
+}
+
+class ManyTemplatesThread : public QThread {
+public:
+	
+	ManyTemplatesThread (TemplateEngine *engine) : engine (engine) { }
+	
+	void run () override {
+		for (int i = 0; i < 500; i++) {
+			int index = i % 16;
+			if (engine->render (QString ("t%1").arg (index)) != QString::number (index)) {
+				failures++;
+			}
+			
+		}
+		
+	}
+	
+	TemplateEngine *engine;
+	int failures = 0;
+	
+};
+
+void TemplateEngineCachingTest::concurrentEvictionsKeepMaxSize () {
+	TemplateEngine engine;
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	engine.setLoader (loader);
+	engine.setMaxCacheSize (4);
+	
+	for (int i = 0; i < 16; i++) {
+		loader->addTemplate (QString ("t%1").arg (i), QByteArray::number (i));
+	}
+	
+	QVector< ManyTemplatesThread * > threads;
+	for (int i = 0; i < 8; i++) {
+		threads.append (new ManyTemplatesThread (&engine));
+	}
+	
+	for (ManyTemplatesThread *thread : threads) {
+		thread->start ();
+	}
+	
+	for (ManyTemplatesThread *thread : threads) {
+		thread->wait ();
+		QCOMPARE(thread->failures, 0);
+	}
+	
+	qDeleteAll (threads);
+	QVERIFY(engine.currentCacheSize () <= 4);
+	
+}
+
+class FailingLoader : public TemplateLoader {
+public:
+	
+	bool loadCalled = false;
+	bool changed = false;
+	
+	QByteArray load (const QString &name) override {
+		loadCalled = true;
+		return "changed " + name.toUtf8 ();
+	}
+	
+	bool hasTemplateChanged (const QString &, const QDateTime &) override {
+		return changed;
+	}
+	
+};
+
+static QString saveTestBundle (const QTemporaryDir &dir) {
+	TemplateEngine engine;
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	engine.setLoader (loader);
+	
+	loader->addTemplate ("base", "<{% block body %}base{% endblock %}>");
+	loader->addTemplate ("a", "{% extends 'base' %}{% block body %}"
+	                          "{% for i in items %}{{ loop.index }}{{ i|upper }}{% endfor %}"
+	                          "{% include 'b' %}{% endblock %}");
+	loader->addTemplate ("b", "{{ name|default('b') }}");
+	
+	QString path = dir.path () + "/test.bundle";
+	if (!engine.saveBundle (path, { "a", "b" })) {
+		return QString ();
+	}
+	
+	return path;
+}
+
+void TemplateEngineCachingTest::loadBundleSkipsCompilation () {
+	QTemporaryDir dir;
+	QString path = saveTestBundle (dir);
+	QVERIFY(!path.isEmpty ());
+	
+	TemplateEngine engine;
+	FailingLoader *loader = new FailingLoader;
+	engine.setLoader (loader);
+	engine.setValue ("items", QVariantList { "x", "y" });
+	
+	QVERIFY(engine.loadBundle (path));
+	QCOMPARE(engine.render ("a"), QString ("<1X2Yb>"));
+	QVERIFY(!loader->loadCalled);
+	
+}
+
+void TemplateEngineCachingTest::loadBundleIgnoresChangedTemplates () {
+	QTemporaryDir dir;
+	QString path = saveTestBundle (dir);
+	QVERIFY(!path.isEmpty ());
+	
+	TemplateEngine engine;
+	FailingLoader *loader = new FailingLoader;
+	loader->changed = true;
+	engine.setLoader (loader);
+	
+	QVERIFY(engine.loadBundle (path));
+	QCOMPARE(engine.render ("b"), QString ("changed b"));
+	QVERIFY(loader->loadCalled);
+	
+}
+
+void TemplateEngineCachingTest::statisticsAreOffByDefault () {
+	TemplateEngine engine;
+	
+	engine.render ("a");
+	QVERIFY(!engine.isRecordingStatistics ());
+	QVERIFY(engine.statistics ().isEmpty ());
+	
+}
+
+void TemplateEngineCachingTest::statisticsAreRecorded () {
+	TemplateEngine engine;
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	engine.setLoader (loader);
+	engine.setRecordingStatistics (true);
+	
+	loader->addTemplate ("a", "a{% include 'b' %}");
+	loader->addTemplate ("b", "bc");
+	
+	engine.render ("a");
+	engine.render ("a");
+	
+	QMap< QString, TemplateStatistics > stats = engine.statistics ();
+	QCOMPARE(stats.keys (), QStringList ({ "a", "b" }));
+	
+	TemplateStatistics a = stats.value ("a");
+	QCOMPARE(a.cacheMisses, quint64 (1));
+	QCOMPARE(a.cacheHits, quint64 (1));
+	QCOMPARE(a.stalenessChecks, quint64 (1));
+	QCOMPARE(a.renders, quint64 (2));
+	QCOMPARE(a.outputSize, quint64 (6));
+	QCOMPARE(a.nodes.value ("text"), quint64 (2));
+	QVERIFY(a.compileTime > 0);
+	QVERIFY(a.renderTime > 0);
+	
+	// 'b' is only read while compiling 'a'
+	TemplateStatistics b = stats.value ("b");
+	QCOMPARE(b.cacheMisses, quint64 (0));
+	QCOMPARE(b.renders, quint64 (0));
+	QVERIFY(b.tokenizeTime > 0);
+	QVERIFY(b.parseTime > 0);
+	
+	engine.resetStatistics ();
+	QVERIFY(engine.statistics ().isEmpty ());
+	
+}
+
+void TemplateEngineCachingTest::statisticsCountNodesByClass () {
+	TemplateEngine engine;
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	engine.setLoader (loader);
+	engine.setRecordingStatistics (true);
+	engine.setValue ("name", "x");
+	engine.setValue ("user", QVariantMap { { "name", "y" } });
+	
+	loader->addTemplate ("a", "{% filter upper %}{{ name }}{% endfilter %}{{ user.name }}");
+	QCOMPARE(engine.render ("a"), QString ("Xy"));
+	
+	TemplateStatistics a = engine.statistics ().value ("a");
+	QCOMPARE(a.nodes.value ("node"), quint64 (2));
+	QCOMPARE(a.nodes.value ("node:filter"), quint64 (1));
+	QCOMPARE(a.nodes.value ("node:chain"), quint64 (1));
+	
+}
+
 QTEST_MAIN(TemplateEngineCachingTest)
 #include "tst_templateengine_caching.moc"
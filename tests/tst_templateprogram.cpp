@@ -0,0 +1,412 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "nuria/memorytemplateloader.hpp"
+#include "nuria/templateengine.hpp"
+#include <nuria/logger.hpp>
+#include <QtTest/QtTest>
+#include <QThread>
+
+using namespace Nuria;
+
+// 
+class TemplateProgramTest : public QObject {
+	Q_OBJECT
+private slots:
+	
+	void renderDoesNotChangeProgram ();
+	void renderConcurrently ();
+	void renderErrorStaysInInstance ();
+	void renderErrorFailsAllRenders ();
+	void renderErrorIsKeptPerThread ();
+	void addFunctionReplacesEngineFunction ();
+	void setValueBySlot ();
+	void renderMemoReturnsEarlierOutput ();
+	void renderMemoSkipsNonDeterministicPrograms ();
+	void shortCircuitEvaluation_data ();
+	void shortCircuitEvaluation ();
+	void typedExpressions_data ();
+	void typedExpressions ();
+	
+};
+
+static const char *g_template =
+        "{% set greeting = 'Hello' %}"
+        "{% for item in items %}"
+        "{{ loop.index }}:{% filter upper %}{{ greeting }} {{ item }}{% endfilter %};"
+        "{% endfor %}"
+        "{% autoescape 'html' %}{{ markup }}{% endautoescape %}";
+
+static const char *g_expected = "1:HELLO A;2:HELLO B;3:HELLO C;&lt;b&gt;";
+
+static TemplateProgram createProgram (TemplateEngine &engine) {
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	loader->addTemplate ("main", g_template);
+	engine.setLoader (loader);
+	
+	TemplateProgram program = engine.program ("main");
+	program.setValue ("items", QVariantList { "a", "b", "c" });
+	program.setValue ("markup", "<b>");
+	return program;
+}
+
+void TemplateProgramTest::renderDoesNotChangeProgram () {
+	TemplateEngine engine;
+	TemplateProgram program = createProgram (engine);
+	
+	QCOMPARE(program.render (), QString (g_expected));
+	QCOMPARE(program.value ("greeting"), QVariant ());
+	QCOMPARE(program.value ("loop"), QVariant ());
+	QCOMPARE(program.render (), QString (g_expected));
+}
+
+class RenderThread : public QThread {
+public:
+	
+	RenderThread (const TemplateProgram &program) : program (program) { }
+	
+	void run () override {
+		for (int i = 0; i < 200; i++) {
+			if (program.render () != QLatin1String (g_expected)) {
+				failures++;
+			}
+			
+		}
+		
+	}
+	
+	TemplateProgram program;
+	int failures = 0;
+	
+};
+
+void TemplateProgramTest::renderConcurrently () {
+	TemplateEngine engine;
+	TemplateProgram program = createProgram (engine);
+	
+	QVector< RenderThread * > threads;
+	for (int i = 0; i < 8; i++) {
+		threads.append (new RenderThread (program));
+	}
+	
+	for (RenderThread *thread : threads) {
+		thread->start ();
+	}
+	
+	for (RenderThread *thread : threads) {
+		thread->wait ();
+		QCOMPARE(thread->failures, 0);
+	}
+	
+	qDeleteAll (threads);
+}
+
+static QString engineGreeting (QString name)
+{ return "Hello " + name; }
+
+static QString programGreeting (QString name)
+{ return "Hi " + name; }
+
+void TemplateProgramTest::renderErrorStaysInInstance () {
+	TemplateEngine engine;
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	loader->addTemplate ("main", "{{ 'a'|escape(mode) }}");
+	engine.setLoader (loader);
+	engine.setValue ("mode", "bogus");
+	
+	TemplateProgram program = engine.program ("main");
+	TemplateProgram copy = program;
+	QCOMPARE(copy.render (), QString ());
+	QCOMPARE(copy.lastError ().error (), TemplateError::InvalidEscapeMode);
+	QVERIFY(!program.lastError ().hasFailed ());
+	
+	// The failed render must not affect the cached program
+	QCOMPARE(engine.render ("main"), QString ());
+	QVERIFY(engine.lastError ().hasFailed ());
+	QVERIFY(!engine.program ("main").lastError ().hasFailed ());
+	
+	engine.setValue ("mode", "html");
+	QCOMPARE(engine.render ("main"), QString ("a"));
+	QVERIFY(!engine.lastError ().hasFailed ());
+}
+
+void TemplateProgramTest::renderErrorFailsAllRenders () {
+	TemplateEngine engine;
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	loader->addTemplate ("main", "a{{ 'b'|escape(mode) }}c");
+	engine.setLoader (loader);
+	engine.setValue ("mode", "bogus");
+	TemplateProgram program = engine.program ("main");
+	
+	QCOMPARE(program.render (), QString ());
+	QCOMPARE(program.lastError ().error (), TemplateError::InvalidEscapeMode);
+	
+	QByteArray hash ("foo");
+	QCOMPARE(program.render (hash), QString ());
+	QCOMPARE(program.lastError ().error (), TemplateError::InvalidEscapeMode);
+	QVERIFY(hash.isEmpty ());
+	
+	QBuffer buffer;
+	buffer.open (QIODevice::WriteOnly);
+	QVERIFY(!program.render (&buffer));
+	QCOMPARE(program.lastError ().error (), TemplateError::InvalidEscapeMode);
+	
+	// Also when memoization is enabled
+	engine.setMaxRenderMemoMemory (1024 * 1024);
+	QCOMPARE(program.render (), QString ());
+	QCOMPARE(program.render (hash), QString ());
+	QCOMPARE(engine.currentRenderMemoMemory (), qint64 (0));
+	
+}
+
+class SharedRenderThread : public QThread {
+public:
+	
+	SharedRenderThread (TemplateProgram *program) : program (program) { }
+	
+	void run () override {
+		result = program->render ();
+		error = program->lastError ();
+	}
+	
+	TemplateProgram *program;
+	QString result;
+	TemplateError error;
+	
+};
+
+void TemplateProgramTest::renderErrorIsKeptPerThread () {
+	TemplateEngine engine;
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	loader->addTemplate ("main", "{{ 'a'|escape(mode) }}");
+	engine.setLoader (loader);
+	engine.setValue ("mode", "bogus");
+	
+	// Both threads render the same instance
+	TemplateProgram program = engine.program ("main");
+	SharedRenderThread thread (&program);
+	thread.start ();
+	QVERIFY(thread.wait ());
+	
+	QCOMPARE(thread.result, QString ());
+	QCOMPARE(thread.error.error (), TemplateError::InvalidEscapeMode);
+	QVERIFY(!program.lastError ().hasFailed ());
+	
+	QCOMPARE(program.render (), QString ());
+	QCOMPARE(program.lastError ().error (), TemplateError::InvalidEscapeMode);
+}
+
+void TemplateProgramTest::addFunctionReplacesEngineFunction () {
+	TemplateEngine engine;
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	loader->addTemplate ("main", "{{ greet(name) }}");
+	engine.setLoader (loader);
+	engine.addFunction ("greet", Callback (engineGreeting));
+	
+	TemplateProgram program = engine.program ("main");
+	program.setValue ("name", "you");
+	QCOMPARE(program.render (), QString ("Hello you"));
+	
+	program.addFunction ("greet", Callback (programGreeting));
+	QCOMPARE(program.render (), QString ("Hi you"));
+}
+
+void TemplateProgramTest::setValueBySlot () {
+	TemplateEngine engine;
+	TemplateProgram program = createProgram (engine);
+	
+	int items = program.slotFor ("items");
+	int markup = program.slotFor ("markup");
+	QVERIFY(items >= 0);
+	QVERIFY(markup >= 0);
+	QVERIFY(items != markup);
+	QCOMPARE(program.slotFor ("unknown"), -1);
+	QCOMPARE(program.value (markup), QVariant ("<b>"));
+	
+	QVERIFY(program.setValue (items, QVariantList { "x" }));
+	QVERIFY(program.setValue (markup, "<i>"));
+	QVERIFY(!program.setValue (-1, "nope"));
+	QVERIFY(!program.setValue (1000, "nope"));
+	
+	QCOMPARE(program.value ("markup"), QVariant ("<i>"));
+	QCOMPARE(program.render (), QString ("1:HELLO X;&lt;i&gt;"));
+	
+	// Slots are shared by copies
+	TemplateProgram copy = program;
+	QVERIFY(copy.setValue (markup, "<u>"));
+	QCOMPARE(copy.value ("markup"), QVariant ("<u>"));
+	QCOMPARE(program.value ("markup"), QVariant ("<i>"));
+	
+}
+
+static int g_countedCalls = 0;
+static QString countedGreeting (QString name)
+{ g_countedCalls++; return "Hello " + name; }
+
+static QString countedFarewell (QString name)
+{ g_countedCalls++; return "Bye " + name; }
+
+void TemplateProgramTest::renderMemoReturnsEarlierOutput () {
+	TemplateEngine engine;
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	loader->addTemplate ("main", "{{ greet(name) }}");
+	engine.setLoader (loader);
+	engine.addFunction ("greet", Callback (countedGreeting), true);
+	g_countedCalls = 0;
+	
+	// Off by default
+	TemplateProgram program = engine.program ("main");
+	QVERIFY(program.isMemoizable ());
+	QCOMPARE(engine.maxRenderMemoMemory (), qint64 (0));
+	program.setValue ("name", "you");
+	program.render ();
+	program.render ();
+	QCOMPARE(g_countedCalls, 2);
+	
+	// 
+	engine.setMaxRenderMemoMemory (1024 * 1024);
+	QByteArray first;
+	QByteArray second;
+	QCOMPARE(program.render (first), QString ("Hello you"));
+	QCOMPARE(program.render (second), QString ("Hello you"));
+	QCOMPARE(g_countedCalls, 3);
+	QCOMPARE(first, second);
+	QCOMPARE(first.length (), 40);
+	QVERIFY(engine.currentRenderMemoMemory () > 0);
+	
+	// Other values
+	program.setValue ("name", "me");
+	QCOMPARE(program.render (second), QString ("Hello me"));
+	QCOMPARE(g_countedCalls, 4);
+	QVERIFY(first != second);
+	
+	program.setValue ("name", "you");
+	QCOMPARE(program.render (), QString ("Hello you"));
+	QCOMPARE(g_countedCalls, 4);
+	
+	// Replaced function
+	engine.addFunction ("greet", Callback (countedFarewell), true);
+	TemplateProgram replaced = engine.program ("main");
+	replaced.setValue ("name", "you");
+	QCOMPARE(replaced.render (), QString ("Bye you"));
+	QCOMPARE(g_countedCalls, 5);
+	
+}
+
+void TemplateProgramTest::renderMemoSkipsNonDeterministicPrograms () {
+	TemplateEngine engine;
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	loader->addTemplate ("random", "{{ greet(name) }}{{ random(10) }}");
+	loader->addTemplate ("user", "{{ greet(name) }}");
+	engine.setLoader (loader);
+	engine.setMaxRenderMemoMemory (1024 * 1024);
+	engine.setValue ("name", "you");
+	g_countedCalls = 0;
+	
+	// Uses a non-deterministic built-in
+	engine.addFunction ("greet", Callback (countedGreeting), true);
+	TemplateProgram program = engine.program ("random");
+	QVERIFY(!program.isMemoizable ());
+	program.render ();
+	program.render ();
+	QCOMPARE(g_countedCalls, 2);
+	
+	// Uses a non-constant function
+	program = engine.program ("user");
+	program.addFunction ("greet", Callback (countedGreeting));
+	QVERIFY(!program.isMemoizable ());
+	program.render ();
+	program.render ();
+	QCOMPARE(g_countedCalls, 4);
+	QCOMPARE(engine.currentRenderMemoMemory (), qint64 (0));
+	
+}
+
+void TemplateProgramTest::shortCircuitEvaluation_data () {
+	QTest::addColumn< QString > ("code");
+	QTest::addColumn< QString > ("result");
+	QTest::addColumn< int > ("calls");
+	
+	QTest::newRow("false and") << "{{ no and greet(name) }}" << "false" << 0;
+	QTest::newRow("true and") << "{{ yes and greet(name) }}" << "true" << 1;
+	QTest::newRow("true or") << "{{ yes or greet(name) }}" << "true" << 0;
+	QTest::newRow("false or") << "{{ no or greet(name) }}" << "true" << 1;
+	QTest::newRow("default used") << "{{ blank|default(greet(name)) }}" << "Hello you" << 1;
+	QTest::newRow("default unused") << "{{ name|default(greet(name)) }}" << "you" << 0;
+}
+
+void TemplateProgramTest::shortCircuitEvaluation () {
+	QFETCH(QString, code);
+	QFETCH(QString, result);
+	QFETCH(int, calls);
+	
+	TemplateEngine engine;
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	loader->addTemplate ("main", code.toUtf8 ());
+	engine.setLoader (loader);
+	engine.addFunction ("greet", Callback (countedGreeting));
+	engine.setValues ({ { "yes", true }, { "no", false }, { "blank", "" }, { "name", "you" } });
+	g_countedCalls = 0;
+	
+	QCOMPARE(engine.render ("main"), result);
+	QCOMPARE(g_countedCalls, calls);
+}
+
+void TemplateProgramTest::typedExpressions_data () {
+	QTest::addColumn< QString > ("code");
+	QTest::addColumn< int > ("type");
+	QTest::addColumn< QVariant > ("value");
+	QTest::addColumn< QString > ("result");
+	
+	int none = QMetaType::UnknownType;
+	QTest::newRow("int add") << "{{ x + 1 }}" << int (QMetaType::Int) << QVariant (2) << "3";
+	QTest::newRow("int multiply") << "{{ x * 1000 }}" << int (QMetaType::Int) << QVariant (1000) << "1000000";
+	QTest::newRow("int overflow") << "{{ x * x }}" << int (QMetaType::Int) << QVariant (100000) << "1e+10";
+	QTest::newRow("int divide") << "{{ x / 4 }}" << int (QMetaType::Int) << QVariant (10) << "2.5";
+	QTest::newRow("int modulo") << "{{ x % 4 }}" << int (QMetaType::Int) << QVariant (10) << "2";
+	QTest::newRow("int compare") << "{{ x > 4 }}" << int (QMetaType::Int) << QVariant (10) << "true";
+	QTest::newRow("int nested") << "{{ (x + 1) * 2 }}" << int (QMetaType::Int) << QVariant (2) << "6";
+	QTest::newRow("int got double") << "{{ x + 1 }}" << int (QMetaType::Int) << QVariant (1.5) << "2.5";
+	QTest::newRow("double got int") << "{{ x * 1000 }}" << int (QMetaType::Double) << QVariant (1000) << "1000000";
+	QTest::newRow("string concat") << "{{ x ~ 'b' }}" << int (QMetaType::QString) << QVariant ("a") << "ab";
+	QTest::newRow("string equal") << "{{ x == 'a' }}" << int (QMetaType::QString) << QVariant ("a") << "true";
+	QTest::newRow("string got int") << "{{ x ~ 'b' }}" << int (QMetaType::QString) << QVariant (1) << "1b";
+	QTest::newRow("bool equal") << "{{ x == true }}" << int (QMetaType::Bool) << QVariant (false) << "false";
+	QTest::newRow("undeclared") << "{{ x * 1000 }}" << none << QVariant (1000) << "1000000";
+	QTest::newRow("loop field") << "{% for i in x %}{{ loop.index * 10 }} {% endfor %}" << none
+	                            << QVariant (QVariantList { 1, 2, 3 }) << "10 20 30 ";
+}
+
+void TemplateProgramTest::typedExpressions () {
+	QFETCH(QString, code);
+	QFETCH(int, type);
+	QFETCH(QVariant, value);
+	QFETCH(QString, result);
+	
+	TemplateEngine engine;
+	MemoryTemplateLoader *loader = new MemoryTemplateLoader;
+	loader->addTemplate ("main", code.toUtf8 ());
+	engine.setLoader (loader);
+	engine.setVariableType ("x", type);
+	engine.setValue ("x", value);
+	
+	QCOMPARE(engine.variableType ("x"), type);
+	QCOMPARE(engine.render ("main"), result);
+}
+
+QTEST_MAIN(TemplateProgramTest)
+#include "tst_templateprogram.moc"
@@ -16,7 +16,9 @@
 
 #include "private/tokenizer.hpp"
 #include <nuria/logger.hpp>
+#include <QJsonDocument>
 #include <QtTest/QTest>
+#include <QDir>
 
 #include "grammar/twig.h"
 
@@ -78,6 +80,13 @@ private slots:
 	// 
 	void testIn ();
 	void expansionWithFilters ();
+	void unknownCharacterStopsExpansion ();
+	void ttlIsKeywordInCacheCommandOnly ();
+	
+	// 
+	void benchmark_data ();
+	void benchmark ();
+	
 };
 
 void TemplateTokenizerTest::emptyInput () {
@@ -237,6 +246,37 @@ void TemplateTokenizerTest::singleTokens_data () {
 	QTest::newRow("comma") << "," << TOK_COMMA;
 	QTest::newRow("colon") << ":" << TOK_COLON;
 	QTest::newRow("pipe") << "|" << TOK_PIPE;
+	QTest::newRow("+") << "+" << TOK_PLUS;
+	QTest::newRow("**") << "**" << TOK_POWER;
+	QTest::newRow("*") << "*" << TOK_MULTIPLY;
+	QTest::newRow("//") << "//" << TOK_ROUND;
+	QTest::newRow("/") << "/" << TOK_DIVIDE;
+	QTest::newRow("%") << "%" << TOK_MODULO;
+	QTest::newRow("~") << "~" << TOK_CONCAT;
+	QTest::newRow("!") << "!" << TOK_NOT;
+	QTest::newRow("&&") << "&&" << TOK_AND;
+	QTest::newRow("||") << "||" << TOK_OR;
+	QTest::newRow("?:") << "?:" << TOK_QUESTION_COLON;
+	QTest::newRow("?") << "?" << TOK_QUESTION;
+	QTest::newRow("{") << "{" << TOK_OBJECT_BEGIN;
+	QTest::newRow("and") << "and" << TOK_AND;
+	QTest::newRow("or") << "or" << TOK_OR;
+	QTest::newRow("is") << "is" << TOK_IS;
+	QTest::newRow("starts") << "starts" << TOK_STARTS;
+	QTest::newRow("ends") << "ends" << TOK_ENDS;
+	QTest::newRow("with") << "with" << TOK_WITH;
+	QTest::newRow("matches") << "matches" << TOK_MATCHES;
+	QTest::newRow("defined") << "defined" << TOK_DEFINED;
+	QTest::newRow("null") << "null" << TOK_NULL;
+	QTest::newRow("divisible") << "divisible" << TOK_DIVISIBLE;
+	QTest::newRow("by") << "by" << TOK_BY;
+	QTest::newRow("iterable") << "iterable" << TOK_ITERABLE;
+	QTest::newRow("even") << "even" << TOK_EVEN;
+	QTest::newRow("odd") << "odd" << TOK_ODD;
+	QTest::newRow("empty") << "empty" << TOK_EMPTY;
+	QTest::newRow("keyword prefix") << "isset" << TOK_SYMBOL;
+	QTest::newRow("keyword suffix") << "this" << TOK_SYMBOL;
+	QTest::newRow("keyword w/ digit") << "or2" << TOK_SYMBOL;
 	
 //	QTest::newRow("") << "" << TOK_;
 }
@@ -277,6 +317,8 @@ void TemplateTokenizerTest::commandTokens_data () {
 	QTest::newRow("endautoescape") << "endautoescape" << TOK_AUTOESCAPE_END;
 	QTest::newRow("spaceless") << "spaceless" << TOK_SPACELESS_BEGIN;
 	QTest::newRow("endspaceless") << "endspaceless" << TOK_SPACELESS_END;
+	QTest::newRow("cache") << "cache" << TOK_CACHE_BEGIN;
+	QTest::newRow("endcache") << "endcache" << TOK_CACHE_END;
 //	QTest::newRow("") << "" << TOK_;
 	
 }
@@ -338,5 +380,65 @@ void TemplateTokenizerTest::expansionWithFilters () {
 	
 }
 
+void TemplateTokenizerTest::unknownCharacterStopsExpansion () {
+	Template::Tokenizer tokenizer;
+	tokenizer.read ("{{ foo @ bar }}");
+	
+	QCOMPARE(tokenizer.allTokens ().length (), 3);
+	
+	CHECK_TOKEN(tokenizer, TOK_EXPANSION_BEGIN, 0, 0);
+	CHECK_TOKEN_VALUE(tokenizer, TOK_SYMBOL, 0, 3, "foo");
+	CHECK_TOKEN(tokenizer, TOK_EXPANSION_END, 0, 7);
+	
+}
+
+void TemplateTokenizerTest::ttlIsKeywordInCacheCommandOnly () {
+	Template::Tokenizer tokenizer;
+	tokenizer.read ("{% cache key ttl 5 %}{{ ttl }}");
+	
+	QCOMPARE(tokenizer.allTokens ().length (), 9);
+	
+	CHECK_TOKEN(tokenizer, TOK_COMMAND_BEGIN, 0, 0);
+	CHECK_TOKEN(tokenizer, TOK_CACHE_BEGIN, 0, 3);
+	CHECK_TOKEN_VALUE(tokenizer, TOK_SYMBOL, 0, 9, "key");
+	CHECK_TOKEN(tokenizer, TOK_TTL, 0, 13);
+	CHECK_TOKEN_VALUE(tokenizer, TOK_INTEGER, 0, 17, 5);
+	CHECK_TOKEN(tokenizer, TOK_COMMAND_END, 0, 19);
+	CHECK_TOKEN(tokenizer, TOK_EXPANSION_BEGIN, 0, 21);
+	CHECK_TOKEN_VALUE(tokenizer, TOK_SYMBOL, 0, 24, "ttl");
+	CHECK_TOKEN(tokenizer, TOK_EXPANSION_END, 0, 28);
+	
+}
+
+void TemplateTokenizerTest::benchmark_data () {
+	QTest::addColumn< QByteArray > ("code");
+	
+	QDir testDir (":/test-cases");
+	for (const QString &cur : testDir.entryList ({ "*.json" })) {
+		QFile file (testDir.absoluteFilePath (cur));
+		file.open (QIODevice::ReadOnly);
+		
+		QVariantMap data = QJsonDocument::fromJson (file.readAll ()).toVariant ().toMap ();
+		QVariant templateData = data.value (QStringLiteral("template"));
+		if (templateData.userType () == QMetaType::QVariantMap) {
+			templateData = templateData.toMap ().value (QStringLiteral("main"));
+		}
+		
+		QByteArray name = cur.section (QLatin1Char ('.'), 0, 0).toLatin1 ();
+		QTest::newRow (name.constData ()) << templateData.toString ().toUtf8 ();
+	}
+	
+}
+
+void TemplateTokenizerTest::benchmark () {
+	QFETCH(QByteArray, code);
+	
+	Template::Tokenizer tokenizer;
+	QBENCHMARK {
+		tokenizer.read (code);
+	}
+	
+}
+
 QTEST_MAIN(TemplateTokenizerTest)
 #include "tst_templatetokenizer.moc"
@@ -0,0 +1,194 @@
+/* Copyright (c) 2014-2015, The Nuria Project
+ * The NuriaProject Framework is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ * 
+ * The NuriaProject Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with The NuriaProject Framework.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "private/templateengine_p.hpp"
+#include "private/astnodes.hpp"
+#include "private/value.hpp"
+#include <nuria/logger.hpp>
+#include <QtTest/QTest>
+
+using namespace Nuria;
+using namespace Nuria::Template;
+
+// 
+class ValueTest : public QObject {
+	Q_OBJECT
+private slots:
+	
+	void scalarsAreInline_data ();
+	void scalarsAreInline ();
+	void viewRefersToVariant ();
+	void ownedValueKeepsVariant ();
+	void movingTakesOwnedVariant ();
+	void ownedVariantSharesStorage ();
+	void isTrue_data ();
+	void isTrue ();
+	void toString_data ();
+	void toString ();
+	void literalsAreNotCopied ();
+	void applyMatchesVariants_data ();
+	void applyMatchesVariants ();
+	
+};
+
+void ValueTest::scalarsAreInline_data () {
+	QTest::addColumn< QVariant > ("variant");
+	QTest::addColumn< int > ("kind");
+	
+	QTest::newRow("invalid") << QVariant () << int (Value::Null);
+	QTest::newRow("bool") << QVariant (true) << int (Value::Bool);
+	QTest::newRow("int") << QVariant (5) << int (Value::Int);
+	QTest::newRow("double") << QVariant (2.5) << int (Value::Double);
+	QTest::newRow("null int") << QVariant (QVariant::Int) << int (Value::Owned);
+	QTest::newRow("string") << QVariant ("foo") << int (Value::Owned);
+}
+
+void ValueTest::scalarsAreInline () {
+	QFETCH(QVariant, variant);
+	QFETCH(int, kind);
+	
+	Value value (variant);
+	QCOMPARE(int (value.kind ()), kind);
+	QCOMPARE(value.userType (), variant.userType ());
+	QCOMPARE(value.toVariant (), variant);
+}
+
+void ValueTest::viewRefersToVariant () {
+	QVariant variant (QStringLiteral("foo"));
+	Value value = Value::view (variant);
+	
+	QCOMPARE(int (value.kind ()), int (Value::Borrowed));
+	QVERIFY(value.string ());
+	QCOMPARE(value.string (), static_cast< const QString * > (variant.constData ()));
+	QCOMPARE(value.toString (), QString ("foo"));
+}
+
+void ValueTest::ownedValueKeepsVariant () {
+	Value value (QVariant (QVariantList { 1, 2 }));
+	Value copy = value;
+	
+	QCOMPARE(int (copy.kind ()), int (Value::Owned));
+	QCOMPARE(copy.toVariant (), QVariant (QVariantList { 1, 2 }));
+	QVERIFY(!copy.string ());
+}
+
+void ValueTest::movingTakesOwnedVariant () {
+	Value value (QVariant (QStringLiteral("foo")));
+	Value moved (std::move (value));
+	
+	QCOMPARE(int (moved.kind ()), int (Value::Owned));
+	QCOMPARE(moved.toString (), QString ("foo"));
+	QCOMPARE(int (value.kind ()), int (Value::Null));
+	
+	value = std::move (moved);
+	QCOMPARE(value.toString (), QString ("foo"));
+	QCOMPARE(int (moved.kind ()), int (Value::Null));
+}
+
+void ValueTest::ownedVariantSharesStorage () {
+	QVERIFY(sizeof(Value) <= sizeof(QVariant) + sizeof(void *));
+}
+
+void ValueTest::isTrue_data () {
+	QTest::addColumn< QVariant > ("variant");
+	
+	QTest::newRow("invalid") << QVariant ();
+	QTest::newRow("false") << QVariant (false);
+	QTest::newRow("true") << QVariant (true);
+	QTest::newRow("zero") << QVariant (0);
+	QTest::newRow("zero double") << QVariant (0.0);
+	QTest::newRow("double") << QVariant (1.5);
+	QTest::newRow("null string") << QVariant (QString ());
+	QTest::newRow("string") << QVariant ("foo");
+	QTest::newRow("list") << QVariant (QVariantList { 1 });
+}
+
+void ValueTest::isTrue () {
+	QFETCH(QVariant, variant);
+	
+	QCOMPARE(Value (variant).isTrue (), isValueTrue (variant));
+	QCOMPARE(Value::view (variant).isTrue (), isValueTrue (variant));
+}
+
+void ValueTest::toString_data () {
+	QTest::addColumn< QVariant > ("variant");
+	
+	QTest::newRow("invalid") << QVariant ();
+	QTest::newRow("bool") << QVariant (false);
+	QTest::newRow("int") << QVariant (-12);
+	QTest::newRow("double") << QVariant (1.25);
+	QTest::newRow("large double") << QVariant (1e10);
+	QTest::newRow("string") << QVariant ("foo");
+}
+
+void ValueTest::toString () {
+	QFETCH(QVariant, variant);
+	
+	QVariant expected = variant;
+	expected.convert (QMetaType::QString);
+	QCOMPARE(Value (variant).toString (), expected.toString ());
+}
+
+void ValueTest::literalsAreNotCopied () {
+	LiteralValueNode node (Location (), QStringLiteral("foo"));
+	Value value = node.evaluateValue (nullptr);
+	
+	QCOMPARE(int (value.kind ()), int (Value::Borrowed));
+	QCOMPARE(value.string (), static_cast< const QString * > (node.value.constData ()));
+}
+
+void ValueTest::applyMatchesVariants_data () {
+	QTest::addColumn< QVariant > ("left");
+	QTest::addColumn< QVariant > ("right");
+	QTest::addColumn< int > ("op");
+	
+	QTest::newRow("int + int") << QVariant (2) << QVariant (3) << int (Operator::Add);
+	QTest::newRow("int overflow") << QVariant (2147483647) << QVariant (1) << int (Operator::Add);
+	QTest::newRow("int / int") << QVariant (7) << QVariant (2) << int (Operator::Divide);
+	QTest::newRow("int % int") << QVariant (7) << QVariant (3) << int (Operator::Modulo);
+	QTest::newRow("int * double") << QVariant (2) << QVariant (1.5) << int (Operator::Multiply);
+	QTest::newRow("string + int") << QVariant ("2") << QVariant (1) << int (Operator::Add);
+	QTest::newRow("-int") << QVariant (4) << QVariant () << int (Operator::Negate);
+	QTest::newRow("-double") << QVariant (1.5) << QVariant () << int (Operator::Negate);
+	QTest::newRow("-string") << QVariant ("a") << QVariant () << int (Operator::Negate);
+	QTest::newRow("!int") << QVariant (0) << QVariant () << int (Operator::Not);
+	QTest::newRow("int ~ double") << QVariant (1) << QVariant (2.5) << int (Operator::Concatenate);
+	QTest::newRow("null ~ string") << QVariant () << QVariant ("a") << int (Operator::Concatenate);
+	QTest::newRow("int == int") << QVariant (3) << QVariant (3) << int (Operator::Equal);
+	QTest::newRow("int != int") << QVariant (3) << QVariant (3) << int (Operator::NotEqual);
+	QTest::newRow("int == double") << QVariant (3) << QVariant (3.0) << int (Operator::Equal);
+	QTest::newRow("string == string") << QVariant ("a") << QVariant ("a") << int (Operator::Equal);
+	QTest::newRow("string != string") << QVariant ("a") << QVariant ("b") << int (Operator::NotEqual);
+	QTest::newRow("int < int") << QVariant (2) << QVariant (3) << int (Operator::Less);
+	QTest::newRow("double >= int") << QVariant (2.5) << QVariant (3) << int (Operator::GreaterEqual);
+	QTest::newRow("string < int") << QVariant ("2") << QVariant (3) << int (Operator::Less);
+	QTest::newRow("int in list") << QVariant (1) << QVariant (QVariantList { 1 }) << int (Operator::In);
+}
+
+void ValueTest::applyMatchesVariants () {
+	QFETCH(QVariant, left);
+	QFETCH(QVariant, right);
+	QFETCH(int, op);
+	
+	QVariant expected = ExpressionNode::apply (left, right, Operator (op));
+	Value result = ExpressionNode::apply (Value::view (left), Value::view (right), Operator (op));
+	QCOMPARE(result.userType (), expected.userType ());
+	QCOMPARE(result.toVariant (), expected);
+}
+
+QTEST_MAIN(ValueTest)
+#include "tst_value.moc"
@@ -40,7 +40,7 @@ struct Struct {
 	int integer = 1;
 	int something () { return 123; }
 };
- 
+
 class VariableAccessorTest : public QObject {
 	Q_OBJECT
 private slots:
@@ -52,6 +52,10 @@ private slots:
 	
 	void walkHierarchy ();
 	void findMethodOfMetaObject ();
+	void prepareChain ();
+	void walkPreparedChainRepeatedly ();
+	void inlineCacheHandlesMultipleTypes ();
+	void inlineCacheChecksObject ();
 	
 private:
 	Nuria::RuntimeMetaObject *metaObj = nullptr;
@@ -159,5 +163,62 @@ void VariableAccessorTest::findMethodOfMetaObject () {
 	
 }
 
+void VariableAccessorTest::prepareChain () {
+	VariableAcessor::Chain chain = VariableAcessor::prepareChain ({ "foo", 2, -1 });
+	QCOMPARE(chain.length (), 3);
+	
+	QCOMPARE(chain.at (0).string, QString ("foo"));
+	QCOMPARE(chain.at (0).name, QByteArray ("foo"));
+	QCOMPARE(chain.at (0).index, -1);
+	QCOMPARE(chain.at (1).index, 2);
+	QCOMPARE(chain.at (1).string, QString ("2"));
+	QCOMPARE(chain.at (2).index, -1);
+}
+
+void VariableAccessorTest::walkPreparedChainRepeatedly () {
+	QVariantMap inner { { "list", QVariantList { 1, QVariantMap { { "integer", 1 } } } } };
+	QVariant data = QVariantMap { { "inner", inner } };
+	VariableAcessor::Chain chain = VariableAcessor::prepareChain ({ "inner", "list", 1, "integer" });
+	
+	for (int i = 0; i < 2; i++) {
+		QVariant v = data;
+		QVERIFY(VariableAcessor::walkChain (v, chain));
+		QCOMPARE(v, QVariant (1));
+	}
+	
+	// The walked data is left untouched
+	QCOMPARE(data.toMap ().value ("inner").toMap (), inner);
+}
+
+void VariableAccessorTest::inlineCacheHandlesMultipleTypes () {
+	VariableAcessor::Chain chain = VariableAcessor::prepareChain ({ "v" }, true);
+	QVariant map = QVariantMap { { "v", 5 } };
+	QVariant object = QVariant::fromValue (this->testObject);
+	
+	for (int i = 0; i < 2; i++) {
+		QVariant v = map;
+		QVERIFY(VariableAcessor::walkChain (v, chain));
+		QCOMPARE(v, QVariant (5));
+		
+		v = object;
+		QVERIFY(VariableAcessor::walkChain (v, chain));
+		QCOMPARE(v, QVariant (1));
+	}
+	
+	QVERIFY(chain.at (0).cache->find (QMetaType::QVariantMap, map));
+	QVERIFY(chain.at (0).cache->find (qMetaTypeId< TestQObject * > (), object));
+	QVERIFY(!chain.at (0).cache->find (QMetaType::QVariantList, QVariantList ()));
+}
+
+void VariableAccessorTest::inlineCacheChecksObject () {
+	VariableAcessor::Chain chain = VariableAcessor::prepareChain ({ "v" }, true);
+	QVariant object = QVariant::fromValue (this->testObject);
+	QVariant null = QVariant::fromValue (static_cast< TestQObject * > (nullptr));
+	
+	QVERIFY(VariableAcessor::walkChain (object, chain));
+	QVERIFY(!chain.at (0).cache->find (null.userType (), null));
+	QVERIFY(!VariableAcessor::walkChain (null, chain));
+}
+
 QTEST_MAIN(VariableAccessorTest)
 #include "tst_variableaccessor.moc"